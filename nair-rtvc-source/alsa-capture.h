@@ -0,0 +1,292 @@
+﻿#pragma once
+
+// ALSA による取り込み (mmap、poll 駆動)
+//
+// デバイスのリングバッファーを snd_pcm_mmap_begin() でそのままパケットとして渡すので、
+// ブロックへの切り分け以外のコピーはない。
+// 周期はエンジンのブロックの倍数に合わせ、WASAPI のイベント駆動と同じく周期ごとに起きる。
+// デバイスは mmap に対応している必要がある (hw: や plughw:)。ハードウェアがなくても snd-aloop や snd-dummy で試せる。
+//
+//   modprobe snd-aloop
+//   rtvc-replay --capture alsa:hw:Loopback,1 --engine ...   (hw:Loopback,0 に再生した音が届く)
+
+#include <alsa/asoundlib.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "capture-backend.h"
+
+namespace rtvc {
+	struct alsa_capture_config {
+		std::string device = "default";
+		unsigned int periods = 2;              ///< リングバッファーの周期数
+		unsigned int max_blocks_per_period = 16; ///< 周期として試すブロック数の上限
+	};
+
+	class AlsaCapture final : public CaptureBackend {
+	public:
+		explicit AlsaCapture(alsa_capture_config config)
+			: config_(std::move(config))
+		{
+		}
+
+		~AlsaCapture() override {
+			if (pcm_) {
+				::snd_pcm_close(pcm_);
+				pcm_ = nullptr;
+			}
+			if (interrupt_fd_ >= 0) {
+				::close(interrupt_fd_);
+				interrupt_fd_ = -1;
+			}
+		}
+
+		char const* Name() const noexcept override {
+			return "alsa";
+		}
+
+		char const* LastError() const noexcept override {
+			return error_.c_str();
+		}
+
+		HRESULT Open(capture_config const& config) override {
+			int err = 0;
+			if ((err = ::snd_pcm_open(&pcm_, config_.device.c_str(), SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK)) < 0) {
+				return Fail("snd_pcm_open", err);
+			}
+
+			snd_pcm_hw_params_t* hw = nullptr;
+			snd_pcm_hw_params_alloca(&hw);
+			if ((err = ::snd_pcm_hw_params_any(pcm_, hw)) < 0) {
+				return Fail("snd_pcm_hw_params_any", err);
+			}
+			if ((err = ::snd_pcm_hw_params_set_access(pcm_, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0) {
+				return Fail("snd_pcm_hw_params_set_access", err);
+			}
+			if ((err = ::snd_pcm_hw_params_set_format(pcm_, hw, SND_PCM_FORMAT_FLOAT_LE)) < 0) {
+				return Fail("snd_pcm_hw_params_set_format", err);
+			}
+			if ((err = ::snd_pcm_hw_params_set_channels(pcm_, hw, 1)) < 0) {
+				return Fail("snd_pcm_hw_params_set_channels", err);
+			}
+			if ((err = ::snd_pcm_hw_params_set_rate(pcm_, hw, static_cast<unsigned int>(config.sample_rate), 0)) < 0) {
+				return Fail("snd_pcm_hw_params_set_rate", err);
+			}
+
+			// 周期をブロックの倍数にする (小さい方から試す)
+			snd_pcm_uframes_t period_size = 0;
+			for (unsigned int blocks = 1; blocks <= config_.max_blocks_per_period; ++blocks) {
+				snd_pcm_uframes_t const candidate = static_cast<snd_pcm_uframes_t>(config.block_size) * blocks;
+				if (::snd_pcm_hw_params_test_period_size(pcm_, hw, candidate, 0) == 0) {
+					period_size = candidate;
+					break;
+				}
+			}
+			if (period_size == 0) {
+				return Fail("no period size is a multiple of the block size", -EINVAL);
+			}
+			if ((err = ::snd_pcm_hw_params_set_period_size(pcm_, hw, period_size, 0)) < 0) {
+				return Fail("snd_pcm_hw_params_set_period_size", err);
+			}
+			unsigned int periods = config_.periods;
+			if ((err = ::snd_pcm_hw_params_set_periods_near(pcm_, hw, &periods, nullptr)) < 0) {
+				return Fail("snd_pcm_hw_params_set_periods_near", err);
+			}
+			if ((err = ::snd_pcm_hw_params(pcm_, hw)) < 0) {
+				return Fail("snd_pcm_hw_params", err);
+			}
+			::snd_pcm_hw_params_get_buffer_size(hw, &buffer_size_);
+			period_size_ = period_size;
+
+			// 周期ごとに起きる。時刻は CLOCK_MONOTONIC (steady_clock と同じ) で取る
+			snd_pcm_sw_params_t* sw = nullptr;
+			snd_pcm_sw_params_alloca(&sw);
+			if ((err = ::snd_pcm_sw_params_current(pcm_, sw)) < 0) {
+				return Fail("snd_pcm_sw_params_current", err);
+			}
+			if ((err = ::snd_pcm_sw_params_set_avail_min(pcm_, sw, period_size_)) < 0) {
+				return Fail("snd_pcm_sw_params_set_avail_min", err);
+			}
+			if ((err = ::snd_pcm_sw_params_set_tstamp_mode(pcm_, sw, SND_PCM_TSTAMP_ENABLE)) < 0) {
+				return Fail("snd_pcm_sw_params_set_tstamp_mode", err);
+			}
+			if ((err = ::snd_pcm_sw_params_set_tstamp_type(pcm_, sw, SND_PCM_TSTAMP_TYPE_MONOTONIC)) < 0) {
+				return Fail("snd_pcm_sw_params_set_tstamp_type", err);
+			}
+			if ((err = ::snd_pcm_sw_params(pcm_, sw)) < 0) {
+				return Fail("snd_pcm_sw_params", err);
+			}
+
+			// デバイスの fd と中断用の eventfd を一緒に待つ
+			int const count = ::snd_pcm_poll_descriptors_count(pcm_);
+			if (count <= 0) {
+				return Fail("snd_pcm_poll_descriptors_count", count < 0 ? count : -EINVAL);
+			}
+			fds_.resize(static_cast<std::size_t>(count) + 1);
+			if ((err = ::snd_pcm_poll_descriptors(pcm_, fds_.data(), static_cast<unsigned int>(count))) < 0) {
+				return Fail("snd_pcm_poll_descriptors", err);
+			}
+			interrupt_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (interrupt_fd_ < 0) {
+				return Fail("eventfd", -errno);
+			}
+			fds_.back() = pollfd{ interrupt_fd_, POLLIN, 0 };
+
+			sample_rate_ = config.sample_rate;
+			return S_OK;
+		}
+
+		std::uint32_t MaxPacketFrames() const noexcept override {
+			return static_cast<std::uint32_t>(buffer_size_);
+		}
+
+		HRESULT Start() override {
+			std::uint64_t value = 0;
+			while (::read(interrupt_fd_, &value, sizeof(value)) > 0) {
+			}
+			pending_flags_ = 0;
+
+			int err = 0;
+			if ((err = ::snd_pcm_prepare(pcm_)) < 0) {
+				return Fail("snd_pcm_prepare", err);
+			}
+			if ((err = ::snd_pcm_start(pcm_)) < 0) {
+				return Fail("snd_pcm_start", err);
+			}
+			return S_OK;
+		}
+
+		HRESULT Wait() override {
+			HRESULT hr = S_OK;
+			for (;;) {
+				if (::poll(fds_.data(), static_cast<nfds_t>(fds_.size()), -1) < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					return Fail("poll", -errno);
+				}
+				if (fds_.back().revents & POLLIN) {
+					return S_FALSE;
+				}
+
+				unsigned short revents = 0;
+				int err = 0;
+				if ((err = ::snd_pcm_poll_descriptors_revents(pcm_, fds_.data(), static_cast<unsigned int>(fds_.size() - 1), &revents)) < 0) {
+					return Fail("snd_pcm_poll_descriptors_revents", err);
+				}
+				if (revents & POLLERR) {
+					// オーバーラン。次のパケットに欠落の印を付けて立て直す
+					if FAILED(hr = Recover(-EPIPE)) {
+						return hr;
+					}
+					continue;
+				}
+				if (revents & POLLIN) {
+					return S_OK;
+				}
+			}
+		}
+
+		void Interrupt() noexcept override {
+			std::uint64_t const value = 1;
+			if (interrupt_fd_ >= 0) {
+				[[maybe_unused]] ssize_t const written = ::write(interrupt_fd_, &value, sizeof(value));
+			}
+		}
+
+		HRESULT Acquire(capture_packet& packet) override {
+			packet.data = nullptr;
+			packet.frames = 0;
+			packet.flags = 0;
+			packet.device_time_ns = 0;
+			mmap_offset_ = 0;
+
+			snd_pcm_sframes_t avail = ::snd_pcm_avail_update(pcm_);
+			if (avail < 0) {
+				return Recover(static_cast<int>(avail));
+			}
+
+			// 取り込み時刻は avail を測った時刻から遡る
+			snd_pcm_uframes_t stamped_avail = 0;
+			snd_htimestamp_t tstamp{};
+			if (::snd_pcm_htimestamp(pcm_, &stamped_avail, &tstamp) == 0 && (tstamp.tv_sec != 0 || tstamp.tv_nsec != 0)) {
+				std::uint64_t const stamp_ns = static_cast<std::uint64_t>(tstamp.tv_sec) * 1'000'000'000ull + static_cast<std::uint64_t>(tstamp.tv_nsec);
+				std::uint64_t const backlog_ns = static_cast<std::uint64_t>(stamped_avail) * 1'000'000'000ull / static_cast<std::uint64_t>(sample_rate_);
+				packet.device_time_ns = stamp_ns > backlog_ns ? stamp_ns - backlog_ns : 0;
+			}
+			else {
+				packet.flags |= CAPTURE_FLAG_TIMESTAMP_ERROR;
+			}
+
+			// リングの終わりで折り返す分は次の Acquire() で渡す
+			snd_pcm_channel_area_t const* areas = nullptr;
+			snd_pcm_uframes_t frames = static_cast<snd_pcm_uframes_t>(avail);
+			int err = 0;
+			if ((err = ::snd_pcm_mmap_begin(pcm_, &areas, &mmap_offset_, &frames)) < 0) {
+				return Recover(err);
+			}
+			packet.data = reinterpret_cast<float const*>(static_cast<std::uint8_t const*>(areas[0].addr) + areas[0].first / 8 + mmap_offset_ * (areas[0].step / 8));
+			packet.frames = static_cast<std::uint32_t>(frames);
+			packet.flags |= pending_flags_;
+			pending_flags_ = 0;
+			return S_OK;
+		}
+
+		HRESULT Release(capture_packet const& packet) override {
+			if (packet.frames == 0) {
+				return S_OK;
+			}
+			snd_pcm_sframes_t const committed = ::snd_pcm_mmap_commit(pcm_, mmap_offset_, packet.frames);
+			if (committed < 0 || static_cast<std::uint32_t>(committed) != packet.frames) {
+				return Recover(committed < 0 ? static_cast<int>(committed) : -EPIPE);
+			}
+			return S_OK;
+		}
+
+		HRESULT Stop() override {
+			if (pcm_) {
+				::snd_pcm_drop(pcm_);
+			}
+			return S_OK;
+		}
+
+	private:
+		HRESULT Fail(char const* what, int err) {
+			error_ = std::string(what) + ": " + ::snd_strerror(err);
+			return hresult_from_errno(err);
+		}
+
+		// xrun や suspend から立て直す
+		HRESULT Recover(int err) {
+			if ((err = ::snd_pcm_recover(pcm_, err, 1)) < 0) {
+				return Fail("snd_pcm_recover", err);
+			}
+			if (::snd_pcm_state(pcm_) != SND_PCM_STATE_RUNNING) {
+				if ((err = ::snd_pcm_start(pcm_)) < 0) {
+					return Fail("snd_pcm_start", err);
+				}
+			}
+			pending_flags_ |= CAPTURE_FLAG_DISCONTINUITY;
+			return S_OK;
+		}
+
+		alsa_capture_config config_;
+		snd_pcm_t* pcm_ = nullptr;
+		int sample_rate_ = 0;
+		snd_pcm_uframes_t period_size_ = 0;
+		snd_pcm_uframes_t buffer_size_ = 0;
+		snd_pcm_uframes_t mmap_offset_ = 0;
+		std::uint32_t pending_flags_ = 0;
+
+		std::vector<pollfd> fds_;
+		int interrupt_fd_ = -1;
+		std::string error_;
+	};
+}
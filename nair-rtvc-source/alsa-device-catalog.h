@@ -0,0 +1,158 @@
+﻿#pragma once
+
+// ALSA のデバイスの一覧 (Windows 以外)
+//
+// カードの抜き差しは /dev/snd のデバイスノードの作成と削除を inotify で受けて知る。
+// 一覧は snd_device_name_hint() の PCM で、ID は snd_pcm_open() に渡す名前。
+
+#include <alsa/asoundlib.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "capture-backend.h"
+#include "device-catalog.h"
+
+namespace rtvc {
+	class AlsaDeviceCatalog final : public DeviceCatalog {
+		/// 抜き差しで続けて届く変化をまとめる時間 (udev がノードを作り終えるのを待つ)
+		static constexpr int const COALESCE_MS = 200;
+
+	public:
+		AlsaDeviceCatalog() = default;
+		AlsaDeviceCatalog(AlsaDeviceCatalog const&) = delete;
+		AlsaDeviceCatalog& operator=(AlsaDeviceCatalog const&) = delete;
+
+		~AlsaDeviceCatalog() override {
+			Stop();
+		}
+
+		/// 最初の一覧を作って変化を見張り始める
+		HRESULT Start() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (thread_.joinable()) {
+				return S_OK;
+			}
+
+			Refresh();
+
+			inotify_fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+			shutdown_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (inotify_fd_ < 0 || shutdown_fd_ < 0) {
+				int const err = errno;
+				Close();
+				return hresult_from_errno(-err);
+			}
+			if (::inotify_add_watch(inotify_fd_, "/dev/snd", IN_CREATE | IN_DELETE | IN_ATTRIB) < 0) {
+				int const err = errno;
+				Close();
+				return hresult_from_errno(-err);
+			}
+			thread_ = std::thread([this] { Run(); });
+			return S_OK;
+		}
+
+		void Stop() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (thread_.joinable()) {
+				std::uint64_t const one = 1;
+				[[maybe_unused]] ssize_t const written = ::write(shutdown_fd_, &one, sizeof(one));
+				thread_.join();
+			}
+			Close();
+		}
+
+	private:
+		void Run() {
+			pollfd fds[2] = {
+				{ inotify_fd_, POLLIN, 0 },
+				{ shutdown_fd_, POLLIN, 0 },
+			};
+			for (;;) {
+				if (::poll(fds, 2, -1) < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					return;
+				}
+				if (fds[1].revents) {
+					return;
+				}
+				// 続けて届いた変化をまとめてから作り直す
+				do {
+					Drain();
+				} while (::poll(fds, 1, COALESCE_MS) > 0 && !(fds[0].revents & ~POLLIN));
+				Refresh();
+			}
+		}
+
+		void Drain() {
+			alignas(inotify_event) char buffer[4096];
+			while (::read(inotify_fd_, buffer, sizeof(buffer)) > 0) {
+			}
+		}
+
+		void Refresh() {
+			device_list capture;
+			device_list render;
+			capture.default_id = "default";
+			render.default_id = "default";
+
+			void** hints = nullptr;
+			if (::snd_device_name_hint(-1, "pcm", &hints) == 0) {
+				for (void** hint = hints; *hint; ++hint) {
+					char* const name = ::snd_device_name_get_hint(*hint, "NAME");
+					char* const desc = ::snd_device_name_get_hint(*hint, "DESC");
+					char* const ioid = ::snd_device_name_get_hint(*hint, "IOID");
+					if (name && std::strcmp(name, "null") != 0) {
+						device_entry entry;
+						entry.id = name;
+						// DESC は "カード名\n説明" なので 1 行にする
+						entry.name = desc ? desc : name;
+						std::replace(entry.name.begin(), entry.name.end(), '\n', ' ');
+						// IOID がなければ両方向
+						if (!ioid || std::strcmp(ioid, "Input") == 0) {
+							capture.devices.push_back(entry);
+						}
+						if (!ioid || std::strcmp(ioid, "Output") == 0) {
+							render.devices.push_back(std::move(entry));
+						}
+					}
+					std::free(name);
+					std::free(desc);
+					std::free(ioid);
+				}
+				::snd_device_name_free_hint(hints);
+			}
+
+			Publish(device_flow::capture, std::move(capture));
+			Publish(device_flow::render, std::move(render));
+		}
+
+		void Close() {
+			if (inotify_fd_ >= 0) {
+				::close(inotify_fd_);
+				inotify_fd_ = -1;
+			}
+			if (shutdown_fd_ >= 0) {
+				::close(shutdown_fd_);
+				shutdown_fd_ = -1;
+			}
+		}
+
+		std::mutex mutex_;
+		int inotify_fd_ = -1;
+		int shutdown_fd_ = -1;
+		std::thread thread_;
+	};
+}
@@ -0,0 +1,120 @@
+﻿#pragma once
+
+// ALSA による直接モニター出力 (Windows 以外)
+//
+// 周期はエンジンのブロック程度にして、再生スレッドが 1 周期ずつ JitterBuffer から取り出して書き込む。
+// snd_pcm_delay() で実際にデバイスが抱えている量を測る。
+
+#include <alsa/asoundlib.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "monitor-output.h"
+
+namespace rtvc {
+	class AlsaRender final : public MonitorOutput {
+	public:
+		explicit AlsaRender(std::string device = "default")
+			: device_(std::move(device))
+		{
+		}
+
+		~AlsaRender() override {
+			Stop();
+			if (pcm_) {
+				::snd_pcm_close(pcm_);
+				pcm_ = nullptr;
+			}
+		}
+
+		char const* Name() const noexcept override {
+			return "alsa";
+		}
+
+		char const* LastError() const noexcept override {
+			return error_.c_str();
+		}
+
+		HRESULT Open(int sample_rate, std::uint32_t write_frames) override {
+			int err = 0;
+			if ((err = ::snd_pcm_open(&pcm_, device_.c_str(), SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+				pcm_ = nullptr;
+				error_ = std::string("snd_pcm_open: ") + ::snd_strerror(err);
+				return hresult_from_errno(err);
+			}
+			// バッファーは 1 回に積まれる分 (周期はその数分の 1 になる)
+			unsigned int const latency_us = static_cast<unsigned int>(1'000'000ull * write_frames / sample_rate);
+			if ((err = ::snd_pcm_set_params(pcm_, SND_PCM_FORMAT_FLOAT_LE, SND_PCM_ACCESS_RW_INTERLEAVED, 1, static_cast<unsigned int>(sample_rate), 1, latency_us)) < 0) {
+				error_ = std::string("snd_pcm_set_params: ") + ::snd_strerror(err);
+				return hresult_from_errno(err);
+			}
+			snd_pcm_uframes_t buffer_size = 0;
+			snd_pcm_uframes_t period_size = 0;
+			if ((err = ::snd_pcm_get_params(pcm_, &buffer_size, &period_size)) < 0) {
+				error_ = std::string("snd_pcm_get_params: ") + ::snd_strerror(err);
+				return hresult_from_errno(err);
+			}
+			period_frames_ = static_cast<std::uint32_t>(period_size);
+			ResetBuffer(sample_rate, write_frames, period_frames_);
+			return S_OK;
+		}
+
+		HRESULT Start() override {
+			running_.store(true, std::memory_order::release);
+			thread_ = std::thread([this] { Render(); });
+			return S_OK;
+		}
+
+		HRESULT Stop() override {
+			if (thread_.joinable()) {
+				running_.store(false, std::memory_order::release);
+				thread_.join();
+			}
+			if (pcm_) {
+				::snd_pcm_drop(pcm_);
+			}
+			return S_OK;
+		}
+
+	private:
+		void Render() {
+			std::vector<float> period(period_frames_);
+			while (running_.load(std::memory_order::acquire)) {
+				buffer_.Pull(period.data(), period_frames_);
+				float const* data = period.data();
+				snd_pcm_uframes_t remaining = period_frames_;
+				while (remaining > 0) {
+					// 書き込みは 1 周期以内に空くので、止めるときもすぐに抜ける
+					snd_pcm_sframes_t const written = ::snd_pcm_writei(pcm_, data, remaining);
+					if (written < 0) {
+						if (int const err = ::snd_pcm_recover(pcm_, static_cast<int>(written), 1); err < 0) {
+							error_ = std::string("snd_pcm_writei: ") + ::snd_strerror(err);
+							ReportRenderFailure(hresult_from_errno(err));
+							return;
+						}
+						continue;
+					}
+					data += written;
+					remaining -= static_cast<snd_pcm_uframes_t>(written);
+				}
+
+				snd_pcm_sframes_t delay = 0;
+				if (::snd_pcm_delay(pcm_, &delay) == 0 && delay > 0) {
+					ReportDeviceLatency(static_cast<std::uint64_t>(delay), 0);
+				}
+			}
+		}
+
+		std::string device_;
+		std::string error_;
+		snd_pcm_t* pcm_ = nullptr;
+		std::uint32_t period_frames_ = 0;
+		std::atomic<bool> running_ = false;
+		std::thread thread_;
+	};
+}
@@ -0,0 +1,100 @@
+﻿#pragma once
+
+// 取り込んだパケットをエンジンのブロック単位に切り分ける
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+namespace rtvc {
+	class BlockAssembler final {
+	public:
+		/// パケットの最大フレーム数に合わせてバッファーを確保する
+		void Reset(std::uint32_t block_size, std::size_t max_packet_frames) {
+			block_size_ = block_size;
+			// あまり (最大 block_size - 1) とパケットを合わせても溢れないようにする
+			std::size_t const buffer_size = ((max_packet_frames + 2 * block_size - 1) / block_size) * block_size;
+			buffer0_.reset(new float[buffer_size]);
+			buffer1_.reset(new float[buffer_size]);
+			capacity_ = buffer_size;
+			remainings_ = 0;
+		}
+
+		/// パケットを追加し、揃ったブロック数を返す (data が nullptr なら無音)
+		/// 揃ったブロックは Blocks() から block_count * block_size フレーム連続して読める
+		std::uint32_t Push(float const* data, std::uint32_t packet_frames) noexcept {
+			std::uint32_t const BLOCK_SIZE = block_size_;
+			std::uint32_t const frames = remainings_ + packet_frames;
+			std::uint32_t const block_count = frames / BLOCK_SIZE;
+			std::uint32_t const block_frames = block_count * BLOCK_SIZE;
+
+			// ブロックに切り分ける (あまりは保存しておく)
+			if (!data) {
+				if (block_count > 0) {
+					// ブロックに書き込む
+					std::size_t const new_frames = block_frames - remainings_;
+					std::memset(buffer0_.get() + remainings_, 0, new_frames * sizeof(float));
+
+					remainings_ = frames % BLOCK_SIZE;
+
+					// あまりを覚えておく
+					std::memset(buffer1_.get(), 0, remainings_ * sizeof(float));
+					std::swap(buffer0_, buffer1_);
+				}
+				else {
+					// あまりを追記する
+					std::memset(buffer0_.get() + remainings_, 0, packet_frames * sizeof(float));
+					remainings_ = frames % BLOCK_SIZE;
+				}
+			}
+			else {
+				if (block_count > 0) {
+					// ブロックに書き込む
+					std::size_t const new_frames = block_frames - remainings_;
+					std::memcpy(buffer0_.get() + remainings_, data, new_frames * sizeof(float));
+
+					remainings_ = frames % BLOCK_SIZE;
+
+					// あまりを覚えておく
+					std::memcpy(buffer1_.get(), data + new_frames, remainings_ * sizeof(float));
+					std::swap(buffer0_, buffer1_);
+				}
+				else {
+					// あまりを追記する
+					std::memcpy(buffer0_.get() + remainings_, data, packet_frames * sizeof(float));
+					remainings_ = frames % BLOCK_SIZE;
+				}
+			}
+
+			return block_count;
+		}
+
+		/// 直前の Push() で揃ったブロック
+		float* Blocks() noexcept {
+			return buffer1_.get();
+		}
+
+		/// ブロックに満たない余っているサンプル数
+		std::uint32_t Remainings() const noexcept {
+			return remainings_;
+		}
+
+		std::uint32_t BlockSize() const noexcept {
+			return block_size_;
+		}
+
+		/// 1 回の Push() で揃う最大フレーム数
+		std::size_t Capacity() const noexcept {
+			return capacity_;
+		}
+
+	private:
+		std::uint32_t block_size_ = 256;
+		std::uint32_t remainings_ = 0;
+		std::size_t capacity_ = 0;
+		std::unique_ptr<float[]> buffer0_;
+		std::unique_ptr<float[]> buffer1_;
+	};
+}
@@ -0,0 +1,143 @@
+﻿#pragma once
+
+// 取り込みバックエンド
+//
+// Process() はこのインターフェースを通してパケットを受け取る。
+// WASAPI のほかにファイルや合成信号を入力にできるので、マイクのない環境でも同じ処理を動かせる。
+//
+//   Open() -> Start() -> { Wait() -> Acquire() -> Release() } の繰り返し -> Stop()
+//
+// Wait() / Acquire() / Release() は取り込みスレッドからだけ呼ぶ。Interrupt() はどのスレッドからでもよい。
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+typedef std::int32_t HRESULT;
+#ifndef S_OK
+#define S_OK ((HRESULT)0L)
+#define S_FALSE ((HRESULT)1L)
+#define E_FAIL ((HRESULT)0x80004005L)
+#define E_INVALIDARG ((HRESULT)0x80070057L)
+#define E_OUTOFMEMORY ((HRESULT)0x8007000EL)
+#define E_NOTIMPL ((HRESULT)0x80004001L)
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+#endif
+#endif
+
+namespace rtvc {
+#if !defined(_WIN32)
+	/// errno を HRESULT にする (HRESULT_FROM_WIN32 と同じ形)
+	inline HRESULT hresult_from_errno(int err) noexcept {
+		return static_cast<HRESULT>(0x80070000u | (static_cast<unsigned int>(err < 0 ? -err : err) & 0xFFFFu));
+	}
+#endif
+
+	/// パケットのフラグ (AUDCLNT_BUFFERFLAGS_* と同じ値)
+	constexpr std::uint32_t const CAPTURE_FLAG_DISCONTINUITY = 0x1;
+	constexpr std::uint32_t const CAPTURE_FLAG_SILENT = 0x2;
+	constexpr std::uint32_t const CAPTURE_FLAG_TIMESTAMP_ERROR = 0x4;
+
+	/// デバイスが使えなくなった (AUDCLNT_E_DEVICE_INVALIDATED と同じ値)
+	constexpr HRESULT const CAPTURE_E_DEVICE_INVALIDATED = static_cast<HRESULT>(0x88890004L);
+
+	struct capture_config {
+		int sample_rate; ///< エンジンのサンプルレート (モノラル float で受け取る)
+		int block_size;  ///< エンジンのブロックサイズ
+	};
+
+	struct capture_packet {
+		float const* data;            ///< CAPTURE_FLAG_SILENT のときは無効
+		std::uint32_t frames;
+		std::uint32_t flags;          ///< CAPTURE_FLAG_*
+		std::uint64_t device_time_ns; ///< パケット先頭サンプルの取り込み時刻 (不明なら 0)
+	};
+
+	class CaptureBackend {
+	public:
+		virtual ~CaptureBackend() = default;
+
+		virtual char const* Name() const noexcept = 0;
+
+		/// 最後に失敗した理由 (なければ空)
+		virtual char const* LastError() const noexcept {
+			return "";
+		}
+
+		/// デバイスを開いて形式を合わせる
+		virtual HRESULT Open(capture_config const& config) = 0;
+
+		/// 1 パケットの最大フレーム数 (Open() の後で有効)
+		virtual std::uint32_t MaxPacketFrames() const noexcept = 0;
+
+		virtual HRESULT Start() = 0;
+
+		/// 次のパケットを待つ (S_OK: パケットがある, S_FALSE: 中断されたか入力が終わった)
+		virtual HRESULT Wait() = 0;
+
+		/// Wait() を抜けさせる
+		virtual void Interrupt() noexcept = 0;
+
+		/// パケットを取り出す (frames が 0 のこともある)
+		virtual HRESULT Acquire(capture_packet& packet) = 0;
+
+		/// Acquire() したパケットを返す
+		virtual HRESULT Release(capture_packet const& packet) = 0;
+
+		virtual HRESULT Stop() = 0;
+	};
+
+	/// デバイスを持たないバックエンドの起床を実時間に合わせる (max speed なら待たない)
+	class CapturePacer final {
+	public:
+		static std::uint64_t now_ns() noexcept {
+			return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+
+		void Reset(bool realtime) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			realtime_ = realtime;
+			interrupted_ = false;
+			start_ns_ = now_ns();
+		}
+
+		bool IsRealtime() const noexcept {
+			return realtime_;
+		}
+
+		/// Reset() した時刻
+		std::uint64_t StartTime() const noexcept {
+			return start_ns_;
+		}
+
+		/// start + offset_ns まで待つ (中断されたら false)
+		bool WaitUntil(std::uint64_t offset_ns) {
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (realtime_) {
+				auto const deadline = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(start_ns_ + offset_ns));
+				cv_.wait_until(lock, deadline, [this] { return interrupted_; });
+			}
+			return !interrupted_;
+		}
+
+		void Interrupt() noexcept {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				interrupted_ = true;
+			}
+			cv_.notify_all();
+		}
+
+	private:
+		std::mutex mutex_;
+		std::condition_variable cv_;
+		bool realtime_ = true;
+		bool interrupted_ = false;
+		std::uint64_t start_ns_ = 0;
+	};
+}
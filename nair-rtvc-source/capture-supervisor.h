@@ -0,0 +1,388 @@
+﻿#pragma once
+
+// 取り込みの監視と復帰
+//
+// デバイスが抜かれたり既定の形式が変わったりして Wait() / Acquire() / Release() が失敗したら、
+// 別のスレッドでバックエンドを作り直す (間隔は指数的に延ばす)。その間は 1 ブロックずつ実時間で無音を返すので、
+// 呼び出し側 (推論スレッド、ブロックの組み立て、出力) はそのまま動き続け、出力の時刻も途切れない。
+//
+// 推論スレッドは失敗したバックエンドと HRESULT を atomic に置いてセマフォで起こすだけで、ロックは取らない。
+//
+//   Fault -> 無音でつなぐ -> { 作り直し -> Open() -> Start() } を失敗するたびに待って繰り返す -> 差し替え
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <semaphore>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#include <objbase.h>
+#endif
+
+#include "capture-backend.h"
+
+namespace rtvc {
+	/// 復帰の統計 (どのスレッドからでも読める)
+	struct capture_recovery_stats {
+		std::atomic<std::uint64_t> faults = 0;          ///< 失敗して作り直しを始めた回数
+		std::atomic<std::uint64_t> recoveries = 0;      ///< 作り直して差し替えた回数
+		std::atomic<std::uint64_t> open_attempts = 0;   ///< 作り直しで開こうとした回数
+		std::atomic<std::uint64_t> bridged_frames = 0;  ///< 無音でつないだフレーム数
+		std::atomic<std::uint64_t> last_recover_ns = 0; ///< 直近の失敗から最初のパケットまで
+		std::atomic<std::uint64_t> max_recover_ns = 0;
+		std::atomic<std::uint64_t> total_recover_ns = 0; ///< 平均は total_recover_ns / recoveries
+		std::atomic<std::int32_t> last_error = 0;       ///< 直近の失敗の HRESULT
+
+		void Reset() noexcept {
+			faults.store(0, std::memory_order::relaxed);
+			recoveries.store(0, std::memory_order::relaxed);
+			open_attempts.store(0, std::memory_order::relaxed);
+			bridged_frames.store(0, std::memory_order::relaxed);
+			last_recover_ns.store(0, std::memory_order::relaxed);
+			max_recover_ns.store(0, std::memory_order::relaxed);
+			total_recover_ns.store(0, std::memory_order::relaxed);
+			last_error.store(0, std::memory_order::relaxed);
+		}
+	};
+
+	class SupervisedCapture final : public CaptureBackend {
+		static constexpr std::uint64_t const INITIAL_BACKOFF_NS = 10'000'000;
+		static constexpr std::uint64_t const MAX_BACKOFF_NS = 2'000'000'000;
+
+	public:
+		/// バックエンドを作る (Open() の前まで。作り直しでは監視のスレッドから呼ぶ)
+		using factory = std::function<std::unique_ptr<CaptureBackend>()>;
+
+		SupervisedCapture(factory make, capture_recovery_stats& stats)
+			: make_(std::move(make))
+			, stats_(stats)
+		{
+		}
+
+		~SupervisedCapture() override {
+			Stop();
+		}
+
+		char const* Name() const noexcept override {
+			return name_;
+		}
+
+		char const* LastError() const noexcept override {
+			return error_.c_str();
+		}
+
+		HRESULT Open(capture_config const& config) override {
+			HRESULT hr = S_OK;
+			config_ = config;
+			inner_ = make_();
+			if (!inner_) {
+				error_ = "unable to create the capture";
+				return E_FAIL;
+			}
+			name_ = inner_->Name();
+			if FAILED(hr = inner_->Open(config)) {
+				error_ = inner_->LastError();
+				return hr;
+			}
+			// 作り直した後もこの長さを超えるパケットは分けて返す
+			max_packet_frames_ = inner_->MaxPacketFrames();
+			return S_OK;
+		}
+
+		std::uint32_t MaxPacketFrames() const noexcept override {
+			return max_packet_frames_;
+		}
+
+		HRESULT Start() override {
+			HRESULT hr = S_OK;
+			if FAILED(hr = inner_->Start()) {
+				error_ = inner_->LastError();
+				return hr;
+			}
+			current_.store(inner_.get());
+			stopping_ = false;
+			thread_ = std::thread([this] { Supervise(); });
+			return S_OK;
+		}
+
+		HRESULT Wait() override {
+			if (interrupted_.load()) {
+				return S_FALSE;
+			}
+			if (reopen_requested_.exchange(false, std::memory_order::acq_rel) && !recovering_) {
+				Fault(S_OK);
+			}
+
+			if (recovering_) {
+				// 作り直せていたら差し替える
+				if (CaptureBackend* const ready = ready_.exchange(nullptr, std::memory_order::acq_rel)) {
+					SwapIn(ready);
+				}
+				else {
+					// 1 ブロック分の無音が揃う時刻まで待つ
+					std::uint64_t const offset = frames_to_ns(bridged_frames_ + static_cast<std::uint64_t>(config_.block_size));
+					return bridge_pacer_.WaitUntil(offset) && !interrupted_.load() ? S_OK : S_FALSE;
+				}
+			}
+
+			// 分けて返している途中
+			if (split_offset_ < split_packet_.frames) {
+				return S_OK;
+			}
+
+			HRESULT const hr = inner_->Wait();
+			if (FAILED(hr)) {
+				Fault(hr);
+				return S_OK;
+			}
+			return hr;
+		}
+
+		void Interrupt() noexcept override {
+			interrupted_.store(true);
+			bridge_pacer_.Interrupt();
+			if (CaptureBackend* const current = current_.load()) {
+				current->Interrupt();
+			}
+			cv_.notify_all();
+		}
+
+		HRESULT Acquire(capture_packet& packet) override {
+			if (recovering_) {
+				// 無音でつなぐ (最初のパケットは不連続)
+				packet.data = nullptr;
+				packet.frames = static_cast<std::uint32_t>(config_.block_size);
+				packet.flags = CAPTURE_FLAG_SILENT | (bridged_frames_ == 0 ? CAPTURE_FLAG_DISCONTINUITY : 0);
+				packet.device_time_ns = bridge_pacer_.StartTime() + frames_to_ns(bridged_frames_);
+				return S_OK;
+			}
+
+			if (split_offset_ >= split_packet_.frames) {
+				HRESULT const hr = inner_->Acquire(split_packet_);
+				if (FAILED(hr)) {
+					Fault(hr);
+					split_packet_ = capture_packet{};
+					packet = capture_packet{ nullptr, 0, CAPTURE_FLAG_SILENT, 0 };
+					return S_OK;
+				}
+				split_offset_ = 0;
+				if (discontinuity_) {
+					split_packet_.flags |= CAPTURE_FLAG_DISCONTINUITY;
+					discontinuity_ = false;
+				}
+				if (first_packet_) {
+					// 失敗から最初のパケットまでを復帰の時間とする
+					std::uint64_t const elapsed = CapturePacer::now_ns() - fault_ns_;
+					stats_.last_recover_ns.store(elapsed, std::memory_order::relaxed);
+					if (elapsed > stats_.max_recover_ns.load(std::memory_order::relaxed)) {
+						stats_.max_recover_ns.store(elapsed, std::memory_order::relaxed);
+					}
+					stats_.total_recover_ns.fetch_add(elapsed, std::memory_order::relaxed);
+					stats_.recoveries.fetch_add(1, std::memory_order::release);
+					first_packet_ = false;
+				}
+			}
+
+			// 長すぎるパケットは MaxPacketFrames() ずつ返す
+			std::uint32_t const frames = (std::min)(split_packet_.frames - split_offset_, max_packet_frames_);
+			packet.data = (split_packet_.flags & CAPTURE_FLAG_SILENT) || !split_packet_.data ? split_packet_.data : split_packet_.data + split_offset_;
+			packet.frames = frames;
+			packet.flags = split_offset_ == 0 ? split_packet_.flags : (split_packet_.flags & ~CAPTURE_FLAG_DISCONTINUITY);
+			packet.device_time_ns = split_packet_.device_time_ns ? split_packet_.device_time_ns + frames_to_ns(split_offset_) : 0;
+			return S_OK;
+		}
+
+		HRESULT Release(capture_packet const& packet) override {
+			if (recovering_) {
+				bridged_frames_ += packet.frames;
+				stats_.bridged_frames.fetch_add(packet.frames, std::memory_order::relaxed);
+				return S_OK;
+			}
+			if (packet.frames == 0 && split_packet_.frames == 0) {
+				// Acquire() の失敗を無音にしたとき
+				return S_OK;
+			}
+
+			split_offset_ += packet.frames;
+			if (split_offset_ < split_packet_.frames) {
+				return S_OK;
+			}
+			HRESULT const hr = inner_->Release(split_packet_);
+			split_packet_ = capture_packet{};
+			split_offset_ = 0;
+			if (FAILED(hr)) {
+				Fault(hr);
+			}
+			return S_OK;
+		}
+
+		HRESULT Stop() override {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				stopping_ = true;
+			}
+			cv_.notify_all();
+			if (thread_.joinable()) {
+				wake_.release();
+				thread_.join();
+			}
+			current_.store(nullptr);
+			// 監視のスレッドが受け取る前に止めたとき
+			if (CaptureBackend* const failing = failing_.exchange(nullptr)) {
+				failing->Stop();
+				delete failing;
+			}
+
+			HRESULT hr = S_OK;
+			if (inner_) {
+				hr = inner_->Stop();
+				inner_.reset();
+			}
+			if (CaptureBackend* const ready = ready_.exchange(nullptr)) {
+				ready->Stop();
+				delete ready;
+			}
+			// Interrupt() が触っているかもしれないので最後に捨てる
+			failed_.clear();
+			return hr;
+		}
+
+		/// 今のデバイスを閉じて作り直す (どのスレッドからでもよい。既定のデバイスが替わったときなど)
+		void Reopen() noexcept {
+			reopen_requested_.store(true, std::memory_order::release);
+		}
+
+	private:
+		// 推論スレッドから。今のバックエンドを監視のスレッドに渡して無音でつなぎ始める
+		void Fault(HRESULT hr) {
+			fault_ns_ = CapturePacer::now_ns();
+			recovering_ = true;
+			first_packet_ = false;
+			bridged_frames_ = 0;
+			bridge_pacer_.Reset(true);
+			if (interrupted_.load()) {
+				bridge_pacer_.Interrupt();
+			}
+			split_packet_ = capture_packet{};
+			split_offset_ = 0;
+			// 推論スレッドなので文字列は写さない (HRESULT だけ渡す)
+			fault_result_.store(hr, std::memory_order::relaxed);
+			failing_.store(inner_.release(), std::memory_order::release);
+			wake_.release();
+		}
+
+		// 推論スレッドから。作り直したバックエンドに差し替える
+		void SwapIn(CaptureBackend* ready) {
+			inner_.reset(ready);
+			current_.store(ready);
+			if (interrupted_.load()) {
+				ready->Interrupt();
+			}
+			recovering_ = false;
+			first_packet_ = true;
+			discontinuity_ = true;
+		}
+
+		// 監視のスレッド
+		void Supervise() {
+#if defined(_WIN32)
+			bool const com = SUCCEEDED(::CoInitializeEx(nullptr, COINIT_MULTITHREADED));
+#endif
+			for (;;) {
+				wake_.acquire();
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					if (stopping_) {
+						break;
+					}
+				}
+				std::unique_ptr<CaptureBackend> failing(failing_.exchange(nullptr, std::memory_order::acq_rel));
+				if (!failing) {
+					continue;
+				}
+				stats_.last_error.store(static_cast<std::int32_t>(fault_result_.load(std::memory_order::relaxed)), std::memory_order::relaxed);
+				stats_.faults.fetch_add(1, std::memory_order::release);
+
+				// Interrupt() が持っているかもしれないので、止めるだけで Stop() まで残す
+				current_.store(nullptr);
+				failing->Stop();
+				Recover();
+
+				std::lock_guard<std::mutex> lock(mutex_);
+				failed_.push_back(std::move(failing));
+			}
+#if defined(_WIN32)
+			if (com) {
+				::CoUninitialize();
+			}
+#endif
+		}
+
+		void Recover() {
+			std::uint64_t backoff_ns = INITIAL_BACKOFF_NS;
+			for (;;) {
+				stats_.open_attempts.fetch_add(1, std::memory_order::relaxed);
+				std::unique_ptr<CaptureBackend> next = make_();
+				if (next && SUCCEEDED(next->Open(config_)) && SUCCEEDED(next->Start())) {
+					ready_.store(next.release(), std::memory_order::release);
+					return;
+				}
+				if (next) {
+					next->Stop();
+				}
+
+				std::unique_lock<std::mutex> lock(mutex_);
+				if (cv_.wait_for(lock, std::chrono::nanoseconds(backoff_ns), [this] { return stopping_ || interrupted_.load(); })) {
+					return;
+				}
+				backoff_ns = (std::min)(backoff_ns * 2, MAX_BACKOFF_NS);
+			}
+		}
+
+		std::uint64_t frames_to_ns(std::uint64_t frames) const noexcept {
+			return frames * 1'000'000'000ull / static_cast<std::uint64_t>(config_.sample_rate);
+		}
+
+		factory make_;
+		capture_recovery_stats& stats_;
+		capture_config config_{};
+		char const* name_ = "supervised";
+		std::string error_;
+		std::uint32_t max_packet_frames_ = 0;
+
+		// 推論スレッドだけが触る
+		std::unique_ptr<CaptureBackend> inner_;
+		bool recovering_ = false;
+		bool first_packet_ = false;
+		bool discontinuity_ = false;
+		std::uint64_t fault_ns_ = 0;
+		std::uint64_t bridged_frames_ = 0;
+		capture_packet split_packet_{};
+		std::uint32_t split_offset_ = 0;
+		CapturePacer bridge_pacer_;
+
+		// スレッドをまたぐ
+		std::atomic<CaptureBackend*> current_ = nullptr; ///< Interrupt() を届ける先
+		std::atomic<CaptureBackend*> ready_ = nullptr;   ///< 作り直して Start() 済み (推論スレッドが受け取る)
+		std::atomic<bool> interrupted_ = false;
+		std::atomic<bool> reopen_requested_ = false;
+		std::atomic<CaptureBackend*> failing_ = nullptr; ///< 推論スレッドが手放したもの (監視のスレッドが受け取る)
+		std::atomic<HRESULT> fault_result_ = S_OK;       ///< failing_ が失敗した理由
+		std::counting_semaphore<> wake_{ 0 };            ///< Fault() と Stop() から監視のスレッドへ
+
+		std::mutex mutex_;
+		std::condition_variable cv_;
+		std::thread thread_;
+		bool stopping_ = false;
+		std::vector<std::unique_ptr<CaptureBackend>> failed_; ///< 止めたもの (Stop() で捨てる)
+	};
+}
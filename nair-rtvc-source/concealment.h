@@ -0,0 +1,192 @@
+﻿#pragma once
+
+// 欠けた音声の穴埋め (パケットロス隠蔽)
+//
+// エンジンが失敗したり間に合わなかったりしたブロックと、再生側のバッファーが空になった分を、
+// 直前に出した音声の 1 周期を繰り返して埋める。周期は直前の出力の自己相関で求め、繰り返しの継ぎ目は 1/4 周期でつなぐ。
+// 10 ms までは元の大きさで、そこから 50 ms かけて無音まで下げる。本物の音声が戻ったら 1/4 周期 (2.5 ms 以上) でクロスフェードする。
+//
+// メモリーは Reset() でだけ確保する (Good() と Conceal() はリアルタイムスレッドから呼べる)。
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include "simd-kernels.h"
+
+namespace rtvc {
+	class Concealer final {
+	public:
+		/// 60 Hz から 500 Hz までの周期を探せるように履歴を用意する (リアルタイムスレッドの外で呼ぶ)
+		void Reset(int sample_rate) {
+			min_lag_ = (std::max)(sample_rate / 500, 2);
+			max_lag_ = (std::max)(sample_rate / 60, min_lag_ + 1);
+			window_ = max_lag_;
+			history_size_ = static_cast<std::size_t>(window_ + 2 * max_lag_);
+			history_.reset(new float[history_size_]);
+			linear_.reset(new float[history_size_]);
+			cycle_.reset(new float[static_cast<std::size_t>(max_lag_)]);
+			std::memset(history_.get(), 0, history_size_ * sizeof(float));
+			write_ = 0;
+			valid_ = 0;
+			hold_frames_ = static_cast<std::uint32_t>(sample_rate / 100);
+			decay_step_ = 1.0f / static_cast<float>((std::max)(sample_rate / 20, 1));
+			min_recover_ = static_cast<std::uint32_t>(sample_rate / 400);
+			period_ = 0;
+			concealing_ = false;
+			concealed_frames_.store(0, std::memory_order::relaxed);
+		}
+
+		/// 本物の音声を通す (隠していた後なら、続きの合成音からクロスフェードする)
+		void Good(float* data, std::uint32_t frames) noexcept {
+			if (concealing_) {
+				concealing_ = false;
+				std::uint32_t const recover = (std::min)(frames, (std::max)(static_cast<std::uint32_t>(period_ / 4), min_recover_));
+				for (std::uint32_t i = 0; i < recover; ++i) {
+					float const w = static_cast<float>(i + 1) / static_cast<float>(recover + 1);
+					data[i] = data[i] * w + Synthesize() * (1.0f - w);
+				}
+			}
+			Remember(data, frames);
+		}
+
+		/// 欠けた frames フレームを合成して out に書く (履歴が足りなければ無音)
+		void Conceal(float* out, std::uint32_t frames) noexcept {
+			if (!concealing_) {
+				Begin();
+				concealing_ = true;
+			}
+			for (std::uint32_t i = 0; i < frames; ++i) {
+				out[i] = Synthesize();
+			}
+			Remember(out, frames);
+			if (period_ != 0) {
+				concealed_frames_.fetch_add(frames, std::memory_order::relaxed);
+			}
+		}
+
+		bool Concealing() const noexcept {
+			return concealing_;
+		}
+
+		/// 合成で埋めたフレーム数 (ほかのスレッドから読める)
+		std::uint64_t ConcealedFrames() const noexcept {
+			return concealed_frames_.load(std::memory_order::relaxed);
+		}
+
+	private:
+		void Remember(float const* data, std::uint32_t frames) noexcept {
+			// 履歴より長ければ後ろだけ残す
+			if (frames >= history_size_) {
+				data += frames - history_size_;
+				frames = static_cast<std::uint32_t>(history_size_);
+			}
+			std::size_t const first = (std::min)(static_cast<std::size_t>(frames), history_size_ - write_);
+			std::memcpy(history_.get() + write_, data, first * sizeof(float));
+			std::memcpy(history_.get(), data + first, (frames - first) * sizeof(float));
+			write_ = (write_ + frames) % history_size_;
+			valid_ = (std::min)(valid_ + frames, history_size_);
+		}
+
+		// 直前の出力から周期を求めて、繰り返す 1 周期を作る
+		void Begin() noexcept {
+			position_ = 0;
+			elapsed_ = 0;
+			gain_ = 1.0f;
+			period_ = 0;
+			if (valid_ < history_size_) {
+				// 鳴らし始めたばかり (埋めるものがない)
+				return;
+			}
+
+			// 古い順に並べ直す (x[n - 1] が最後に出した音声)
+			float* const x = linear_.get();
+			std::size_t const n = history_size_;
+			std::memcpy(x, history_.get() + write_, (n - write_) * sizeof(float));
+			std::memcpy(x + (n - write_), history_.get(), write_ * sizeof(float));
+
+			// 最後の window_ と lag 前の window_ の正規化相関が最大になる lag
+			// lag を 2 つおきに粗く探してから、前後を詳しく見る
+			simd::kernel_table const& kernels = simd::kernels();
+			float const* const tail = x + n - window_;
+			float const tail_energy = kernels.dot(tail, tail, static_cast<std::size_t>(window_));
+			if (tail_energy < 1e-9f) {
+				return;
+			}
+			auto const correlation = [&](int lag) {
+				float const* const past = tail - lag;
+				float const dot = kernels.dot(tail, past, static_cast<std::size_t>(window_));
+				float const energy = kernels.dot(past, past, static_cast<std::size_t>(window_));
+				return energy > 0.0f ? dot / std::sqrt(energy * tail_energy) : 0.0f;
+			};
+			int best = max_lag_;
+			float best_score = -1.0f;
+			for (int lag = min_lag_; lag <= max_lag_; lag += 2) {
+				float const score = correlation(lag);
+				if (score > best_score) {
+					best_score = score;
+					best = lag;
+				}
+			}
+			int const coarse = best;
+			best_score = -1.0f;
+			for (int lag = (std::max)(coarse - 2, min_lag_); lag <= (std::min)(coarse + 2, max_lag_); ++lag) {
+				float const score = correlation(lag);
+				if (score > best_score) {
+					best_score = score;
+					best = lag;
+				}
+			}
+			// はっきりした周期がない (無声音) ときは長めに取ってうなりを抑える
+			period_ = best_score < 0.3f ? max_lag_ : best;
+
+			// 最後の 1 周期。終わりの 1/4 周期は 2 周期前に寄せて、先頭へ滑らかに戻るようにする
+			float const* const last = x + n - period_;
+			float const* const before = x + n - 2 * period_;
+			int const overlap = (std::max)(period_ / 4, 1);
+			for (int i = 0; i < period_; ++i) {
+				float const w = i < period_ - overlap ? 0.0f : static_cast<float>(i - (period_ - overlap) + 1) / static_cast<float>(overlap);
+				cycle_[i] = last[i] * (1.0f - w) + before[i] * w;
+			}
+		}
+
+		float Synthesize() noexcept {
+			if (period_ == 0 || gain_ <= 0.0f) {
+				return 0.0f;
+			}
+			float const sample = cycle_[position_] * gain_;
+			if (++position_ == period_) {
+				position_ = 0;
+			}
+			if (++elapsed_ > hold_frames_) {
+				gain_ = (std::max)(gain_ - decay_step_, 0.0f);
+			}
+			return sample;
+		}
+
+		int min_lag_ = 0;
+		int max_lag_ = 0;
+		int window_ = 0;
+		std::size_t history_size_ = 0;
+		std::unique_ptr<float[]> history_; ///< 最後に出した音声 (リング)
+		std::unique_ptr<float[]> linear_;  ///< 周期を探すときに並べ直す
+		std::unique_ptr<float[]> cycle_;   ///< 繰り返す 1 周期
+		std::size_t write_ = 0;
+		std::size_t valid_ = 0;
+
+		std::uint32_t hold_frames_ = 0;
+		float decay_step_ = 0.0f;
+		std::uint32_t min_recover_ = 0;
+
+		bool concealing_ = false;
+		int period_ = 0; ///< 0 なら無音で埋める
+		int position_ = 0;
+		std::uint32_t elapsed_ = 0;
+		float gain_ = 0.0f;
+		std::atomic<std::uint64_t> concealed_frames_ = 0;
+	};
+}
@@ -0,0 +1,45 @@
+﻿#pragma once
+
+// 決まったフレーム数だけ遅らせる
+//
+// 素の声 (ドライ) を変換した声 (ウェット) と揃えるために、エンジンの遅延 (get_sample_latency) だけ遅らせる。
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+namespace rtvc {
+	class DelayLine final {
+	public:
+		/// 遅延と 1 回に通す最大フレーム数に合わせてバッファーを確保する (中身は無音)
+		void Reset(std::uint32_t delay_frames, std::size_t max_frames) {
+			delay_frames_ = delay_frames;
+			max_frames_ = max_frames;
+			std::size_t const buffer_size = delay_frames + max_frames;
+			buffer_.reset(new float[buffer_size]);
+			std::memset(buffer_.get(), 0, buffer_size * sizeof(float));
+		}
+
+		/// in を frames フレーム積み、delay_frames 前の分を out に書き出す (frames は max_frames 以下)
+		void Process(float const* in, float* out, std::uint32_t frames) noexcept {
+			// [遅延中の分 | in] と並べて先頭から出し、残りを前に詰める
+			std::memcpy(buffer_.get() + delay_frames_, in, frames * sizeof(float));
+			std::memcpy(out, buffer_.get(), frames * sizeof(float));
+			std::memmove(buffer_.get(), buffer_.get() + frames, delay_frames_ * sizeof(float));
+		}
+
+		std::uint32_t DelayFrames() const noexcept {
+			return delay_frames_;
+		}
+
+		std::size_t MaxFrames() const noexcept {
+			return max_frames_;
+		}
+
+	private:
+		std::unique_ptr<float[]> buffer_;
+		std::uint32_t delay_frames_ = 0;
+		std::size_t max_frames_ = 0;
+	};
+}
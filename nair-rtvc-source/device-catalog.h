@@ -0,0 +1,142 @@
+﻿#pragma once
+
+// デバイスの一覧 (プロセスで共有するキャッシュ)
+//
+// 一覧は OS からの通知 (IMMNotificationClient、/dev/snd の変化) を受けたときだけ作り直し、
+// プロパティの構築や取り込みの開始はキャッシュを読むだけにする。
+// デバイスは位置ではなく安定した ID (WASAPI はエンドポイント ID、ALSA は PCM 名) で指す。
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace rtvc {
+	enum class device_flow : int {
+		capture,
+		render,
+	};
+
+	enum class device_change : int {
+		added,           ///< 使えるようになった
+		removed,         ///< 使えなくなった (抜かれた、無効にされた)
+		default_changed, ///< 既定のデバイスが替わった (id は新しい既定)
+	};
+
+	struct device_entry {
+		std::string id;   ///< 設定に保存する ID (UTF-8)
+		std::string name; ///< 表示名 (UTF-8)
+	};
+
+	struct device_list {
+		std::uint64_t generation = 0; ///< 作り直すたびに増える
+		std::vector<device_entry> devices;
+		std::string default_id; ///< 既定のデバイス (なければ空)
+
+		device_entry const* Find(std::string const& id) const noexcept {
+			for (device_entry const& entry : devices) {
+				if (entry.id == id) {
+					return &entry;
+				}
+			}
+			return nullptr;
+		}
+
+		/// 一覧での位置 (なければ -1)
+		int IndexOf(std::string const& id) const noexcept {
+			for (std::size_t i = 0; i < devices.size(); ++i) {
+				if (devices[i].id == id) {
+					return static_cast<int>(i);
+				}
+			}
+			return -1;
+		}
+
+		/// 以前の設定 (位置) から ID を引く
+		std::string IdAt(int index) const {
+			return index >= 0 && static_cast<std::size_t>(index) < devices.size() ? devices[static_cast<std::size_t>(index)].id : std::string();
+		}
+	};
+
+	class DeviceCatalog {
+	public:
+		/// 一覧が変わったときに呼ばれる (通知のスレッドから。中で Unsubscribe() しない)
+		using listener = std::function<void(device_flow flow, device_change change, std::string const& id)>;
+
+		virtual ~DeviceCatalog() = default;
+
+		/// キャッシュした一覧 (作り直しても、受け取った一覧はそのまま読める)
+		std::shared_ptr<device_list const> Devices(device_flow flow) const {
+			std::lock_guard<std::mutex> lock(lists_mutex_);
+			return lists_[static_cast<int>(flow)];
+		}
+
+		std::uint64_t Subscribe(listener callback) {
+			std::lock_guard<std::mutex> lock(listeners_mutex_);
+			std::uint64_t const token = next_token_++;
+			listeners_.emplace_back(token, std::move(callback));
+			return token;
+		}
+
+		/// 戻ったらもう呼ばれない (呼ばれている途中なら終わるまで待つ)
+		void Unsubscribe(std::uint64_t token) {
+			std::lock_guard<std::mutex> lock(listeners_mutex_);
+			for (auto it = listeners_.begin(); it != listeners_.end(); ++it) {
+				if (it->first == token) {
+					listeners_.erase(it);
+					break;
+				}
+			}
+		}
+
+	protected:
+		DeviceCatalog()
+			: lists_{ std::make_shared<device_list const>(), std::make_shared<device_list const>() }
+		{
+		}
+
+		/// 作り直した一覧に差し替えて、前との違いを知らせる
+		void Publish(device_flow flow, device_list next) {
+			std::shared_ptr<device_list const> previous = Devices(flow);
+			next.generation = previous->generation + 1;
+
+			std::vector<std::pair<device_change, std::string>> changes;
+			for (device_entry const& entry : previous->devices) {
+				if (!next.Find(entry.id)) {
+					changes.emplace_back(device_change::removed, entry.id);
+				}
+			}
+			for (device_entry const& entry : next.devices) {
+				if (!previous->Find(entry.id)) {
+					changes.emplace_back(device_change::added, entry.id);
+				}
+			}
+			if (next.default_id != previous->default_id) {
+				changes.emplace_back(device_change::default_changed, next.default_id);
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(lists_mutex_);
+				lists_[static_cast<int>(flow)] = std::make_shared<device_list const>(std::move(next));
+			}
+
+			std::lock_guard<std::mutex> lock(listeners_mutex_);
+			for (auto const& [change, id] : changes) {
+				for (auto const& [token, callback] : listeners_) {
+					callback(flow, change, id);
+				}
+			}
+		}
+
+	private:
+		mutable std::mutex lists_mutex_;
+		std::shared_ptr<device_list const> lists_[2];
+
+		std::mutex listeners_mutex_; ///< 知らせている間も持つので、Unsubscribe() は終わるまで待つ
+		std::vector<std::pair<std::uint64_t, listener>> listeners_;
+		std::uint64_t next_token_ = 1;
+	};
+}
@@ -0,0 +1,454 @@
+﻿#pragma once
+
+// 組み込みの軽量エンジン (eco)
+//
+// rtvc.vvfx と同じ関数テーブルの形で、ニューラルネットを使わずにピッチだけを変える。
+// 低性能な PC で推論が間に合わないときや、エンジンが見つからないときの代わりに使う。
+//
+// TD-PSOLA: 基本周期ごとに入力へ印 (ピッチマーク) を付け、周期の 2 倍の長さのグレインを切り出して、
+// 変換後の周期の間隔で重ね合わせる。グレインの中身 (スペクトル包絡) は伸び縮みしないので、
+// ピッチを変えてもフォルマントはそのまま残る (song)。talk ではフォルマントもピッチに少しだけ追従させる。
+//
+// パラメーターはエンジンと同じ { input_gain, output_gain, pitch_shift, pitch_shift_mode, pitch_snap }。
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <utility>
+
+#include "rtvc-engine.h"
+#include "simd-kernels.h"
+
+namespace rtvc::eco {
+	inline constexpr int const SAMPLE_RATE = 24'000;
+	inline constexpr int const BLOCK_SIZE = 256;
+
+	inline constexpr int const PERIOD_MIN = SAMPLE_RATE / 800;  ///< 基本周波数の上限 800 [hz]
+	inline constexpr int const PERIOD_MAX = SAMPLE_RATE / 80;   ///< 基本周波数の下限 80 [hz]
+	inline constexpr int const UNVOICED_PERIOD = SAMPLE_RATE / 200; ///< 無声音はこの間隔でそのまま重ね合わせる
+	inline constexpr int const ANALYSIS_WINDOW = PERIOD_MAX;   ///< 周期を推定する窓
+	inline constexpr float const FORMANT_MIN = 0.8f;
+	inline constexpr float const FORMANT_MAX = 1.25f;
+
+	/// ピッチマークを付けるのに必要な先読み (山の探索とフォルマントを変えたグレインの切り出し)
+	inline constexpr int const MARK_LOOKAHEAD = static_cast<int>(PERIOD_MAX * FORMANT_MAX) + PERIOD_MAX / 4 + 2;
+	/// 入力から出力までの遅延 (最後のマークの後ろにグレイン 1 つ分と、マークの間隔 1 つ分)
+	inline constexpr int const SAMPLE_LATENCY = (MARK_LOOKAHEAD + 2 * PERIOD_MAX + 31) / 32 * 32;
+
+	inline constexpr std::size_t const RING_SIZE = 4096; ///< 2 の冪
+	inline constexpr std::size_t const RING_MASK = RING_SIZE - 1;
+	static_assert(SAMPLE_LATENCY + BLOCK_SIZE + 2 * PERIOD_MAX * 2 < static_cast<int>(RING_SIZE));
+
+	/// 基本周期の推定 (YIN の累積平均正規化差分関数)
+	struct pitch_estimate {
+		float period; ///< [samples] (有声音のときだけ有効)
+		bool voiced;
+	};
+
+	inline pitch_estimate estimate_pitch(float const* x, float* d) noexcept {
+		// x は ANALYSIS_WINDOW + PERIOD_MAX サンプル、d は PERIOD_MAX + 1 要素
+		simd::kernel_table const& kernels = simd::kernels();
+		float const energy = kernels.dot(x, x, ANALYSIS_WINDOW);
+		if (energy < ANALYSIS_WINDOW * 1e-6f) {
+			// -60 dBFS より小さければ無声とみなす
+			return { 0.0f, false };
+		}
+
+		d[0] = 1.0f;
+		float running = 0.0f;
+		for (int tau = 1; tau <= PERIOD_MAX; ++tau) {
+			float const diff = kernels.squared_distance(x, x + tau, ANALYSIS_WINDOW);
+			running += diff;
+			d[tau] = running > 0.0f ? diff * tau / running : 1.0f;
+		}
+
+		// 閾値を下回った最初の谷を取る (なければ最小値)
+		constexpr float const THRESHOLD = 0.15f;
+		int best = -1;
+		for (int tau = PERIOD_MIN; tau <= PERIOD_MAX; ++tau) {
+			if (d[tau] < THRESHOLD) {
+				while (tau + 1 <= PERIOD_MAX && d[tau + 1] < d[tau]) {
+					++tau;
+				}
+				best = tau;
+				break;
+			}
+		}
+		if (best < 0) {
+			best = PERIOD_MIN;
+			for (int tau = PERIOD_MIN + 1; tau <= PERIOD_MAX; ++tau) {
+				if (d[tau] < d[best]) {
+					best = tau;
+				}
+			}
+		}
+		if (d[best] > 0.35f) {
+			return { 0.0f, false };
+		}
+
+		// 放物線補間
+		float period = static_cast<float>(best);
+		if (best > PERIOD_MIN && best < PERIOD_MAX) {
+			float const a = d[best - 1];
+			float const b = d[best];
+			float const c = d[best + 1];
+			float const denominator = a - 2.0f * b + c;
+			if (denominator > 0.0f) {
+				period += 0.5f * (a - c) / denominator;
+			}
+		}
+		return { period, true };
+	}
+
+	class PsolaShifter final {
+	public:
+		void Reset() noexcept {
+			input_.fill(0.0f);
+			output_.fill(0.0f);
+			input_end_ = 0;
+			next_mark_ = 0;
+			marks_begin_ = 0;
+			marks_end_ = 0;
+			next_synthesis_ = 0.0;
+			period_ = static_cast<float>(UNVOICED_PERIOD);
+			voiced_ = false;
+			unvoiced_blocks_ = 0;
+		}
+
+		/// 1 ブロック処理する (x と y は同じでもよい)
+		void Process(float const* x, float* y, float input_gain, float output_gain, float pitch_shift, float pitch_shift_mode, float pitch_snap) noexcept {
+			simd::kernel_table const& kernels = simd::kernels();
+			{
+				// リングの終わりで折り返す
+				std::size_t const at = static_cast<std::size_t>(input_end_) & RING_MASK;
+				std::size_t const first = (std::min)(static_cast<std::size_t>(BLOCK_SIZE), RING_SIZE - at);
+				kernels.scale(x, input_.data() + at, input_gain, first);
+				kernels.scale(x + first, input_.data(), input_gain, BLOCK_SIZE - first);
+			}
+			input_end_ += BLOCK_SIZE;
+
+			Analyze();
+
+			// 変換後の周期の比 (pitch_shift は自然対数)
+			float const ratio = std::clamp(std::exp(pitch_shift), 0.5f, 2.0f);
+			float const snap = std::clamp(pitch_snap, 0.0f, 1.0f);
+			float const formant_follow = pitch_shift_mode >= 0.5f ? 0.25f : 0.0f;
+			Mark(ratio, snap, formant_follow);
+			Synthesize();
+
+			// SAMPLE_LATENCY だけ前の分を出力して、重ね合わせの場所を空ける (始めの SAMPLE_LATENCY は無音)
+			std::int64_t const begin = static_cast<std::int64_t>(input_end_) - SAMPLE_LATENCY - BLOCK_SIZE;
+			std::size_t const silent = static_cast<std::size_t>(std::clamp<std::int64_t>(-begin, 0, BLOCK_SIZE));
+			std::fill(y, y + silent, 0.0f);
+			for (std::size_t i = silent; i < BLOCK_SIZE;) {
+				std::size_t const at = static_cast<std::size_t>(begin + static_cast<std::int64_t>(i)) & RING_MASK;
+				std::size_t const n = (std::min)(BLOCK_SIZE - i, RING_SIZE - at);
+				kernels.scale(output_.data() + at, y + i, output_gain, n);
+				std::fill(output_.data() + at, output_.data() + at + n, 0.0f);
+				i += n;
+			}
+		}
+
+	private:
+		struct pitch_mark {
+			std::int64_t position;
+			float period;  ///< 入力の周期
+			float ratio;   ///< 周期の比 (出力の周期 = period / ratio)
+			float formant; ///< フォルマントの比
+		};
+
+		float Input(std::int64_t t) const noexcept {
+			return input_[static_cast<std::size_t>(t) & RING_MASK];
+		}
+
+		// 最新の窓で周期を推定する
+		void Analyze() noexcept {
+			constexpr int const SIZE = ANALYSIS_WINDOW + PERIOD_MAX;
+			std::int64_t const begin = static_cast<std::int64_t>(input_end_) - SIZE;
+			if (begin < 0) {
+				return;
+			}
+			for (int i = 0; i < SIZE; ++i) {
+				window_[i] = Input(begin + i);
+			}
+			pitch_estimate const estimate = estimate_pitch(window_.data(), difference_.data());
+			if (estimate.voiced) {
+				// オクターブの飛びは除いて緩やかに追う
+				period_ = voiced_ && std::abs(estimate.period - period_) < 0.2f * period_ ? period_ + 0.5f * (estimate.period - period_) : estimate.period;
+				voiced_ = true;
+				unvoiced_blocks_ = 0;
+			}
+			else if (++unvoiced_blocks_ > 2) {
+				voiced_ = false;
+			}
+		}
+
+		// 先読みが揃った位置までピッチマークを付ける
+		void Mark(float ratio, float snap, float formant_follow) noexcept {
+			for (;;) {
+				float const period = voiced_ ? period_ : static_cast<float>(UNVOICED_PERIOD);
+				std::int64_t candidate = next_mark_;
+				if (candidate + MARK_LOOKAHEAD > static_cast<std::int64_t>(input_end_)) {
+					break;
+				}
+
+				pitch_mark mark{ candidate, period, 1.0f, 1.0f };
+				if (voiced_) {
+					// 声門の閉じる位置 (周期内の山) に揃える
+					int const reach = static_cast<int>(period) / 4;
+					std::int64_t const previous = marks_end_ > marks_begin_ ? marks_[(marks_end_ - 1) % MAX_MARKS].position : candidate - static_cast<std::int64_t>(period);
+					std::int64_t const low = (std::max)(candidate - reach, previous + static_cast<std::int64_t>(period) / 2);
+					std::int64_t peak = candidate;
+					float peak_value = -1.0f;
+					for (std::int64_t t = low; t <= candidate + reach; ++t) {
+						float const v = Input(t);
+						if (v > peak_value) {
+							peak_value = v;
+							peak = t;
+						}
+					}
+					mark.position = peak;
+
+					// 半音に寄せる
+					float shifted = ratio;
+					if (snap > 0.0f) {
+						float const f0 = SAMPLE_RATE / period * ratio;
+						float const semitones = 12.0f * std::log2(f0 / 440.0f);
+						float const snapped = semitones + snap * (std::round(semitones) - semitones);
+						shifted = 440.0f * std::exp2(snapped / 12.0f) / (SAMPLE_RATE / period);
+					}
+					mark.ratio = std::clamp(shifted, 0.5f, 2.0f);
+					mark.formant = std::clamp(std::pow(mark.ratio, formant_follow), FORMANT_MIN, FORMANT_MAX);
+				}
+
+				if (marks_end_ - marks_begin_ == MAX_MARKS) {
+					++marks_begin_;
+				}
+				marks_[marks_end_++ % MAX_MARKS] = mark;
+				next_mark_ = mark.position + static_cast<std::int64_t>(std::lround(period));
+			}
+		}
+
+		// 最後のピッチマークまでグレインを重ね合わせる
+		void Synthesize() noexcept {
+			while (marks_end_ > marks_begin_) {
+				std::int64_t const s = static_cast<std::int64_t>(std::llround(next_synthesis_));
+				if (s > marks_[(marks_end_ - 1) % MAX_MARKS].position) {
+					break;
+				}
+
+				// 合成位置に一番近いマーク
+				while (marks_end_ - marks_begin_ > 1 && marks_[(marks_begin_ + 1) % MAX_MARKS].position <= s) {
+					++marks_begin_;
+				}
+				pitch_mark mark = marks_[marks_begin_ % MAX_MARKS];
+				if (marks_end_ - marks_begin_ > 1) {
+					pitch_mark const& next = marks_[(marks_begin_ + 1) % MAX_MARKS];
+					if (next.position - s < s - mark.position) {
+						mark = next;
+					}
+				}
+
+				// 周期の 2 倍の長さのハン窓 (間隔 period / ratio で重なるので 1 / ratio 倍する)
+				int const half = static_cast<int>(mark.period);
+				float const scale = 1.0f / mark.ratio;
+				float const step = PI_F / static_cast<float>(half);
+				for (int k = -half + 1; k < half; ++k) {
+					float const w = 0.5f + 0.5f * std::cos(step * static_cast<float>(k));
+					float const source = static_cast<float>(mark.position) + static_cast<float>(k) * mark.formant;
+					std::int64_t const i = static_cast<std::int64_t>(std::floor(source));
+					float const frac = source - static_cast<float>(i);
+					float const v = Input(i) + frac * (Input(i + 1) - Input(i));
+					std::int64_t const t = s + k;
+					if (t >= 0) {
+						output_[static_cast<std::size_t>(t) & RING_MASK] += w * v * scale;
+					}
+				}
+				next_synthesis_ += mark.period / mark.ratio;
+			}
+		}
+
+		static constexpr float const PI_F = 3.14159265f;
+		static constexpr std::size_t const MAX_MARKS = 64;
+
+		std::array<float, RING_SIZE> input_{};
+		std::array<float, RING_SIZE> output_{}; ///< 重ね合わせ (入力の時刻で持つ)
+		std::array<float, ANALYSIS_WINDOW + PERIOD_MAX> window_{};
+		std::array<float, PERIOD_MAX + 1> difference_{};
+		std::uint64_t input_end_ = 0;
+
+		std::array<pitch_mark, MAX_MARKS> marks_{};
+		std::size_t marks_begin_ = 0;
+		std::size_t marks_end_ = 0;
+		std::int64_t next_mark_ = 0;
+		double next_synthesis_ = 0.0;
+
+		float period_ = static_cast<float>(UNVOICED_PERIOD);
+		bool voiced_ = false;
+		int unvoiced_blocks_ = 0;
+	};
+
+	/// 同時に開けるエンジンの数 (ソースごとに 1 つ。切り替えの間は新旧 2 つ)
+	inline constexpr std::size_t const MAX_INSTANCES = 8;
+
+	/// エンジンごとの状態 (関数テーブルに文脈を渡せないので、枠ごとに別の関数を作る)
+	struct instance_slot {
+		std::atomic<bool> used = false;   ///< eco_engine_api() で取り、destroy() で返す
+		std::unique_ptr<PsolaShifter> shifter; ///< init() で作る
+	};
+
+	inline std::array<instance_slot, MAX_INSTANCES>& instance_slots() {
+		static std::array<instance_slot, MAX_INSTANCES> slots;
+		return slots;
+	}
+
+	inline constexpr char const* const PARAM_NAMES[] = { "input_gain", "output_gain", "pitch_shift", "pitch_shift_mode", "pitch_snap" };
+
+	inline int RTVC_CALL get_protocol_version(int* major_version, int* minor_version, int* revision) {
+		*major_version = 1;
+		*minor_version = 0;
+		*revision = 0;
+		return 0;
+	}
+
+	template <std::size_t I>
+	struct instance_api {
+		static int RTVC_CALL init([[maybe_unused]] char const* model_name) {
+			instance_slot& slot = instance_slots()[I];
+			if (!slot.shifter) {
+				slot.shifter.reset(new (std::nothrow) PsolaShifter);
+				if (!slot.shifter) {
+					// 失敗したら destroy() は呼ばれないので枠を返す
+					slot.used.store(false, std::memory_order::release);
+					return -1;
+				}
+			}
+			slot.shifter->Reset();
+			return 0;
+		}
+
+		static int RTVC_CALL destroy() {
+			instance_slot& slot = instance_slots()[I];
+			slot.shifter.reset();
+			slot.used.store(false, std::memory_order::release);
+			return 0;
+		}
+
+		static int RTVC_CALL process(int num_params, float const* params, float const* x, float* y) {
+			float const defaults[] = { 1.0f, 1.0f, 0.0f, 1.0f, 0.0f };
+			float p[std::size(defaults)];
+			for (std::size_t i = 0; i < std::size(defaults); ++i) {
+				p[i] = static_cast<int>(i) < num_params ? params[i] : defaults[i];
+			}
+			instance_slots()[I].shifter->Process(x, y, p[0], p[1], p[2], p[3], p[4]);
+			return 0;
+		}
+	};
+
+	/// 枠ごとの init / destroy / process
+	struct instance_entry {
+		decltype(engine_api::init) init;
+		decltype(engine_api::destroy) destroy;
+		decltype(engine_api::process) process;
+	};
+
+	template <std::size_t... I>
+	constexpr std::array<instance_entry, sizeof...(I)> make_instance_entries(std::index_sequence<I...>) noexcept {
+		return { { { instance_api<I>::init, instance_api<I>::destroy, instance_api<I>::process }... } };
+	}
+
+	inline constexpr std::array<instance_entry, MAX_INSTANCES> const INSTANCE_ENTRIES = make_instance_entries(std::make_index_sequence<MAX_INSTANCES>());
+
+	inline int RTVC_CALL get_version(int* major_version, int* minor_version, int* revision) {
+		*major_version = 1;
+		*minor_version = 0;
+		*revision = 0;
+		return 0;
+	}
+
+	inline int RTVC_CALL get_sample_rate(int* sample_rate) {
+		*sample_rate = SAMPLE_RATE;
+		return 0;
+	}
+
+	inline int RTVC_CALL get_sample_latency(int* sample_latency) {
+		*sample_latency = SAMPLE_LATENCY;
+		return 0;
+	}
+
+	inline int RTVC_CALL get_block_size(int* block_size) {
+		*block_size = BLOCK_SIZE;
+		return 0;
+	}
+
+	inline int RTVC_CALL get_num_params(int* num_params) {
+		*num_params = static_cast<int>(std::size(PARAM_NAMES));
+		return 0;
+	}
+
+	inline int RTVC_CALL get_param_name(int i, char const** param_name) {
+		if (i < 0 || i >= static_cast<int>(std::size(PARAM_NAMES))) {
+			return -1;
+		}
+		*param_name = PARAM_NAMES[i];
+		return 0;
+	}
+
+	inline int RTVC_CALL get_num_voices(int* num_voices) {
+		*num_voices = 1;
+		return 0;
+	}
+
+	inline int RTVC_CALL get_voice_name(int i, char const** voice_name) {
+		if (i != 0) {
+			return -1;
+		}
+		*voice_name = "pitch shift (eco)";
+		return 0;
+	}
+
+	// 声は 1 つなので何を選んでも同じ
+	inline int RTVC_CALL set_voice([[maybe_unused]] int voice_id) {
+		return 0;
+	}
+
+	inline int RTVC_CALL set_voices([[maybe_unused]] int num_voices, [[maybe_unused]] int const* voice_ids, [[maybe_unused]] float const* voice_amounts) {
+		return 0;
+	}
+}
+
+namespace rtvc {
+	/// 組み込みの軽量エンジンの関数テーブル (エンジンごとに状態を持つ。eco::MAX_INSTANCES 個まで開いていたら false)
+	///
+	/// 空いている枠を取り、destroy() か init() の失敗で返す。init() を呼ばずに捨てるときは destroy() を呼ぶ。
+	inline bool eco_engine_api(engine_api& api) {
+		std::size_t slot = 0;
+		while (slot < eco::MAX_INSTANCES && eco::instance_slots()[slot].used.exchange(true, std::memory_order::acq_rel)) {
+			++slot;
+		}
+		if (slot == eco::MAX_INSTANCES) {
+			return false;
+		}
+		api.get_protocol_version = eco::get_protocol_version;
+		api.init = eco::INSTANCE_ENTRIES[slot].init;
+		api.destroy = eco::INSTANCE_ENTRIES[slot].destroy;
+		api.process = eco::INSTANCE_ENTRIES[slot].process;
+		api.get_version = eco::get_version;
+		api.get_sample_rate = eco::get_sample_rate;
+		api.get_sample_latency = eco::get_sample_latency;
+		api.get_block_size = eco::get_block_size;
+		api.get_num_params = eco::get_num_params;
+		api.get_param_name = eco::get_param_name;
+		api.get_num_voices = eco::get_num_voices;
+		api.get_voice_name = eco::get_voice_name;
+		api.set_voice = eco::set_voice;
+		api.set_voices = eco::set_voices;
+		return true;
+	}
+}
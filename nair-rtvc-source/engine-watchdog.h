@@ -0,0 +1,251 @@
+﻿#pragma once
+
+// エンジンの見張り
+//
+// エンジンの呼び出しを専用のスレッドに移し、推論スレッドは起床ごとの期限までだけ待つ。
+// GPU ドライバーやモデルのページインでエンジンが止まっても、推論スレッドは期限が来たらドライに切り替えて先に進み、
+// エンジンは裏で返るのを待つ。返ったら次の起床からエンジンに戻す。切り替えの前後は DryFallback でつなぐ。
+//
+//   Start() -> { Run() (推論スレッドから) } -> Stop()
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <semaphore>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#include <avrt.h>
+#endif
+
+#include "capture-backend.h"
+#include "pipeline-trace.h"
+#include "rt-check.h"
+#include "rtvc-engine.h"
+#include "simd-kernels.h"
+
+namespace rtvc {
+	/// 期限に間に合わなかった回数と止まっていた長さ
+	struct watchdog_stats {
+		std::atomic<std::uint64_t> misses = 0;        ///< 期限に間に合わずドライに切り替えた回数
+		std::atomic<std::uint64_t> recoveries = 0;    ///< 止まっていたエンジンが返った回数
+		std::atomic<std::uint64_t> dry_blocks = 0;    ///< 代わりにドライを出したブロック数
+		std::atomic<std::uint64_t> last_stall_ns = 0; ///< 止まっていた呼び出しが返るまでの時間
+		std::atomic<std::uint64_t> max_stall_ns = 0;
+
+		void Reset() noexcept {
+			misses.store(0, std::memory_order::relaxed);
+			recoveries.store(0, std::memory_order::relaxed);
+			dry_blocks.store(0, std::memory_order::relaxed);
+			last_stall_ns.store(0, std::memory_order::relaxed);
+			max_stall_ns.store(0, std::memory_order::relaxed);
+		}
+	};
+
+	class EngineWatchdog final {
+	public:
+		static constexpr int const MAX_PARAMS = 16;
+
+		~EngineWatchdog() {
+			Stop();
+		}
+
+		/// 呼び出し用のスレッドを起こす (リアルタイムスレッドの外で呼ぶ)
+		/// max_frames は 1 回の Run() に渡す最大フレーム数 (trace があればエンジンを呼んだ区間を記録する)
+		/// スレッドは推論スレッドと同じく MMCSS に登録する。登録できなければその HRESULT を返す (スレッドは普通の優先度で動く)
+		HRESULT Start(std::size_t max_frames, PipelineTrace* trace = nullptr) {
+			Stop();
+			buffer_.assign(max_frames, 0.0f);
+			trace_ = trace;
+			stalled_ = false;
+			shutdown_.store(false, std::memory_order::relaxed);
+			thread_ = std::thread([this] { Work(); });
+			// 登録が済むまで待つ
+			done_.acquire();
+			return register_hr_;
+		}
+
+		/// スレッドを止める (エンジンが止まっていれば返るまで待つ。推論スレッドを止めてから呼ぶ)
+		void Stop() {
+			if (!thread_.joinable()) {
+				return;
+			}
+			shutdown_.store(true, std::memory_order::release);
+			request_.release();
+			thread_.join();
+			// 返らないうちに止めた分を捨てる
+			while (request_.try_acquire()) {
+			}
+			while (done_.try_acquire()) {
+			}
+			stalled_ = false;
+		}
+
+		bool Running() const noexcept {
+			return thread_.joinable();
+		}
+
+		/// 前の呼び出しがまだ返っていない (推論スレッドのみ。この間はエンジンのほかの関数も呼ばない)
+		bool Stalled() const noexcept {
+			return stalled_;
+		}
+
+		/// 続けて並んだ num_blocks ブロックを engine で処理し、deadline_ns まで待つ (推論スレッドから)
+		/// 間に合えば blocks を書き換えて true を返す。間に合わないか前の呼び出しが返っていなければ blocks はそのままで false
+		bool Run(engine_api const& engine, int num_params, float const* params, int block_size, int num_blocks, float* blocks, std::uint64_t deadline_ns, int& retval) noexcept {
+			retval = 0;
+			std::size_t const frames = static_cast<std::size_t>(num_blocks) * block_size;
+			if (stalled_) {
+				if (!done_.try_acquire()) {
+					stats_.dry_blocks.fetch_add(static_cast<std::uint64_t>(num_blocks), std::memory_order::relaxed);
+					return false;
+				}
+				// 止まっていた呼び出しが返った (出力は遅すぎるので捨てる)
+				stalled_ = false;
+				std::uint64_t const stall = CapturePacer::now_ns() - submitted_ns_;
+				stats_.last_stall_ns.store(stall, std::memory_order::relaxed);
+				if (stall > stats_.max_stall_ns.load(std::memory_order::relaxed)) {
+					stats_.max_stall_ns.store(stall, std::memory_order::relaxed);
+				}
+				stats_.recoveries.fetch_add(1, std::memory_order::release);
+			}
+
+			// 期限を過ぎて返ってきても書き込めるように、呼び出しは自分のバッファーで行う
+			engine_ = &engine;
+			num_params_ = (std::min)(num_params, MAX_PARAMS);
+			std::memcpy(params_, params, static_cast<std::size_t>(num_params_) * sizeof(float));
+			block_size_ = block_size;
+			num_blocks_ = num_blocks;
+			std::memcpy(buffer_.data(), blocks, frames * sizeof(float));
+			submitted_ns_ = CapturePacer::now_ns();
+			request_.release();
+
+			std::uint64_t const timeout = deadline_ns > submitted_ns_ ? deadline_ns - submitted_ns_ : 0;
+			bool done = false;
+			{
+				// 期限までの待ちは意図したもの
+				rt_check::suspend_scope _suspend_scope;
+				done = done_.try_acquire_for(std::chrono::nanoseconds(timeout));
+			}
+			if (!done) {
+				stalled_ = true;
+				stats_.misses.fetch_add(1, std::memory_order::release);
+				stats_.dry_blocks.fetch_add(static_cast<std::uint64_t>(num_blocks), std::memory_order::relaxed);
+				return false;
+			}
+			std::memcpy(blocks, buffer_.data(), frames * sizeof(float));
+			retval = retval_;
+			return true;
+		}
+
+		watchdog_stats& Stats() noexcept {
+			return stats_;
+		}
+
+	private:
+		void Work() {
+#if defined(_WIN32)
+			DWORD taskIndex = 0;
+			HANDLE hMmCss = ::AvSetMmThreadCharacteristics(TEXT("Pro Audio"), &taskIndex);
+			if (!hMmCss) {
+				hMmCss = ::AvSetMmThreadCharacteristics(TEXT("Audio"), &taskIndex);
+			}
+			register_hr_ = hMmCss ? S_OK : HRESULT_FROM_WIN32(::GetLastError());
+
+			struct mm_thread_guard {
+				mm_thread_guard(HANDLE hMmCss) : hMmCss_(hMmCss) {}
+				~mm_thread_guard() noexcept {
+					if (hMmCss_) {
+						::AvRevertMmThreadCharacteristics(hMmCss_);
+					}
+				}
+				HANDLE hMmCss_;
+			} _mm_thread_guard(hMmCss);
+#else
+			register_hr_ = S_OK;
+#endif
+			done_.release();
+
+			for (;;) {
+				request_.acquire();
+				if (shutdown_.load(std::memory_order::acquire)) {
+					break;
+				}
+				{
+					rt_check::realtime_scope _realtime_scope;
+					TraceScope _trace(trace_, trace_thread::engine, trace_span::engine, static_cast<std::uint32_t>(num_blocks_));
+					retval_ = process_blocks(*engine_, num_params_, params_, block_size_, num_blocks_, buffer_.data(), buffer_.data());
+				}
+				done_.release();
+			}
+		}
+
+		std::thread thread_;
+		std::binary_semaphore request_{ 0 }; ///< 推論スレッドから呼び出し用のスレッドへ
+		std::binary_semaphore done_{ 0 };    ///< 呼び出し用のスレッドから推論スレッドへ
+		std::atomic<bool> shutdown_ = false;
+		PipelineTrace* trace_ = nullptr;
+
+		// 推論スレッドが書いて request_ で渡す
+		engine_api const* engine_ = nullptr;
+		int num_params_ = 0;
+		float params_[MAX_PARAMS] = {};
+		int block_size_ = 0;
+		int num_blocks_ = 0;
+		std::vector<float> buffer_;
+		int retval_ = 0; ///< done_ で返す
+		HRESULT register_hr_ = S_OK; ///< MMCSS に登録できたか (Start() に done_ で返す)
+
+		bool stalled_ = false;           ///< 推論スレッドのみ
+		std::uint64_t submitted_ns_ = 0; ///< 推論スレッドのみ
+		watchdog_stats stats_;
+	};
+
+	/// 見張りがドライに切り替えたところをつなぐ
+	///
+	/// 間に合わなかったブロックにはウェットがないので、out に入れておいた穴埋め (Concealer の合成音、なければ無音) からドライへクロスフェードする。
+	/// エンジンが戻ったら、ドライからウェットへクロスフェードする。
+	class DryFallback final {
+	public:
+		/// リアルタイムスレッドの外で呼ぶ
+		void Reset(std::uint32_t fade_frames) {
+			fade_frames_ = (std::max)(fade_frames, 1u);
+			wet_gain_ = 1.0f;
+			dry_ramp_ = fade_frames_;
+		}
+
+		/// out (ウェット、wet_ready でなければ穴埋め) と遅延を揃えたドライ dry から frames フレーム出力する
+		void Process(bool wet_ready, float* out, float const* dry, std::uint32_t frames) noexcept {
+			float const step = 1.0f / static_cast<float>(fade_frames_);
+			if (!wet_ready) {
+				if (wet_gain_ > 0.0f) {
+					wet_gain_ = 0.0f;
+					dry_ramp_ = 0;
+				}
+				simd::kernels().crossfade(out, dry, out, dry_ramp_, step, frames);
+				dry_ramp_ = (std::min)(dry_ramp_ + frames, fade_frames_);
+				return;
+			}
+			for (std::uint32_t i = 0; i < frames && wet_gain_ < 1.0f; ++i) {
+				float const a = dry_ramp_ < fade_frames_ ? static_cast<float>(dry_ramp_++) * step : 1.0f;
+				wet_gain_ = (std::min)(wet_gain_ + step, 1.0f);
+				out[i] = dry[i] * a * (1.0f - wet_gain_) + out[i] * wet_gain_;
+			}
+		}
+
+		/// ドライを出している (戻る途中も含む)
+		bool Active() const noexcept {
+			return wet_gain_ < 1.0f;
+		}
+
+	private:
+		std::uint32_t fade_frames_ = 1;
+		float wet_gain_ = 1.0f;
+		std::uint32_t dry_ramp_ = 1;
+	};
+}
@@ -0,0 +1,189 @@
+﻿#pragma once
+
+// ファイルからの取り込み
+//
+// WAV (PCM 16/24/32 bit, float 32 bit) か、エンジンのサンプルレートのモノラル float の raw を読む。
+// 開くときに全体をメモリーに読み込み、モノラルにまとめる (リサンプリングはしない)。
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "capture-backend.h"
+
+namespace rtvc {
+	struct file_capture_config {
+		std::filesystem::path path;
+		std::uint32_t packet_frames = 0; ///< 0 なら 10 ms
+		bool realtime = true;            ///< false なら待たずに最大速度で流す
+		bool loop = false;               ///< 終わりに達したら先頭に戻る
+	};
+
+	/// WAV を読んでモノラル float にする (サンプルレートは sample_rate に入る)
+	inline bool load_wav(std::vector<std::uint8_t> const& file, std::vector<float>& samples, int& sample_rate) {
+		auto const u16 = [&](std::size_t pos) { return static_cast<std::uint32_t>(file[pos] | (file[pos + 1] << 8)); };
+		auto const u32 = [&](std::size_t pos) { return u16(pos) | (u16(pos + 2) << 16); };
+
+		if (file.size() < 12 || std::memcmp(file.data(), "RIFF", 4) != 0 || std::memcmp(file.data() + 8, "WAVE", 4) != 0) {
+			return false;
+		}
+
+		std::uint32_t format = 0;
+		std::uint32_t channels = 0;
+		std::uint32_t bits = 0;
+		for (std::size_t pos = 12; pos + 8 <= file.size();) {
+			std::uint32_t const chunk_size = u32(pos + 4);
+			std::size_t const body = pos + 8;
+			if (body + chunk_size > file.size()) {
+				return false;
+			}
+			if (std::memcmp(file.data() + pos, "fmt ", 4) == 0 && chunk_size >= 16) {
+				format = u16(body);
+				channels = u16(body + 2);
+				sample_rate = static_cast<int>(u32(body + 4));
+				bits = u16(body + 14);
+				if (format == 0xFFFE && chunk_size >= 26) {
+					// WAVE_FORMAT_EXTENSIBLE は SubFormat の先頭で判定する
+					format = u16(body + 24);
+				}
+			}
+			else if (std::memcmp(file.data() + pos, "data", 4) == 0) {
+				if (channels == 0 || !((format == 1 && (bits == 16 || bits == 24 || bits == 32)) || (format == 3 && bits == 32))) {
+					return false;
+				}
+				std::size_t const frame_bytes = channels * bits / 8;
+				std::size_t const frames = chunk_size / frame_bytes;
+				samples.assign(frames, 0.0f);
+				for (std::size_t i = 0; i < frames; ++i) {
+					float sum = 0.0f;
+					for (std::uint32_t ch = 0; ch < channels; ++ch) {
+						std::uint8_t const* p = file.data() + body + i * frame_bytes + ch * bits / 8;
+						if (format == 3) {
+							float value;
+							std::memcpy(&value, p, sizeof(value));
+							sum += value;
+						}
+						else if (bits == 16) {
+							sum += static_cast<std::int16_t>(p[0] | (p[1] << 8)) / 32768.0f;
+						}
+						else if (bits == 24) {
+							std::int32_t const value = static_cast<std::int32_t>((p[0] << 8) | (p[1] << 16) | (static_cast<std::uint32_t>(p[2]) << 24)) >> 8;
+							sum += value / 8388608.0f;
+						}
+						else {
+							std::int32_t value;
+							std::memcpy(&value, p, sizeof(value));
+							sum += value / 2147483648.0f;
+						}
+					}
+					samples[i] = sum / channels;
+				}
+				return true;
+			}
+			pos = body + chunk_size + (chunk_size & 1);
+		}
+		return false;
+	}
+
+	class FileCapture final : public CaptureBackend {
+	public:
+		explicit FileCapture(file_capture_config config)
+			: config_(std::move(config))
+		{
+		}
+
+		char const* Name() const noexcept override {
+			return "file";
+		}
+
+		HRESULT Open(capture_config const& config) override {
+			std::ifstream stream(config_.path, std::ios::binary);
+			if (!stream) {
+				return E_FAIL;
+			}
+			std::vector<std::uint8_t> const file{ std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() };
+
+			int sample_rate = config.sample_rate;
+			if (!load_wav(file, samples_, sample_rate)) {
+				// raw はエンジンの形式そのもの
+				samples_.resize(file.size() / sizeof(float));
+				std::memcpy(samples_.data(), file.data(), samples_.size() * sizeof(float));
+			}
+			if (sample_rate != config.sample_rate || samples_.empty()) {
+				return E_INVALIDARG;
+			}
+
+			sample_rate_ = config.sample_rate;
+			packet_frames_ = config_.packet_frames ? config_.packet_frames : static_cast<std::uint32_t>(sample_rate_ / 100);
+			return S_OK;
+		}
+
+		std::uint32_t MaxPacketFrames() const noexcept override {
+			return packet_frames_;
+		}
+
+		HRESULT Start() override {
+			position_ = 0;
+			total_frames_ = 0;
+			pacer_.Reset(config_.realtime);
+			return S_OK;
+		}
+
+		HRESULT Wait() override {
+			if (position_ >= samples_.size()) {
+				return S_FALSE;
+			}
+			// パケットの最後のサンプルが届いた時刻に起きる
+			std::uint64_t const frames = total_frames_ + NextFrames();
+			return pacer_.WaitUntil(frames_to_ns(frames)) ? S_OK : S_FALSE;
+		}
+
+		void Interrupt() noexcept override {
+			pacer_.Interrupt();
+		}
+
+		HRESULT Acquire(capture_packet& packet) override {
+			packet.data = samples_.data() + position_;
+			packet.frames = NextFrames();
+			packet.flags = 0;
+			packet.device_time_ns = pacer_.IsRealtime() ? pacer_.StartTime() + frames_to_ns(total_frames_) : 0;
+			return S_OK;
+		}
+
+		HRESULT Release(capture_packet const& packet) override {
+			position_ += packet.frames;
+			total_frames_ += packet.frames;
+			if (config_.loop && position_ >= samples_.size()) {
+				position_ = 0;
+			}
+			return S_OK;
+		}
+
+		HRESULT Stop() override {
+			return S_OK;
+		}
+
+	private:
+		std::uint32_t NextFrames() const noexcept {
+			return static_cast<std::uint32_t>((std::min)(static_cast<std::size_t>(packet_frames_), samples_.size() - position_));
+		}
+
+		std::uint64_t frames_to_ns(std::uint64_t frames) const noexcept {
+			return frames * 1'000'000'000ull / static_cast<std::uint64_t>(sample_rate_);
+		}
+
+		file_capture_config config_;
+		std::vector<float> samples_;
+		int sample_rate_ = 0;
+		std::uint32_t packet_frames_ = 0;
+		std::size_t position_ = 0;
+		std::uint64_t total_frames_ = 0;
+		CapturePacer pacer_;
+	};
+}
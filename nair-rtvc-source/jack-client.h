@@ -0,0 +1,249 @@
+﻿#pragma once
+
+// JACK クライアント
+//
+// JACK の周期がエンジンのブロックの倍数なら、process コールバックの中でそのままエンジンに通す (追加のバッファリングなし)。
+// 倍数でなければ、入力をロックフリーのリングで推論スレッドに渡し、Process() と同じくブロックに切り分けて処理し、
+// 出力リングから返す。このときの遅延は 1 周期 + 1 ブロック増える。
+// ハードウェアがなくても jackd -d dummy で試せる。
+
+#include <jack/jack.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "block-assembler.h"
+#include "capture-backend.h"
+#include "rt-check.h"
+#include "spsc-ring.h"
+
+namespace rtvc {
+	struct jack_client_config {
+		std::string client_name = "rtvc";
+		bool connect_physical = true; ///< 物理ポートの最初の入出力につなぐ
+	};
+
+	class JackClient final {
+	public:
+		/// ブロック単位の処理 (blocks は block_count * block_size フレーム。その場で書き換える)
+		typedef void (*process_fn)(void* user, float* blocks, std::uint32_t block_count);
+
+		explicit JackClient(jack_client_config config)
+			: config_(std::move(config))
+		{
+		}
+
+		JackClient(JackClient const&) = delete;
+		JackClient& operator=(JackClient const&) = delete;
+
+		~JackClient() {
+			Close();
+		}
+
+		char const* LastError() const noexcept {
+			return error_.c_str();
+		}
+
+		HRESULT Open(capture_config const& config, process_fn process, void* user) {
+			jack_status_t status{};
+			client_ = ::jack_client_open(config_.client_name.c_str(), JackNoStartServer, &status);
+			if (!client_) {
+				return Fail("jack_client_open failed");
+			}
+			if (static_cast<int>(::jack_get_sample_rate(client_)) != config.sample_rate) {
+				return Fail("JACK sample rate differs from the engine");
+			}
+
+			input_ = ::jack_port_register(client_, "in", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+			output_ = ::jack_port_register(client_, "out", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+			if (!input_ || !output_) {
+				return Fail("jack_port_register failed");
+			}
+
+			block_size_ = static_cast<std::uint32_t>(config.block_size);
+			process_ = process;
+			user_ = user;
+			if (SetPeriod(::jack_get_buffer_size(client_)) != 0) {
+				return Fail("unable to set up the period");
+			}
+
+			::jack_set_process_callback(client_, JackClient::process_callback, this);
+			::jack_set_buffer_size_callback(client_, JackClient::buffer_size_callback, this);
+			return S_OK;
+		}
+
+		HRESULT Activate() {
+			running_.store(true, std::memory_order::release);
+			worker_ = std::thread([this] { Run(); });
+
+			if (::jack_activate(client_) != 0) {
+				return Fail("jack_activate failed");
+			}
+			if (config_.connect_physical) {
+				Connect();
+			}
+			return S_OK;
+		}
+
+		void Close() {
+			if (client_) {
+				::jack_deactivate(client_);
+			}
+			if (worker_.joinable()) {
+				running_.store(false, std::memory_order::release);
+				Signal();
+				worker_.join();
+			}
+			if (client_) {
+				::jack_client_close(client_);
+				client_ = nullptr;
+			}
+		}
+
+		/// 周期がブロックの倍数で、コールバックの中で処理しているか
+		bool IsPeriodLocked() const noexcept {
+			return locked_.load(std::memory_order::acquire);
+		}
+
+		std::uint32_t Period() const noexcept {
+			return period_.load(std::memory_order::acquire);
+		}
+
+		/// 出力が間に合わずに無音で埋めた回数
+		std::uint64_t Underruns() const noexcept {
+			return underruns_.load(std::memory_order::relaxed);
+		}
+
+	private:
+		HRESULT Fail(char const* what) {
+			error_ = what;
+			return E_FAIL;
+		}
+
+		// 周期に合わせて経路を選ぶ (JACK のスレッドから。コールバックは止まっている)
+		int SetPeriod(jack_nframes_t nframes) {
+			bool const locked = nframes % block_size_ == 0;
+
+			// 推論スレッドがリングを触っていないときに作り直す
+			locked_.store(true, std::memory_order::seq_cst);
+			while (busy_.load(std::memory_order::seq_cst)) {
+				std::this_thread::yield();
+			}
+			if (!locked) {
+				// 入力 2 周期分と、出力の先行分 (1 周期 + 1 ブロック) を持てるようにする
+				std::size_t const capacity = 4 * (static_cast<std::size_t>(nframes) + block_size_);
+				in_ring_.Reset(capacity);
+				out_ring_.Reset(capacity);
+				out_ring_.Write(nullptr, nframes + block_size_);
+				assembler_.Reset(block_size_, capacity);
+			}
+			period_.store(nframes, std::memory_order::release);
+			locked_.store(locked, std::memory_order::release);
+			return 0;
+		}
+
+		void Process(jack_nframes_t nframes) noexcept {
+			rt_check::realtime_scope _realtime_scope;
+
+			float const* in = static_cast<float const*>(::jack_port_get_buffer(input_, nframes));
+			float* out = static_cast<float*>(::jack_port_get_buffer(output_, nframes));
+			if (locked_.load(std::memory_order::acquire)) {
+				// 周期がブロックの倍数なのでそのまま処理する
+				if (out != in) {
+					std::memcpy(out, in, nframes * sizeof(float));
+				}
+				process_(user_, out, nframes / block_size_);
+				return;
+			}
+
+			// 推論スレッドに渡して、前の周期までの結果を返す
+			in_ring_.Write(in, nframes);
+			Signal();
+			std::size_t const read = out_ring_.Read(out, nframes);
+			if (read < nframes) {
+				std::memset(out + read, 0, (nframes - read) * sizeof(float));
+				underruns_.fetch_add(1, std::memory_order::relaxed);
+			}
+		}
+
+		// 周期がブロックの倍数でないときの推論スレッド
+		void Run() {
+			std::uint32_t seen = signal_.load(std::memory_order::acquire);
+			float chunk[1024];
+			while (running_.load(std::memory_order::acquire)) {
+				signal_.wait(seen, std::memory_order::acquire);
+				seen = signal_.load(std::memory_order::acquire);
+
+				busy_.store(true, std::memory_order::seq_cst);
+				if (!locked_.load(std::memory_order::seq_cst)) {
+					while (std::size_t const frames = in_ring_.Read(chunk, std::size(chunk))) {
+						std::uint32_t const block_count = assembler_.Push(chunk, static_cast<std::uint32_t>(frames));
+						if (block_count > 0) {
+							process_(user_, assembler_.Blocks(), block_count);
+							out_ring_.Write(assembler_.Blocks(), static_cast<std::size_t>(block_count) * block_size_);
+						}
+					}
+				}
+				busy_.store(false, std::memory_order::seq_cst);
+			}
+		}
+
+		void Signal() noexcept {
+			signal_.fetch_add(1, std::memory_order::release);
+			signal_.notify_one();
+		}
+
+		// 物理ポートの最初の取り込みを入力に、最初の再生を出力につなぐ
+		void Connect() {
+			if (char const** ports = ::jack_get_ports(client_, nullptr, JACK_DEFAULT_AUDIO_TYPE, JackPortIsPhysical | JackPortIsOutput)) {
+				if (ports[0]) {
+					::jack_connect(client_, ports[0], ::jack_port_name(input_));
+				}
+				::jack_free(ports);
+			}
+			if (char const** ports = ::jack_get_ports(client_, nullptr, JACK_DEFAULT_AUDIO_TYPE, JackPortIsPhysical | JackPortIsInput)) {
+				if (ports[0]) {
+					::jack_connect(client_, ::jack_port_name(output_), ports[0]);
+				}
+				::jack_free(ports);
+			}
+		}
+
+		static int process_callback(jack_nframes_t nframes, void* instance) {
+			reinterpret_cast<JackClient*>(instance)->Process(nframes);
+			return 0;
+		}
+
+		static int buffer_size_callback(jack_nframes_t nframes, void* instance) {
+			return reinterpret_cast<JackClient*>(instance)->SetPeriod(nframes);
+		}
+
+		jack_client_config config_;
+		jack_client_t* client_ = nullptr;
+		jack_port_t* input_ = nullptr;
+		jack_port_t* output_ = nullptr;
+		std::uint32_t block_size_ = 0;
+		process_fn process_ = nullptr;
+		void* user_ = nullptr;
+
+		std::atomic<bool> locked_ = false;
+		std::atomic<std::uint32_t> period_ = 0;
+		std::atomic<std::uint64_t> underruns_ = 0;
+
+		SpscRing<float> in_ring_;
+		SpscRing<float> out_ring_;
+		BlockAssembler assembler_;
+		std::atomic<std::uint32_t> signal_ = 0;
+		std::atomic<bool> running_ = false;
+		std::atomic<bool> busy_ = false;
+		std::thread worker_;
+
+		std::string error_;
+	};
+}
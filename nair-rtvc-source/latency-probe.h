@@ -0,0 +1,193 @@
+﻿#pragma once
+
+// ループバックによる遅延測定
+//
+// 取り込んだサンプルの代わりに既知のチャープをエンジンへ入力し、
+// 処理後の出力との相互相関 (FFT) のピーク位置からエンジンの遅延を求める。
+// ピークは放物線補間するのでサンプル以下の分解能で求まる。
+
+#include <atomic>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace rtvc {
+	inline constexpr double const PI = 3.14159265358979323846;
+
+	// 基数 2 の FFT (size は 2 の冪)
+	inline void fft(std::complex<double>* data, std::size_t size, bool inverse) noexcept {
+		for (std::size_t i = 1, j = 0; i < size; ++i) {
+			std::size_t bit = size >> 1;
+			for (; j & bit; bit >>= 1) {
+				j ^= bit;
+			}
+			j ^= bit;
+			if (i < j) {
+				std::swap(data[i], data[j]);
+			}
+		}
+
+		for (std::size_t length = 2; length <= size; length <<= 1) {
+			double const angle = (inverse ? 2.0 : -2.0) * PI / static_cast<double>(length);
+			std::complex<double> const w_length(std::cos(angle), std::sin(angle));
+			for (std::size_t i = 0; i < size; i += length) {
+				std::complex<double> w(1.0, 0.0);
+				for (std::size_t k = 0; k < length / 2; ++k) {
+					std::complex<double> const u = data[i + k];
+					std::complex<double> const v = data[i + k + length / 2] * w;
+					data[i + k] = u + v;
+					data[i + k + length / 2] = u - v;
+					w *= w_length;
+				}
+			}
+		}
+
+		if (inverse) {
+			double const scale = 1.0 / static_cast<double>(size);
+			for (std::size_t i = 0; i < size; ++i) {
+				data[i] *= scale;
+			}
+		}
+	}
+
+	struct latency_probe_result {
+		double latency_frames; ///< 入力から出力までの遅延 (補間済み)
+		double confidence;     ///< 相関ピークと相関の平均の比
+	};
+
+	/// 相互相関 r[lag] = sum x[n] y[n + lag] のピークを求める
+	inline latency_probe_result find_correlation_peak(float const* x, std::size_t x_size, float const* y, std::size_t y_size) {
+		std::size_t size = 1;
+		while (size < x_size + y_size) {
+			size <<= 1;
+		}
+
+		std::vector<std::complex<double>> X(size), Y(size);
+		for (std::size_t i = 0; i < x_size; ++i) {
+			X[i] = x[i];
+		}
+		for (std::size_t i = 0; i < y_size; ++i) {
+			Y[i] = y[i];
+		}
+		fft(X.data(), size, false);
+		fft(Y.data(), size, false);
+		for (std::size_t i = 0; i < size; ++i) {
+			Y[i] *= std::conj(X[i]);
+		}
+		fft(Y.data(), size, true);
+
+		// 非負のラグだけを探す
+		std::size_t const max_lag = y_size;
+		std::size_t peak = 0;
+		double peak_value = 0.0;
+		double sum = 0.0;
+		for (std::size_t lag = 0; lag < max_lag; ++lag) {
+			double const value = std::abs(Y[lag].real());
+			sum += value;
+			if (value > peak_value) {
+				peak_value = value;
+				peak = lag;
+			}
+		}
+
+		double offset = 0.0;
+		if (peak > 0 && peak + 1 < max_lag) {
+			double const a = std::abs(Y[peak - 1].real());
+			double const b = peak_value;
+			double const c = std::abs(Y[peak + 1].real());
+			double const denominator = a - 2.0 * b + c;
+			if (denominator != 0.0) {
+				offset = 0.5 * (a - c) / denominator;
+			}
+		}
+
+		double const mean = sum / static_cast<double>(max_lag);
+		return { static_cast<double>(peak) + offset, mean > 0.0 ? peak_value / mean : 0.0 };
+	}
+
+	class LatencyProbe final {
+	public:
+		enum class state : int {
+			idle,      ///< 何もしていない
+			running,   ///< オーディオスレッドが注入と記録をしている
+			analyzing, ///< 記録が終わり、解析待ち
+		};
+
+		/// 測定を始める (UI スレッドから)
+		bool Arm(int sample_rate, int max_latency_frames) {
+			if (state_.load(std::memory_order::acquire) != state::idle) {
+				return false;
+			}
+
+			// 150 Hz から 3 kHz まで 0.25 秒の対数チャープ (声の帯域に収める)
+			std::size_t const stimulus_size = static_cast<std::size_t>(sample_rate / 4);
+			double const f0 = 150.0;
+			double const f1 = 3'000.0;
+			double const duration = static_cast<double>(stimulus_size) / sample_rate;
+			double const k = std::log(f1 / f0);
+			stimulus_.reset(new float[stimulus_size]);
+			for (std::size_t i = 0; i < stimulus_size; ++i) {
+				double const t = static_cast<double>(i) / sample_rate;
+				double const phase = 2.0 * PI * f0 * duration / k * (std::exp(t / duration * k) - 1.0);
+				double const window = std::sin(PI * static_cast<double>(i) / stimulus_size);
+				stimulus_[i] = static_cast<float>(0.3 * window * std::sin(phase));
+			}
+			stimulus_size_ = stimulus_size;
+
+			record_size_ = stimulus_size + static_cast<std::size_t>(max_latency_frames);
+			record_.reset(new float[record_size_]);
+			position_ = 0;
+
+			state_.store(state::running, std::memory_order::release);
+			return true;
+		}
+
+		bool IsRunning() const noexcept {
+			return state_.load(std::memory_order::acquire) == state::running;
+		}
+
+		// エンジンへの入力をチャープに置き換える (オーディオスレッドから)
+		void Inject(float* block, std::size_t frames) noexcept {
+			for (std::size_t i = 0; i < frames; ++i) {
+				std::size_t const n = position_ + i;
+				block[i] = n < stimulus_size_ ? stimulus_[n] : 0.0f;
+			}
+		}
+
+		// エンジンの出力を記録する (オーディオスレッドから)
+		void Record(float const* block, std::size_t frames) noexcept {
+			if (position_ >= record_size_) {
+				return;
+			}
+			for (std::size_t i = 0; i < frames && position_ < record_size_; ++i) {
+				record_[position_++] = block[i];
+			}
+			if (position_ >= record_size_) {
+				state_.store(state::analyzing, std::memory_order::release);
+			}
+		}
+
+		/// 記録が終わっていれば解析する (低優先度のスレッドから)
+		bool Analyze(latency_probe_result& result) {
+			if (state_.load(std::memory_order::acquire) != state::analyzing) {
+				return false;
+			}
+			result = find_correlation_peak(stimulus_.get(), stimulus_size_, record_.get(), record_size_);
+			state_.store(state::idle, std::memory_order::release);
+			return true;
+		}
+
+	private:
+		std::atomic<state> state_ = state::idle;
+
+		std::unique_ptr<float[]> stimulus_;
+		std::size_t stimulus_size_ = 0;
+		std::unique_ptr<float[]> record_;
+		std::size_t record_size_ = 0;
+		std::size_t position_ = 0;
+	};
+}
@@ -0,0 +1,246 @@
+﻿#pragma once
+
+// オーディオスレッド用の遅延ロガー
+//
+// オーディオスレッドはイベントコードと整数引数だけをロックフリーのリングに積み、
+// 優先度の低いスレッドがそれを取り出して整形し blog() に流す。
+// 同じイベントは 1 秒ごとに集約し "overrun x37 in last second" のように出力する。
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <mutex>
+#include <thread>
+
+#include <util/base.h>
+
+namespace rtvc {
+	enum class log_event : std::uint16_t {
+		wait_failed,            ///< (error)
+		get_buffer_failed,      ///< (hr)
+		release_buffer_failed,  ///< (hr)
+		discontinuity,          ///< (frames)
+		timestamp_error,        ///< (frames)
+		set_voice_failed,       ///< (retval, voice id)
+		process_failed,         ///< (retval, block index)
+		processing_overrun,     ///< (elapsed us, budget us)
+		count_,
+	};
+
+	struct log_event_info {
+		int level;
+		char const* name;
+		char const* format; ///< 引数は常に long long 3 つ
+	};
+
+	inline constexpr log_event_info const LOG_EVENTS[] = {
+		{ LOG_ERROR  , "wait failed"          , "wait for capture event failed: %llx" },
+		{ LOG_ERROR  , "GetBuffer failed"     , "GetBuffer failed: %llx" },
+		{ LOG_ERROR  , "ReleaseBuffer failed" , "ReleaseBuffer failed: %llx" },
+		{ LOG_WARNING, "overrun"              , "capture overrun: discontinuity in packet of %lld frames" },
+		{ LOG_WARNING, "timestamp error"      , "capture timestamp error in packet of %lld frames" },
+		{ LOG_WARNING, "set_voice failed"     , "set_voice failed: %lld (voice %lld)" },
+		{ LOG_WARNING, "process failed"       , "process failed: %lld (block %lld)" },
+		{ LOG_WARNING, "processing overrun"   , "processing overrun: %lld [us] for %lld [us] of audio" },
+	};
+	static_assert(std::size(LOG_EVENTS) == static_cast<std::size_t>(log_event::count_));
+
+	struct log_entry {
+		std::uint64_t timestamp_ns;
+		log_event code;
+		long long args[3];
+	};
+
+	/// 固定長の MPSC リング (Dmitry Vyukov の bounded queue)
+	template <std::size_t CAPACITY>
+	class LogRing final {
+		static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+
+	public:
+		LogRing() noexcept {
+			for (std::size_t i = 0; i < CAPACITY; ++i) {
+				cells_[i].sequence.store(i, std::memory_order::relaxed);
+			}
+		}
+
+		// リアルタイムスレッドから呼べる (溢れたら捨てて数える)
+		bool push(log_entry const& entry) noexcept {
+			std::size_t pos = enqueue_pos_.load(std::memory_order::relaxed);
+			for (;;) {
+				cell& c = cells_[pos & (CAPACITY - 1)];
+				std::size_t const seq = c.sequence.load(std::memory_order::acquire);
+				std::intptr_t const diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+				if (diff == 0) {
+					if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order::relaxed)) {
+						c.entry = entry;
+						c.sequence.store(pos + 1, std::memory_order::release);
+						return true;
+					}
+				}
+				else if (diff < 0) {
+					dropped_.fetch_add(1, std::memory_order::relaxed);
+					return false;
+				}
+				else {
+					pos = enqueue_pos_.load(std::memory_order::relaxed);
+				}
+			}
+		}
+
+		// 取り出しは単一スレッドから
+		bool pop(log_entry& entry) noexcept {
+			std::size_t const pos = dequeue_pos_.load(std::memory_order::relaxed);
+			cell& c = cells_[pos & (CAPACITY - 1)];
+			std::size_t const seq = c.sequence.load(std::memory_order::acquire);
+			if (static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1) < 0) {
+				return false;
+			}
+			entry = c.entry;
+			c.sequence.store(pos + CAPACITY, std::memory_order::release);
+			dequeue_pos_.store(pos + 1, std::memory_order::relaxed);
+			return true;
+		}
+
+		std::uint64_t take_dropped() noexcept {
+			return dropped_.exchange(0, std::memory_order::relaxed);
+		}
+
+	private:
+		struct cell {
+			std::atomic<std::size_t> sequence;
+			log_entry entry;
+		};
+
+		alignas(64) cell cells_[CAPACITY];
+		alignas(64) std::atomic<std::size_t> enqueue_pos_ = 0;
+		alignas(64) std::atomic<std::size_t> dequeue_pos_ = 0;
+		std::atomic<std::uint64_t> dropped_ = 0;
+	};
+
+	class DeferredLogger final {
+		static constexpr std::uint64_t const WINDOW_NS = 1'000'000'000;
+		static constexpr auto const DRAIN_INTERVAL = std::chrono::milliseconds(100);
+
+	public:
+		DeferredLogger() = default;
+		DeferredLogger(DeferredLogger const&) = delete;
+		DeferredLogger& operator=(DeferredLogger const&) = delete;
+
+		~DeferredLogger() {
+			Stop();
+		}
+
+		static std::uint64_t now_ns() noexcept {
+			return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+
+		// オーディオスレッドから呼ぶ
+		void Push(log_event code, long long arg0 = 0, long long arg1 = 0, long long arg2 = 0) noexcept {
+			ring_.push(log_entry{ now_ns(), code, { arg0, arg1, arg2 } });
+		}
+
+		void Start() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (thread_.joinable()) {
+				return;
+			}
+			running_ = true;
+			thread_ = std::thread([this] { Run(); });
+		}
+
+		void Stop() {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (!thread_.joinable()) {
+					return;
+				}
+				running_ = false;
+			}
+			cv_.notify_all();
+			thread_.join();
+			Drain(true);
+		}
+
+		// 溜まっているイベントを出力する (ドレインスレッド以外からは Stop 後のみ)
+		void Drain(bool flush) {
+			std::uint64_t const now = now_ns();
+
+			log_entry entry;
+			while (ring_.pop(entry)) {
+				aggregate& a = aggregates_[static_cast<std::size_t>(entry.code)];
+				if (a.window_start_ns == 0 || entry.timestamp_ns - a.window_start_ns >= WINDOW_NS) {
+					Flush(entry.code, a);
+					a.window_start_ns = entry.timestamp_ns;
+					Print(entry);
+				}
+				else {
+					++a.suppressed;
+				}
+			}
+
+			for (std::size_t i = 0; i < aggregates_.size(); ++i) {
+				aggregate& a = aggregates_[i];
+				if (flush || (a.window_start_ns != 0 && now - a.window_start_ns >= WINDOW_NS)) {
+					Flush(static_cast<log_event>(i), a);
+				}
+			}
+
+			if (std::uint64_t const dropped = ring_.take_dropped()) {
+				blog(LOG_WARNING, "[nair-rtvc-source] %llu log event(s) dropped", static_cast<unsigned long long>(dropped));
+			}
+		}
+
+	private:
+		struct aggregate {
+			std::uint64_t window_start_ns = 0;
+			std::uint64_t suppressed = 0;
+		};
+
+		void Run() {
+#if defined(_WIN32)
+			::SetThreadPriority(::GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#endif
+			std::unique_lock<std::mutex> lock(mutex_);
+			while (running_) {
+				cv_.wait_for(lock, DRAIN_INTERVAL, [this] { return !running_; });
+				lock.unlock();
+				Drain(false);
+				lock.lock();
+			}
+		}
+
+		static void Print(log_entry const& entry) {
+			log_event_info const& info = LOG_EVENTS[static_cast<std::size_t>(entry.code)];
+			char message[256];
+			std::snprintf(message, sizeof(message), info.format, entry.args[0], entry.args[1], entry.args[2]);
+			blog(info.level, "[nair-rtvc-source] %s", message);
+		}
+
+		static void Flush(log_event code, aggregate& a) {
+			if (a.suppressed > 0) {
+				log_event_info const& info = LOG_EVENTS[static_cast<std::size_t>(code)];
+				blog(info.level, "[nair-rtvc-source] %s x%llu in last second", info.name, static_cast<unsigned long long>(a.suppressed));
+			}
+			a.window_start_ns = 0;
+			a.suppressed = 0;
+		}
+
+		LogRing<1024> ring_;
+		std::array<aggregate, static_cast<std::size_t>(log_event::count_)> aggregates_{};
+
+		std::mutex mutex_;
+		std::condition_variable cv_;
+		std::thread thread_;
+		bool running_ = false;
+	};
+
+	inline DeferredLogger& deferred_logger() {
+		static DeferredLogger logger;
+		return logger;
+	}
+}
@@ -12,12 +12,39 @@
 #include <functiondiscoverykeys_devpkey.h>
 #include <wrl.h>
 
+#include <chrono>
 #include <filesystem>
+#include <mutex>
+#include <thread>
 
 #include <obs-module.h>
 #include <util/platform.h>
 #include <media-io/audio-math.h>
 
+#include "rtvc-engine.h"
+#include "eco-engine.h"
+#include "model-registry.h"
+#include "capture-backend.h"
+#include "wasapi-capture.h"
+#include "capture-supervisor.h"
+#include "wasapi-device-catalog.h"
+#include "file-capture.h"
+#include "synthetic-capture.h"
+#include "shared-audio.h"
+#include "wasapi-render.h"
+#include "block-assembler.h"
+#include "delay-line.h"
+#include "session-file.h"
+#include "rt-check.h"
+#include "log-ring.h"
+#include "latency-probe.h"
+#include "engine-watchdog.h"
+#include "concealment.h"
+#include "voice-preset.h"
+#include "simd-kernels.h"
+#include "pipeline-trace.h"
+#include "telemetry.h"
+
 #pragma comment(lib, "avrt.lib")
 #pragma comment(lib, "obs.lib")
 #pragma comment(lib, "w32-pthreads.lib")
@@ -30,6 +57,8 @@ namespace {
 
 	void obs_log(int log_level, char const* format, ...)
 	{
+		RTVC_RT_BLOCKING("blogva");
+
 		va_list args;
 		va_start(args, format);
 		blogva(log_level, format, args);
@@ -38,60 +67,19 @@ namespace {
 
 	constexpr TCHAR const VVFX_FILE[] = L"VVFX\\rtvc.vvfx";
 
-	typedef int(__stdcall* rtvc_get_protocol_version_fn)(int* major_version, int* minor_version, int* revision);
-	typedef int(__stdcall* rtvc_init_fn)(char const* model_name);
-	typedef int(__stdcall* rtvc_destroy_fn)();
-	typedef int(__stdcall* rtvc_process_fn)(int num_params, float const* params, float const* x, float* y);
-
-	typedef int(__stdcall* rtvc_get_version_fn)(int* major_version, int* minor_version, int* revision);
-	typedef int(__stdcall* rtvc_get_sample_rate_fn)(int* sample_rate);
-	typedef int(__stdcall* rtvc_get_block_size_fn)(int* block_size);
-	typedef int(__stdcall* rtvc_get_sample_latency_fn)(int* sample_latency);
-
-	typedef int(__stdcall* rtvc_get_num_params_fn)(int* num_params);
-	typedef int(__stdcall* rtvc_get_param_name_fn)(int i, char const** param_name);
-
-	typedef int(__stdcall* rtvc_get_num_voices_fn)(int* num_voices);
-	typedef int(__stdcall* rtvc_get_voice_name_fn)(int i, char const** voice_name);
-	typedef int(__stdcall* rtvc_set_voice_fn)(int voice_id);
-	typedef int(__stdcall* rtvc_set_voices_fn)(int num_voices, int const* voice_ids, float const* voice_amounts);
-
-	rtvc_get_protocol_version_fn  rtvc_get_protocol_version;
-	rtvc_init_fn                  rtvc_init;
-	rtvc_destroy_fn               rtvc_destroy;
-	rtvc_process_fn               rtvc_process;
-
-	rtvc_get_version_fn           rtvc_get_version;
-	rtvc_get_sample_rate_fn       rtvc_get_sample_rate;
-	rtvc_get_sample_latency_fn    rtvc_get_sample_latency;
-	rtvc_get_block_size_fn        rtvc_get_block_size;
-
-	rtvc_get_num_params_fn        rtvc_get_num_params;
-	rtvc_get_param_name_fn        rtvc_get_param_name;
-
-	rtvc_get_num_voices_fn        rtvc_get_num_voices;
-	rtvc_get_voice_name_fn        rtvc_get_voice_name;
-	rtvc_set_voice_fn             rtvc_set_voice;
-	rtvc_set_voices_fn            rtvc_set_voices;
+	constexpr char const SOURCE_ID[] = "nair-rtvc-source";
+	constexpr char const DRY_SOURCE_ID[] = "nair-rtvc-dry-source";
 }
 
 BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserved)
 {
-	static HMODULE hDynamicModule = nullptr;
-
 	switch (ul_reason_for_call)
 	{
 	case DLL_PROCESS_ATTACH:
 	{
-		std::wstring library_path(L"C:\\Program Files\\Common Files");
-		std::vector<TCHAR> buf(GetEnvironmentVariable(L"CommonProgramFiles", nullptr, 0));
-		if (GetEnvironmentVariable(L"CommonProgramFiles", buf.data(), static_cast<DWORD>(buf.size()))) {
-			library_path = buf.data();
-		}
-		library_path += L"\\";
-		library_path += VVFX_FILE;
+		std::filesystem::path library_path = rtvc::default_engine_path();
 		OBS_INFO("load rtvc at %ls", library_path.c_str());
-		hDynamicModule = LoadLibrary(library_path.c_str());
+		HMODULE hDynamicModule = LoadLibrary(library_path.c_str());
 		if (!hDynamicModule) {
 			TCHAR szModulePath[MAX_PATH];
 			::GetModuleFileName(hModule, szModulePath, static_cast<DWORD>(std::size(szModulePath)));
@@ -102,106 +90,23 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserv
 			OBS_INFO("load rtvc at %ls", local_library_path.c_str());
 			hDynamicModule = ::LoadLibrary(local_library_path.c_str());
 			if (!hDynamicModule) {
-				OBS_ERROR("failed to load rtvc.vvfx");
-				return FALSE;
-			}
-		}
-
-		// protocol
-		{
-			rtvc_get_protocol_version = reinterpret_cast<rtvc_get_protocol_version_fn>(::GetProcAddress(hDynamicModule, "get_protocol_version"));
-			if (!rtvc_get_protocol_version) {
-				OBS_ERROR("failed to get proc get_protocol_version");
-				return FALSE;
-			}
-
-			rtvc_init = reinterpret_cast<rtvc_init_fn>(::GetProcAddress(hDynamicModule, "init"));
-			if (!rtvc_init) {
-				OBS_ERROR("failed to get proc init");
-				return FALSE;
-			}
-
-			rtvc_destroy = reinterpret_cast<rtvc_destroy_fn>(::GetProcAddress(hDynamicModule, "destroy"));
-			if (!rtvc_destroy) {
-				OBS_ERROR("failed to get proc destroy");
-				return FALSE;
-			}
-
-			rtvc_process = reinterpret_cast<rtvc_process_fn>(::GetProcAddress(hDynamicModule, "process"));
-			if (!rtvc_process) {
-				OBS_ERROR("failed to get proc process");
-				return FALSE;
-			}
-		}
-
-		// model
-		{
-			rtvc_get_version = reinterpret_cast<rtvc_get_version_fn>(::GetProcAddress(hDynamicModule, "get_version"));
-			if (!rtvc_get_version) {
-				OBS_ERROR("failed to get proc get_version");
-				return FALSE;
-			}
-
-			rtvc_get_sample_rate = reinterpret_cast<rtvc_get_sample_rate_fn>(::GetProcAddress(hDynamicModule, "get_sample_rate"));
-			if (!rtvc_get_sample_rate) {
-				OBS_ERROR("failed to get proc get_sample_rate");
-				return FALSE;
-			}
-
-			rtvc_get_sample_latency = reinterpret_cast<rtvc_get_sample_latency_fn>(::GetProcAddress(hDynamicModule, "get_sample_latency"));
-			if (!rtvc_get_sample_latency) {
-				OBS_ERROR("failed to get proc get_sample_latency");
-				return FALSE;
-			}
-
-			rtvc_get_block_size = reinterpret_cast<rtvc_get_block_size_fn>(::GetProcAddress(hDynamicModule, "get_block_size"));
-			if (!rtvc_get_block_size) {
-				OBS_ERROR("failed to get proc get_block_size");
-				return FALSE;
+				// 後から入れたら「Reload Engine」で読み込める
+				OBS_WARN("failed to load rtvc.vvfx, using the built-in eco engine");
+				rtvc::model_registry().Reset(rtvc::engine_api{}, nullptr, rtvc::default_engine_path());
+				break;
 			}
+			library_path = local_library_path;
 		}
 
-		// param
-		{
-			rtvc_get_num_params = reinterpret_cast<rtvc_get_num_params_fn>(::GetProcAddress(hDynamicModule, "get_num_params"));
-			if (!rtvc_get_num_params) {
-				OBS_ERROR("failed to get proc get_num_params");
-				return FALSE;
-			}
-
-			rtvc_get_param_name = reinterpret_cast<rtvc_get_param_name_fn>(::GetProcAddress(hDynamicModule, "get_param_name"));
-			if (!rtvc_get_param_name) {
-				OBS_ERROR("failed to get proc get_param_name");
-				return FALSE;
-			}
-		}
-
-		// voice
-		{
-			rtvc_get_num_voices = reinterpret_cast<rtvc_get_num_voices_fn>(::GetProcAddress(hDynamicModule, "get_num_voices"));
-			if (!rtvc_get_num_voices) {
-				OBS_ERROR("failed to get proc get_num_voices");
-				return FALSE;
-			}
-
-			rtvc_get_voice_name = reinterpret_cast<rtvc_get_voice_name_fn>(::GetProcAddress(hDynamicModule, "get_voice_name"));
-			if (!rtvc_get_voice_name) {
-				OBS_ERROR("failed to get proc get_voice_name");
-				return FALSE;
-			}
-
-			rtvc_set_voice = reinterpret_cast<rtvc_set_voice_fn>(::GetProcAddress(hDynamicModule, "set_voice"));
-			if (!rtvc_set_voice) {
-				OBS_ERROR("failed to get proc set_voice");
-				return FALSE;
-			}
-
-			rtvc_set_voices = reinterpret_cast<rtvc_set_voices_fn>(::GetProcAddress(hDynamicModule, "set_voices"));
-			if (!rtvc_set_voices) {
-				OBS_ERROR("failed to get proc set_voices");
-				return FALSE;
-			}
+		rtvc::engine_api neural_engine;
+		if (char const* const missing = rtvc::resolve_engine_api(hDynamicModule, neural_engine)) {
+			OBS_WARN("failed to get proc %s, using the built-in eco engine", missing);
+			::FreeLibrary(hDynamicModule);
+			rtvc::model_registry().Reset(rtvc::engine_api{}, nullptr, library_path);
+			break;
 		}
+		// モデルを切り替えるときと読み込み直すときは、この場所から複製を読み込む (解放もレジストリーが行う)
+		rtvc::model_registry().Reset(neural_engine, hDynamicModule, library_path);
 		OBS_INFO("dll_process_attach done");
 
 		break;
@@ -210,10 +115,7 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserv
 	case DLL_THREAD_DETACH:
 		break;
 	case DLL_PROCESS_DETACH:
-		if (hDynamicModule) {
-			FreeLibrary(hDynamicModule);
-			hDynamicModule = nullptr;
-		}
+		// ローダーロックの中では FreeLibrary もファイルの削除もしない (obs_module_unload で済ませる)
 		break;
 	}
 	return TRUE;
@@ -236,11 +138,46 @@ namespace {
 			"ultra_high-latency",
 			"maximum-latency",
 		};
+		enum capture_type : int {
+			CAPTURE_WASAPI = 0,    ///< 入力デバイス
+			CAPTURE_FILE = 1,      ///< WAV / raw ファイルを繰り返す
+			CAPTURE_SYNTHETIC = 2, ///< テストトーン
+			CAPTURE_HOST = 3,      ///< rtvc-host が変換した音声 (エンジンを通さない)
+		};
+		enum engine_choice : int {
+			ENGINE_AUTO = 0,   ///< ニューラル (読み込めないか間に合わなければ eco)
+			ENGINE_NEURAL = 1,
+			ENGINE_ECO = 2,    ///< 組み込みのピッチシフト
+		};
 		static constexpr double const PITCH_SHIFT_PROTOTYPES[2][5] = {
 			{0, +1200,    0,    0, -1200},  // song mode
 			{0, +1000, +400, -200,  -800},  // talk mode
 		};
 
+		// プリセットに残すプロパティ (入力ゲインはマイクに合わせたものなので残さない)
+		struct preset_key {
+			char const* name;
+			bool integer;
+		};
+		static constexpr preset_key const PRESET_KEYS[] = {
+			{ "primary_voice", true },
+			{ "secondary_voice", true },
+			{ "amount", false },
+			{ "your_voice", true },
+			{ "pitch_shift", false },
+			{ "pitch_shift_mode", true },
+			{ "pitch_snap", false },
+			{ "output_gain", false },
+		};
+		static constexpr char const* const PRESET_SETTINGS[rtvc::VoicePresets::NUM_SLOTS] = { nullptr, "preset_1", "preset_2", "preset_3", "preset_4" };
+		static constexpr char const* const PRESET_HOTKEYS[rtvc::VoicePresets::NUM_SLOTS][2] = {
+			{ "rtvc.preset.0", "Voice Preset: Properties" },
+			{ "rtvc.preset.1", "Voice Preset 1" },
+			{ "rtvc.preset.2", "Voice Preset 2" },
+			{ "rtvc.preset.3", "Voice Preset 3" },
+			{ "rtvc.preset.4", "Voice Preset 4" },
+		};
+
 	public:
 		OBSAudioSource(obs_source_t* context)
 			: context_(context)
@@ -252,146 +189,316 @@ namespace {
 			HRESULT hr = S_OK;
 			OBS_INFO("rtvc init");
 
-			Microsoft::WRL::ComPtr<IMMDeviceEnumerator> pDeviceEnumerator;
-			if FAILED(hr = ::CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&pDeviceEnumerator)))
-			{
+			// 使っているデバイスが抜かれたら切り替える
+			device_listener_ = rtvc::wasapi_device_catalog().Subscribe([this](rtvc::device_flow flow, rtvc::device_change change, std::string const& id) {
+				OnDeviceChanged(flow, change, id);
+			});
+
+			// ドライ出力のソースがつなぎに来る
+			proc_handler_t* const ph = obs_source_get_proc_handler(context_);
+			proc_handler_add(ph, "void attach_dry(ptr source)", OBSAudioSource::attach_dry, this);
+			proc_handler_add(ph, "void detach_dry(ptr source)", OBSAudioSource::detach_dry, this);
+			proc_handler_add(ph, "void set_dry_active(ptr source, bool active)", OBSAudioSource::set_dry_active, this);
+
+			// 配信を止めずに rtvc.vvfx の新しい版に替える
+			proc_handler_add(ph, "void reload_engine()", OBSAudioSource::reload_engine, this);
+
+			// 声のプリセットをホットキーで切り替える (0 はプロパティの値に戻す)
+			for (int i = 0; i < rtvc::VoicePresets::NUM_SLOTS; ++i) {
+				preset_hotkeys_[i] = obs_hotkey_register_source(context_, PRESET_HOTKEYS[i][0], PRESET_HOTKEYS[i][1], OBSAudioSource::preset_hotkey, this);
+			}
+
+			// ブロックごとの時系列を書き出す
+			proc_handler_add(ph, "void dump_trace()", OBSAudioSource::dump_trace, this);
+			trace_hotkey_ = obs_hotkey_register_source(context_, "rtvc.trace", "Dump Pipeline Trace", OBSAudioSource::trace_hotkey, this);
+
+			// 聞こえていない間は取り込みと推論を止める (最初の Update() より前に今の状態を取る)
+			active_.store(obs_source_active(context_));
+			muted_.store(obs_source_muted(context_));
+			signal_handler_connect(obs_source_get_signal_handler(context_), "mute", OBSAudioSource::mute_changed, this);
+
+			hEvtActivityChanged_ = ::CreateEventEx(nullptr, nullptr, 0, EVENT_MODIFY_STATE | SYNCHRONIZE);
+			if (!hEvtActivityChanged_) {
+				hr = ::GetLastError();
 				std::string const& msg = std::system_category().message(hr);
-				OBS_ERROR("unable to instantiate pDeviceIn enumerator: %s (%x)", msg.c_str(), hr);
+				OBS_ERROR("unable to create activity event: %s (%x)", msg.c_str(), hr);
 				return hr;
 			}
 
-			if FAILED(hr = pDeviceEnumerator->EnumAudioEndpoints(eCapture, DEVICE_STATE_ACTIVE, &pDeviceCollection_))
-			{
+			hActivityThread_ = ::CreateThread(nullptr, 0, OBSAudioSource::activity, this, 0, nullptr);
+			if (!hActivityThread_) {
+				hr = ::GetLastError();
 				std::string const& msg = std::system_category().message(hr);
-				OBS_ERROR("unable to retrieve pDeviceIn collection: %s (%x)", msg.c_str(), hr);
+				OBS_ERROR("unable to create activity thread: %s (%x)", msg.c_str(), hr);
 				return hr;
 			}
 
-			{
-				int major_version = -1;
-				int minor_version = -1;
-				int revision = -1;
-				if (int const retval = rtvc_get_protocol_version(&major_version, &minor_version, &revision)) {
-					OBS_ERROR("could not get protocol version: %d", retval);
-					return E_FAIL;
-				}
-				OBS_INFO("protocol version: %d.%d.%d", major_version, minor_version, revision);
-
-				if (major_version != 1) {
-					OBS_ERROR("unsupported protocol version: %d.%d.%d", major_version, minor_version, revision);
-					return E_FAIL;
-				}
+			hEvtMonitorShutdown_ = ::CreateEventEx(nullptr, nullptr, 0, EVENT_MODIFY_STATE | SYNCHRONIZE);
+			if (!hEvtMonitorShutdown_) {
+				hr = ::GetLastError();
+				std::string const& msg = std::system_category().message(hr);
+				OBS_ERROR("unable to create monitor shutdown event: %s (%x)", msg.c_str(), hr);
+				return hr;
+			}
 
-				if (int const retval = rtvc_init("jvs100")) {
-					OBS_ERROR("could not init jvs100: %d", retval);
-					return E_FAIL;
-				}
-				OBS_INFO("init: jvs100");
+			hMonitorThread_ = ::CreateThread(nullptr, 0, OBSAudioSource::monitor, this, 0, nullptr);
+			if (!hMonitorThread_) {
+				hr = ::GetLastError();
+				std::string const& msg = std::system_category().message(hr);
+				OBS_ERROR("unable to create monitor thread: %s (%x)", msg.c_str(), hr);
+				return hr;
 			}
-			{
-				int major_version = -1;
-				int minor_version = -1;
-				int revision = -1;
-				if (int const retval = rtvc_get_version(&major_version, &minor_version, &revision)) {
-					OBS_ERROR("could not get version: %d", retval);
-					return E_FAIL;
-				}
-				OBS_INFO("version: %d.%d.%d", major_version, minor_version, revision);
 
-				if (int const retval = rtvc_get_sample_rate(&sample_rate_)) {
-					OBS_ERROR("could not get sample rate: %d", retval);
-					return E_FAIL;
-				}
-				OBS_INFO("sample rate: %d [hz]", sample_rate_);
+			return S_OK;
+		}
 
-				int sample_latency = 0;
-				if (int const retval = rtvc_get_sample_latency(&sample_latency)) {
-					OBS_ERROR("could not get sample latency: %d", retval);
-					return E_FAIL;
+		// エンジンを初期化して形式を読む (pipeline_mutex_ を持って、止めてから呼ぶ)
+		HRESULT OpenEngine(bool eco) {
+			HRESULT hr = S_OK;
+			CloseEngine();
+
+			std::unique_ptr<rtvc::model_instance> instance;
+			std::string error;
+			if (eco) {
+				instance.reset(new rtvc::model_instance);
+				instance->name = "eco";
+				if (!rtvc::eco_engine_api(instance->api)) {
+					error = "too many eco engines are open";
+					hr = E_OUTOFMEMORY;
 				}
-				OBS_INFO("sample latency: %d [ms]", 1'000 * sample_latency / sample_rate_);
-
-				if (int const retval = rtvc_get_block_size(&block_size_)) {
-					OBS_ERROR("could not get block size: %d", retval);
-					return E_FAIL;
+				else if FAILED(hr = rtvc::init_model(*instance, error)) {
+					rtvc::model_registry().Close(std::move(instance));
 				}
-				OBS_INFO("block size: %d [ms]", 1'000 * block_size_ / sample_rate_);
+			}
+			else {
+				hr = rtvc::model_registry().Open(model_, instance, error);
+			}
+			if FAILED(hr) {
+				OBS_ERROR("%s", error.c_str());
+				return hr;
 			}
 
+			AdoptEngine(std::move(instance));
+			engine_eco_ = eco;
 			return S_OK;
 		}
 
-		// 破棄する
-		HRESULT Destroy() {
-			OBS_INFO("rtvc destroy");
-			HRESULT hr = S_OK;
+		// 初期化したエンジンを推論スレッドに渡す (止めてから呼ぶ)
+		void AdoptEngine(std::unique_ptr<rtvc::model_instance> instance) {
+			rtvc::model_instance const& adopted = *instance;
+			OBS_INFO("protocol version: %d.%d.%d", adopted.protocol_version[0], adopted.protocol_version[1], adopted.protocol_version[2]);
+			OBS_INFO("init: %s (%.0f [ms])", adopted.name.c_str(), adopted.init_ns / 1'000'000.0);
+			OBS_INFO("version: %d.%d.%d", adopted.version[0], adopted.version[1], adopted.version[2]);
+
+			sample_rate_ = adopted.format.sample_rate;
+			sample_latency_ = adopted.format.sample_latency;
+			block_size_ = adopted.format.block_size;
+			OBS_INFO("sample rate: %d [hz]", sample_rate_);
+			OBS_INFO("sample latency: %d [ms]", 1'000 * sample_latency_ / sample_rate_);
+			OBS_INFO("block size: %d [ms]", 1'000 * block_size_ / sample_rate_);
+			if (adopted.api.max_blocks > 1) {
+				OBS_INFO("process_n: up to %d blocks per call", adopted.api.max_blocks);
+			}
 
-			if FAILED(hr = Stop()) {
-				return hr;
+			if (int const retval = rtvc::model_registry().Close(models_.Reset(std::move(instance)))) {
+				OBS_ERROR("Could not destroy RTVC Engine: %d", retval);
 			}
+			engine_ready_ = true;
+		}
 
-			if (int const retval = rtvc_destroy()) {
+		void CloseEngine() {
+			if (!engine_ready_) {
+				return;
+			}
+			if (int const retval = rtvc::model_registry().Close(models_.Reset(nullptr))) {
 				OBS_ERROR("Could not destroy RTVC Engine: %d", retval);
-				return E_FAIL;
 			}
+			engine_ready_ = false;
+		}
 
+		// 設定と状態に合わせてエンジンを選ぶ (pipeline_mutex_ を持って、止めてから呼ぶ)
+		HRESULT SelectEngine() {
+			HRESULT hr = S_OK;
+			bool const available = rtvc::model_registry().Available();
+			bool const eco = engine_choice_ == ENGINE_ECO || !available || (engine_choice_ == ENGINE_AUTO && overrun_fallback_);
+			if (engine_choice_ == ENGINE_NEURAL && !available) {
+				OBS_WARN("neural engine is not available, using the eco engine");
+			}
+			if (!engine_ready_ || engine_eco_ != eco) {
+				if (FAILED(hr = OpenEngine(eco)) && !eco) {
+					OBS_WARN("could not start the neural engine, using the eco engine");
+					hr = OpenEngine(true);
+				}
+				if SUCCEEDED(hr) {
+					OBS_INFO("engine: %s", engine_eco_ ? "eco (built-in)" : "neural");
+				}
+			}
+			auto_fallback_armed_.store(engine_ready_ && !engine_eco_ && engine_choice_ == ENGINE_AUTO, std::memory_order::release);
 			return hr;
 		}
 
-		// パラメーターを定義する
-		HRESULT GetProperties(obs_properties_t& props) {
-			HRESULT hr = S_OK;
-			{
-				obs_property_t* prop_device = obs_properties_add_list(&props, "device", "Input", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+		// 推論が間に合わないので eco に切り替える (Activity のスレッドから)
+		void FallBackToEco() {
+			if (!engine_ready_ || engine_eco_ || engine_choice_ != ENGINE_AUTO) {
+				return;
+			}
+			OBS_WARN("neural engine cannot keep up, switching to the eco engine");
+			bool const running = started_ && !suspended_;
+			if FAILED(Stop()) {
+				return;
+			}
+			overrun_fallback_ = true;
+			if (SUCCEEDED(SelectEngine()) && running) {
+				Start();
+			}
+		}
 
-				UINT deviceCount = 0;
-				if FAILED(hr = pDeviceCollection_->GetCount(&deviceCount)) {
-					std::string const& msg = std::system_category().message(hr);
-					OBS_ERROR("Unable to get pDeviceIn collection length: %s (%x)", msg.c_str(), hr);
-					return hr;
+		// 裏で用意したモデルの形式が違うので、止めて差し替える (Activity のスレッドから)
+		void RestartWithModel() {
+			std::unique_ptr<rtvc::model_instance> instance = models_.TakeRestart();
+			if (!instance) {
+				return;
+			}
+			if (!engine_ready_ || engine_eco_) {
+				rtvc::model_registry().Close(std::move(instance));
+				return;
+			}
+			OBS_INFO("model %s has a different format, restarting the pipeline", instance->name.c_str());
+			bool const running = started_ && !suspended_;
+			if FAILED(Stop()) {
+				rtvc::model_registry().Close(std::move(instance));
+				return;
+			}
+			AdoptEngine(std::move(instance));
+			if (running) {
+				Start();
+			}
+		}
+
+		// ディスク上の rtvc.vvfx を読み込み直す (Activity のスレッドから)
+		void ReloadEngine() {
+			int protocol_version[3] = { -1, -1, -1 };
+			std::string error;
+			if FAILED(rtvc::model_registry().Upgrade(protocol_version, error)) {
+				OBS_ERROR("could not reload the engine: %s", error.c_str());
+				return;
+			}
+			OBS_INFO("engine reloaded: protocol version %d.%d.%d", protocol_version[0], protocol_version[1], protocol_version[2]);
+
+			if (engine_ready_ && !engine_eco_) {
+				// 新しい版でモデルを開き直して、ブロックの境目でクロスフェードする
+				models_.Reopen();
+			}
+			else if (engine_choice_ != ENGINE_ECO) {
+				// 読み込めなかったか間に合わなかったので eco にしていた
+				bool const running = started_ && !suspended_;
+				if FAILED(Stop()) {
+					return;
 				}
+				overrun_fallback_ = false;
+				if (SUCCEEDED(SelectEngine()) && running) {
+					Start();
+				}
+			}
+		}
 
-				device_count_ = static_cast<int>(deviceCount);
+		// 破棄する
+		HRESULT Destroy() {
+			OBS_INFO("rtvc destroy");
+			HRESULT hr = S_OK;
 
-				for (UINT i = 0; i < deviceCount; ++i) {
-					Microsoft::WRL::ComPtr<IMMDevice> pDevice;
-					if FAILED(hr = pDeviceCollection_->Item(i, &pDevice)) {
-						std::string const& msg = std::system_category().message(hr);
-						OBS_WARN("Unable to open pDeviceIn %d property store: %s (%x)", i, msg.c_str(), hr);
-						continue;
-					}
+			if (hMonitorThread_) {
+				::SetEvent(hEvtMonitorShutdown_);
+				::WaitForSingleObject(hMonitorThread_, INFINITE);
+				::CloseHandle(hMonitorThread_);
+				hMonitorThread_ = nullptr;
+			}
+			if (hEvtMonitorShutdown_) {
+				::CloseHandle(hEvtMonitorShutdown_);
+				hEvtMonitorShutdown_ = nullptr;
+			}
 
-					Microsoft::WRL::ComPtr<IPropertyStore> propertyStore;
-					if FAILED(hr = pDevice->OpenPropertyStore(STGM_READ, &propertyStore)) {
-						std::string const& msg = std::system_category().message(hr);
-						OBS_WARN("Unable to open pDeviceIn %d property store: %s (%x)", i, msg.c_str(), hr);
-						continue;
-					}
+			for (obs_hotkey_id& id : preset_hotkeys_) {
+				if (id != OBS_INVALID_HOTKEY_ID) {
+					obs_hotkey_unregister(id);
+					id = OBS_INVALID_HOTKEY_ID;
+				}
+			}
+			if (trace_hotkey_ != OBS_INVALID_HOTKEY_ID) {
+				obs_hotkey_unregister(trace_hotkey_);
+				trace_hotkey_ = OBS_INVALID_HOTKEY_ID;
+			}
 
-					PROPVARIANT pv;
-					::PropVariantInit(&pv);
-					if FAILED(hr = propertyStore->GetValue(PKEY_Device_FriendlyName, &pv))
-					{
-						::PropVariantClear(&pv);
-						std::string const& msg = std::system_category().message(hr);
-						OBS_WARN("Unable to retrieve friendly name for pDeviceIn (%d): %s (%x)", i, msg.c_str(), hr);
-						continue;
-					}
+			signal_handler_disconnect(obs_source_get_signal_handler(context_), "mute", OBSAudioSource::mute_changed, this);
+			if (hActivityThread_) {
+				activity_shutdown_.store(true);
+				::SetEvent(hEvtActivityChanged_);
+				::WaitForSingleObject(hActivityThread_, INFINITE);
+				::CloseHandle(hActivityThread_);
+				hActivityThread_ = nullptr;
+			}
+			if (hEvtActivityChanged_) {
+				::CloseHandle(hEvtActivityChanged_);
+				hEvtActivityChanged_ = nullptr;
+			}
 
-					if (pv.vt != VT_LPWSTR) {
-						::PropVariantClear(&pv);
-						continue;
-					}
+			if (device_listener_) {
+				rtvc::wasapi_device_catalog().Unsubscribe(device_listener_);
+				device_listener_ = 0;
+			}
+			{
+				std::lock_guard<std::mutex> lock(pipeline_mutex_);
+				if FAILED(hr = Stop()) {
+					return hr;
+				}
+				CloseEngine();
+			}
+			models_.Shutdown();
+			recorder_.Close();
 
-					std::string device_name(::WideCharToMultiByte(CP_UTF8, WC_COMPOSITECHECK, pv.pwszVal, -1, nullptr, 0, nullptr, nullptr), '\0');
-					if (!::WideCharToMultiByte(CP_UTF8, WC_COMPOSITECHECK, pv.pwszVal, -1, device_name.data(), static_cast<int>(device_name.size()), nullptr, nullptr)) {
-						::PropVariantClear(&pv);
-						continue;
-					}
-					::PropVariantClear(&pv);
+			return hr;
+		}
+
+		// キャッシュしたデバイスの一覧を選択肢にする (先頭は既定のデバイス)
+		static void ListDevices(rtvc::device_flow flow, obs_property_t* prop) {
+			std::shared_ptr<rtvc::device_list const> const devices = rtvc::wasapi_device_catalog().Devices(flow);
+			obs_property_list_add_string(prop, "Default", "");
+			for (rtvc::device_entry const& entry : devices->devices) {
+				obs_property_list_add_string(prop, entry.name.c_str(), entry.id.c_str());
+			}
+		}
 
-					obs_property_list_add_int(prop_device, device_name.c_str(), i);
+		// パラメーターを定義する
+		HRESULT GetProperties(obs_properties_t& props) {
+			HRESULT hr = S_OK;
+			{
+				obs_property_t* prop_device = obs_properties_add_list(&props, "device_endpoint", "Input", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
+				ListDevices(rtvc::device_flow::capture, prop_device);
+			}
+			{
+				obs_property_t* prop_capture = obs_properties_add_list(&props, "capture", "Capture", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+				obs_property_list_add_int(prop_capture, "Input Device", CAPTURE_WASAPI);
+				obs_property_list_add_int(prop_capture, "Audio File", CAPTURE_FILE);
+				obs_property_list_add_int(prop_capture, "Test Tone", CAPTURE_SYNTHETIC);
+				obs_property_list_add_int(prop_capture, "Voice Changer Host", CAPTURE_HOST);
+				obs_properties_add_path(&props, "capture_file", "Capture File", OBS_PATH_FILE, "Audio (*.wav *.raw)", nullptr);
+			}
+			{
+				obs_property_t* prop_engine = obs_properties_add_list(&props, "engine", "Engine", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+				obs_property_list_add_int(prop_engine, "Auto", ENGINE_AUTO);
+				obs_property_list_add_int(prop_engine, "Neural", ENGINE_NEURAL);
+				obs_property_list_add_int(prop_engine, "Eco (pitch shift only)", ENGINE_ECO);
+				obs_property_set_long_description(prop_engine, "Auto switches to the built-in eco engine when the neural engine is missing or cannot keep up");
+				obs_property_t* prop_engine_timeout = obs_properties_add_float_slider(&props, "engine_timeout", "Engine Timeout", 0, 200, 1);
+				obs_property_float_set_suffix(prop_engine_timeout, " ms");
+				obs_property_set_long_description(prop_engine_timeout, "Output the dry voice while the engine has not returned this long after the blocks were due (0 disables)");
+			}
+			{
+				obs_property_t* prop_model = obs_properties_add_list(&props, "model", "Model", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
+				for (std::string const& name : rtvc::model_registry().Models()) {
+					obs_property_list_add_string(prop_model, name.c_str(), name.c_str());
 				}
+				obs_property_set_long_description(prop_model, "A new model is loaded in the background and swapped in without stopping the voice");
 			}
 			{
 				obs_property_t* prop_latency = obs_properties_add_list(&props, "latency", "Latency", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
@@ -430,28 +537,88 @@ namespace {
 				obs_property_float_set_suffix(prop_pitch_snap, " %");
 			}
 			{
-				int num_voices = 0;
-				if (int retval = rtvc_get_num_voices(&num_voices)) {
-					return retval;
-				}
-				obs_property_t* prop_primary_voice = obs_properties_add_list(&props, "primary_voice", "Primary Voice", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
-				obs_property_t* prop_secondary_voice = obs_properties_add_list(&props, "secondary_voice", "Secondary Voice", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
-
-				obs_property_list_add_int(prop_secondary_voice, "none", -1);
-				for (int i = 0; i < num_voices; ++i) {
-					char const* voice_name = nullptr;
-					if (int const retval = rtvc_get_voice_name(i, &voice_name)) {
+				// 裏で差し替えたモデルも、読んでいる間は破棄されない
+				int const retval = models_.WithServing([&props](rtvc::model_instance const* serving) -> int {
+					int num_voices = 0;
+					if (!serving) {
 					}
-					else {
-						obs_property_list_add_int(prop_primary_voice, voice_name, i);
-						obs_property_list_add_int(prop_secondary_voice, voice_name, i);
+					else if (int retval = serving->api.get_num_voices(&num_voices)) {
+						return retval;
 					}
+					obs_property_t* prop_primary_voice = obs_properties_add_list(&props, "primary_voice", "Primary Voice", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+					obs_property_t* prop_secondary_voice = obs_properties_add_list(&props, "secondary_voice", "Secondary Voice", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+
+					obs_property_list_add_int(prop_secondary_voice, "none", -1);
+					for (int i = 0; i < num_voices; ++i) {
+						char const* voice_name = nullptr;
+						if (int const retval = serving->api.get_voice_name(i, &voice_name)) {
+						}
+						else {
+							obs_property_list_add_int(prop_primary_voice, voice_name, i);
+							obs_property_list_add_int(prop_secondary_voice, voice_name, i);
+						}
+					}
+					return 0;
+				});
+				if (retval) {
+					return retval;
 				}
 			}
 			{
 				obs_property_t* prop_amount = obs_properties_add_float_slider(&props, "amount", "Amount", 0, 100, 1);
 				obs_property_float_set_suffix(prop_amount, " %");
 			}
+			{
+				obs_property_t* prop_preset_blend = obs_properties_add_float_slider(&props, "preset_blend", "Voice Blend", 0, 200, 1);
+				obs_property_float_set_suffix(prop_preset_blend, " ms");
+				obs_property_set_long_description(prop_preset_blend, "Move to the new voice over this long when a preset hotkey is pressed or the voice settings change (0 switches at once)");
+				obs_property_t* const prop_store_presets[] = {
+					obs_properties_add_button(&props, "store_preset_1", "Store Preset 1", OBSAudioSource::store_preset_clicked<1>),
+					obs_properties_add_button(&props, "store_preset_2", "Store Preset 2", OBSAudioSource::store_preset_clicked<2>),
+					obs_properties_add_button(&props, "store_preset_3", "Store Preset 3", OBSAudioSource::store_preset_clicked<3>),
+					obs_properties_add_button(&props, "store_preset_4", "Store Preset 4", OBSAudioSource::store_preset_clicked<4>),
+				};
+				for (obs_property_t* const prop_store_preset : prop_store_presets) {
+					obs_property_set_long_description(prop_store_preset, "Keep the current voices, amount, pitch and output gain for the \"Voice Preset\" hotkey");
+				}
+			}
+			{
+				obs_property_t* prop_auto_sync = obs_properties_add_bool(&props, "auto_sync", "Auto Sync Offset");
+				obs_property_set_long_description(prop_auto_sync, "Set the sync offset from the measured capture and conversion delay");
+				obs_property_t* prop_sync_adjust = obs_properties_add_float_slider(&props, "sync_adjust", "Sync Adjust", -500, 500, 1);
+				obs_property_float_set_suffix(prop_sync_adjust, " ms");
+			}
+			{
+				obs_property_t* prop_monitor = obs_properties_add_bool(&props, "monitor", "Direct Monitoring");
+				obs_property_set_long_description(prop_monitor, "Play the converted voice on an output device without going through the OBS audio monitoring");
+				obs_property_t* prop_monitor_device = obs_properties_add_list(&props, "monitor_endpoint", "Monitoring Device", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
+				ListDevices(rtvc::device_flow::render, prop_monitor_device);
+			}
+			{
+				obs_properties_add_bool(&props, "record_session", "Record Session");
+				obs_properties_add_path(&props, "record_path", "Session File", OBS_PATH_FILE_SAVE, "Session (*.rtvcsession)", nullptr);
+			}
+			{
+				obs_property_t* prop_dump_trace = obs_properties_add_button(&props, "dump_trace", "Dump Pipeline Trace", OBSAudioSource::dump_trace_clicked);
+				obs_property_set_long_description(prop_dump_trace, "Write the per-block timeline of the last seconds as a Chrome trace (open it in ui.perfetto.dev)");
+				obs_property_t* prop_trace_seconds = obs_properties_add_int_slider(&props, "trace_seconds", "Trace Length", 1, 60, 1);
+				obs_property_int_set_suffix(prop_trace_seconds, " s");
+				obs_property_t* prop_trace_on_overrun = obs_properties_add_bool(&props, "trace_on_overrun", "Dump Trace on Overrun");
+				obs_property_set_long_description(prop_trace_on_overrun, "Also write the trace when a block misses its deadline (at most once per trace length)");
+				obs_properties_add_path(&props, "trace_dir", "Trace Folder", OBS_PATH_DIRECTORY, nullptr, nullptr);
+			}
+			{
+				obs_property_t* prop_stats_file = obs_properties_add_path(&props, "stats_file", "Stats File", OBS_PATH_FILE_SAVE, "Stats (*.rtvcstats)", nullptr);
+				obs_property_set_long_description(prop_stats_file, "Publish live metrics once a second to a memory-mapped file (empty to disable)");
+				obs_property_t* prop_prometheus_file = obs_properties_add_path(&props, "prometheus_file", "Prometheus Textfile", OBS_PATH_FILE_SAVE, "Prometheus (*.prom)", nullptr);
+				obs_property_set_long_description(prop_prometheus_file, "Also write the metrics for the node_exporter textfile collector (empty to disable)");
+			}
+			{
+				obs_property_t* prop_reload_engine = obs_properties_add_button(&props, "reload_engine", "Reload Engine", OBSAudioSource::reload_engine_clicked);
+				obs_property_set_long_description(prop_reload_engine, "Load an updated rtvc.vvfx side by side and cross over to it without stopping the voice");
+				obs_property_t* prop_measure_latency = obs_properties_add_button(&props, "measure_latency", "Measure Latency", OBSAudioSource::measure_latency_clicked);
+				obs_property_set_long_description(prop_measure_latency, "Feed a test chirp through the voice changer and measure its latency (the output is muted meanwhile)");
+			}
 			return hr;
 		}
 
@@ -459,106 +626,104 @@ namespace {
 			OBS_INFO("rtvc start");
 			HRESULT hr = S_OK;
 
-			if (hEvtAudioCaptureSamplesReady_) {
-				::CloseHandle(hEvtAudioCaptureSamplesReady_);
-				hEvtAudioCaptureSamplesReady_ = nullptr;
-			}
-			hEvtAudioCaptureSamplesReady_ = ::CreateEventEx(nullptr, nullptr, 0, EVENT_MODIFY_STATE | SYNCHRONIZE);
-			if (!hEvtAudioCaptureSamplesReady_) {
-				hr = ::GetLastError();
-				std::string const& msg = std::system_category().message(hr);
-				OBS_ERROR("unable to create samples ready event: %s (%x)", msg.c_str(), hr);
-				return hr;
-			}
+			int const SAMPLE_RATE = sample_rate_;
+			int const BLOCK_SIZE = block_size_;
 
-			if (hEvtShutdown_) {
-				::CloseHandle(hEvtShutdown_);
-				hEvtShutdown_ = nullptr;
+			// 構成が変わったので遅延を測り直す
+			pipeline_delay_ns_.store(0, std::memory_order::release);
+			{
+				std::lock_guard<std::mutex> endpoint_lock(endpoint_mutex_);
+				active_endpoint_.clear();
 			}
-			hEvtShutdown_ = ::CreateEventEx(nullptr, nullptr, 0, EVENT_MODIFY_STATE | SYNCHRONIZE);
-			if (!hEvtShutdown_) {
-				hr = ::GetLastError();
-				std::string const& msg = std::system_category().message(hr);
-				OBS_ERROR("unable to create shutdown event: %s (%x)", msg.c_str(), hr);
-				return hr;
+			device_index_.store(-1, std::memory_order::relaxed);
+			recovery_stats_.Reset();
+			supervisor_ = nullptr;
+			monitor_buffer_ns_.store(0, std::memory_order::relaxed);
+			monitor_device_ns_.store(0, std::memory_order::relaxed);
+			monitor_underruns_.store(0, std::memory_order::release);
+			monitor_render_result_.store(S_OK, std::memory_order::release);
+
+			switch (capture_type_) {
+			case CAPTURE_FILE:
+			{
+				rtvc::file_capture_config config;
+				config.path = std::filesystem::u8path(capture_file_);
+				config.loop = true;
+				capture_.reset(new rtvc::FileCapture(std::move(config)));
+				break;
 			}
-
-			int const device_id = device_id_.load(std::memory_order::acquire);
-			int const latency_type = latency_mode_.load(std::memory_order::acquire);
-			if FAILED(hr = pDeviceCollection_->Item(device_id, &pDevice_)) {
-				std::string const& msg = std::system_category().message(hr);
-				OBS_ERROR("unable to retrieve pDeviceIn: %s (%x)", msg.c_str(), hr);
-				return hr;
+			case CAPTURE_SYNTHETIC:
+				capture_.reset(new rtvc::SyntheticCapture(rtvc::synthetic_capture_config{}));
+				break;
+			case CAPTURE_HOST:
+				// ホストが終わったら無音でつなぎ、再起動されたら開き直して続きから読む
+				capture_.reset(new rtvc::SupervisedCapture([]() -> std::unique_ptr<rtvc::CaptureBackend> {
+					return std::unique_ptr<rtvc::CaptureBackend>(new rtvc::SharedAudioCapture());
+				}, recovery_stats_));
+				break;
+			default:
+			{
+				// デバイスが抜かれたら推論を止めずに開き直す (作り直しは監視のスレッドから呼ばれる)
+				std::string const endpoint = device_endpoint_;
+				int const latency_mode = latency_mode_.load(std::memory_order::acquire);
+				std::unique_ptr<rtvc::SupervisedCapture> supervisor(new rtvc::SupervisedCapture([this, endpoint, latency_mode]() -> std::unique_ptr<rtvc::CaptureBackend> {
+					Microsoft::WRL::ComPtr<IMMDevice> pDevice;
+					std::string active;
+					if FAILED(OpenEndpoint(rtvc::device_flow::capture, endpoint, active, pDevice)) {
+						return nullptr;
+					}
+					device_index_.store(rtvc::wasapi_device_catalog().Devices(rtvc::device_flow::capture)->IndexOf(active), std::memory_order::relaxed);
+					{
+						std::lock_guard<std::mutex> endpoint_lock(endpoint_mutex_);
+						active_endpoint_ = std::move(active);
+					}
+					return std::unique_ptr<rtvc::CaptureBackend>(new rtvc::WasapiCapture(std::move(pDevice), latency_mode));
+				}, recovery_stats_));
+				supervisor_ = supervisor.get();
+				capture_ = std::move(supervisor);
+				break;
 			}
-
-			// AudioClient準備
-			if FAILED(hr = pDevice_->Activate(__uuidof(IAudioClient3), CLSCTX_INPROC_SERVER, nullptr, &pAudioClientIn_)) {
-				std::string const& msg = std::system_category().message(hr);
-				OBS_ERROR("unable to activate audio pAudioClientIn: %s (%x)", msg.c_str(), hr);
-				return hr;
 			}
 
-			// デバイスのレイテンシ取得
-			REFERENCE_TIME hnsDefaultDevicePeriod;
-			REFERENCE_TIME hnsMinimumDevicePeriod;
-			if FAILED(hr = pAudioClientIn_->GetDevicePeriod(&hnsDefaultDevicePeriod, &hnsMinimumDevicePeriod)) {
+			if FAILED(hr = capture_->Open(rtvc::capture_config{ SAMPLE_RATE, BLOCK_SIZE })) {
 				std::string const& msg = std::system_category().message(hr);
-				OBS_ERROR("unable to get pDeviceIn period: %s (%x)", msg.c_str(), hr);
+				OBS_ERROR("unable to open %s capture: %s %s (%x)", capture_->Name(), capture_->LastError(), msg.c_str(), hr);
+				capture_.reset();
+				supervisor_ = nullptr;
 				return hr;
 			}
+			OBS_INFO("capture: %s", capture_->Name());
 
-			OBS_INFO("default device period: %ld [ms]", hnsDefaultDevicePeriod / 10'000);
-			OBS_INFO("minimum device period: %ld [ms]", hnsMinimumDevicePeriod / 10'000);
-
-			int const SAMPLE_RATE = sample_rate_;
-			int const BLOCK_SIZE = block_size_;
-
-			REFERENCE_TIME const hnsBufferPeriod = hnsDefaultDevicePeriod * latency_type;
-			std::size_t const buffer_size = (((SAMPLE_RATE * hnsBufferPeriod / 1'000'000) + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
-			buffer0_.reset(new float[buffer_size]);
-			buffer1_.reset(new float[buffer_size]);
+			std::size_t const buffer_size = capture_->MaxPacketFrames();
+			assembler_.Reset(BLOCK_SIZE, buffer_size);
+			buffer_frames_ = static_cast<std::uint32_t>(buffer_size);
 			OBS_INFO("buffer size:  %ld [frames]", buffer_size);
 
-			{
-				WAVEFORMATEXTENSIBLE format;
-				std::memset(&format, 0, sizeof(format));
-				format.Format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
-				format.Format.nChannels = 1;
-				format.Format.nSamplesPerSec = SAMPLE_RATE;
-				format.Format.wBitsPerSample = 32;
-				format.Format.nBlockAlign = format.Format.wBitsPerSample / 8 * format.Format.nChannels;
-				format.Format.nAvgBytesPerSec = format.Format.nSamplesPerSec * format.Format.nBlockAlign;
-				format.Format.cbSize = sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
-				format.dwChannelMask = SPEAKER_FRONT_CENTER;
-				format.Samples.wValidBitsPerSample = format.Format.wBitsPerSample;
-				format.SubFormat = KSDATAFORMAT_SUBTYPE_IEEE_FLOAT;
-
-				if FAILED(hr = pAudioClientIn_->Initialize(
-					AUDCLNT_SHAREMODE_SHARED,
-					AUDCLNT_STREAMFLAGS_EVENTCALLBACK | AUDCLNT_STREAMFLAGS_NOPERSIST | AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM | AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY,
-					hnsBufferPeriod,
-					0,
-					reinterpret_cast<WAVEFORMATEX*>(&format),
-					nullptr))
-				{
+			// ドライはエンジンの遅延だけ遅らせてウェットと揃える
+			dry_delay_.Reset(static_cast<std::uint32_t>(sample_latency_), assembler_.Capacity());
+			dry_blocks_.reset(new float[assembler_.Capacity()]);
+
+			// ニューラルのエンジンは別のスレッドで呼び、止まったらドライでつなぐ (戻るときは 10 ms でクロスフェード)
+			if (!engine_eco_ && capture_type_ != CAPTURE_HOST) {
+				if FAILED(hr = watchdog_.Start(assembler_.Capacity(), &trace_)) {
 					std::string const& msg = std::system_category().message(hr);
-					OBS_ERROR("unable to initialize audio pAudioClientIn: %s (%x)", msg.c_str(), hr);
-					return hr;
+					OBS_WARN("engine thread is not registered with MMCSS: %s (%x)", msg.c_str(), hr);
+					hr = S_OK;
 				}
 			}
-
-			if FAILED(hr = pAudioClientIn_->SetEventHandle(hEvtAudioCaptureSamplesReady_))
-			{
-				std::string const& msg = std::system_category().message(hr);
-				OBS_ERROR("unable to set ready event: %s (%x)", msg.c_str(), hr);
-				return hr;
-			}
-
-			if FAILED(hr = pAudioClientIn_->GetService(IID_PPV_ARGS(&pCaptureClient_)))
-			{
-				std::string const& msg = std::system_category().message(hr);
-				OBS_ERROR("unable to get new pCaptureClient pAudioClientIn: %s (%x)", msg.c_str(), hr);
-				return hr;
+			dry_fallback_.Reset(static_cast<std::uint32_t>(SAMPLE_RATE / 100));
+			concealer_.Reset(SAMPLE_RATE);
+
+			// モデルを差し替えるときは 20 ms かけて移る (途中で止めていたら古い方は手放す)
+			models_.FinishFade();
+			crossfade_.Reset(BLOCK_SIZE, SAMPLE_RATE / 50);
+
+			if (monitor_enabled_) {
+				// 失敗しても配信には影響しないので続ける
+				if FAILED(hr = OpenMonitor(static_cast<std::uint32_t>((buffer_size / BLOCK_SIZE + 1) * BLOCK_SIZE))) {
+					monitor_.reset();
+					hr = S_OK;
+				}
 			}
 
 			if (hAudioThread_) {
@@ -573,85 +738,282 @@ namespace {
 				return hr;
 			}
 
-			if FAILED(hr = pAudioClientIn_->Start()) {
-				std::string const& msg = std::system_category().message(hr);
-				OBS_ERROR("unable to start pCaptureClient pAudioClientIn: %s (%x)", msg.c_str(), hr);
+			if FAILED(hr = capture_->Start()) {
 				return hr;
 			}
 
 			return hr;
 		}
 
-		HRESULT Stop() {
-			OBS_INFO("rtvc stop");
+		// 設定したデバイスを開く (なくなっていれば既定のデバイスにする)
+		// active には実際に開いたデバイスの ID を返す
+		HRESULT OpenEndpoint(rtvc::device_flow flow, std::string const& endpoint, std::string& active, Microsoft::WRL::ComPtr<IMMDevice>& pDevice) {
 			HRESULT hr = S_OK;
+			rtvc::WasapiDeviceCatalog const& catalog = rtvc::wasapi_device_catalog();
+			std::shared_ptr<rtvc::device_list const> const devices = catalog.Devices(flow);
 
-			::SetEvent(hEvtShutdown_);
-			::WaitForSingleObject(hAudioThread_, INFINITE);
-			if (pAudioClientIn_) {
-				if FAILED(hr = pAudioClientIn_->Stop()) {
-					std::string const& msg = std::system_category().message(hr);
-					OBS_ERROR("Unable to stop audio pAudioClientIn: %s (%x)", msg.c_str(), hr);
-					return hr;
-				}
+			std::string id = endpoint;
+			if (!id.empty() && !devices->Find(id)) {
+				OBS_WARN("%s device is not available, using the default device: %s", flow == rtvc::device_flow::capture ? "input" : "monitoring", id.c_str());
+				id.clear();
 			}
-
-			if (hEvtAudioCaptureSamplesReady_) {
-				::CloseHandle(hEvtAudioCaptureSamplesReady_);
-				hEvtAudioCaptureSamplesReady_ = nullptr;
+			if FAILED(hr = catalog.OpenDevice(flow, id, pDevice)) {
+				std::string const& msg = std::system_category().message(hr);
+				OBS_ERROR("unable to open %s device: %s (%x)", flow == rtvc::device_flow::capture ? "input" : "monitoring", msg.c_str(), hr);
+				active.clear();
+				return hr;
 			}
-
-			if (hEvtShutdown_) {
-				::CloseHandle(hEvtShutdown_);
-				hEvtShutdown_ = nullptr;
+			active = id.empty() ? devices->default_id : id;
+			if (rtvc::device_entry const* const entry = devices->Find(active)) {
+				OBS_INFO("%s device: %s", flow == rtvc::device_flow::capture ? "input" : "monitoring", entry->name.c_str());
 			}
+			return S_OK;
+		}
 
-			if (hAudioThread_) {
-				::CloseHandle(hAudioThread_);
-				hAudioThread_ = nullptr;
+		// デバイスが抜き差しされた (一覧のスレッドから)
+		void OnDeviceChanged(rtvc::device_flow flow, rtvc::device_change change, std::string const& id) {
+			std::lock_guard<std::mutex> lock(pipeline_mutex_);
+			if (suspended_) {
+				// 再開するときに開き直す
+				return;
 			}
 
-			pCaptureClient_.Reset();
-			pAudioClientIn_.Reset();
-			pDevice_.Reset();
+			bool restart = false;
+			if (flow == rtvc::device_flow::capture && capture_type_ == CAPTURE_WASAPI) {
+				std::string active;
+				{
+					std::lock_guard<std::mutex> endpoint_lock(endpoint_mutex_);
+					active = active_endpoint_;
+				}
+				bool const following_default = active != device_endpoint_;
+				bool reopen = false;
+				switch (change) {
+				case rtvc::device_change::removed:
+					// 使っているデバイスが抜かれたら既定のデバイスに逃がす
+					reopen = id == active;
+					break;
+				case rtvc::device_change::added:
+					// 設定したデバイスが戻ってきた
+					reopen = following_default && id == device_endpoint_;
+					break;
+				case rtvc::device_change::default_changed:
+					reopen = following_default;
+					break;
+				}
+				if (reopen && supervisor_) {
+					// 推論はそのままで取り込みだけ開き直す (止まったのを待たずに始める)
+					OBS_INFO("device %s, reopening: %s", change == rtvc::device_change::removed ? "removed" : change == rtvc::device_change::added ? "added" : "default changed", id.c_str());
+					supervisor_->Reopen();
+					return;
+				}
+				// どのデバイスも開けていなかった
+				restart = reopen || (change != rtvc::device_change::removed && !capture_);
+			}
+			else if (flow == rtvc::device_flow::render && monitor_enabled_) {
+				bool const following_default = monitor_active_endpoint_ != monitor_endpoint_;
+				switch (change) {
+				case rtvc::device_change::removed:
+					restart = id == monitor_active_endpoint_;
+					break;
+				case rtvc::device_change::added:
+					restart = following_default && id == monitor_endpoint_;
+					break;
+				case rtvc::device_change::default_changed:
+					restart = following_default;
+					break;
+				}
+			}
+			if (!restart) {
+				return;
+			}
 
-			return hr;
+			OBS_INFO("device %s, restarting: %s", change == rtvc::device_change::removed ? "removed" : change == rtvc::device_change::added ? "added" : "default changed", id.c_str());
+			if FAILED(Stop()) {
+				return;
+			}
+			Start();
 		}
 
-		// パラメーターを更新する
-		HRESULT Update(obs_data_t* settings) {
+		// 直接モニター出力を開いて鳴らし始める
+		HRESULT OpenMonitor(std::uint32_t write_frames) {
 			HRESULT hr = S_OK;
 
-			int const old_device_id = device_id_.load(std::memory_order::acquire);
-			int const new_device_id = static_cast<int>(obs_data_get_int(settings, "device"));
-			int const old_latency_mode = latency_mode_.load(std::memory_order::acquire);
-			int const new_latency_mode = static_cast<int>(obs_data_get_int(settings, "latency"));
-			if ((old_device_id != new_device_id) || (old_latency_mode != new_latency_mode)) {
-				if (old_device_id >= 0) {
-					if FAILED(hr = Stop()) {
+			Microsoft::WRL::ComPtr<IMMDevice> pDevice;
+			if FAILED(hr = OpenEndpoint(rtvc::device_flow::render, monitor_endpoint_, monitor_active_endpoint_, pDevice)) {
+				return hr;
+			}
+
+			monitor_.reset(new rtvc::WasapiRender(std::move(pDevice)));
+			if FAILED(hr = monitor_->Open(sample_rate_, write_frames)) {
+				std::string const& msg = std::system_category().message(hr);
+				OBS_ERROR("unable to open %s monitoring: %s %s (%x)", monitor_->Name(), monitor_->LastError(), msg.c_str(), hr);
+				return hr;
+			}
+			if FAILED(hr = monitor_->Start()) {
+				std::string const& msg = std::system_category().message(hr);
+				OBS_ERROR("unable to start %s monitoring: %s %s (%x)", monitor_->Name(), monitor_->LastError(), msg.c_str(), hr);
+				return hr;
+			}
+			OBS_INFO("direct monitoring: %s (target %u [frames])", monitor_->Name(), monitor_->Buffer().TargetFrames());
+			return S_OK;
+		}
+
+		HRESULT Stop() {
+			OBS_INFO("rtvc stop");
+			HRESULT hr = S_OK;
+
+			if (capture_) {
+				capture_->Interrupt();
+			}
+			if (hAudioThread_) {
+				::WaitForSingleObject(hAudioThread_, INFINITE);
+				::CloseHandle(hAudioThread_);
+				hAudioThread_ = nullptr;
+			}
+			// エンジンが止まったままなら返るまで待つ
+			watchdog_.Stop();
+			ReportRealtimeViolations();
+			if (monitor_) {
+				monitor_->Stop();
+				if (HRESULT const render_hr = monitor_->RenderResult(); FAILED(render_hr)) {
+					OBS_ERROR("direct monitoring had stopped playing: %s (%x)", monitor_->LastError(), static_cast<std::uint32_t>(render_hr));
+				}
+				rtvc::JitterBuffer const& buffer = monitor_->Buffer();
+				OBS_INFO("direct monitoring stopped: %llu underrun(s), %llu overflow(s), %llu frame(s) skipped, %llu frame(s) concealed",
+					static_cast<unsigned long long>(buffer.Underruns()), static_cast<unsigned long long>(buffer.Overflows()), static_cast<unsigned long long>(buffer.SkippedFrames()),
+					static_cast<unsigned long long>(buffer.ConcealedFrames()));
+				monitor_.reset();
+				monitor_buffer_ns_.store(0, std::memory_order::relaxed);
+				monitor_target_ns_.store(0, std::memory_order::relaxed);
+			}
+			if (capture_) {
+				if FAILED(hr = capture_->Stop()) {
+					return hr;
+				}
+				capture_.reset();
+				supervisor_ = nullptr;
+			}
+			if (std::uint64_t const faults = recovery_stats_.faults.load(std::memory_order::acquire)) {
+				OBS_INFO("capture recovery: %llu fault(s), %llu recovery(ies), max %.1f [ms], %llu frame(s) bridged",
+					static_cast<unsigned long long>(faults), static_cast<unsigned long long>(recovery_stats_.recoveries.load(std::memory_order::relaxed)),
+					recovery_stats_.max_recover_ns.load(std::memory_order::relaxed) / 1'000'000.0,
+					static_cast<unsigned long long>(recovery_stats_.bridged_frames.load(std::memory_order::relaxed)));
+			}
+
+			return hr;
+		}
+
+		// パラメーターを更新する
+		HRESULT Update(obs_data_t* settings) {
+			HRESULT hr = S_OK;
+
+			// 以前の設定 (位置) は ID に置き換える
+			if (obs_data_has_user_value(settings, "device")) {
+				std::string const id = rtvc::wasapi_device_catalog().Devices(rtvc::device_flow::capture)->IdAt(static_cast<int>(obs_data_get_int(settings, "device")));
+				obs_data_set_string(settings, "device_endpoint", id.c_str());
+				obs_data_erase(settings, "device");
+			}
+
+			std::lock_guard<std::mutex> lock(pipeline_mutex_);
+			std::string const new_device_endpoint = obs_data_get_string(settings, "device_endpoint");
+			int const old_latency_mode = latency_mode_.load(std::memory_order::acquire);
+			int const new_latency_mode = static_cast<int>(obs_data_get_int(settings, "latency"));
+			int const new_capture_type = static_cast<int>(obs_data_get_int(settings, "capture"));
+			std::string const new_capture_file = obs_data_get_string(settings, "capture_file");
+			int const new_engine_choice = static_cast<int>(obs_data_get_int(settings, "engine"));
+			std::string const new_model = obs_data_get_string(settings, "model");
+			model_ = new_model.empty() ? rtvc::ModelRegistry::DEFAULT_MODEL : new_model;
+			bool const new_monitor_enabled = obs_data_get_bool(settings, "monitor");
+			std::string const new_monitor_endpoint = obs_data_get_string(settings, "monitor_endpoint");
+			if (!started_ || (engine_choice_ != new_engine_choice) || (device_endpoint_ != new_device_endpoint) || (old_latency_mode != new_latency_mode) || (capture_type_ != new_capture_type) || (capture_file_ != new_capture_file) ||
+				(monitor_enabled_ != new_monitor_enabled) || (monitor_endpoint_ != new_monitor_endpoint)) {
+				if FAILED(hr = Stop()) {
+					return hr;
+				}
+
+				if (!started_ || engine_choice_ != new_engine_choice) {
+					// 選び直したら、間に合わなかったことは忘れる
+					engine_choice_ = new_engine_choice;
+					overrun_fallback_ = false;
+					if FAILED(hr = SelectEngine()) {
 						return hr;
 					}
 				}
 
-				device_id_.store(new_device_id, std::memory_order::release);
+				started_ = true;
+				device_endpoint_ = new_device_endpoint;
 				latency_mode_.store(new_latency_mode, std::memory_order::release);
-				if FAILED(hr = Start()) {
+				capture_type_ = new_capture_type;
+				capture_file_ = new_capture_file;
+				monitor_enabled_ = new_monitor_enabled;
+				monitor_endpoint_ = new_monitor_endpoint;
+				monitor_enabled_flag_.store(new_monitor_enabled, std::memory_order::release);
+				suspended_ = !IsAudible();
+				if (suspended_) {
+					OBS_INFO("rtvc suspended until the source becomes audible");
+				}
+				else if FAILED(hr = Start()) {
 					return hr;
 				}
 			}
+			if (engine_ready_ && !engine_eco_) {
+				// 止めずに裏で用意して、推論スレッドがブロックの境目で差し替える
+				models_.Request(model_);
+			}
 			{
-				// gain = 10 ** (db / 20)
-				input_gain_.store(static_cast<float>(std::pow(10.0, obs_data_get_double(settings, "input_gain") * 0.05)), std::memory_order::release);
-				output_gain_.store(static_cast<float>(std::pow(10.0, obs_data_get_double(settings, "output_gain") * 0.05)), std::memory_order::release);
-
-				// cent = 1200 * log2(hz)
-				double const base_pitch_shift = PITCH_SHIFT_PROTOTYPES[obs_data_get_int(settings, "pitch_shift_mode")][obs_data_get_int(settings, "your_voice")];
-				pitch_shift_.store(static_cast<float>((obs_data_get_double(settings, "pitch_shift") + base_pitch_shift) * (std::log(2.0) / 1200.0)), std::memory_order::release);
-				pitch_shift_mode_.store(static_cast<float>(obs_data_get_int(settings, "pitch_shift_mode")), std::memory_order::release);
-				pitch_snap_.store(static_cast<float>(obs_data_get_double(settings, "pitch_snap") * 0.01), std::memory_order::release);
-				primary_voice_.store(static_cast<int>(obs_data_get_int(settings, "primary_voice")), std::memory_order::release);
-				secondary_voice_.store(static_cast<int>(obs_data_get_int(settings, "secondary_voice")), std::memory_order::release);
-				amount_.store(static_cast<float>(obs_data_get_double(settings, "amount") * 0.01), std::memory_order::release);
+				// プロパティの値とプリセットをここで計算しておき、推論スレッドには表ごと渡す
+				rtvc::voice_params slots[rtvc::VoicePresets::NUM_SLOTS];
+				for (int i = 0; i < rtvc::VoicePresets::NUM_SLOTS; ++i) {
+					obs_data_t* const preset = PRESET_SETTINGS[i] ? obs_data_get_obj(settings, PRESET_SETTINGS[i]) : nullptr;
+					slots[i] = MakeVoiceParams(settings, preset);
+					obs_data_release(preset);
+				}
+				voice_presets_.Publish(slots, static_cast<std::uint64_t>(obs_data_get_double(settings, "preset_blend") * 1'000'000.0));
+			}
+			{
+				// 記録の開始と終了
+				bool const record = obs_data_get_bool(settings, "record_session");
+				std::string const record_path = obs_data_get_string(settings, "record_path");
+				if (recorder_.IsActive() && (!record || record_path != record_path_)) {
+					if (std::uint64_t const dropped = recorder_.Close()) {
+						OBS_WARN("session recording dropped %llu record(s)", static_cast<unsigned long long>(dropped));
+					}
+					OBS_INFO("session recording stopped: %s", record_path_.c_str());
+				}
+				if (record && !record_path.empty() && !recorder_.IsActive()) {
+					rtvc::session::file_header header{};
+					std::memcpy(header.magic, rtvc::session::MAGIC, sizeof(header.magic));
+					header.version = rtvc::session::VERSION;
+					header.sample_rate = static_cast<std::uint32_t>(sample_rate_);
+					header.block_size = static_cast<std::uint32_t>(block_size_);
+					header.sample_latency = static_cast<std::uint32_t>(sample_latency_);
+					header.start_time_ns = os_gettime_ns();
+					if (recorder_.Open(std::filesystem::u8path(record_path), header)) {
+						OBS_INFO("session recording started: %s", record_path.c_str());
+					}
+					else {
+						OBS_ERROR("unable to open session file: %s", record_path.c_str());
+					}
+				}
+				record_path_ = record_path;
+			}
+			{
+				// 時系列の書き出し (Monitor() が読む)
+				std::lock_guard<std::mutex> lock(trace_mutex_);
+				trace_dir_ = obs_data_get_string(settings, "trace_dir");
+				trace_seconds_ = static_cast<double>(obs_data_get_int(settings, "trace_seconds"));
+				trace_on_overrun_.store(obs_data_get_bool(settings, "trace_on_overrun"), std::memory_order::release);
+			}
+			{
+				// 統計の書き出し先 (Monitor() が開き直す)
+				std::lock_guard<std::mutex> lock(telemetry_mutex_);
+				stats_path_ = obs_data_get_string(settings, "stats_file");
+				prometheus_path_ = obs_data_get_string(settings, "prometheus_file");
+			}
+			{
+				engine_timeout_ns_.store(static_cast<std::uint64_t>(obs_data_get_double(settings, "engine_timeout") * 1'000'000), std::memory_order::release);
+				auto_sync_.store(obs_data_get_bool(settings, "auto_sync"), std::memory_order::release);
+				sync_adjust_ns_.store(static_cast<std::int64_t>(obs_data_get_double(settings, "sync_adjust") * 1'000'000), std::memory_order::release);
 			}
 			return hr;
 		}
@@ -663,120 +1025,638 @@ namespace {
 			int const SAMPLE_RATE = sample_rate_;
 			int const BLOCK_SIZE = block_size_;
 
-			UINT uBufferSizeIn = 0;
-			if FAILED(hr = pAudioClientIn_->GetBufferSize(&uBufferSizeIn)) {
-				return hr;
-			}
-			OBS_INFO("uBufferSizeIn: %u", uBufferSizeIn);
+			// ホストが変換済みの音声はそのまま出力する
+			bool const converted = capture_type_ == CAPTURE_HOST;
+
+			rtvc::engine_api const* engine = &models_.Serving()->api;
 
 			std::uint64_t total_frames = 0; ///< これまでの累積フレーム数
-			std::uint32_t remainings = 0; ///< ブロックに満たない余っているサンプル数
 
-			HANDLE events[] = { hEvtAudioCaptureSamplesReady_, hEvtShutdown_ };
+			// 推論の負荷 (処理時間 / ブロックの長さ) の平滑値。Auto で 1 を超え続けたら eco に切り替える
+			bool const auto_fallback = auto_fallback_armed_.load(std::memory_order::acquire);
+			float load = 0.0f;
+			std::uint64_t load_blocks = 0;
+
+			std::uint32_t recorded_generation = 0; ///< 記録済みのセッション
+			rtvc::session::params_record recorded_params{}; ///< 最後に記録したパラメーター
+
+			telemetry_.Start();
+			struct telemetry_guard {
+				~telemetry_guard() noexcept {
+					counters_.Stop();
+				}
+				rtvc::PipelineCounters& counters_;
+			} _telemetry_guard{ telemetry_ };
+
 			for (;;) {
-				DWORD const result = ::WaitForMultipleObjects(static_cast<DWORD>(std::size(events)), events, FALSE, INFINITE);
-				if (result == WAIT_OBJECT_0 + 1) {
+				trace_.Begin(rtvc::trace_thread::capture, rtvc::trace_span::wait);
+				hr = capture_->Wait();
+				trace_.End(rtvc::trace_thread::capture, rtvc::trace_span::wait);
+				if FAILED(hr) {
+					rtvc::deferred_logger().Push(rtvc::log_event::wait_failed, static_cast<std::uint32_t>(hr));
+					return hr;
+				}
+				if (hr == S_FALSE) {
 					break;
 				}
-
-				float* pDataIn = nullptr;
-				UINT32 uNumFrameToRead = 0; // shared mode での GetNextPacketSize と一致する。
-				DWORD dwFlags = 0;
-				if FAILED(hr = pCaptureClient_->GetBuffer(reinterpret_cast<BYTE**>(&pDataIn), &uNumFrameToRead, &dwFlags, nullptr, nullptr)) {
+				rtvc::rt_check::realtime_scope _realtime_scope;
+				std::uint64_t const wake_time = os_gettime_ns();
+				rtvc::TraceScope _block_trace(&trace_, rtvc::trace_thread::capture, rtvc::trace_span::block);
+
+				rtvc::capture_packet packet;
+				trace_.Begin(rtvc::trace_thread::capture, rtvc::trace_span::get_buffer);
+				hr = capture_->Acquire(packet);
+				trace_.End(rtvc::trace_thread::capture, rtvc::trace_span::get_buffer, packet.frames);
+				if FAILED(hr) {
+					rtvc::deferred_logger().Push(rtvc::log_event::get_buffer_failed, static_cast<std::uint32_t>(hr));
 					return hr;
 				}
+				if (packet.flags & rtvc::CAPTURE_FLAG_DISCONTINUITY) {
+					rtvc::deferred_logger().Push(rtvc::log_event::discontinuity, packet.frames);
+				}
+				if (packet.flags & rtvc::CAPTURE_FLAG_TIMESTAMP_ERROR) {
+					rtvc::deferred_logger().Push(rtvc::log_event::timestamp_error, packet.frames);
+				}
 
-				std::uint32_t const frames = remainings + uNumFrameToRead;
-				std::uint32_t const block_count = frames / BLOCK_SIZE;
-				std::uint32_t const block_frames = static_cast<uint32_t>(block_count * BLOCK_SIZE);
+				std::uint32_t const remainings = assembler_.Remainings();
 				std::uint64_t const timestamp = audio_frames_to_ns(SAMPLE_RATE, total_frames * BLOCK_SIZE);
 
-				// ブロックに切り分ける (あまりは保存しておく)
-				if (dwFlags & AUDCLNT_BUFFERFLAGS_SILENT) {
-					if (block_count > 0) {
-						// ブロックに書き込む
-						std::size_t const new_frames = block_frames - remainings;
-						std::memset(buffer0_.get() + remainings, 0, new_frames * sizeof(float));
-
-						remainings = frames % BLOCK_SIZE;
-
-						// あまりを覚えておく
-						std::memset(buffer1_.get(), 0, remainings * sizeof(float));
-						std::swap(buffer0_, buffer1_);
-					}
-					else {
-						// あまりを追記する
-						std::memset(buffer0_.get() + remainings, 0, uNumFrameToRead * sizeof(float));
-						remainings = frames % BLOCK_SIZE;
-					}
+				// 出力ブロック先頭サンプルの取り込み時刻 (あまりの分だけ前のパケットに遡る)
+				std::uint64_t const capture_time = packet.device_time_ns - audio_frames_to_ns(SAMPLE_RATE, remainings);
+				bool const capture_time_valid = packet.device_time_ns != 0 && !(packet.flags & rtvc::CAPTURE_FLAG_TIMESTAMP_ERROR);
+				telemetry_.RecordWake(wake_time, audio_frames_to_ns(SAMPLE_RATE, packet.frames));
+				telemetry_.RecordCapture(packet.device_time_ns, packet.frames, SAMPLE_RATE, capture_time_valid && !(packet.flags & rtvc::CAPTURE_FLAG_DISCONTINUITY));
+
+				bool const silent = (packet.flags & rtvc::CAPTURE_FLAG_SILENT) != 0;
+				bool const recording = recorder_.IsActive();
+				if (recording) {
+					rtvc::session::packet_record const record{ packet.frames, packet.flags, packet.device_time_ns };
+					std::size_t const data_size = silent ? 0 : packet.frames * sizeof(float);
+					recorder_.Append(rtvc::session::record_type::packet, wake_time, &record, sizeof(record), packet.data, data_size);
 				}
-				else {
-					if (block_count > 0) {
-						// ブロックに書き込む
-						std::size_t const new_frames = block_frames - remainings;
-						std::memcpy(buffer0_.get() + remainings, pDataIn, new_frames * sizeof(float));
-
-						remainings = frames % BLOCK_SIZE;
 
-						// あまりを覚えておく
-						std::memcpy(buffer1_.get(), pDataIn + new_frames, remainings * sizeof(float));
-						std::swap(buffer0_, buffer1_);
-					}
-					else {
-						// あまりを追記する
-						std::memcpy(buffer0_.get() + remainings, pDataIn, uNumFrameToRead * sizeof(float));
-						remainings = frames % BLOCK_SIZE;
-					}
-				}
+				// ブロックに切り分ける (あまりは保存しておく)
+				trace_.Begin(rtvc::trace_thread::capture, rtvc::trace_span::assemble);
+				std::uint32_t const block_count = assembler_.Push(silent ? nullptr : packet.data, packet.frames);
+				std::uint32_t const block_frames = static_cast<uint32_t>(block_count * BLOCK_SIZE);
+				trace_.End(rtvc::trace_thread::capture, rtvc::trace_span::assemble, block_count);
+				_block_trace.SetArg(block_count);
 
-				if FAILED(hr = pCaptureClient_->ReleaseBuffer(uNumFrameToRead))
+				if FAILED(hr = capture_->Release(packet))
 				{
+					rtvc::deferred_logger().Push(rtvc::log_event::release_buffer_failed, static_cast<std::uint32_t>(hr));
 					return hr;
 				}
 
 				// ブロック単位で処理
 				if (block_count > 0) {
-					int const id1 = primary_voice_.load(std::memory_order::acquire);
-					int const id2 = secondary_voice_.load(std::memory_order::acquire);
-					if (id2 < 0) {
-						rtvc_set_voice(id1);
+					// 裏で用意できたモデルに差し替える (古いモデルとしばらく並べて通してクロスフェードする)
+					// (止まったエンジンが裏で返るまでは差し替えない。破棄されてしまう)
+					rtvc::model_instance const* previous = nullptr;
+					if (crossfade_.Active() || watchdog_.Stalled()) {
 					}
-					else
-					{
-						int const ids[] = { id1, id2 };
-						float const amount = amount_.load(std::memory_order::acquire);
-						float const amounts[] = { 1.0f - amount, amount };
-						rtvc_set_voices(2, ids, amounts);
+					else if (rtvc::model_instance const* const next = models_.TakeReady(previous)) {
+						engine = &next->api;
+						crossfade_.Begin(previous, next);
+					}
+
+					// 見張りはブロックの長さと猶予が過ぎたらドライに切り替える
+					std::uint64_t const engine_timeout = engine_timeout_ns_.load(std::memory_order::acquire);
+					bool const supervised = !converted && watchdog_.Running() && (engine_timeout != 0 || watchdog_.Stalled());
+					std::uint64_t const deadline = wake_time + audio_frames_to_ns(SAMPLE_RATE, block_frames) + engine_timeout;
+					bool missed = false;
+
+					std::uint64_t const engine_start = os_gettime_ns();
+					// 声を切り替えたら数ブロックかけて配分を移す
+					trace_.Begin(rtvc::trace_thread::capture, rtvc::trace_span::set_voice);
+					rtvc::voice_mix const& voices = voice_presets_.Advance(block_count, audio_frames_to_ns(SAMPLE_RATE, BLOCK_SIZE));
+					for (rtvc::engine_api const* const target : { engine, crossfade_.Active() ? &crossfade_.From() : nullptr }) {
+						if (converted || !target || (target == engine && watchdog_.Stalled())) {
+						}
+						else if (voices.num_voices == 1) {
+							if (int const retval = target->set_voice(voices.ids[0])) {
+								rtvc::deferred_logger().Push(rtvc::log_event::set_voice_failed, retval, voices.ids[0]);
+							}
+						}
+						else if (voices.num_voices > 1)
+						{
+							if (int const retval = target->set_voices(voices.num_voices, voices.ids, voices.amounts)) {
+								rtvc::deferred_logger().Push(rtvc::log_event::set_voice_failed, retval, voices.ids[0]);
+							}
+						}
 					}
+					trace_.End(rtvc::trace_thread::capture, rtvc::trace_span::set_voice, static_cast<std::uint32_t>(voices.num_voices));
 					{
 						float const params[] = {
-							input_gain_.load(std::memory_order::acquire),
-							output_gain_.load(std::memory_order::acquire),
-							pitch_shift_.load(std::memory_order::acquire),
-							pitch_shift_mode_.load(std::memory_order::acquire),
-							pitch_snap_.load(std::memory_order::acquire),
+							voices.params[0],
+							voices.params[1],
+							voices.params[2],
+							voices.params[3],
+							voices.params[4],
 						};
 						constexpr int const num_params = static_cast<int>(std::size(params));
-						float* out = buffer1_.get();
-						for (std::uint32_t i = 0; i < block_count; ++i, out += BLOCK_SIZE, ++total_frames) {
-							rtvc_process(num_params, params, out, out);
+
+						// 記録開始時と変更時にパラメーターを残す (切り替えの途中は移っていく先の値)
+						if (recording) {
+							rtvc::voice_params const& target = voice_presets_.Target();
+							rtvc::session::params_record const snapshot{ target.primary_voice, target.secondary_voice, target.amount, { target.params[0], target.params[1], target.params[2], target.params[3], target.params[4] } };
+							std::uint32_t const generation = recorder_.Generation();
+							if (generation != recorded_generation || !(snapshot == recorded_params)) {
+								if (generation != recorded_generation) {
+									rtvc::session::config_record const config{ device_index_.load(std::memory_order::relaxed), latency_mode_.load(std::memory_order::acquire), buffer_frames_, 0 };
+									recorder_.Append(rtvc::session::record_type::config, wake_time, &config, sizeof(config));
+								}
+								recorder_.Append(rtvc::session::record_type::params, wake_time, &snapshot, sizeof(snapshot));
+								recorded_generation = generation;
+								recorded_params = snapshot;
+							}
+						}
+
+						// エンジンに通す前の声を遅らせて取っておく (ホストの音声はすでに変換済み)
+						if (!converted) {
+							dry_delay_.Process(assembler_.Blocks(), dry_blocks_.get(), block_frames);
+						}
+
+						float* out = assembler_.Blocks();
+						bool probed = false;
+						for (std::uint32_t i = 0; i < block_count;) {
+							bool const probing = latency_probe_.IsRunning();
+							if (probing) {
+								latency_probe_.Inject(out, BLOCK_SIZE);
+							}
+							bool const fading = !converted && crossfade_.Active();
+							if (fading) {
+								crossfade_.ProcessFrom(num_params, params, out);
+							}
+							// 測定とクロスフェードの間は 1 ブロックずつ、それ以外は残りをまとめて渡す (process_n があれば呼び出しが減る)
+							std::uint32_t const n = probing || fading ? 1 : block_count - i;
+							int retval = 0;
+							bool wet = true;
+							trace_.Begin(rtvc::trace_thread::capture, rtvc::trace_span::process);
+							if (!converted && supervised) {
+								wet = watchdog_.Run(*engine, num_params, params, BLOCK_SIZE, static_cast<int>(n), out, deadline, retval);
+								missed |= !wet;
+							}
+							else if (!converted) {
+								retval = rtvc::process_blocks(*engine, num_params, params, BLOCK_SIZE, static_cast<int>(n), out, out);
+							}
+							trace_.End(rtvc::trace_thread::capture, rtvc::trace_span::process, n);
+							if (!wet) {
+								trace_.Instant(rtvc::trace_thread::capture, rtvc::trace_span::deadline_miss, n);
+								if (trace_on_overrun_.load(std::memory_order::relaxed)) {
+									trace_.Request(rtvc::PipelineTrace::REQUEST_AUTOMATIC);
+								}
+							}
+							if (retval) {
+								rtvc::deferred_logger().Push(rtvc::log_event::process_failed, retval, static_cast<long long>(total_frames));
+							}
+							// 失敗したか間に合わなかったブロックは直前の出力を繰り返して埋める (見張りはその上でドライに移る)
+							if (!converted && wet && retval == 0) {
+								concealer_.Good(out, n * BLOCK_SIZE);
+							}
+							else if (!converted) {
+								rtvc::TraceScope _trace(&trace_, rtvc::trace_thread::capture, rtvc::trace_span::conceal, n);
+								concealer_.Conceal(out, n * BLOCK_SIZE);
+							}
+							if (supervised) {
+								dry_fallback_.Process(wet, out, dry_blocks_.get() + (out - assembler_.Blocks()), n * BLOCK_SIZE);
+							}
+							if (fading && crossfade_.Mix(out)) {
+								models_.FinishFade();
+							}
+							if (probing) {
+								latency_probe_.Record(out, BLOCK_SIZE);
+								probed = true;
+							}
+							i += n;
+							out += n * BLOCK_SIZE;
+							total_frames += n;
+						}
+
+						// 測定用のチャープは配信に流さない
+						if (probed) {
+							std::memset(assembler_.Blocks(), 0, block_frames * sizeof(float));
 						}
 					}
+					std::uint64_t const engine_end = os_gettime_ns();
 					{
+						rtvc::TraceScope _trace(&trace_, rtvc::trace_thread::capture, rtvc::trace_span::output, block_frames);
 						obs_source_audio data;
 						std::memset(&data, 0, sizeof(data));
-						data.data[0] = reinterpret_cast<std::uint8_t*>(buffer1_.get());
+						data.data[0] = reinterpret_cast<std::uint8_t*>(assembler_.Blocks());
 						data.frames = block_frames;
 						data.speakers = SPEAKERS_MONO;
 						data.format = AUDIO_FORMAT_FLOAT;
 						data.samples_per_sec = SAMPLE_RATE;
 						data.timestamp = os_gettime_ns(); // timestamp;
+						RTVC_RT_BLOCKING("obs_source_output_audio");
 						obs_source_output_audio(context_, &data);
+
+						// 再開してから最初のブロックを出すまで
+						if (resume_ns_.load(std::memory_order::relaxed) != 0) {
+							if (std::uint64_t const resumed = resume_ns_.exchange(0, std::memory_order::acq_rel)) {
+								resume_latency_ns_.store(engine_end - resumed, std::memory_order::release);
+							}
+						}
+
+						// 同じタイムスタンプでドライを出すと、OBS の中でサンプル単位で揃う
+						if (!converted) {
+							dry_in_use_.store(true);
+							if (obs_source_t* const dry = dry_source_.load()) {
+								data.data[0] = reinterpret_cast<std::uint8_t*>(dry_blocks_.get());
+								RTVC_RT_BLOCKING("obs_source_output_audio (dry)");
+								obs_source_output_audio(dry, &data);
+							}
+							dry_in_use_.store(false, std::memory_order::release);
+						}
+
+						if (monitor_) {
+							monitor_->Write(assembler_.Blocks(), block_frames);
+							monitor_buffer_ns_.store(monitor_->BufferLatencyNs(), std::memory_order::relaxed);
+							monitor_device_ns_.store(monitor_->DeviceLatencyNs(), std::memory_order::relaxed);
+							monitor_target_ns_.store(audio_frames_to_ns(SAMPLE_RATE, monitor_->Buffer().TargetFrames()), std::memory_order::relaxed);
+							monitor_skipped_frames_.store(monitor_->Buffer().SkippedFrames(), std::memory_order::relaxed);
+							monitor_underruns_.store(monitor_->Buffer().Underruns(), std::memory_order::release);
+							monitor_render_result_.store(monitor_->RenderResult(), std::memory_order::release);
+						}
+
+						// 取り込みから出力までの遅延 = デバイスとブロック組み立て + エンジン
+						if (capture_time_valid && data.timestamp > capture_time) {
+							std::int64_t const delay = static_cast<std::int64_t>(data.timestamp - capture_time) + static_cast<std::int64_t>(audio_frames_to_ns(SAMPLE_RATE, sample_latency_));
+							std::int64_t const smoothed = pipeline_delay_ns_.load(std::memory_order::relaxed);
+							pipeline_delay_ns_.store(smoothed == 0 ? delay : smoothed + (delay - smoothed) / 16, std::memory_order::release);
+						}
+					}
+
+					// 処理がブロックの長さに間に合っていない
+					std::uint64_t const elapsed = os_gettime_ns() - wake_time;
+					if (recording) {
+						rtvc::session::timing_record const timing{ block_count, 0, engine_end - engine_start, elapsed };
+						recorder_.Append(rtvc::session::record_type::timing, wake_time, &timing, sizeof(timing));
+					}
+					std::uint64_t const budget = audio_frames_to_ns(SAMPLE_RATE, block_frames);
+					telemetry_.RecordBlocks(block_count, budget, engine_end - engine_start, elapsed);
+					if (elapsed > budget) {
+						rtvc::deferred_logger().Push(rtvc::log_event::processing_overrun, static_cast<long long>(elapsed / 1'000), static_cast<long long>(budget / 1'000));
+						trace_.Instant(rtvc::trace_thread::capture, rtvc::trace_span::overrun, static_cast<std::uint32_t>(elapsed / 1'000));
+						if (trace_on_overrun_.load(std::memory_order::relaxed)) {
+							trace_.Request(rtvc::PipelineTrace::REQUEST_AUTOMATIC);
+						}
+					}
+					if (auto_fallback && load_blocks != ~std::uint64_t{ 0 }) {
+						// 始めの数秒 (モデルの準備) は数えない
+						// 見張りがドライに切り替えた起床は間に合わなかったものとして数える
+						float const ratio = missed ? 2.0f : static_cast<float>(elapsed) / static_cast<float>(budget);
+						load += (ratio - load) / 64.0f;
+						if (++load_blocks > FALLBACK_WARMUP_BLOCKS && load > 1.0f) {
+							engine_overrun_.store(true, std::memory_order::release);
+							::SetEvent(hEvtActivityChanged_);
+							load_blocks = ~std::uint64_t{ 0 };
+						}
 					}
 				}
 			}
 
-			return hr;
+			return S_OK;
+		}
+
+		// 低優先度で定期的な処理を行う
+		HRESULT Monitor() {
+			std::int64_t reported_delay = 0;
+			std::int64_t reported_monitor_latency = 0;
+			std::uint64_t reported_underruns = 0;
+			HRESULT reported_render_result = S_OK;
+			std::uint64_t reported_faults = 0;
+			std::uint64_t reported_recoveries = 0;
+			std::uint64_t reported_swaps = 0;
+			std::uint64_t reported_swap_failures = 0;
+			std::uint64_t reported_concealed = 0;
+			std::uint64_t reported_misses = 0;
+			std::uint64_t reported_stall_recoveries = 0;
+			std::uint64_t last_trace_ns = 0;
+			std::uint64_t last_telemetry_ns = 0;
+			std::int64_t applied_offset = 0;
+			std::int64_t saved_offset = 0;
+			bool applied = false;
+
+			while (::WaitForSingleObject(hEvtMonitorShutdown_, 500) == WAIT_TIMEOUT) {
+				std::int64_t const delay = pipeline_delay_ns_.load(std::memory_order::acquire);
+				if (delay > 0 && std::abs(delay - reported_delay) >= 1'000'000) {
+					OBS_INFO("pipeline delay: %.1f [ms] (engine %.1f [ms])", delay / 1'000'000.0, 1'000.0 * sample_latency_ / sample_rate_);
+					reported_delay = delay;
+				}
+
+				// 直接モニターは取り込みから聞こえるまでを出す
+				{
+					std::uint64_t const underruns = monitor_underruns_.load(std::memory_order::acquire);
+					std::int64_t const buffer_latency = static_cast<std::int64_t>(monitor_buffer_ns_.load(std::memory_order::relaxed));
+					std::int64_t const device_latency = static_cast<std::int64_t>(monitor_device_ns_.load(std::memory_order::relaxed));
+					std::int64_t const monitor_latency = buffer_latency + device_latency;
+					if (delay > 0 && device_latency > 0 && (std::abs(monitor_latency - reported_monitor_latency) >= 1'000'000 || underruns != reported_underruns)) {
+						OBS_INFO("monitoring latency: %.1f [ms] (buffer %.1f [ms], device %.1f [ms]), capture to ear %.1f [ms], %llu underrun(s)",
+							monitor_latency / 1'000'000.0, buffer_latency / 1'000'000.0, device_latency / 1'000'000.0,
+							(delay + monitor_latency) / 1'000'000.0, static_cast<unsigned long long>(underruns));
+						reported_monitor_latency = monitor_latency;
+						reported_underruns = underruns;
+					}
+					// 再生スレッドが止まった (デバイスが抜かれたときなど)
+					if (HRESULT const render_hr = monitor_render_result_.load(std::memory_order::acquire); render_hr != reported_render_result) {
+						if FAILED(render_hr) {
+							std::string const& msg = std::system_category().message(render_hr);
+							OBS_ERROR("direct monitoring stopped playing: %s (%x)", msg.c_str(), static_cast<std::uint32_t>(render_hr));
+						}
+						reported_render_result = render_hr;
+					}
+				}
+
+				if (std::uint64_t const resume_latency = resume_latency_ns_.exchange(0, std::memory_order::acq_rel)) {
+					OBS_INFO("rtvc resumed: first block %.1f [ms] after activation", resume_latency / 1'000'000.0);
+				}
+
+				// 取り込みの復帰
+				{
+					std::uint64_t const faults = recovery_stats_.faults.load(std::memory_order::acquire);
+					std::uint64_t const recoveries = recovery_stats_.recoveries.load(std::memory_order::acquire);
+					if (faults != reported_faults) {
+						std::int32_t const error = recovery_stats_.last_error.load(std::memory_order::relaxed);
+						std::string const& msg = std::system_category().message(error);
+						OBS_WARN("capture lost, reopening: %s (%x)", msg.c_str(), static_cast<std::uint32_t>(error));
+						reported_faults = faults;
+					}
+					if (recoveries != reported_recoveries) {
+						OBS_INFO("capture recovered in %.1f [ms] (%llu attempt(s), %llu frame(s) bridged)",
+							recovery_stats_.last_recover_ns.load(std::memory_order::relaxed) / 1'000'000.0,
+							static_cast<unsigned long long>(recovery_stats_.open_attempts.load(std::memory_order::relaxed)),
+							static_cast<unsigned long long>(recovery_stats_.bridged_frames.load(std::memory_order::relaxed)));
+						reported_recoveries = recoveries;
+					}
+				}
+
+				// モデルの切り替え
+				{
+					rtvc::model_switch_stats const& stats = models_.Stats();
+					std::uint64_t const swaps = stats.swaps.load(std::memory_order::acquire);
+					std::uint64_t const failures = stats.failures.load(std::memory_order::acquire);
+					if (swaps != reported_swaps) {
+						std::string const name = models_.WithServing([](rtvc::model_instance const* serving) {
+							return serving ? serving->name : std::string();
+						});
+						OBS_INFO("model switched to %s: initialized in %.0f [ms] in the background, swapped %.1f [ms] after ready in %.1f [us] (max %.1f [us]), crossfaded in %.1f [ms]",
+							name.c_str(), stats.last_init_ns.load(std::memory_order::relaxed) / 1'000'000.0, stats.last_wait_ns.load(std::memory_order::relaxed) / 1'000'000.0,
+							stats.last_swap_ns.load(std::memory_order::relaxed) / 1'000.0, stats.max_swap_ns.load(std::memory_order::relaxed) / 1'000.0,
+							stats.last_fade_ns.load(std::memory_order::relaxed) / 1'000'000.0);
+						reported_swaps = swaps;
+					}
+					if (failures != reported_swap_failures) {
+						OBS_WARN("could not switch the model: %s", models_.LastError().c_str());
+						reported_swap_failures = failures;
+					}
+				}
+
+				// 埋めたブロック
+				{
+					std::uint64_t const concealed = concealer_.ConcealedFrames();
+					if (concealed < reported_concealed) {
+						// Start() で数え直した
+						reported_concealed = 0;
+					}
+					if (concealed != reported_concealed) {
+						OBS_WARN("concealed %.1f [ms] of failed or late engine output (total %.1f [ms])",
+							audio_frames_to_ns(sample_rate_, concealed - reported_concealed) / 1'000'000.0, audio_frames_to_ns(sample_rate_, concealed) / 1'000'000.0);
+						reported_concealed = concealed;
+					}
+				}
+
+				// エンジンの見張り
+				{
+					rtvc::watchdog_stats& stats = watchdog_.Stats();
+					std::uint64_t const misses = stats.misses.load(std::memory_order::acquire);
+					std::uint64_t const recoveries = stats.recoveries.load(std::memory_order::acquire);
+					if (misses != reported_misses) {
+						OBS_WARN("engine missed its deadline, output is dry until it returns (%llu miss(es), %llu dry block(s))",
+							static_cast<unsigned long long>(misses), static_cast<unsigned long long>(stats.dry_blocks.load(std::memory_order::relaxed)));
+						reported_misses = misses;
+					}
+					if (recoveries != reported_stall_recoveries) {
+						OBS_INFO("engine returned after %.1f [ms] (max %.1f [ms]), back to the converted voice",
+							stats.last_stall_ns.load(std::memory_order::relaxed) / 1'000'000.0, stats.max_stall_ns.load(std::memory_order::relaxed) / 1'000'000.0);
+						reported_stall_recoveries = recoveries;
+					}
+				}
+
+				// ブロックごとの時系列 (間に合わなかったときの自動の書き出しは、1 回の長さに 1 回まで)
+				if (std::uint32_t const reasons = trace_.TakeRequest()) {
+					std::uint64_t const now = os_gettime_ns();
+					double seconds = 0.0;
+					{
+						std::lock_guard<std::mutex> lock(trace_mutex_);
+						seconds = trace_seconds_;
+					}
+					if ((reasons & rtvc::PipelineTrace::REQUEST_MANUAL) || last_trace_ns == 0 || now - last_trace_ns >= static_cast<std::uint64_t>(seconds * 1e9)) {
+						WriteTrace((reasons & rtvc::PipelineTrace::REQUEST_MANUAL) == 0);
+						last_trace_ns = now;
+					}
+				}
+
+				// 運用監視のための統計 (500 [ms] ごとに起きるので、およそ 1 秒ごと)
+				if (std::uint64_t const now = os_gettime_ns(); now - last_telemetry_ns >= 900'000'000) {
+					PublishTelemetry(now, false);
+					last_telemetry_ns = now;
+				}
+
+				rtvc::latency_probe_result result;
+				if (latency_probe_.Analyze(result)) {
+					double const engine_ms = 1'000.0 * result.latency_frames / sample_rate_;
+					double const nominal_ms = 1'000.0 * sample_latency_ / sample_rate_;
+					if (delay > 0) {
+						// 取り込みからエンジン入力までは Process() の実測値を使う
+						double const capture_ms = delay / 1'000'000.0 - nominal_ms;
+						OBS_INFO("measured latency: engine %.2f [ms] (nominal %.2f [ms]), capture to output %.2f [ms], confidence %.1f", engine_ms, nominal_ms, capture_ms + engine_ms, result.confidence);
+					}
+					else {
+						OBS_INFO("measured latency: engine %.2f [ms] (nominal %.2f [ms]), confidence %.1f", engine_ms, nominal_ms, result.confidence);
+					}
+					if (result.confidence < 10.0) {
+						OBS_WARN("latency probe: weak correlation peak, the measurement may be wrong");
+					}
+				}
+
+				// 遅れて届く分だけ音声を前に戻す
+				if (auto_sync_.load(std::memory_order::acquire)) {
+					if (!applied) {
+						saved_offset = obs_source_get_sync_offset(context_);
+						applied_offset = saved_offset;
+						applied = true;
+					}
+					if (delay > 0) {
+						std::int64_t const offset = sync_adjust_ns_.load(std::memory_order::acquire) - delay;
+						if (std::abs(offset - applied_offset) >= 2'000'000) {
+							obs_source_set_sync_offset(context_, offset);
+							applied_offset = offset;
+						}
+						// ドライもウェットと同じタイムスタンプで出すので同じだけ戻す
+						SyncDry(applied_offset);
+					}
+				}
+				else if (applied) {
+					obs_source_set_sync_offset(context_, saved_offset);
+					applied = false;
+					RestoreDry();
+				}
+			}
+			RestoreDry();
+
+			// 破棄するので止まったことを残す
+			PublishTelemetry(os_gettime_ns(), true);
+			telemetry_file_.Close();
+			return S_OK;
+		}
+
+		// ドライ出力のソースをつなぐ (1 つだけ。後からつないだ方に替わる)
+		void AttachDry(obs_source_t* source) {
+			obs_source_t* const previous = dry_source_.exchange(source);
+			if (previous != source) {
+				WaitDryUnused();
+				OBS_INFO("dry output attached: %s", obs_source_get_name(source));
+			}
+			SetDryActive(source, obs_source_active(source));
+		}
+
+		// ドライ出力のソースを外す (戻ったら推論スレッドはもう触らない)
+		void DetachDry(obs_source_t* source) {
+			{
+				// Auto Sync Offset で付けた同期のずれを外す前に戻す
+				std::lock_guard<std::mutex> lock(dry_sync_mutex_);
+				if (dry_synced_ && obs_weak_source_references_source(dry_synced_, source)) {
+					RestoreDryLocked();
+				}
+			}
+			obs_source_t* expected = source;
+			if (dry_source_.compare_exchange_strong(expected, nullptr)) {
+				WaitDryUnused();
+				OBS_INFO("dry output detached: %s", obs_source_get_name(source));
+				dry_active_.store(false);
+				::SetEvent(hEvtActivityChanged_);
+			}
+		}
+
+		// つないだドライ出力にウェットと同じ同期のずれを付ける (Activity のスレッドから)
+		void SyncDry(std::int64_t offset) {
+			std::lock_guard<std::mutex> lock(dry_sync_mutex_);
+			obs_source_t* const dry = dry_source_.load();
+			if (dry_synced_ && !obs_weak_source_references_source(dry_synced_, dry)) {
+				// つなぎ替えられた
+				RestoreDryLocked();
+			}
+			if (!dry) {
+				return;
+			}
+			if (!dry_synced_) {
+				dry_synced_ = obs_source_get_weak_source(dry);
+				dry_saved_offset_ = obs_source_get_sync_offset(dry);
+				dry_applied_offset_ = dry_saved_offset_;
+			}
+			if (offset != dry_applied_offset_) {
+				obs_source_set_sync_offset(dry, offset);
+				dry_applied_offset_ = offset;
+			}
+		}
+
+		// ドライ出力の同期のずれを付ける前に戻す
+		void RestoreDry() {
+			std::lock_guard<std::mutex> lock(dry_sync_mutex_);
+			RestoreDryLocked();
+		}
+
+		void RestoreDryLocked() {
+			if (!dry_synced_) {
+				return;
+			}
+			if (obs_source_t* const dry = obs_weak_source_get_source(dry_synced_)) {
+				obs_source_set_sync_offset(dry, dry_saved_offset_);
+				obs_source_release(dry);
+			}
+			obs_weak_source_release(dry_synced_);
+			dry_synced_ = nullptr;
+		}
+
+		// ドライ出力が配信に載っているか (ウェットが聞こえなくても止めない)
+		void SetDryActive(obs_source_t* source, bool active) {
+			if (dry_source_.load() == source) {
+				dry_active_.store(active);
+				activity_ns_.store(os_gettime_ns(), std::memory_order::release);
+				::SetEvent(hEvtActivityChanged_);
+			}
+		}
+
+		// 出力が聞こえるか (ミュートしても直接モニターは鳴らす)
+		bool IsAudible() const noexcept {
+			return dry_active_.load() || (active_.load() && (!muted_.load() || monitor_enabled_flag_.load(std::memory_order::acquire)));
+		}
+
+		// 聞こえるかどうかに合わせて止める、または再開する (pipeline_mutex_ を持って呼ぶ)
+		void ApplyActivity() {
+			if (!started_) {
+				return;
+			}
+			bool const audible = IsAudible();
+			if (!audible && !suspended_) {
+				if FAILED(Stop()) {
+					return;
+				}
+				suspended_ = true;
+				OBS_INFO("rtvc suspended (%s)", active_.load() ? "muted" : "inactive");
+			}
+			else if (audible && suspended_) {
+				// エンジンは読み込んだままなので、取り込みを開き直すだけでよい
+				suspended_ = false;
+				resume_ns_.store(activity_ns_.load(std::memory_order::acquire), std::memory_order::release);
+				if FAILED(Start()) {
+					resume_ns_.store(0, std::memory_order::relaxed);
+				}
+			}
+		}
+
+		// Activity Thread (OBS のビデオスレッドでデバイスを開かないように、ここで止めたり再開したりする)
+		HRESULT Activity() {
+			while (::WaitForSingleObject(hEvtActivityChanged_, INFINITE) == WAIT_OBJECT_0 && !activity_shutdown_.load()) {
+				std::lock_guard<std::mutex> lock(pipeline_mutex_);
+				ApplyActivity();
+				if (engine_overrun_.exchange(false, std::memory_order::acq_rel)) {
+					FallBackToEco();
+				}
+				if (model_restart_.exchange(false, std::memory_order::acq_rel)) {
+					RestartWithModel();
+				}
+				if (reload_requested_.exchange(false, std::memory_order::acq_rel)) {
+					ReloadEngine();
+				}
+			}
+			return S_OK;
+		}
+
+		// 推論スレッドが出力し終えるのを待つ (dry_source_ を替えてから呼ぶ)
+		void WaitDryUnused() const {
+			while (dry_in_use_.load()) {
+				std::this_thread::yield();
+			}
+		}
+
+		// リアルタイムスレッドでの違反を報告する (RTVC_RT_CHECK ビルドのみ)
+		static void ReportRealtimeViolations() {
+			rtvc::rt_check::dump([](rtvc::rt_check::violation kind, char const* what, std::uint32_t count, void* const* frames, std::uint32_t num_frames) {
+				OBS_WARN("real-time violation: %s in %s (x%u)", rtvc::rt_check::to_string(kind), what, count);
+				for (std::uint32_t i = 0; i < num_frames; ++i) {
+					HMODULE hModule = nullptr;
+					TCHAR szModulePath[MAX_PATH] = {};
+					if (::GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, reinterpret_cast<LPCTSTR>(frames[i]), &hModule)) {
+						::GetModuleFileName(hModule, szModulePath, static_cast<DWORD>(std::size(szModulePath)));
+					}
+					std::filesystem::path const module_path{ szModulePath };
+					OBS_WARN("  #%02u %ls+0x%llx", i, module_path.filename().c_str(),
+						static_cast<unsigned long long>(reinterpret_cast<std::uintptr_t>(frames[i]) - reinterpret_cast<std::uintptr_t>(hModule)));
+				}
+			});
 		}
 
 	public:
@@ -813,7 +1693,12 @@ namespace {
 		// パラメーターのデフォルト値を設定する
 		static void get_defaults(obs_data_t* settings)
 		{
-			obs_data_set_default_int(settings, "device", 0);
+			obs_data_set_default_string(settings, "device_endpoint", "");
+			obs_data_set_default_int(settings, "capture", CAPTURE_WASAPI);
+			obs_data_set_default_string(settings, "capture_file", "");
+			obs_data_set_default_int(settings, "engine", ENGINE_AUTO);
+			obs_data_set_default_double(settings, "engine_timeout", 40.0);
+			obs_data_set_default_string(settings, "model", rtvc::ModelRegistry::DEFAULT_MODEL);
 			obs_data_set_default_int(settings, "latency", static_cast<int>(1 + std::size(LATENCY_MODES) / 2));
 
 			obs_data_set_default_double(settings, "input_gain", 0.0);
@@ -825,6 +1710,18 @@ namespace {
 			obs_data_set_default_int(settings, "primary_voice", 100);
 			obs_data_set_default_int(settings, "secondary_voice", -1);
 			obs_data_set_default_double(settings, "amount", 0.0);
+			obs_data_set_default_double(settings, "preset_blend", 30.0);
+			obs_data_set_default_bool(settings, "monitor", false);
+			obs_data_set_default_string(settings, "monitor_endpoint", "");
+			obs_data_set_default_bool(settings, "record_session", false);
+			obs_data_set_default_string(settings, "record_path", "");
+			obs_data_set_default_int(settings, "trace_seconds", 10);
+			obs_data_set_default_bool(settings, "trace_on_overrun", false);
+			obs_data_set_default_string(settings, "trace_dir", "");
+			obs_data_set_default_string(settings, "stats_file", "");
+			obs_data_set_default_string(settings, "prometheus_file", "");
+			obs_data_set_default_bool(settings, "auto_sync", false);
+			obs_data_set_default_double(settings, "sync_adjust", 0.0);
 		}
 
 		// パラメーターを定義する
@@ -901,37 +1798,608 @@ namespace {
 			return hr;
 		}
 
+		// エンジンに渡す値を計算する (preset にある値はそちらを使う)
+		static rtvc::voice_params MakeVoiceParams(obs_data_t* settings, obs_data_t* preset) {
+			auto const from = [settings, preset](char const* name) {
+				return preset && obs_data_has_user_value(preset, name) ? preset : settings;
+			};
+			rtvc::voice_params p;
+
+			// gain = 10 ** (db / 20)
+			p.params[0] = static_cast<float>(std::pow(10.0, obs_data_get_double(settings, "input_gain") * 0.05));
+			p.params[1] = static_cast<float>(std::pow(10.0, obs_data_get_double(from("output_gain"), "output_gain") * 0.05));
+
+			// cent = 1200 * log2(hz)
+			std::int64_t const pitch_shift_mode = obs_data_get_int(from("pitch_shift_mode"), "pitch_shift_mode");
+			double const base_pitch_shift = PITCH_SHIFT_PROTOTYPES[pitch_shift_mode][obs_data_get_int(from("your_voice"), "your_voice")];
+			p.params[2] = static_cast<float>((obs_data_get_double(from("pitch_shift"), "pitch_shift") + base_pitch_shift) * (std::log(2.0) / 1200.0));
+			p.params[3] = static_cast<float>(pitch_shift_mode);
+			p.params[4] = static_cast<float>(obs_data_get_double(from("pitch_snap"), "pitch_snap") * 0.01);
+			p.primary_voice = static_cast<int>(obs_data_get_int(from("primary_voice"), "primary_voice"));
+			p.secondary_voice = static_cast<int>(obs_data_get_int(from("secondary_voice"), "secondary_voice"));
+			p.amount = static_cast<float>(obs_data_get_double(from("amount"), "amount") * 0.01);
+			return p;
+		}
+
+		// 今のプロパティの値をプリセットに残す (Update() で計算し直す)
+		void StorePreset(int index) {
+			obs_data_t* const settings = obs_source_get_settings(context_);
+			obs_data_t* const preset = obs_data_create();
+			for (preset_key const& key : PRESET_KEYS) {
+				if (key.integer) {
+					obs_data_set_int(preset, key.name, obs_data_get_int(settings, key.name));
+				}
+				else {
+					obs_data_set_double(preset, key.name, obs_data_get_double(settings, key.name));
+				}
+			}
+			obs_data_t* const changes = obs_data_create();
+			obs_data_set_obj(changes, PRESET_SETTINGS[index], preset);
+			obs_source_update(context_, changes);
+			obs_data_release(changes);
+			obs_data_release(preset);
+			obs_data_release(settings);
+			OBS_INFO("voice preset %d stored", index);
+		}
+
+		// ホットキーで声のプリセットを切り替える (推論スレッドには番号を書くだけ)
+		void SelectPreset(obs_hotkey_id id) {
+			for (int i = 0; i < rtvc::VoicePresets::NUM_SLOTS; ++i) {
+				if (preset_hotkeys_[i] == id && voice_presets_.Select(i)) {
+					OBS_INFO("voice preset %d selected", i);
+				}
+			}
+		}
+
+		// エンジンを読み込み直す (デバイスやファイルを触るので Activity のスレッドで行う)
+		void RequestReload() {
+			reload_requested_.store(true, std::memory_order::release);
+			::SetEvent(hEvtActivityChanged_);
+		}
+
+		static bool reload_engine_clicked(obs_properties_t* props, obs_property_t* property, void* instance)
+		{
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			if (_this) {
+				_this->RequestReload();
+			}
+			return false;
+		}
+
+		static void reload_engine(void* instance, calldata_t* cd) {
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			if (_this) {
+				_this->RequestReload();
+			}
+		}
+
+		// 直近の時系列を書き出す (ファイルは Monitor のスレッドで書く)
+		void WriteTrace(bool automatic) {
+			std::string dir;
+			double seconds = 10.0;
+			{
+				std::lock_guard<std::mutex> lock(trace_mutex_);
+				dir = trace_dir_;
+				seconds = trace_seconds_;
+			}
+			std::error_code ec;
+			std::filesystem::path const folder = dir.empty() ? std::filesystem::temp_directory_path(ec) : std::filesystem::u8path(dir);
+
+			SYSTEMTIME now;
+			::GetLocalTime(&now);
+			char name[64];
+			std::snprintf(name, sizeof(name), "rtvc-trace-%04u%02u%02u-%02u%02u%02u.json", now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond);
+			std::filesystem::path const path = folder / name;
+			std::string const display = reinterpret_cast<char const*>(path.u8string().c_str());
+			if (trace_.Write(path, seconds)) {
+				OBS_INFO("pipeline trace written%s: %s (last %.0f [s])", automatic ? " after an overrun" : "", display.c_str(), seconds);
+			}
+			else {
+				OBS_ERROR("unable to write pipeline trace: %s", display.c_str());
+			}
+		}
+
+		// 統計を書き出す (Monitor のスレッドから。書き出し先が変わっていたら開き直す)
+		void PublishTelemetry(std::uint64_t now, bool closing) {
+			std::string stats_path;
+			std::string prometheus_path;
+			{
+				std::lock_guard<std::mutex> lock(telemetry_mutex_);
+				stats_path = stats_path_;
+				prometheus_path = prometheus_path_;
+			}
+			if (stats_path != telemetry_opened_) {
+				telemetry_file_.Close();
+				telemetry_opened_ = stats_path;
+				HRESULT hr = S_OK;
+				if (stats_path.empty()) {
+				}
+				else if FAILED(hr = telemetry_file_.Open(std::filesystem::u8path(stats_path))) {
+					std::string const& msg = std::system_category().message(hr);
+					OBS_ERROR("unable to open stats file: %s %s (%x)", stats_path.c_str(), msg.c_str(), hr);
+				}
+				else {
+					OBS_INFO("publishing stats: %s", stats_path.c_str());
+				}
+			}
+
+			// 窓は書き出していなくても進める
+			rtvc::telemetry_record record{};
+			telemetry_window_.Update(telemetry_, now, record);
+			if (!telemetry_file_.IsOpen() && prometheus_path.empty()) {
+				return;
+			}
+
+			std::memcpy(record.magic, rtvc::TELEMETRY_MAGIC, sizeof(record.magic));
+			record.version = rtvc::TELEMETRY_VERSION;
+			record.size = static_cast<std::uint32_t>(sizeof(record));
+			record.update_time_ns = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+			record.sample_rate = static_cast<std::uint32_t>(sample_rate_);
+			record.block_size = static_cast<std::uint32_t>(block_size_);
+			int const latency_mode = latency_mode_.load(std::memory_order::acquire);
+			record.latency_mode = latency_mode;
+			if (latency_mode >= 1 && latency_mode <= static_cast<int>(std::size(LATENCY_MODES))) {
+				std::snprintf(record.latency_mode_name, sizeof(record.latency_mode_name), "%s", LATENCY_MODES[latency_mode - 1]);
+			}
+			if (closing) {
+				record.running = 0;
+			}
+			record.output_fifo_fill_ms = monitor_buffer_ns_.load(std::memory_order::relaxed) / 1'000'000.0;
+			record.output_fifo_target_ms = monitor_target_ns_.load(std::memory_order::relaxed) / 1'000'000.0;
+			record.pipeline_delay_ms = pipeline_delay_ns_.load(std::memory_order::acquire) / 1'000'000.0;
+			rtvc::watchdog_stats& stats = watchdog_.Stats();
+			record.deadline_misses_total = stats.misses.load(std::memory_order::relaxed);
+			record.shed_blocks_total = stats.dry_blocks.load(std::memory_order::relaxed);
+			record.concealed_frames_total = concealer_.ConcealedFrames();
+			record.output_underruns_total = monitor_underruns_.load(std::memory_order::acquire);
+			record.output_skipped_frames_total = monitor_skipped_frames_.load(std::memory_order::relaxed);
+
+			telemetry_file_.Publish(record);
+
+			// 書けなかったことは変わったときだけ出す
+			if (!prometheus_path.empty()) {
+				bool const written = rtvc::write_prometheus(std::filesystem::u8path(prometheus_path), record, obs_source_get_name(context_));
+				if (!written && !prometheus_failed_) {
+					OBS_ERROR("unable to write prometheus textfile: %s", prometheus_path.c_str());
+				}
+				prometheus_failed_ = !written;
+			}
+		}
+
+		static bool dump_trace_clicked(obs_properties_t* props, obs_property_t* property, void* instance)
+		{
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			if (_this) {
+				_this->trace_.Request(rtvc::PipelineTrace::REQUEST_MANUAL);
+			}
+			return false;
+		}
+
+		static void dump_trace(void* instance, calldata_t* cd) {
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			if (_this) {
+				_this->trace_.Request(rtvc::PipelineTrace::REQUEST_MANUAL);
+			}
+		}
+
+		static void trace_hotkey(void* instance, obs_hotkey_id id, obs_hotkey_t* hotkey, bool pressed)
+		{
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			if (_this && pressed) {
+				_this->trace_.Request(rtvc::PipelineTrace::REQUEST_MANUAL);
+			}
+		}
+
+		// 遅延測定を始める
+		static bool measure_latency_clicked(obs_properties_t* props, obs_property_t* property, void* instance)
+		{
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			if (_this) {
+				// 最大 2 秒の遅延まで記録する
+				if (_this->latency_probe_.Arm(_this->sample_rate_, 2 * _this->sample_rate_)) {
+					OBS_INFO("latency probe started");
+				}
+				else {
+					OBS_WARN("latency probe is already running");
+				}
+			}
+			return false;
+		}
+
+		// 今の声をプリセットに残す
+		template <int Index>
+		static bool store_preset_clicked(obs_properties_t* props, obs_property_t* property, void* instance)
+		{
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			if (_this) {
+				_this->StorePreset(Index);
+			}
+			return false;
+		}
+
+		// 声のプリセットを切り替える
+		static void preset_hotkey(void* instance, obs_hotkey_id id, obs_hotkey_t* hotkey, bool pressed)
+		{
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			if (_this && pressed) {
+				_this->SelectPreset(id);
+			}
+		}
+
+		// ドライ出力のソースから呼ばれる
+		static void attach_dry(void* instance, calldata_t* cd) {
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			if (obs_source_t* const source = reinterpret_cast<obs_source_t*>(calldata_ptr(cd, "source"))) {
+				_this->AttachDry(source);
+			}
+		}
+
+		static void detach_dry(void* instance, calldata_t* cd) {
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			if (obs_source_t* const source = reinterpret_cast<obs_source_t*>(calldata_ptr(cd, "source"))) {
+				_this->DetachDry(source);
+			}
+		}
+
+		static void set_dry_active(void* instance, calldata_t* cd) {
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			if (obs_source_t* const source = reinterpret_cast<obs_source_t*>(calldata_ptr(cd, "source"))) {
+				_this->SetDryActive(source, calldata_bool(cd, "active"));
+			}
+		}
+
+		// シーンに載った (ビデオスレッドから。ここでは知らせるだけ)
+		static void activate(void* instance) {
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			_this->active_.store(true);
+			_this->activity_ns_.store(os_gettime_ns(), std::memory_order::release);
+			::SetEvent(_this->hEvtActivityChanged_);
+		}
+
+		static void deactivate(void* instance) {
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			_this->active_.store(false);
+			_this->activity_ns_.store(os_gettime_ns(), std::memory_order::release);
+			::SetEvent(_this->hEvtActivityChanged_);
+		}
+
+		static void mute_changed(void* instance, calldata_t* cd) {
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			_this->muted_.store(calldata_bool(cd, "muted"));
+			_this->activity_ns_.store(os_gettime_ns(), std::memory_order::release);
+			::SetEvent(_this->hEvtActivityChanged_);
+		}
+
+		// Activity Thread
+		static DWORD WINAPI activity(void* instance) {
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			if (_this) {
+				return _this->Activity();
+			}
+			return S_OK;
+		}
+
+		// Monitor Thread
+		static DWORD WINAPI monitor(void* instance) {
+			::SetThreadPriority(::GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+
+			OBSAudioSource* _this = reinterpret_cast<OBSAudioSource*>(instance);
+			if (_this) {
+				return _this->Monitor();
+			}
+			return S_OK;
+		}
+
 	private:
+		static constexpr std::uint64_t const FALLBACK_WARMUP_BLOCKS = 500;
+
+		/// 使っているエンジン (止めている間に入れ替えるほか、同じ形式のモデルは推論スレッドがブロックの境目で差し替える)
+		rtvc::ModelSwitcher models_{ rtvc::model_registry(), [this] {
+			model_restart_.store(true, std::memory_order::release);
+			::SetEvent(hEvtActivityChanged_);
+		} };
+		std::string model_ = rtvc::ModelRegistry::DEFAULT_MODEL;
+		std::atomic<bool> model_restart_ = false; ///< 裏のスレッドが Activity のスレッドに止めての差し替えを頼む
+		std::atomic<bool> reload_requested_ = false; ///< 「Reload Engine」が押された
+		rtvc::EngineCrossfade crossfade_; ///< 推論スレッドだけが使う
+		bool engine_ready_ = false;
+		bool engine_eco_ = false;
+		int engine_choice_ = ENGINE_AUTO;
+		bool overrun_fallback_ = false; ///< Auto で推論が間に合わなかったので eco にしている
+		std::atomic<bool> auto_fallback_armed_ = false; ///< 推論スレッドが負荷を見る
+		std::atomic<bool> engine_overrun_ = false; ///< 推論スレッドが Activity のスレッドに切り替えを頼む
+
 		int sample_rate_ = 24'000;
 		int block_size_ = 256;
+		int sample_latency_ = 0;
 
 		obs_source_t* context_;
 
-		Microsoft::WRL::ComPtr<IMMDeviceCollection> pDeviceCollection_;
-		Microsoft::WRL::ComPtr<IMMDevice> pDevice_;
-
-		int device_count_ = 0;
-		std::atomic<int> device_id_ = -1;
+		std::mutex pipeline_mutex_; ///< Start() と Stop() を UI と一覧と Activity のスレッドから呼ぶ
+		bool started_ = false;
+		bool suspended_ = false; ///< 聞こえていないので止めている
+		std::uint64_t device_listener_ = 0;
+		std::string device_endpoint_; ///< 設定した入力デバイス (空なら既定)
+		std::mutex endpoint_mutex_; ///< active_endpoint_ は取り込みを作り直すスレッドからも書く
+		std::string active_endpoint_; ///< 実際に開いている入力デバイス
+		std::atomic<int> device_index_ = -1; ///< 開いている入力デバイスの一覧での位置 (記録用)
 		std::atomic<int> latency_mode_ = static_cast<int>(1 + std::size(LATENCY_MODES) / 2);
 
-		std::atomic<int> primary_voice_ = 0;
-		std::atomic<float> amount_ = 0.0f;
-		std::atomic<int> secondary_voice_ = 0;
+		rtvc::VoicePresets voice_presets_; ///< プロパティの値とプリセット (計算済み)
+		obs_hotkey_id preset_hotkeys_[rtvc::VoicePresets::NUM_SLOTS] = { OBS_INVALID_HOTKEY_ID, OBS_INVALID_HOTKEY_ID, OBS_INVALID_HOTKEY_ID, OBS_INVALID_HOTKEY_ID, OBS_INVALID_HOTKEY_ID };
+
+		std::atomic<bool> auto_sync_ = false;
+		std::atomic<std::int64_t> sync_adjust_ns_ = 0;
+		std::atomic<std::int64_t> pipeline_delay_ns_ = 0; ///< 取り込みから出力までの平滑化した遅延
+
+		rtvc::LatencyProbe latency_probe_;
+
+		HANDLE hEvtMonitorShutdown_ = nullptr;
+		HANDLE hMonitorThread_ = nullptr;
+
+		HANDLE hEvtActivityChanged_ = nullptr;
+		HANDLE hActivityThread_ = nullptr;
+		std::atomic<bool> activity_shutdown_ = false;
+		std::atomic<bool> active_ = false; ///< シーンに載っている
+		std::atomic<bool> muted_ = false;
+		std::atomic<bool> dry_active_ = false; ///< つないだドライ出力がシーンに載っている
+		std::atomic<bool> monitor_enabled_flag_ = false; ///< monitor_enabled_ の写し (ロックなしで読む)
+		std::atomic<std::uint64_t> activity_ns_ = 0; ///< 聞こえるかどうかが最後に変わった時刻
+		std::atomic<std::uint64_t> resume_ns_ = 0; ///< 再開のきっかけの時刻 (最初のブロックを出したら 0)
+		std::atomic<std::uint64_t> resume_latency_ns_ = 0; ///< 再開から最初のブロックまで (Monitor() が出す)
+
+		int capture_type_ = CAPTURE_WASAPI;
+		std::string capture_file_;
+		std::unique_ptr<rtvc::CaptureBackend> capture_;
+		rtvc::SupervisedCapture* supervisor_ = nullptr; ///< capture_ が入力デバイスのとき (所有しない)
+		rtvc::capture_recovery_stats recovery_stats_;
+		HANDLE hAudioThread_ = nullptr;
 
-		std::atomic<float> input_gain_ = 1.0f;
-		std::atomic<float> output_gain_ = 1.0f;
-		std::atomic<float> pitch_shift_ = 0.0f;
-		std::atomic<float> pitch_shift_mode_ = 1.0f;
-		std::atomic<float> pitch_snap_ = 0.0f;
+		rtvc::BlockAssembler assembler_;
+		std::uint32_t buffer_frames_ = 0;
+
+		bool monitor_enabled_ = false;
+		std::string monitor_endpoint_; ///< 設定した再生デバイス (空なら既定)
+		std::string monitor_active_endpoint_; ///< 実際に開いている再生デバイス
+		std::unique_ptr<rtvc::MonitorOutput> monitor_; ///< 直接モニター出力 (Start() から Stop() まで)
+		std::atomic<std::uint64_t> monitor_buffer_ns_ = 0; ///< JitterBuffer の遅延 (推論スレッドが写す)
+		std::atomic<std::uint64_t> monitor_device_ns_ = 0; ///< 再生デバイスの遅延 (推論スレッドが写す)
+		std::atomic<std::uint64_t> monitor_underruns_ = 0;
+		std::atomic<std::uint64_t> monitor_target_ns_ = 0; ///< JitterBuffer の目標 (推論スレッドが写す)
+		std::atomic<std::uint64_t> monitor_skipped_frames_ = 0;
+		std::atomic<HRESULT> monitor_render_result_ = S_OK; ///< 再生スレッドが失敗して止まった理由 (推論スレッドが写す)
+
+		rtvc::session::Recorder recorder_;
+		std::string record_path_;
+
+		rtvc::DelayLine dry_delay_;
+		std::unique_ptr<float[]> dry_blocks_; ///< 遅らせたドライ (推論スレッドのみ)
+		std::atomic<obs_source_t*> dry_source_ = nullptr; ///< つないだドライ出力のソース (参照は持たない)
+		std::atomic<bool> dry_in_use_ = false; ///< 推論スレッドが dry_source_ に出力している間 true
+		std::mutex dry_sync_mutex_;
+		obs_weak_source_t* dry_synced_ = nullptr; ///< Auto Sync Offset で同期のずれを付けたドライ出力のソース
+		std::int64_t dry_saved_offset_ = 0;       ///< そのソースの元の同期のずれ
+		std::int64_t dry_applied_offset_ = 0;
+
+		rtvc::EngineWatchdog watchdog_; ///< ニューラルのエンジンを呼ぶスレッド (Start() から Stop() まで)
+		rtvc::DryFallback dry_fallback_; ///< 推論スレッドのみ
+		rtvc::Concealer concealer_; ///< 失敗したブロックを埋める (推論スレッドのみ)
+		std::atomic<std::uint64_t> engine_timeout_ns_ = 40'000'000; ///< ブロックの長さを過ぎてから待つ時間 (0 なら見張らない)
+
+		rtvc::PipelineTrace trace_; ///< 推論スレッドと見張りのスレッドが積む (書き出しは Monitor のスレッド)
+		obs_hotkey_id trace_hotkey_ = OBS_INVALID_HOTKEY_ID;
+		std::mutex trace_mutex_; ///< trace_dir_ と trace_seconds_ は UI のスレッドが書く
+		std::string trace_dir_; ///< 空なら一時フォルダー
+		double trace_seconds_ = 10.0;
+		std::atomic<bool> trace_on_overrun_ = false;
+
+		rtvc::PipelineCounters telemetry_; ///< 推論スレッドが足す (まとめて書き出すのは Monitor のスレッド)
+		std::mutex telemetry_mutex_; ///< stats_path_ と prometheus_path_ は UI のスレッドが書く
+		std::string stats_path_; ///< メモリーマップする統計ファイル (空なら書かない)
+		std::string prometheus_path_; ///< textfile collector が読むファイル (空なら書かない)
+		rtvc::TelemetryWindow telemetry_window_; ///< Monitor のスレッドのみ
+		rtvc::TelemetryFile telemetry_file_; ///< Monitor のスレッドのみ
+		std::string telemetry_opened_; ///< telemetry_file_ に開いているパス (Monitor のスレッドのみ)
+		bool prometheus_failed_ = false; ///< Monitor のスレッドのみ
+	};
 
-		HANDLE hEvtAudioCaptureSamplesReady_ = nullptr;
-		HANDLE hEvtShutdown_ = nullptr;
-		HANDLE hAudioThread_ = nullptr;
-		Microsoft::WRL::ComPtr<IAudioClient3> pAudioClientIn_;
-		Microsoft::WRL::ComPtr<IAudioCaptureClient> pCaptureClient_;
+	// 素の声 (ドライ) を出すソース
+	//
+	// 取り込みもエンジンも持たず、選んだボイスチェンジャーのソースに自分をつないでもらう。
+	// 音声はボイスチェンジャーの推論スレッドが同じブロックから、ウェットと同じタイムスタンプで出力する。
+	class OBSDrySource final {
+	public:
+		OBSDrySource(obs_source_t* context)
+			: context_(context)
+		{
+			// 後から作られた (読み込まれた) ボイスチェンジャーにもつなぐ
+			signal_handler_connect(obs_get_signal_handler(), "source_create", OBSDrySource::source_created, this);
+		}
+
+		~OBSDrySource() {
+			signal_handler_disconnect(obs_get_signal_handler(), "source_create", OBSDrySource::source_created, this);
+			Detach();
+		}
+
+		// パラメーターを定義する
+		HRESULT GetProperties(obs_properties_t& props) {
+			obs_property_t* prop_parent = obs_properties_add_list(&props, "parent", "Voice Changer", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
+			obs_enum_sources([](void* param, obs_source_t* source) {
+				if (std::strcmp(obs_source_get_id(source), SOURCE_ID) == 0) {
+					// 名前を変えてもつないだままにするので UUID で選ぶ
+					obs_property_list_add_string(reinterpret_cast<obs_property_t*>(param), obs_source_get_name(source), obs_source_get_uuid(source));
+				}
+				return true;
+			}, prop_parent);
+			return S_OK;
+		}
+
+		// パラメーターを更新する
+		HRESULT Update(obs_data_t* settings) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			std::string const parent_id = obs_data_get_string(settings, "parent");
+			if (parent_id == parent_id_ && parent_) {
+				return S_OK;
+			}
+			DetachLocked();
+			parent_id_ = parent_id;
+			obs_source_t* parent = obs_get_source_by_uuid(parent_id_.c_str());
+			if (!parent) {
+				// 名前で選んでいた頃の設定
+				parent = obs_get_source_by_name(parent_id_.c_str());
+			}
+			if (parent) {
+				AttachLocked(parent);
+				obs_source_release(parent);
+			}
+			return S_OK;
+		}
+
+	private:
+		void AttachLocked(obs_source_t* parent) {
+			if (std::strcmp(obs_source_get_id(parent), SOURCE_ID) != 0) {
+				return;
+			}
+			if (!CallParent(parent, "attach_dry")) {
+				return;
+			}
+			parent_ = obs_source_get_weak_source(parent);
+
+			// 名前で選んでいた設定は UUID に書き換える
+			char const* const uuid = obs_source_get_uuid(parent);
+			if (parent_id_ != uuid) {
+				parent_id_ = uuid;
+				obs_data_t* const settings = obs_source_get_settings(context_);
+				obs_data_set_string(settings, "parent", uuid);
+				obs_data_release(settings);
+			}
+		}
+
+		void DetachLocked() {
+			if (!parent_) {
+				return;
+			}
+			if (obs_source_t* const parent = obs_weak_source_get_source(parent_)) {
+				CallParent(parent, "detach_dry");
+				obs_source_release(parent);
+			}
+			obs_weak_source_release(parent_);
+			parent_ = nullptr;
+		}
+
+		void Detach() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			DetachLocked();
+		}
+
+		bool CallParent(obs_source_t* parent, char const* name) {
+			calldata_t cd;
+			calldata_init(&cd);
+			calldata_set_ptr(&cd, "source", context_);
+			bool const called = proc_handler_call(obs_source_get_proc_handler(parent), name, &cd);
+			calldata_free(&cd);
+			return called;
+		}
+
+		// ボイスチェンジャーが聞こえなくてもドライが載っている間は止めないように知らせる
+		void SetActive(bool active) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!parent_) {
+				return;
+			}
+			if (obs_source_t* const parent = obs_weak_source_get_source(parent_)) {
+				calldata_t cd;
+				calldata_init(&cd);
+				calldata_set_ptr(&cd, "source", context_);
+				calldata_set_bool(&cd, "active", active);
+				proc_handler_call(obs_source_get_proc_handler(parent), "set_dry_active", &cd);
+				calldata_free(&cd);
+				obs_source_release(parent);
+			}
+		}
+
+		static void source_created(void* instance, calldata_t* cd) {
+			OBSDrySource* _this = reinterpret_cast<OBSDrySource*>(instance);
+			obs_source_t* const source = reinterpret_cast<obs_source_t*>(calldata_ptr(cd, "source"));
+			if (!source) {
+				return;
+			}
+			std::lock_guard<std::mutex> lock(_this->mutex_);
+			if (!_this->parent_ && (_this->parent_id_ == obs_source_get_uuid(source) || _this->parent_id_ == obs_source_get_name(source))) {
+				_this->AttachLocked(source);
+			}
+		}
+
+	public:
+		static char const* get_name(void* type_data) {
+			return "Real-Time Voice Changer (Dry)";
+		}
+
+		// 構築する
+		static void* create(obs_data_t* settings, obs_source_t* context)
+		{
+			std::unique_ptr<OBSDrySource> _this(new OBSDrySource(context));
+
+			if FAILED(_this->Update(settings)) {
+				// TODO:
+			}
+
+			return _this.release();
+		}
+
+		// 破棄する
+		static void destroy(void* instance)
+		{
+			std::unique_ptr<OBSDrySource> _this(reinterpret_cast<OBSDrySource*>(instance));
+		}
+
+		// パラメーターのデフォルト値を設定する
+		static void get_defaults(obs_data_t* settings)
+		{
+			obs_data_set_default_string(settings, "parent", "");
+		}
+
+		static void activate(void* instance)
+		{
+			reinterpret_cast<OBSDrySource*>(instance)->SetActive(true);
+		}
 
-		std::unique_ptr<float[]> buffer0_;
-		std::unique_ptr<float[]> buffer1_;
+		static void deactivate(void* instance)
+		{
+			reinterpret_cast<OBSDrySource*>(instance)->SetActive(false);
+		}
+
+		// パラメーターを定義する
+		static obs_properties_t* get_properties(void* instance)
+		{
+			OBSDrySource* _this = reinterpret_cast<OBSDrySource*>(instance);
+			if (_this) {
+				obs_properties_t* props = obs_properties_create();
+				if FAILED(_this->GetProperties(*props)) {
+					// TODO:
+				}
+				return props;
+			}
+			return nullptr;
+		}
+
+		// パラメーターを更新する
+		static void update(void* instance, obs_data_t* settings)
+		{
+			OBSDrySource* _this = reinterpret_cast<OBSDrySource*>(instance);
+			if (_this) {
+				if FAILED(_this->Update(settings)) {
+					// TODO:
+				}
+			}
+		}
+
+	private:
+		obs_source_t* context_;
+
+		std::mutex mutex_;
+		std::string parent_id_; ///< つなぐボイスチェンジャーの UUID (古い設定では名前)
+		obs_weak_source_t* parent_ = nullptr; ///< つないでいるボイスチェンジャー
 	};
 }
 
@@ -942,10 +2410,17 @@ extern "C" {
 		bool obs_module_load(void)
 	{
 		OBS_INFO("plugin loaded successfully (version 1.0.5)");
+		OBS_INFO("simd kernels: %s", rtvc::simd::to_string(rtvc::simd::kernels().isa));
+		rtvc::rt_check::install();
+		rtvc::deferred_logger().Start();
+		if (HRESULT const hr = rtvc::wasapi_device_catalog().Start(); FAILED(hr)) {
+			std::string const& msg = std::system_category().message(hr);
+			OBS_ERROR("unable to start device catalog: %s (%x)", msg.c_str(), hr);
+		}
 
 		obs_source_info info;
 		std::memset(&info, 0, sizeof(info));
-		info.id = "nair-rtvc-source";
+		info.id = SOURCE_ID;
 		info.type = OBS_SOURCE_TYPE_INPUT;
 		info.output_flags = OBS_SOURCE_AUDIO | OBS_SOURCE_DO_NOT_DUPLICATE;
 		info.get_name = OBSAudioSource::get_name;
@@ -954,9 +2429,34 @@ extern "C" {
 		info.get_defaults = OBSAudioSource::get_defaults;
 		info.get_properties = OBSAudioSource::get_properties;
 		info.update = OBSAudioSource::update;
+		info.activate = OBSAudioSource::activate;
+		info.deactivate = OBSAudioSource::deactivate;
 		// info.icon_type      = OBS_ICON_TYPE_AUDIO_INPUT;
 		obs_register_source(&info);
 
+		obs_source_info dry_info;
+		std::memset(&dry_info, 0, sizeof(dry_info));
+		dry_info.id = DRY_SOURCE_ID;
+		dry_info.type = OBS_SOURCE_TYPE_INPUT;
+		dry_info.output_flags = OBS_SOURCE_AUDIO;
+		dry_info.get_name = OBSDrySource::get_name;
+		dry_info.create = OBSDrySource::create;
+		dry_info.destroy = OBSDrySource::destroy;
+		dry_info.get_defaults = OBSDrySource::get_defaults;
+		dry_info.get_properties = OBSDrySource::get_properties;
+		dry_info.update = OBSDrySource::update;
+		dry_info.activate = OBSDrySource::activate;
+		dry_info.deactivate = OBSDrySource::deactivate;
+		obs_register_source(&dry_info);
+
 		return true;
 	}
+
+	void obs_module_unload(void)
+	{
+		// ソースはすべて破棄済み。読み込んだエンジンと複製をここで解放する
+		rtvc::model_registry().Reset(rtvc::engine_api{}, nullptr, {});
+		rtvc::wasapi_device_catalog().Stop();
+		rtvc::deferred_logger().Stop();
+	}
 }
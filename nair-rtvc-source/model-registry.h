@@ -0,0 +1,644 @@
+﻿#pragma once
+
+// モデルの一覧と切り替え
+//
+// vvfx エンジンの関数はプロセスに 1 つの状態しか持たないので、2 つ目からはライブラリーの複製を読み込んで
+// モデルごとに別のインスタンスにする (1 つ目は読み込み済みのライブラリーをそのまま使う)。
+// 切り替えでは裏のスレッドで新しいモデルを初期化して慣らしておき、その間は古いモデルが鳴らし続ける。
+// 推論スレッドはブロックの境目でポインターを差し替え、短いクロスフェードの後に古いモデルを裏のスレッドで破棄する。
+// ディスク上のライブラリーを新しい版に替えたときも、Upgrade() で並べて読み込んでから同じように差し替える。
+//
+//   Request() -> { 複製を読み込む -> init() -> 慣らし } -> TakeReady() (ブロックの境目) -> クロスフェード -> FinishFade() -> 古いものを破棄
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+#include "capture-backend.h"
+#include "rtvc-engine.h"
+#include "simd-kernels.h"
+
+namespace rtvc {
+	/// 初期化したエンジンの形式 (同じなら止めずに差し替えられる)
+	struct engine_format {
+		int sample_rate = 0;
+		int block_size = 0;
+		int sample_latency = 0;
+
+		bool operator==(engine_format const&) const = default;
+	};
+
+	/// モデル 1 つ分のエンジン
+	struct model_instance {
+		std::string name;
+		engine_api api;
+		int protocol_version[3] = { -1, -1, -1 };
+		int version[3] = { -1, -1, -1 };
+		engine_format format;
+		std::uint64_t init_ns = 0;      ///< 初期化と慣らしにかかった時間
+		bool initialized = false;       ///< init() が成功した (destroy() が要る)
+		module_handle module = nullptr; ///< 破棄するときに解放するライブラリー (ModelRegistry が持っていれば nullptr)
+		std::filesystem::path copy_path;
+	};
+
+	/// instance.api で instance.name を初期化して形式を読み、1 ブロック無音を通して慣らす
+	inline HRESULT init_model(model_instance& instance, std::string& error) {
+		engine_api const& api = instance.api;
+		int* const pv = instance.protocol_version;
+		if (int const retval = api.get_protocol_version(&pv[0], &pv[1], &pv[2])) {
+			error = "could not get protocol version: " + std::to_string(retval);
+			return E_FAIL;
+		}
+		if (pv[0] != 1) {
+			error = "unsupported protocol version: " + std::to_string(pv[0]) + "." + std::to_string(pv[1]) + "." + std::to_string(pv[2]);
+			return E_FAIL;
+		}
+
+		std::uint64_t const start = CapturePacer::now_ns();
+		if (int const retval = api.init(instance.name.c_str())) {
+			error = "could not init " + instance.name + ": " + std::to_string(retval);
+			return E_FAIL;
+		}
+		instance.initialized = true;
+
+		int* const v = instance.version;
+		if (int const retval = api.get_version(&v[0], &v[1], &v[2])) {
+			error = "could not get version: " + std::to_string(retval);
+			return E_FAIL;
+		}
+		if (int const retval = api.get_sample_rate(&instance.format.sample_rate)) {
+			error = "could not get sample rate: " + std::to_string(retval);
+			return E_FAIL;
+		}
+		if (int const retval = api.get_sample_latency(&instance.format.sample_latency)) {
+			error = "could not get sample latency: " + std::to_string(retval);
+			return E_FAIL;
+		}
+		if (int const retval = api.get_block_size(&instance.format.block_size)) {
+			error = "could not get block size: " + std::to_string(retval);
+			return E_FAIL;
+		}
+		if (instance.format.sample_rate <= 0 || instance.format.block_size <= 0) {
+			error = "invalid format";
+			return E_FAIL;
+		}
+		negotiate_batch(instance.api);
+
+		// 最初の process() は重いことが多いので、推論スレッドに渡す前に済ませておく
+		std::vector<float> block(static_cast<std::size_t>(instance.format.block_size));
+		float const params[] = { 1.0f, 1.0f, 0.0f, 0.0f, 0.0f };
+		api.set_voice(0);
+		if (int const retval = api.process(static_cast<int>(std::size(params)), params, block.data(), block.data())) {
+			error = "could not warm up " + instance.name + ": " + std::to_string(retval);
+			return E_FAIL;
+		}
+		instance.init_ns = CapturePacer::now_ns() - start;
+		return S_OK;
+	}
+
+	/// 読み込み済みのライブラリーとモデルの一覧 (プロセスに 1 つ)
+	class ModelRegistry final {
+	public:
+		static constexpr char const DEFAULT_MODEL[] = "jvs100";
+
+		// プラグインは DLL の解放 (ローダーロックの中) より前に Reset() で空にしておくので、ここでは何もしない
+		~ModelRegistry() {
+			Reset(engine_api{}, nullptr, {});
+		}
+
+		/// 読み込み済みのライブラリー (解放はこちらで行う) とその場所 (複製と読み込み直しの元) を登録する
+		void Reset(engine_api const& primary, module_handle module, std::filesystem::path library_path) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			ReleasePrimaryLocked();
+			primary_ = primary;
+			primary_module_ = module;
+			library_path_ = std::move(library_path);
+		}
+
+		bool Available() const {
+			std::lock_guard<std::mutex> lock(mutex_);
+			return primary_.process != nullptr;
+		}
+
+		/// 使えるモデルの名前 (エンジンが一覧を返さなければ既定のモデルだけ)
+		std::vector<std::string> Models() const {
+			std::lock_guard<std::mutex> lock(mutex_);
+			std::vector<std::string> models;
+			if (!primary_.process) {
+				return models;
+			}
+			int num_models = 0;
+			if (primary_.get_num_models && primary_.get_model_name && primary_.get_num_models(&num_models) == 0) {
+				for (int i = 0; i < num_models; ++i) {
+					char const* model_name = nullptr;
+					if (primary_.get_model_name(i, &model_name) == 0 && model_name && *model_name) {
+						models.emplace_back(model_name);
+					}
+				}
+			}
+			if (models.empty()) {
+				models.emplace_back(DEFAULT_MODEL);
+			}
+			return models;
+		}
+
+		/// name を別のインスタンスとして初期化する (数秒かかることがある。リアルタイムスレッドからは呼ばない)
+		HRESULT Open(std::string const& name, std::unique_ptr<model_instance>& instance, std::string& error) {
+			std::unique_ptr<model_instance> opened(new model_instance);
+			opened->name = name;
+			std::filesystem::path source;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (!primary_.process) {
+					error = "engine is not loaded";
+					return E_FAIL;
+				}
+				if (!primary_user_) {
+					primary_user_ = opened.get();
+					opened->api = primary_;
+				}
+				else {
+					source = library_path_;
+					opened->copy_path = NextCopyPathLocked();
+				}
+			}
+
+			HRESULT hr = S_OK;
+			if (!opened->copy_path.empty()) {
+				if FAILED(hr = LoadCopy(source, opened->copy_path, opened->module, opened->api, error)) {
+					opened->copy_path.clear();
+					return hr;
+				}
+			}
+			if FAILED(hr = init_model(*opened, error)) {
+				Close(std::move(opened));
+				return hr;
+			}
+			instance = std::move(opened);
+			return S_OK;
+		}
+
+		/// 破棄する (destroy() の戻り値を返す)
+		int Close(std::unique_ptr<model_instance> instance) {
+			if (!instance) {
+				return 0;
+			}
+			int retval = 0;
+			if (instance->initialized) {
+				retval = instance->api.destroy();
+			}
+			module_handle module = nullptr;
+			std::filesystem::path copy_path;
+			{
+				// Upgrade() が古いライブラリーを渡しに来ることがある
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (instance.get() == primary_user_) {
+					primary_user_ = nullptr;
+				}
+				module = instance->module;
+				copy_path = std::move(instance->copy_path);
+			}
+			FreeCopy(module, copy_path);
+			return retval;
+		}
+
+		/// ディスク上のライブラリーを並べて読み込み直す (OBS を止めずに版を上げる)
+		///
+		/// 使っているインスタンスはそのまま古いライブラリーで動き、これから開くモデルは新しい方を使う。
+		/// 古いライブラリーは、それを使っているインスタンスを破棄したときに解放する。
+		HRESULT Upgrade(int (&protocol_version)[3], std::string& error) {
+			std::filesystem::path source;
+			std::filesystem::path copy_path;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (library_path_.empty()) {
+					error = "engine path is unknown";
+					return E_FAIL;
+				}
+				source = library_path_;
+				copy_path = NextCopyPathLocked();
+			}
+
+			HRESULT hr = S_OK;
+			module_handle module = nullptr;
+			engine_api api;
+			if FAILED(hr = LoadCopy(source, copy_path, module, api, error)) {
+				return hr;
+			}
+			int* const pv = protocol_version;
+			if (int const retval = api.get_protocol_version(&pv[0], &pv[1], &pv[2])) {
+				error = "could not get protocol version: " + std::to_string(retval);
+				FreeCopy(module, copy_path);
+				return E_FAIL;
+			}
+			if (pv[0] != 1) {
+				error = "unsupported protocol version: " + std::to_string(pv[0]) + "." + std::to_string(pv[1]) + "." + std::to_string(pv[2]);
+				FreeCopy(module, copy_path);
+				return E_FAIL;
+			}
+
+			std::lock_guard<std::mutex> lock(mutex_);
+			ReleasePrimaryLocked();
+			primary_ = api;
+			primary_module_ = module;
+			primary_copy_path_ = std::move(copy_path);
+			return S_OK;
+		}
+
+	private:
+		// 今のライブラリーを手放す。使っているインスタンスがあれば、破棄するときに解放してもらう (mutex_ を持って呼ぶ)
+		void ReleasePrimaryLocked() {
+			if (primary_user_) {
+				primary_user_->module = primary_module_;
+				primary_user_->copy_path = std::move(primary_copy_path_);
+				primary_user_ = nullptr;
+			}
+			else {
+				FreeCopy(primary_module_, primary_copy_path_);
+			}
+			primary_ = engine_api{};
+			primary_module_ = nullptr;
+			primary_copy_path_.clear();
+		}
+
+		std::filesystem::path NextCopyPathLocked() {
+			return std::filesystem::temp_directory_path() /
+				(library_path_.stem().string() + "-" + std::to_string(process_id()) + "-" + std::to_string(++copies_) + library_path_.extension().string());
+		}
+
+		// 同じ場所のライブラリーは 2 度読み込めない (同じモジュールが返る) ので、複製を読み込む
+		static HRESULT LoadCopy(std::filesystem::path const& source, std::filesystem::path const& copy_path, module_handle& module, engine_api& api, std::string& error) {
+			std::error_code ec;
+			if (!std::filesystem::copy_file(source, copy_path, std::filesystem::copy_options::overwrite_existing, ec)) {
+				error = "could not copy the engine: " + ec.message();
+				return E_FAIL;
+			}
+			module = load_module(copy_path);
+			if (!module) {
+				error = "could not load the engine copy: " + copy_path.string();
+				std::filesystem::remove(copy_path, ec);
+				return E_FAIL;
+			}
+			if (char const* const missing = resolve_engine_api(module, api)) {
+				error = std::string("failed to get proc ") + missing;
+				FreeCopy(module, copy_path);
+				module = nullptr;
+				return E_FAIL;
+			}
+			return S_OK;
+		}
+
+		static void FreeCopy(module_handle module, std::filesystem::path const& copy_path) {
+			if (module) {
+				free_module(module);
+			}
+			if (!copy_path.empty()) {
+				std::error_code ec;
+				std::filesystem::remove(copy_path, ec);
+			}
+		}
+
+		static unsigned long process_id() noexcept {
+#if defined(_WIN32)
+			return ::GetCurrentProcessId();
+#else
+			return static_cast<unsigned long>(::getpid());
+#endif
+		}
+
+		mutable std::mutex mutex_;
+		engine_api primary_;                      ///< 最初のインスタンスが使うライブラリー
+		module_handle primary_module_ = nullptr;
+		std::filesystem::path primary_copy_path_; ///< 読み込み直したときの複製
+		model_instance* primary_user_ = nullptr;  ///< primary_ を使っているインスタンス
+		std::filesystem::path library_path_;
+		unsigned int copies_ = 0;
+	};
+
+	inline ModelRegistry& model_registry() {
+		static ModelRegistry registry;
+		return registry;
+	}
+
+	/// 切り替えの統計 (どのスレッドからでも読める)
+	struct model_switch_stats {
+		std::atomic<std::uint64_t> swaps = 0;        ///< 止めずに差し替え終えた (クロスフェードまで) 回数
+		std::atomic<std::uint64_t> failures = 0;     ///< 用意できなかった回数
+		std::atomic<std::uint64_t> last_init_ns = 0; ///< 裏での初期化と慣らし
+		std::atomic<std::uint64_t> last_wait_ns = 0; ///< 用意できてから推論スレッドが差し替えるまで
+		std::atomic<std::uint64_t> last_swap_ns = 0; ///< 推論スレッドが差し替えにかかった時間
+		std::atomic<std::uint64_t> max_swap_ns = 0;
+		std::atomic<std::uint64_t> last_fade_ns = 0; ///< 差し替えてから古いモデルを手放すまで
+	};
+
+	/// 差し替えのつなぎ (推論スレッドから)
+	///
+	/// 新しいエンジンの遅延が埋まるまでは古いエンジンにも同じブロックを通してその出力を使い、
+	/// それから fade_frames かけて新しいエンジンの出力に移る。
+	class EngineCrossfade final {
+	public:
+		/// 推論スレッドを止めている間に用意する
+		void Reset(int block_size, int fade_frames) {
+			scratch_.assign(static_cast<std::size_t>(block_size), 0.0f);
+			fade_frames_ = static_cast<std::uint32_t>(fade_frames > 0 ? fade_frames : 1);
+			from_ = nullptr;
+		}
+
+		void Begin(model_instance const* from, model_instance const* to) noexcept {
+			from_ = from;
+			prime_frames_ = static_cast<std::uint32_t>(to->format.sample_latency > 0 ? to->format.sample_latency : 0);
+			position_ = 0;
+		}
+
+		bool Active() const noexcept {
+			return from_ != nullptr;
+		}
+
+		engine_api const& From() const noexcept {
+			return from_->api;
+		}
+
+		/// 新しいエンジンに通す前のブロックを古いエンジンにも通して取っておく
+		void ProcessFrom(int num_params, float const* params, float const* in) noexcept {
+			std::memcpy(scratch_.data(), in, scratch_.size() * sizeof(float));
+			from_->api.process(num_params, params, scratch_.data(), scratch_.data());
+		}
+
+		/// 新しいエンジンの出力に混ぜる (終わったら true)
+		bool Mix(float* block) noexcept {
+			std::uint32_t const frames = static_cast<std::uint32_t>(scratch_.size());
+			std::uint32_t i = 0;
+			if (position_ < prime_frames_) {
+				i = (std::min)(frames, prime_frames_ - position_);
+				std::memcpy(block, scratch_.data(), i * sizeof(float));
+			}
+			if (i < frames && position_ + i < prime_frames_ + fade_frames_) {
+				std::uint32_t const n = (std::min)(frames - i, prime_frames_ + fade_frames_ - (position_ + i));
+				simd::kernels().crossfade(scratch_.data() + i, block + i, block + i, position_ + i - prime_frames_ + 1, 1.0f / static_cast<float>(fade_frames_), n);
+			}
+			position_ += frames;
+			if (position_ < prime_frames_ + fade_frames_) {
+				return false;
+			}
+			from_ = nullptr;
+			return true;
+		}
+
+	private:
+		std::vector<float> scratch_;
+		model_instance const* from_ = nullptr;
+		std::uint32_t prime_frames_ = 0;
+		std::uint32_t fade_frames_ = 1;
+		std::uint32_t position_ = 0;
+	};
+
+	/// 推論スレッドが使うモデルを止めずに切り替える (ソースごとに 1 つ)
+	class ModelSwitcher final {
+	public:
+		/// 形式 (サンプルレート、ブロックサイズ、遅延) が違って止めずに差し替えられないモデルを用意できた (裏のスレッドから)
+		using restart_callback = std::function<void()>;
+
+		ModelSwitcher(ModelRegistry& registry, restart_callback on_restart)
+			: registry_(registry)
+			, on_restart_(std::move(on_restart))
+		{
+		}
+
+		~ModelSwitcher() {
+			Shutdown();
+			registry_.Close(Reset(nullptr));
+		}
+
+		/// 裏のスレッドを止める
+		void Shutdown() {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				shutdown_ = true;
+			}
+			cv_.notify_all();
+			if (thread_.joinable()) {
+				thread_.join();
+			}
+		}
+
+		/// 推論スレッドを止めている間に、使うインスタンスを替える (用意中のものは捨てる)
+		/// 前のインスタンスを返す
+		std::unique_ptr<model_instance> Reset(std::unique_ptr<model_instance> serving) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			DiscardLocked();
+			for (std::atomic<model_instance*>* const slot : { &fading_, &retired_ }) {
+				if (model_instance* const instance = slot->exchange(nullptr, std::memory_order::acq_rel)) {
+					registry_.Close(std::unique_ptr<model_instance>(instance));
+				}
+			}
+			target_ = serving ? serving->name : std::string();
+			return std::unique_ptr<model_instance>(serving_.exchange(serving.release(), std::memory_order::acq_rel));
+		}
+
+		/// 裏で name を用意する (使っているか用意中のモデルなら何もしない)
+		void Request(std::string const& name) {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (name == target_ || shutdown_) {
+					return;
+				}
+				DiscardLocked();
+				target_ = name;
+				model_instance const* const serving = serving_.load(std::memory_order::acquire);
+				if (serving && serving->name == name) {
+					return;
+				}
+				requested_ = true;
+				if (!thread_.joinable()) {
+					thread_ = std::thread([this] { Load(); });
+				}
+			}
+			cv_.notify_one();
+		}
+
+		/// 使っているモデルを裏で開き直す (Upgrade() したライブラリーに移る)
+		void Reopen() {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				model_instance const* const serving = serving_.load(std::memory_order::acquire);
+				if (!serving || shutdown_) {
+					return;
+				}
+				DiscardLocked();
+				target_ = serving->name;
+				requested_ = true;
+				if (!thread_.joinable()) {
+					thread_ = std::thread([this] { Load(); });
+				}
+			}
+			cv_.notify_one();
+		}
+
+		/// 推論スレッドが今使っているインスタンス (推論スレッドから、または止めている間に)
+		model_instance const* Serving() const noexcept {
+			return serving_.load(std::memory_order::acquire);
+		}
+
+		/// 用意できたモデルに差し替える (推論スレッドからブロックの境目で。差し替えたら新しいインスタンスを返す)
+		/// previous には古いインスタンスを返す。クロスフェードを終えたら FinishFade() で手放す
+		model_instance const* TakeReady(model_instance const*& previous) noexcept {
+			// 前に差し替えた分を手放して、裏で破棄し終えるまでは待つ
+			if (!ready_.load(std::memory_order::relaxed) || fading_.load(std::memory_order::relaxed) || retired_.load(std::memory_order::acquire)) {
+				return nullptr;
+			}
+			std::uint64_t const start = CapturePacer::now_ns();
+			model_instance* const next = ready_.exchange(nullptr, std::memory_order::acq_rel);
+			if (!next) {
+				return nullptr;
+			}
+			model_instance* const old = serving_.exchange(next, std::memory_order::acq_rel);
+			fading_.store(old, std::memory_order::release);
+			previous = old;
+			std::uint64_t const end = CapturePacer::now_ns();
+
+			std::uint64_t const swap_ns = end - start;
+			swapped_ns_ = end;
+			stats_.last_wait_ns.store(end - ready_ns_.load(std::memory_order::relaxed), std::memory_order::relaxed);
+			stats_.last_swap_ns.store(swap_ns, std::memory_order::relaxed);
+			if (swap_ns > stats_.max_swap_ns.load(std::memory_order::relaxed)) {
+				stats_.max_swap_ns.store(swap_ns, std::memory_order::relaxed);
+			}
+			return next;
+		}
+
+		/// クロスフェードを終えた古いインスタンスを手放す (推論スレッドから。破棄は裏のスレッドで)
+		void FinishFade() noexcept {
+			if (model_instance* const old = fading_.exchange(nullptr, std::memory_order::acq_rel)) {
+				retired_.store(old, std::memory_order::release);
+				stats_.last_fade_ns.store(CapturePacer::now_ns() - swapped_ns_, std::memory_order::relaxed);
+				stats_.swaps.fetch_add(1, std::memory_order::release);
+			}
+		}
+
+		/// 止めて差し替える必要があるモデルを受け取る
+		std::unique_ptr<model_instance> TakeRestart() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			return std::move(restart_);
+		}
+
+		/// 今使っているインスタンスを f に渡す (その間は破棄されない。まだなければ nullptr)
+		template <typename F>
+		auto WithServing(F&& f) const {
+			std::lock_guard<std::mutex> lock(mutex_);
+			return f(serving_.load(std::memory_order::acquire));
+		}
+
+		model_switch_stats const& Stats() const noexcept {
+			return stats_;
+		}
+
+		/// 最後に用意できなかった理由
+		std::string LastError() const {
+			std::lock_guard<std::mutex> lock(mutex_);
+			return error_;
+		}
+
+	private:
+		// 用意中と用意済みのものを捨てる (mutex_ を持って呼ぶ)
+		void DiscardLocked() {
+			++generation_;
+			requested_ = false;
+			if (model_instance* const ready = ready_.exchange(nullptr, std::memory_order::acq_rel)) {
+				registry_.Close(std::unique_ptr<model_instance>(ready));
+			}
+			registry_.Close(std::move(restart_));
+		}
+
+		// 裏のスレッド
+		void Load() {
+			std::unique_lock<std::mutex> lock(mutex_);
+			for (;;) {
+				// 差し替えは推論スレッドから知らせないので、ときどき見に行く
+				cv_.wait_for(lock, std::chrono::milliseconds(100), [this] {
+					return shutdown_ || requested_ || retired_.load(std::memory_order::acquire) != nullptr;
+				});
+				if (model_instance* const retired = retired_.exchange(nullptr, std::memory_order::acq_rel)) {
+					registry_.Close(std::unique_ptr<model_instance>(retired));
+				}
+				if (shutdown_) {
+					break;
+				}
+				if (!requested_) {
+					continue;
+				}
+				requested_ = false;
+				std::string const name = target_;
+				std::uint64_t const generation = generation_;
+
+				// 初期化の間も推論スレッドは古いモデルで動き続ける
+				lock.unlock();
+				std::unique_ptr<model_instance> instance;
+				std::string error;
+				HRESULT const hr = registry_.Open(name, instance, error);
+				lock.lock();
+
+				if (generation != generation_) {
+					registry_.Close(std::move(instance));
+					continue;
+				}
+				if FAILED(hr) {
+					error_ = error;
+					model_instance const* const serving = serving_.load(std::memory_order::acquire);
+					target_ = serving ? serving->name : std::string();
+					stats_.failures.fetch_add(1, std::memory_order::release);
+					continue;
+				}
+				stats_.last_init_ns.store(instance->init_ns, std::memory_order::relaxed);
+
+				model_instance const* const serving = serving_.load(std::memory_order::acquire);
+				if (serving && serving->format == instance->format) {
+					ready_ns_.store(CapturePacer::now_ns(), std::memory_order::relaxed);
+					ready_.store(instance.release(), std::memory_order::release);
+				}
+				else {
+					restart_ = std::move(instance);
+					lock.unlock();
+					on_restart_();
+					lock.lock();
+				}
+			}
+		}
+
+		ModelRegistry& registry_;
+		restart_callback on_restart_;
+
+		mutable std::mutex mutex_; ///< インスタンスの破棄と、target_ 以下
+		std::condition_variable cv_;
+		std::thread thread_;
+		std::string target_;              ///< 使いたいモデル
+		std::uint64_t generation_ = 0;    ///< 変わったら用意中のものは捨てる
+		bool requested_ = false;
+		bool shutdown_ = false;
+		std::unique_ptr<model_instance> restart_;
+		std::string error_;
+
+		std::atomic<model_instance*> serving_ = nullptr; ///< 推論スレッドが使っている
+		std::atomic<model_instance*> ready_ = nullptr;   ///< 裏のスレッドから推論スレッドへ
+		std::atomic<model_instance*> fading_ = nullptr;  ///< 差し替えた後、クロスフェードの間だけ推論スレッドが使う
+		std::atomic<model_instance*> retired_ = nullptr; ///< 推論スレッドから裏のスレッドへ
+		std::atomic<std::uint64_t> ready_ns_ = 0;
+		std::uint64_t swapped_ns_ = 0; ///< 推論スレッドだけが使う
+		model_switch_stats stats_;
+	};
+}
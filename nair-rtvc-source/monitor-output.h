@@ -0,0 +1,239 @@
+﻿#pragma once
+
+// 直接モニター出力
+//
+// 推論スレッドが変換した音声を、OBS のモニタリング (非同期ソースのバッファーとモニター側のバッファー) を通さずに
+// 再生デバイスへ送る。推論スレッドは JitterBuffer に積むだけで、デバイスのスレッドが周期ごとに取り出す。
+//
+//   Open() -> Start() -> { Write() の繰り返し (推論スレッドから) } -> Stop()
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "capture-backend.h"
+#include "concealment.h"
+#include "spsc-ring.h"
+
+namespace rtvc {
+	/// 取り込みの周期と再生の周期の違いを吸収するバッファー (単一生産者・単一消費者、ロックフリー)
+	///
+	/// 目標の量が溜まるまでは無音を返し、足りなくなったら直前の音声を繰り返して (Concealer) 埋めながら溜め直す。
+	/// 取り込みと再生のクロックのずれで溜まりすぎたら、古い分を捨てて目標に戻す。
+	class JitterBuffer final {
+	public:
+		/// リアルタイムスレッドの外で呼ぶ
+		void Reset(std::size_t capacity, std::uint32_t target_frames, std::uint32_t slack_frames, int sample_rate) {
+			ring_.Reset((std::max)(capacity, static_cast<std::size_t>(2 * (target_frames + slack_frames))));
+			target_frames_ = target_frames;
+			slack_frames_ = slack_frames;
+			priming_ = true;
+			fill_frames_.store(0, std::memory_order::relaxed);
+			underruns_.store(0, std::memory_order::relaxed);
+			overflows_.store(0, std::memory_order::relaxed);
+			skipped_frames_.store(0, std::memory_order::relaxed);
+			concealer_.Reset(sample_rate);
+		}
+
+		/// 積む (生産者から。入りきらない分は捨てる)
+		void Push(float const* data, std::uint32_t frames) noexcept {
+			if (ring_.Write(data, frames) < frames) {
+				overflows_.fetch_add(1, std::memory_order::relaxed);
+			}
+		}
+
+		/// frames フレーム取り出す (消費者から。足りない分は合成して埋める)
+		void Pull(float* out, std::uint32_t frames) noexcept {
+			std::size_t available = ring_.Readable();
+
+			// 平滑化した溜まり具合 (推論スレッドはまとめて積むので、瞬間の量ではなくこれで判断する)
+			std::uint32_t fill = fill_frames_.load(std::memory_order::relaxed);
+			fill = static_cast<std::uint32_t>(fill + (static_cast<std::int64_t>(available) - fill) / 16);
+
+			if (priming_) {
+				if (available < target_frames_) {
+					fill_frames_.store(fill, std::memory_order::relaxed);
+					// 鳴らし始めは履歴がないので無音になる
+					concealer_.Conceal(out, frames);
+					return;
+				}
+				priming_ = false;
+			}
+			if (fill > target_frames_ + slack_frames_ && available > target_frames_) {
+				std::size_t const skipped = ring_.Skip(available - target_frames_);
+				skipped_frames_.fetch_add(skipped, std::memory_order::relaxed);
+				available -= skipped;
+				fill = target_frames_;
+			}
+			fill_frames_.store(fill, std::memory_order::relaxed);
+
+			std::uint32_t const read = static_cast<std::uint32_t>(ring_.Read(out, (std::min)(static_cast<std::size_t>(frames), available)));
+			concealer_.Good(out, read);
+			if (read < frames) {
+				concealer_.Conceal(out + read, frames - read);
+				underruns_.fetch_add(1, std::memory_order::relaxed);
+				priming_ = true;
+			}
+		}
+
+		/// 平滑化した溜まり具合
+		std::uint32_t FillFrames() const noexcept {
+			return fill_frames_.load(std::memory_order::relaxed);
+		}
+
+		std::uint32_t TargetFrames() const noexcept {
+			return target_frames_;
+		}
+
+		std::uint64_t Underruns() const noexcept {
+			return underruns_.load(std::memory_order::relaxed);
+		}
+
+		std::uint64_t Overflows() const noexcept {
+			return overflows_.load(std::memory_order::relaxed);
+		}
+
+		/// 溜まりすぎて捨てたフレーム数
+		std::uint64_t SkippedFrames() const noexcept {
+			return skipped_frames_.load(std::memory_order::relaxed);
+		}
+
+		/// 空になって合成で埋めたフレーム数
+		std::uint64_t ConcealedFrames() const noexcept {
+			return concealer_.ConcealedFrames();
+		}
+
+	private:
+		SpscRing<float> ring_;
+		std::uint32_t target_frames_ = 0;
+		std::uint32_t slack_frames_ = 0;
+		bool priming_ = true;
+		std::atomic<std::uint32_t> fill_frames_ = 0;
+		std::atomic<std::uint64_t> underruns_ = 0;
+		std::atomic<std::uint64_t> overflows_ = 0;
+		std::atomic<std::uint64_t> skipped_frames_ = 0;
+		Concealer concealer_; ///< 消費者のみ
+	};
+
+	/// 再生デバイスのレートへの線形補間 (消費者のスレッドだけで使う)
+	///
+	/// 位相は出力のレートを分母にした整数で持つので、読む入力のフレーム数は丸めずに決まる。出力は入力より 2 フレーム遅れる。
+	class LinearResampler final {
+	public:
+		void Reset(int from_rate, int to_rate) noexcept {
+			from_rate_ = static_cast<std::uint64_t>(from_rate);
+			to_rate_ = static_cast<std::uint64_t>(to_rate);
+			phase_ = 0;
+			previous_ = 0.0f;
+			current_ = 0.0f;
+		}
+
+		/// 出力を frames フレーム作るのに読む入力のフレーム数
+		std::uint32_t SourceFrames(std::uint32_t frames) const noexcept {
+			return static_cast<std::uint32_t>((phase_ + frames * from_rate_) / to_rate_);
+		}
+
+		/// in (SourceFrames(frames) フレーム) から frames フレーム作り、channels チャンネルに同じ値を並べて書く
+		void Process(float const* in, float* out, std::uint32_t frames, std::uint32_t channels) noexcept {
+			float const scale = 1.0f / static_cast<float>(to_rate_);
+			for (std::uint32_t i = 0; i < frames; ++i) {
+				float const y = previous_ + (current_ - previous_) * (static_cast<float>(phase_) * scale);
+				for (std::uint32_t c = 0; c < channels; ++c) {
+					*out++ = y;
+				}
+				phase_ += from_rate_;
+				while (phase_ >= to_rate_) {
+					phase_ -= to_rate_;
+					previous_ = current_;
+					current_ = *in++;
+				}
+			}
+		}
+
+	private:
+		std::uint64_t from_rate_ = 1;
+		std::uint64_t to_rate_ = 1;
+		std::uint64_t phase_ = 0;
+		float previous_ = 0.0f;
+		float current_ = 0.0f;
+	};
+
+	class MonitorOutput {
+	public:
+		virtual ~MonitorOutput() = default;
+
+		virtual char const* Name() const noexcept = 0;
+
+		/// 最後に失敗した理由 (なければ空)
+		virtual char const* LastError() const noexcept {
+			return "";
+		}
+
+		/// デバイスを開いて形式を合わせ、JitterBuffer を用意する
+		/// write_frames は推論スレッドが 1 回に Write() する最大フレーム数 (ブロック数 * ブロックサイズ)
+		virtual HRESULT Open(int sample_rate, std::uint32_t write_frames) = 0;
+
+		virtual HRESULT Start() = 0;
+
+		virtual HRESULT Stop() = 0;
+
+		/// 変換した音声を渡す (推論スレッドから。ブロックしない)
+		void Write(float const* data, std::uint32_t frames) noexcept {
+			buffer_.Push(data, frames);
+		}
+
+		/// デバイスが抱えている遅延 (再生待ちのフレームとストリームの遅延) [ns]
+		std::uint64_t DeviceLatencyNs() const noexcept {
+			return device_latency_ns_.load(std::memory_order::relaxed);
+		}
+
+		/// JitterBuffer の遅延 [ns]
+		std::uint64_t BufferLatencyNs() const noexcept {
+			return static_cast<std::uint64_t>(buffer_.FillFrames()) * 1'000'000'000ull / static_cast<std::uint64_t>(sample_rate_);
+		}
+
+		/// Write() してから聞こえるまで [ns]
+		std::uint64_t LatencyNs() const noexcept {
+			return BufferLatencyNs() + DeviceLatencyNs();
+		}
+
+		JitterBuffer const& Buffer() const noexcept {
+			return buffer_;
+		}
+
+		/// 再生スレッドが失敗して止まっていればその HRESULT (動いていれば S_OK。どのスレッドからでも読める)
+		/// 失敗していれば LastError() に理由が入っている
+		HRESULT RenderResult() const noexcept {
+			return render_result_.load(std::memory_order::acquire);
+		}
+
+	protected:
+		/// 再生の周期に合わせてバッファーを用意する
+		void ResetBuffer(int sample_rate, std::uint32_t write_frames, std::uint32_t period_frames) {
+			sample_rate_ = sample_rate;
+			// 推論スレッドはまとめて積むので、1 回分と 1 周期を溜めてから鳴らし始める
+			buffer_.Reset(static_cast<std::size_t>(sample_rate / 2), write_frames + period_frames, write_frames, sample_rate);
+			device_latency_ns_.store(0, std::memory_order::relaxed);
+			render_result_.store(S_OK, std::memory_order::relaxed);
+		}
+
+		/// デバイスのスレッドが止まるときに知らせる (理由は先に LastError() に入れておく)
+		void ReportRenderFailure(HRESULT hr) noexcept {
+			render_result_.store(hr, std::memory_order::release);
+		}
+
+		/// デバイスのスレッドから実測した遅延を知らせる
+		void ReportDeviceLatency(std::uint64_t frames, std::uint64_t stream_latency_ns) noexcept {
+			device_latency_ns_.store(frames * 1'000'000'000ull / static_cast<std::uint64_t>(sample_rate_) + stream_latency_ns, std::memory_order::relaxed);
+		}
+
+		JitterBuffer buffer_;
+		int sample_rate_ = 24'000;
+
+	private:
+		std::atomic<std::uint64_t> device_latency_ns_ = 0;
+		std::atomic<HRESULT> render_result_ = S_OK;
+	};
+}
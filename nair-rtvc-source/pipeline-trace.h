@@ -0,0 +1,288 @@
+﻿#pragma once
+
+// ブロックごとの処理の時系列 (Chrome のトレースイベント形式で書き出す)
+//
+// 推論スレッドと見張りの呼び出し用スレッドが、それぞれ自分のリングに区間の始まりと終わりを TSC の値で積む。
+// 1 つ積むのはアトミックな書き込み 4 回だけで、ロックもメモリー確保もしない。リングは古いものから上書きする。
+// 書き出すときは直近の指定した秒数だけを JSON にする (https://ui.perfetto.dev や chrome://tracing で開ける)。
+//
+//   Begin() / End() / Instant() (リアルタイムスレッドから) -> Request() -> TakeRequest() -> Write() (ほかのスレッドで)
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace rtvc {
+	/// 記録するスレッド (スレッドごとに 1 本のリングを持つ)
+	enum class trace_thread : std::uint8_t {
+		capture, ///< 取り込みを待ち、ブロックに切り分けてエンジンに通し、出力する
+		engine,  ///< 見張りの呼び出し用スレッド
+		count_,
+	};
+
+	enum class trace_span : std::uint8_t {
+		wait,          ///< 取り込みの起床を待つ
+		block,         ///< 起床から出力まで
+		get_buffer,
+		assemble,
+		set_voice,
+		process,       ///< エンジンに通す (見張りがあれば期限まで待つ)
+		conceal,
+		output,
+		engine,        ///< 見張りの呼び出し用スレッドでエンジンを呼ぶ
+		overrun,       ///< (瞬間) 処理がブロックの長さに間に合わなかった
+		deadline_miss, ///< (瞬間) 見張りがドライに切り替えた
+		count_,
+	};
+
+	struct trace_span_info {
+		char const* name;
+		char const* arg; ///< 引数の名前 (なければ nullptr)
+	};
+
+	inline constexpr char const* const TRACE_THREADS[] = { "capture", "engine" };
+	static_assert(std::size(TRACE_THREADS) == static_cast<std::size_t>(trace_thread::count_));
+
+	inline constexpr trace_span_info const TRACE_SPANS[] = {
+		{ "wait"         , nullptr },
+		{ "block"        , "blocks" },
+		{ "GetBuffer"    , "frames" },
+		{ "assemble"     , "blocks" },
+		{ "set_voice"    , "voices" },
+		{ "rtvc_process" , "blocks" },
+		{ "conceal"      , "blocks" },
+		{ "output"       , "frames" },
+		{ "engine"       , "blocks" },
+		{ "overrun"      , "us" },
+		{ "deadline miss", "blocks" },
+	};
+	static_assert(std::size(TRACE_SPANS) == static_cast<std::size_t>(trace_span::count_));
+
+	enum class trace_phase : std::uint8_t {
+		begin,
+		end,
+		instant,
+	};
+
+	struct trace_event {
+		std::uint64_t ticks;
+		trace_phase phase;
+		trace_span span;
+		std::uint32_t arg;
+	};
+
+	/// 時刻 (x86 は TSC、ほかは steady_clock のナノ秒)
+	inline std::uint64_t trace_ticks() noexcept {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+	}
+
+	/// 1 つのスレッドだけが書き、どのスレッドからでも読める上書きリング
+	///
+	/// 読み手は写してから claimed_ を読み直し、写している間に上書きされたかもしれない分を捨てる (seqlock と同じ)。
+	class TraceRing final {
+	public:
+		static constexpr std::size_t const CAPACITY = std::size_t{ 1 } << 16;
+
+		TraceRing()
+			: slots_(new slot[CAPACITY])
+		{
+		}
+
+		/// 書き手のスレッドから
+		void Push(trace_phase phase, trace_span span, std::uint32_t arg) noexcept {
+			std::uint64_t const pos = written_.load(std::memory_order::relaxed);
+			claimed_.store(pos + 1, std::memory_order::relaxed);
+			std::atomic_thread_fence(std::memory_order::release);
+			slot& s = slots_[pos & (CAPACITY - 1)];
+			s.ticks.store(trace_ticks(), std::memory_order::relaxed);
+			s.info.store(static_cast<std::uint64_t>(phase) | (static_cast<std::uint64_t>(span) << 8) | (static_cast<std::uint64_t>(arg) << 32), std::memory_order::relaxed);
+			written_.store(pos + 1, std::memory_order::release);
+		}
+
+		/// 残っているイベントを古い順に events に足す (どのスレッドからでも)
+		void Snapshot(std::vector<trace_event>& events) const {
+			std::uint64_t const end = written_.load(std::memory_order::acquire);
+			std::uint64_t const begin = end > CAPACITY ? end - CAPACITY : 0;
+			std::vector<std::uint64_t> words(static_cast<std::size_t>(2 * (end - begin)));
+			for (std::uint64_t i = begin; i < end; ++i) {
+				slot const& s = slots_[i & (CAPACITY - 1)];
+				words[2 * (i - begin)] = s.ticks.load(std::memory_order::relaxed);
+				words[2 * (i - begin) + 1] = s.info.load(std::memory_order::relaxed);
+			}
+			std::atomic_thread_fence(std::memory_order::acquire);
+			std::uint64_t const claimed = claimed_.load(std::memory_order::relaxed);
+			std::uint64_t const valid = claimed > CAPACITY ? claimed - CAPACITY : 0;
+			for (std::uint64_t i = (std::max)(begin, valid); i < end; ++i) {
+				std::uint64_t const info = words[2 * (i - begin) + 1];
+				events.push_back(trace_event{ words[2 * (i - begin)], static_cast<trace_phase>(info & 0xff), static_cast<trace_span>((info >> 8) & 0xff), static_cast<std::uint32_t>(info >> 32) });
+			}
+		}
+
+	private:
+		struct slot {
+			std::atomic<std::uint64_t> ticks{ 0 };
+			std::atomic<std::uint64_t> info{ 0 };
+		};
+
+		std::unique_ptr<slot[]> slots_;
+		alignas(64) std::atomic<std::uint64_t> claimed_{ 0 }; ///< 書き始めた数
+		std::atomic<std::uint64_t> written_{ 0 };             ///< 書き終えた数
+	};
+
+	class PipelineTrace final {
+	public:
+		static constexpr std::uint32_t const REQUEST_MANUAL = 1;    ///< ホットキーやボタン
+		static constexpr std::uint32_t const REQUEST_AUTOMATIC = 2; ///< 間に合わなかったとき
+
+		PipelineTrace()
+			: origin_ticks_(trace_ticks())
+			, origin_ns_(now_ns())
+		{
+		}
+
+		PipelineTrace(PipelineTrace const&) = delete;
+		PipelineTrace& operator=(PipelineTrace const&) = delete;
+
+		static std::uint64_t now_ns() noexcept {
+			return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+
+		// 記録するスレッドから呼ぶ
+		void Begin(trace_thread thread, trace_span span, std::uint32_t arg = 0) noexcept {
+			rings_[static_cast<std::size_t>(thread)].Push(trace_phase::begin, span, arg);
+		}
+
+		void End(trace_thread thread, trace_span span, std::uint32_t arg = 0) noexcept {
+			rings_[static_cast<std::size_t>(thread)].Push(trace_phase::end, span, arg);
+		}
+
+		void Instant(trace_thread thread, trace_span span, std::uint32_t arg = 0) noexcept {
+			rings_[static_cast<std::size_t>(thread)].Push(trace_phase::instant, span, arg);
+		}
+
+		/// 書き出しを頼む (どのスレッドからでも。REQUEST_MANUAL か REQUEST_AUTOMATIC)
+		void Request(std::uint32_t reason) noexcept {
+			requests_.fetch_or(reason, std::memory_order::acq_rel);
+		}
+
+		/// 頼まれた理由を取り出す (なければ 0)
+		std::uint32_t TakeRequest() noexcept {
+			return requests_.exchange(0, std::memory_order::acq_rel);
+		}
+
+		/// 直近 seconds 秒を Chrome のトレースイベント形式で書き出す (リアルタイムスレッドの外で。0 ならリングに残っているすべて)
+		bool Write(std::filesystem::path const& path, double seconds) const {
+			// TSC の刻みをナノ秒に直す比は、作ってから今までで測る
+			std::uint64_t const now_ticks = trace_ticks();
+			std::uint64_t const now = now_ns();
+			double const ticks_per_ns = now > origin_ns_ + 1'000'000 && now_ticks > origin_ticks_
+				? static_cast<double>(now_ticks - origin_ticks_) / static_cast<double>(now - origin_ns_)
+				: 1.0;
+			std::uint64_t const window = seconds > 0.0 ? static_cast<std::uint64_t>(seconds * 1e9 * ticks_per_ns) : now_ticks;
+			std::uint64_t const first_ticks = now_ticks > window ? now_ticks - window : 0;
+
+			std::ofstream out(path, std::ios::binary | std::ios::trunc);
+			if (!out) {
+				return false;
+			}
+			out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+			out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"nair-rtvc-source\"}}";
+
+			std::vector<trace_event> events;
+			events.reserve(TraceRing::CAPACITY);
+			char line[256];
+			for (std::size_t t = 0; t < std::size(rings_); ++t) {
+				int const tid = static_cast<int>(t) + 1;
+				std::snprintf(line, sizeof(line), ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", tid, TRACE_THREADS[t]);
+				out << line;
+
+				events.clear();
+				rings_[t].Snapshot(events);
+				int depth = 0;
+				for (trace_event const& e : events) {
+					if (e.ticks < first_ticks) {
+						continue;
+					}
+					// 窓の前に始まった区間の終わりは出さない
+					if (e.phase == trace_phase::end && depth == 0) {
+						continue;
+					}
+					depth += e.phase == trace_phase::begin ? 1 : e.phase == trace_phase::end ? -1 : 0;
+
+					trace_span_info const& info = TRACE_SPANS[static_cast<std::size_t>(e.span)];
+					double const ts = static_cast<double>(static_cast<std::int64_t>(e.ticks - origin_ticks_)) / ticks_per_ns / 1'000.0;
+					char const* const phase = e.phase == trace_phase::begin ? "B" : e.phase == trace_phase::end ? "E" : "i";
+					int length = std::snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"cat\":\"rtvc\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%d", info.name, phase, ts, tid);
+					if (e.phase == trace_phase::instant) {
+						length += std::snprintf(line + length, sizeof(line) - length, ",\"s\":\"t\"");
+					}
+					if (info.arg && (e.arg != 0 || e.phase != trace_phase::begin)) {
+						length += std::snprintf(line + length, sizeof(line) - length, ",\"args\":{\"%s\":%u}", info.arg, e.arg);
+					}
+					std::snprintf(line + length, sizeof(line) - length, "}");
+					out << line;
+				}
+			}
+			out << "\n]}\n";
+			return static_cast<bool>(out);
+		}
+
+	private:
+		TraceRing rings_[static_cast<std::size_t>(trace_thread::count_)];
+		std::atomic<std::uint32_t> requests_{ 0 };
+		std::uint64_t const origin_ticks_;
+		std::uint64_t const origin_ns_;
+	};
+
+	/// 区間を記録する (trace が nullptr なら何もしない。引数は終わりで決めてもよい)
+	class TraceScope final {
+	public:
+		TraceScope(PipelineTrace* trace, trace_thread thread, trace_span span, std::uint32_t arg = 0) noexcept
+			: trace_(trace)
+			, thread_(thread)
+			, span_(span)
+			, arg_(arg)
+		{
+			if (trace_) {
+				trace_->Begin(thread_, span_, arg_);
+			}
+		}
+
+		TraceScope(TraceScope const&) = delete;
+		TraceScope& operator=(TraceScope const&) = delete;
+
+		~TraceScope() {
+			if (trace_) {
+				trace_->End(thread_, span_, arg_);
+			}
+		}
+
+		void SetArg(std::uint32_t arg) noexcept {
+			arg_ = arg;
+		}
+
+	private:
+		PipelineTrace* trace_;
+		trace_thread thread_;
+		trace_span span_;
+		std::uint32_t arg_;
+	};
+}
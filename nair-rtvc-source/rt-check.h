@@ -0,0 +1,374 @@
+﻿#pragma once
+
+// リアルタイムスレッドの安全性チェッカー
+//
+// RTVC_RT_CHECK を定義したビルド (Debug 構成) でのみ有効になる。
+// realtime_scope の生存中にメモリー確保・解放、ロック取得、ブロッキング呼び出しが
+// 行われるとスタックと共に記録し、非リアルタイムスレッドから dump() で報告する。
+//
+// - Windows: デバッグ CRT の _CrtSetAllocHook で確保・解放を捕捉し、
+//            ロックやブロッキング呼び出しは RTVC_RT_BLOCKING() の注釈で捕捉する。
+// - Linux:   RTVC_RT_CHECK_INTERPOSE を定義した翻訳単位を共有ライブラリーとしてビルドし、
+//            LD_PRELOAD すると malloc/free, pthread のロック, ブロッキング syscall を横取りする。
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(RTVC_RT_CHECK)
+#if defined(_WIN32)
+#include <crtdbg.h>
+#else
+#include <execinfo.h>
+#endif
+#endif
+
+namespace rtvc::rt_check {
+	enum class violation : std::uint32_t {
+		allocation,
+		deallocation,
+		lock,
+		blocking_call,
+	};
+
+	inline char const* to_string(violation kind) noexcept {
+		switch (kind) {
+		case violation::allocation:    return "allocation";
+		case violation::deallocation:  return "deallocation";
+		case violation::lock:          return "lock";
+		case violation::blocking_call: return "blocking call";
+		}
+		return "unknown";
+	}
+
+#if defined(RTVC_RT_CHECK)
+	constexpr std::size_t const MAX_FRAMES = 24;
+	constexpr std::size_t const MAX_RECORDS = 256;
+
+	/// スタック単位で重複排除した違反の記録
+	struct record {
+		std::atomic<std::uint64_t> hash{ 0 }; ///< 0 は空きスロット
+		std::atomic<std::uint32_t> count{ 0 };
+		std::atomic<bool> ready{ false };
+		violation kind = violation::allocation;
+		char const* what = nullptr;
+		std::uint32_t num_frames = 0;
+		void* frames[MAX_FRAMES] = {};
+	};
+
+	struct state {
+		record records[MAX_RECORDS];
+		std::atomic<std::uint64_t> dropped{ 0 }; ///< テーブルが溢れて記録できなかった件数
+	};
+
+	inline state& global_state() noexcept {
+		static state s;
+		return s;
+	}
+
+	inline thread_local int realtime_depth = 0;
+	inline thread_local int suspend_depth = 0;
+	inline thread_local bool in_report = false;
+
+	inline bool is_realtime() noexcept {
+		return realtime_depth > 0 && suspend_depth == 0 && !in_report;
+	}
+
+	inline std::uint32_t capture_stack(void** frames, std::uint32_t max_frames) noexcept {
+#if defined(_WIN32)
+		return ::CaptureStackBackTrace(2, max_frames, frames, nullptr);
+#else
+		int const n = ::backtrace(frames, static_cast<int>(max_frames));
+		return n > 0 ? static_cast<std::uint32_t>(n) : 0;
+#endif
+	}
+
+	// 違反を記録する (メモリー確保もロックもしない)
+	inline void report(violation kind, char const* what) noexcept {
+		if (!is_realtime()) {
+			return;
+		}
+		in_report = true;
+
+		void* frames[MAX_FRAMES];
+		std::uint32_t const num_frames = capture_stack(frames, static_cast<std::uint32_t>(MAX_FRAMES));
+
+		// FNV-1a
+		std::uint64_t hash = 14695981039346656037ull ^ static_cast<std::uint64_t>(kind);
+		for (std::uint32_t i = 0; i < num_frames; ++i) {
+			hash = (hash ^ reinterpret_cast<std::uintptr_t>(frames[i])) * 1099511628211ull;
+		}
+		if (hash == 0) {
+			hash = 1;
+		}
+
+		state& s = global_state();
+		std::size_t slot = static_cast<std::size_t>(hash % MAX_RECORDS);
+		for (std::size_t probe = 0; probe < MAX_RECORDS; ++probe, slot = (slot + 1) % MAX_RECORDS) {
+			record& r = s.records[slot];
+			std::uint64_t expected = 0;
+			if (r.hash.compare_exchange_strong(expected, hash, std::memory_order::acq_rel)) {
+				r.kind = kind;
+				r.what = what;
+				r.num_frames = num_frames;
+				for (std::uint32_t i = 0; i < num_frames; ++i) {
+					r.frames[i] = frames[i];
+				}
+				r.count.fetch_add(1, std::memory_order::relaxed);
+				r.ready.store(true, std::memory_order::release);
+				in_report = false;
+				return;
+			}
+			if (expected == hash) {
+				r.count.fetch_add(1, std::memory_order::relaxed);
+				in_report = false;
+				return;
+			}
+		}
+		s.dropped.fetch_add(1, std::memory_order::relaxed);
+		in_report = false;
+	}
+
+	/// 記録された違反を列挙して消去する (非リアルタイムスレッドから呼ぶ)
+	/// fn(violation kind, char const* what, std::uint32_t count, void* const* frames, std::uint32_t num_frames)
+	template <typename Fn>
+	inline std::uint64_t dump(Fn&& fn) {
+		state& s = global_state();
+		std::uint64_t total = 0;
+		for (record& r : s.records) {
+			if (!r.ready.load(std::memory_order::acquire)) {
+				continue;
+			}
+			std::uint32_t const count = r.count.exchange(0, std::memory_order::relaxed);
+			if (count == 0) {
+				continue;
+			}
+			total += count;
+			fn(r.kind, r.what, count, static_cast<void* const*>(r.frames), r.num_frames);
+		}
+		return total + s.dropped.exchange(0, std::memory_order::relaxed);
+	}
+
+#if defined(_WIN32)
+	inline int __cdecl alloc_hook(int alloc_type, void*, std::size_t, int block_type, long, unsigned char const*, int) {
+		if (block_type != _CRT_BLOCK) {
+			switch (alloc_type) {
+			case _HOOK_ALLOC:
+			case _HOOK_REALLOC:
+				report(violation::allocation, "malloc");
+				break;
+			case _HOOK_FREE:
+				report(violation::deallocation, "free");
+				break;
+			}
+		}
+		return TRUE;
+	}
+#endif
+
+	// 確保・解放の捕捉を開始する
+	inline void install() noexcept {
+#if defined(_WIN32)
+#if defined(_DEBUG)
+		::_CrtSetAllocHook(alloc_hook);
+#endif
+#else
+		// backtrace() は初回呼び出しで libgcc をロードするので先に済ませておく
+		void* frames[1];
+		::backtrace(frames, 1);
+#endif
+	}
+
+	/// このスコープの間、現在のスレッドをリアルタイムとして扱う
+	class realtime_scope final {
+	public:
+		realtime_scope() noexcept { ++realtime_depth; }
+		~realtime_scope() noexcept { --realtime_depth; }
+		realtime_scope(realtime_scope const&) = delete;
+		realtime_scope& operator=(realtime_scope const&) = delete;
+	};
+
+	/// 意図的なブロッキング (デバイスの待機など) の間だけチェックを止める
+	class suspend_scope final {
+	public:
+		suspend_scope() noexcept { ++suspend_depth; }
+		~suspend_scope() noexcept { --suspend_depth; }
+		suspend_scope(suspend_scope const&) = delete;
+		suspend_scope& operator=(suspend_scope const&) = delete;
+	};
+#else
+	inline bool is_realtime() noexcept { return false; }
+	inline void report(violation, char const*) noexcept {}
+	template <typename Fn>
+	inline std::uint64_t dump(Fn&&) { return 0; }
+	inline void install() noexcept {}
+
+	class realtime_scope final {
+	public:
+		realtime_scope() noexcept {} // 使われていない変数の警告を出さない
+		realtime_scope(realtime_scope const&) = delete;
+		realtime_scope& operator=(realtime_scope const&) = delete;
+	};
+
+	class suspend_scope final {
+	public:
+		suspend_scope() noexcept {} // 使われていない変数の警告を出さない
+		suspend_scope(suspend_scope const&) = delete;
+		suspend_scope& operator=(suspend_scope const&) = delete;
+	};
+#endif
+}
+
+/// ロックを取る、あるいはブロックしうる呼び出しの直前に置く
+#define RTVC_RT_BLOCKING(WHAT) ::rtvc::rt_check::report(::rtvc::rt_check::violation::blocking_call, WHAT)
+#define RTVC_RT_LOCK(WHAT) ::rtvc::rt_check::report(::rtvc::rt_check::violation::lock, WHAT)
+
+#if defined(RTVC_RT_CHECK) && defined(RTVC_RT_CHECK_INTERPOSE) && defined(__linux__)
+// LD_PRELOAD 用シム
+//   g++ -std=c++20 -O1 -g -shared -fPIC rtvc-rt-check/main.cpp -o librtvc-rt-check.so -ldl
+// パイプライン側 (rtvc-replay, rtvc-host) は同じヘッダーを RTVC_RT_CHECK 付きで -rdynamic を付けてビルドし、realtime_scope を張る。
+// thread_local の状態は実行ファイル側の定義に解決されるので、シム側からも同じ状態が見える。
+#include <dlfcn.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <cstdio>
+#include <ctime>
+
+namespace rtvc::rt_check::interpose {
+	// dlsym 自体が calloc を呼ぶため、解決中は静的領域から払い出す
+	alignas(16) inline unsigned char bootstrap_heap[4096];
+	inline std::size_t bootstrap_used = 0;
+	inline thread_local bool resolving = false;
+
+	template <typename Fn>
+	inline Fn next(char const* name) noexcept {
+		resolving = true;
+		Fn const fn = reinterpret_cast<Fn>(::dlsym(RTLD_NEXT, name));
+		resolving = false;
+		return fn;
+	}
+
+	inline bool is_bootstrap(void* p) noexcept {
+		return p >= bootstrap_heap && p < bootstrap_heap + sizeof(bootstrap_heap);
+	}
+
+	inline void print_report() noexcept {
+		dump([](violation kind, char const* what, std::uint32_t count, void* const* frames, std::uint32_t num_frames) {
+			std::fprintf(stderr, "[rtvc-rt-check] %s in real-time scope: %s (x%u)\n", to_string(kind), what, count);
+			::backtrace_symbols_fd(frames, static_cast<int>(num_frames), STDERR_FILENO);
+		});
+	}
+
+	struct reporter {
+		reporter() noexcept { install(); }
+		~reporter() { print_report(); }
+	};
+	inline reporter _reporter;
+}
+
+extern "C" {
+	void* malloc(std::size_t size) {
+		using namespace rtvc::rt_check;
+		static auto const real = interpose::next<void* (*)(std::size_t)>("malloc");
+		report(violation::allocation, "malloc");
+		return real(size);
+	}
+
+	void* calloc(std::size_t count, std::size_t size) {
+		using namespace rtvc::rt_check;
+		if (interpose::resolving) {
+			std::size_t const bytes = (count * size + 15) & ~std::size_t{ 15 };
+			if (interpose::bootstrap_used + bytes > sizeof(interpose::bootstrap_heap)) {
+				return nullptr;
+			}
+			void* const p = interpose::bootstrap_heap + interpose::bootstrap_used;
+			interpose::bootstrap_used += bytes;
+			return p;
+		}
+		static auto const real = interpose::next<void* (*)(std::size_t, std::size_t)>("calloc");
+		report(violation::allocation, "calloc");
+		return real(count, size);
+	}
+
+	void* realloc(void* ptr, std::size_t size) {
+		using namespace rtvc::rt_check;
+		static auto const real = interpose::next<void* (*)(void*, std::size_t)>("realloc");
+		report(violation::allocation, "realloc");
+		return real(ptr, size);
+	}
+
+	void free(void* ptr) {
+		using namespace rtvc::rt_check;
+		if (!ptr || interpose::is_bootstrap(ptr)) {
+			return;
+		}
+		static auto const real = interpose::next<void (*)(void*)>("free");
+		report(violation::deallocation, "free");
+		real(ptr);
+	}
+
+	int pthread_mutex_lock(pthread_mutex_t* mutex) {
+		using namespace rtvc::rt_check;
+		static auto const real = interpose::next<int (*)(pthread_mutex_t*)>("pthread_mutex_lock");
+		report(violation::lock, "pthread_mutex_lock");
+		return real(mutex);
+	}
+
+	int pthread_rwlock_rdlock(pthread_rwlock_t* rwlock) {
+		using namespace rtvc::rt_check;
+		static auto const real = interpose::next<int (*)(pthread_rwlock_t*)>("pthread_rwlock_rdlock");
+		report(violation::lock, "pthread_rwlock_rdlock");
+		return real(rwlock);
+	}
+
+	int pthread_rwlock_wrlock(pthread_rwlock_t* rwlock) {
+		using namespace rtvc::rt_check;
+		static auto const real = interpose::next<int (*)(pthread_rwlock_t*)>("pthread_rwlock_wrlock");
+		report(violation::lock, "pthread_rwlock_wrlock");
+		return real(rwlock);
+	}
+
+	int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+		using namespace rtvc::rt_check;
+		static auto const real = interpose::next<int (*)(pthread_cond_t*, pthread_mutex_t*)>("pthread_cond_wait");
+		report(violation::blocking_call, "pthread_cond_wait");
+		return real(cond, mutex);
+	}
+
+	int sem_wait(sem_t* sem) {
+		using namespace rtvc::rt_check;
+		static auto const real = interpose::next<int (*)(sem_t*)>("sem_wait");
+		report(violation::blocking_call, "sem_wait");
+		return real(sem);
+	}
+
+	int nanosleep(timespec const* req, timespec* rem) {
+		using namespace rtvc::rt_check;
+		static auto const real = interpose::next<int (*)(timespec const*, timespec*)>("nanosleep");
+		report(violation::blocking_call, "nanosleep");
+		return real(req, rem);
+	}
+
+	ssize_t read(int fd, void* buf, std::size_t count) {
+		using namespace rtvc::rt_check;
+		static auto const real = interpose::next<ssize_t (*)(int, void*, std::size_t)>("read");
+		report(violation::blocking_call, "read");
+		return real(fd, buf, count);
+	}
+
+	ssize_t write(int fd, void const* buf, std::size_t count) {
+		using namespace rtvc::rt_check;
+		static auto const real = interpose::next<ssize_t (*)(int, void const*, std::size_t)>("write");
+		report(violation::blocking_call, "write");
+		return real(fd, buf, count);
+	}
+
+	int fsync(int fd) {
+		using namespace rtvc::rt_check;
+		static auto const real = interpose::next<int (*)(int)>("fsync");
+		report(violation::blocking_call, "fsync");
+		return real(fd);
+	}
+}
+#endif
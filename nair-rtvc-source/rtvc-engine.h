@@ -0,0 +1,187 @@
+﻿#pragma once
+
+// vvfx エンジン (rtvc.vvfx) の関数テーブル
+
+#include <algorithm>
+#include <filesystem>
+#include <limits>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#define RTVC_CALL __stdcall
+#else
+#define RTVC_CALL
+#include <dlfcn.h>
+#endif
+
+namespace rtvc {
+	typedef int(RTVC_CALL* get_protocol_version_fn)(int* major_version, int* minor_version, int* revision);
+	typedef int(RTVC_CALL* init_fn)(char const* model_name);
+	typedef int(RTVC_CALL* destroy_fn)();
+	typedef int(RTVC_CALL* process_fn)(int num_params, float const* params, float const* x, float* y);
+
+	typedef int(RTVC_CALL* get_version_fn)(int* major_version, int* minor_version, int* revision);
+	typedef int(RTVC_CALL* get_sample_rate_fn)(int* sample_rate);
+	typedef int(RTVC_CALL* get_block_size_fn)(int* block_size);
+	typedef int(RTVC_CALL* get_sample_latency_fn)(int* sample_latency);
+
+	typedef int(RTVC_CALL* get_num_params_fn)(int* num_params);
+	typedef int(RTVC_CALL* get_param_name_fn)(int i, char const** param_name);
+
+	typedef int(RTVC_CALL* get_num_voices_fn)(int* num_voices);
+	typedef int(RTVC_CALL* get_voice_name_fn)(int i, char const** voice_name);
+	typedef int(RTVC_CALL* set_voice_fn)(int voice_id);
+	typedef int(RTVC_CALL* set_voices_fn)(int num_voices, int const* voice_ids, float const* voice_amounts);
+
+	// 任意 (なければ既定のモデルだけを使う)
+	typedef int(RTVC_CALL* get_num_models_fn)(int* num_models);
+	typedef int(RTVC_CALL* get_model_name_fn)(int i, char const** model_name);
+
+	// 任意 (なければ 1 ブロックずつ process() を呼ぶ)
+	// x と y は num_blocks ブロックが続けて並んでいる。同じでもよい
+	typedef int(RTVC_CALL* process_n_fn)(int num_params, float const* params, int num_blocks, float const* x, float* y);
+	typedef int(RTVC_CALL* get_max_blocks_fn)(int* max_blocks);
+
+	struct engine_api {
+		get_protocol_version_fn  get_protocol_version = nullptr;
+		init_fn                  init = nullptr;
+		destroy_fn               destroy = nullptr;
+		process_fn               process = nullptr;
+
+		get_version_fn           get_version = nullptr;
+		get_sample_rate_fn       get_sample_rate = nullptr;
+		get_sample_latency_fn    get_sample_latency = nullptr;
+		get_block_size_fn        get_block_size = nullptr;
+
+		get_num_params_fn        get_num_params = nullptr;
+		get_param_name_fn        get_param_name = nullptr;
+
+		get_num_voices_fn        get_num_voices = nullptr;
+		get_voice_name_fn        get_voice_name = nullptr;
+		set_voice_fn             set_voice = nullptr;
+		set_voices_fn            set_voices = nullptr;
+
+		get_num_models_fn        get_num_models = nullptr;
+		get_model_name_fn        get_model_name = nullptr;
+
+		process_n_fn             process_n = nullptr;
+		get_max_blocks_fn        get_max_blocks = nullptr;
+
+		int                      max_blocks = 1; ///< process_blocks() が 1 回で渡すブロック数 (negotiate_batch() で決める)
+	};
+
+#if defined(_WIN32)
+	using module_handle = HMODULE;
+
+	inline void* get_proc(module_handle hModule, char const* name) {
+		return reinterpret_cast<void*>(::GetProcAddress(hModule, name));
+	}
+
+	inline module_handle load_module(std::filesystem::path const& path) {
+		return ::LoadLibraryW(path.c_str());
+	}
+
+	inline void free_module(module_handle hModule) {
+		::FreeLibrary(hModule);
+	}
+
+	// %CommonProgramFiles%\VVFX\rtvc.vvfx
+	inline std::wstring default_engine_path() {
+		std::wstring library_path(L"C:\\Program Files\\Common Files");
+		std::vector<TCHAR> buf(GetEnvironmentVariable(L"CommonProgramFiles", nullptr, 0));
+		if (GetEnvironmentVariable(L"CommonProgramFiles", buf.data(), static_cast<DWORD>(buf.size()))) {
+			library_path = buf.data();
+		}
+		library_path += L"\\VVFX\\rtvc.vvfx";
+		return library_path;
+	}
+#else
+	using module_handle = void*;
+
+	inline void* get_proc(module_handle hModule, char const* name) {
+		return ::dlsym(hModule, name);
+	}
+
+	inline module_handle load_module(std::filesystem::path const& path) {
+		return ::dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	}
+
+	inline void free_module(module_handle hModule) {
+		::dlclose(hModule);
+	}
+#endif
+
+	template <typename Fn>
+	inline bool resolve(module_handle hModule, char const* name, Fn& fn) {
+		fn = reinterpret_cast<Fn>(get_proc(hModule, name));
+		return fn != nullptr;
+	}
+
+	/// 必須の関数をすべて解決する (見つからなかった関数名を返す。揃っていれば nullptr)
+	inline char const* resolve_engine_api(module_handle hModule, engine_api& api) {
+		// protocol
+		if (!resolve(hModule, "get_protocol_version", api.get_protocol_version)) return "get_protocol_version";
+		if (!resolve(hModule, "init", api.init)) return "init";
+		if (!resolve(hModule, "destroy", api.destroy)) return "destroy";
+		if (!resolve(hModule, "process", api.process)) return "process";
+
+		// model
+		if (!resolve(hModule, "get_version", api.get_version)) return "get_version";
+		if (!resolve(hModule, "get_sample_rate", api.get_sample_rate)) return "get_sample_rate";
+		if (!resolve(hModule, "get_sample_latency", api.get_sample_latency)) return "get_sample_latency";
+		if (!resolve(hModule, "get_block_size", api.get_block_size)) return "get_block_size";
+
+		// param
+		if (!resolve(hModule, "get_num_params", api.get_num_params)) return "get_num_params";
+		if (!resolve(hModule, "get_param_name", api.get_param_name)) return "get_param_name";
+
+		// voice
+		if (!resolve(hModule, "get_num_voices", api.get_num_voices)) return "get_num_voices";
+		if (!resolve(hModule, "get_voice_name", api.get_voice_name)) return "get_voice_name";
+		if (!resolve(hModule, "set_voice", api.set_voice)) return "set_voice";
+		if (!resolve(hModule, "set_voices", api.set_voices)) return "set_voices";
+
+		// optional
+		resolve(hModule, "get_num_models", api.get_num_models);
+		resolve(hModule, "get_model_name", api.get_model_name);
+		resolve(hModule, "process_n", api.process_n);
+		resolve(hModule, "get_max_blocks", api.get_max_blocks);
+
+		return nullptr;
+	}
+
+	/// init() の後に、process_blocks() が 1 回で渡すブロック数を決める
+	/// limit が 0 ならエンジンの希望どおり、1 なら process_n() があっても 1 ブロックずつにする
+	inline int negotiate_batch(engine_api& api, int limit = 0) {
+		int max_blocks = 1;
+		if (api.process_n && limit != 1) {
+			max_blocks = (std::numeric_limits<int>::max)();
+			int preferred = 0;
+			if (api.get_max_blocks && api.get_max_blocks(&preferred) == 0 && preferred > 0) {
+				max_blocks = preferred;
+			}
+			if (limit > 0) {
+				max_blocks = (std::min)(max_blocks, limit);
+			}
+		}
+		api.max_blocks = max_blocks;
+		return max_blocks;
+	}
+
+	/// 続けて並んだ num_blocks ブロックを処理する (リアルタイムスレッドから)
+	/// process_n() があれば max_blocks ずつまとめて渡し、なければ process() を 1 ブロックずつ呼ぶ
+	inline int process_blocks(engine_api const& api, int num_params, float const* params, int block_size, int num_blocks, float const* x, float* y) {
+		int const batch = api.process_n ? api.max_blocks : 1;
+		for (int i = 0; i < num_blocks;) {
+			int const n = (std::min)(batch, num_blocks - i);
+			std::size_t const offset = static_cast<std::size_t>(i) * block_size;
+			if (int const retval = n > 1 ? api.process_n(num_params, params, n, x + offset, y + offset) : api.process(num_params, params, x + offset, y + offset)) {
+				return retval;
+			}
+			i += n;
+		}
+		return 0;
+	}
+}
@@ -0,0 +1,344 @@
+﻿#pragma once
+
+// セッションの記録と再生
+//
+// Process() が見たパケット (フレーム数、フラグ、起床時刻、サンプル)、
+// パラメーターの変更、ブロックごとのエンジン処理時間をコンパクトなバイナリーに書き出す。
+// オーディオスレッドはロックフリーのリングに積むだけで、ファイルへの書き込みは別スレッドが行う。
+//
+// ファイル形式 (リトルエンディアン)
+//   file_header
+//   { record_header, ペイロード (record_header::size バイト) } の繰り返し
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace rtvc::session {
+	constexpr char const MAGIC[8] = { 'R', 'T', 'V', 'C', 'S', 'E', 'S', 'S' };
+	constexpr std::uint32_t const VERSION = 1;
+
+	/// パケットのフラグ (AUDCLNT_BUFFERFLAGS_* と同じ値)
+	constexpr std::uint32_t const FLAG_DISCONTINUITY = 0x1;
+	constexpr std::uint32_t const FLAG_SILENT = 0x2;
+	constexpr std::uint32_t const FLAG_TIMESTAMP_ERROR = 0x4;
+
+	struct file_header {
+		char magic[8];
+		std::uint32_t version;
+		std::uint32_t sample_rate;
+		std::uint32_t block_size;
+		std::uint32_t sample_latency;
+		std::uint64_t start_time_ns;
+	};
+
+	enum class record_type : std::uint32_t {
+		packet = 1, ///< packet_record + float[frames] (無音なら省略)
+		params = 2, ///< params_record
+		timing = 3, ///< timing_record
+		config = 4, ///< config_record
+	};
+
+	struct record_header {
+		record_type type;
+		std::uint32_t size;         ///< ペイロードのバイト数
+		std::uint64_t timestamp_ns; ///< 起床時刻
+	};
+
+	struct packet_record {
+		std::uint32_t frames;         ///< uNumFrameToRead
+		std::uint32_t flags;          ///< dwFlags
+		std::uint64_t device_time_ns; ///< パケット先頭サンプルの取り込み時刻
+	};
+
+	struct params_record {
+		std::int32_t primary_voice;
+		std::int32_t secondary_voice;
+		float amount;
+		float params[5]; ///< input_gain, output_gain, pitch_shift, pitch_shift_mode, pitch_snap
+
+		bool operator==(params_record const& other) const noexcept {
+			return std::memcmp(this, &other, sizeof(params_record)) == 0;
+		}
+	};
+
+	struct timing_record {
+		std::uint32_t blocks;    ///< この起床で処理したブロック数
+		std::uint32_t reserved;
+		std::uint64_t engine_ns; ///< set_voice と process にかかった時間
+		std::uint64_t total_ns;  ///< 起床から出力までの時間
+	};
+
+	struct config_record {
+		std::int32_t device;
+		std::int32_t latency_mode;
+		std::uint32_t buffer_frames;
+		std::uint32_t reserved;
+	};
+
+	class Recorder final {
+		static constexpr std::size_t const RING_SIZE = 8 << 20; // 24kHz で約 80 秒分
+
+	public:
+		Recorder() = default;
+		Recorder(Recorder const&) = delete;
+		Recorder& operator=(Recorder const&) = delete;
+
+		~Recorder() {
+			Close();
+		}
+
+		/// 記録を始める (UI スレッドから)
+		bool Open(std::filesystem::path const& path, file_header const& header) {
+			Close();
+
+			std::FILE* file = nullptr;
+#if defined(_WIN32)
+			if (::_wfopen_s(&file, path.c_str(), L"wb") != 0) {
+				file = nullptr;
+			}
+#else
+			file = std::fopen(path.c_str(), "wb");
+#endif
+			if (!file) {
+				return false;
+			}
+			if (std::fwrite(&header, sizeof(header), 1, file) != 1) {
+				std::fclose(file);
+				return false;
+			}
+
+			if (!ring_) {
+				ring_.reset(new std::uint8_t[RING_SIZE]);
+			}
+			file_ = file;
+			read_pos_.store(0, std::memory_order::relaxed);
+			write_pos_.store(0, std::memory_order::relaxed);
+			dropped_.store(0, std::memory_order::relaxed);
+			generation_.fetch_add(1, std::memory_order::relaxed);
+
+			running_ = true;
+			thread_ = std::thread([this] { Run(); });
+			active_.store(true, std::memory_order::release);
+			return true;
+		}
+
+		/// 記録を終える (UI スレッドから)。捨てたレコード数を返す
+		std::uint64_t Close() {
+			if (!thread_.joinable()) {
+				return 0;
+			}
+
+			// オーディオスレッドが Append() から抜けるのを待つ
+			active_.store(false, std::memory_order::seq_cst);
+			while (writers_.load(std::memory_order::seq_cst) != 0) {
+				std::this_thread::yield();
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				running_ = false;
+			}
+			cv_.notify_all();
+			thread_.join();
+
+			Flush();
+			std::fclose(file_);
+			file_ = nullptr;
+			return dropped_.load(std::memory_order::relaxed);
+		}
+
+		bool IsActive() const noexcept {
+			return active_.load(std::memory_order::acquire);
+		}
+
+		/// Open() のたびに変わる (最初のパラメーターを必ず記録するために使う)
+		std::uint32_t Generation() const noexcept {
+			return generation_.load(std::memory_order::relaxed);
+		}
+
+		/// レコードを積む (オーディオスレッドから。溢れたら捨てる)
+		bool Append(record_type type, std::uint64_t timestamp_ns, void const* payload, std::size_t size, void const* extra = nullptr, std::size_t extra_size = 0) noexcept {
+			writers_.fetch_add(1, std::memory_order::seq_cst);
+			bool result = false;
+			if (active_.load(std::memory_order::seq_cst)) {
+				record_header const header{ type, static_cast<std::uint32_t>(size + extra_size), timestamp_ns };
+				std::size_t const total = sizeof(header) + size + extra_size;
+				std::uint64_t const write_pos = write_pos_.load(std::memory_order::relaxed);
+				std::uint64_t const read_pos = read_pos_.load(std::memory_order::acquire);
+				if (RING_SIZE - static_cast<std::size_t>(write_pos - read_pos) >= total) {
+					std::uint64_t pos = write_pos;
+					pos = Copy(pos, &header, sizeof(header));
+					pos = Copy(pos, payload, size);
+					pos = Copy(pos, extra, extra_size);
+					write_pos_.store(pos, std::memory_order::release);
+					result = true;
+				}
+				else {
+					dropped_.fetch_add(1, std::memory_order::relaxed);
+				}
+			}
+			writers_.fetch_sub(1, std::memory_order::seq_cst);
+			return result;
+		}
+
+	private:
+		std::uint64_t Copy(std::uint64_t pos, void const* data, std::size_t size) noexcept {
+			if (size == 0) {
+				return pos;
+			}
+			std::size_t const offset = static_cast<std::size_t>(pos % RING_SIZE);
+			std::size_t const first = (std::min)(size, RING_SIZE - offset);
+			std::memcpy(ring_.get() + offset, data, first);
+			std::memcpy(ring_.get(), static_cast<std::uint8_t const*>(data) + first, size - first);
+			return pos + size;
+		}
+
+		void Flush() {
+			std::uint64_t const write_pos = write_pos_.load(std::memory_order::acquire);
+			std::uint64_t read_pos = read_pos_.load(std::memory_order::relaxed);
+			while (read_pos != write_pos) {
+				std::size_t const offset = static_cast<std::size_t>(read_pos % RING_SIZE);
+				std::size_t const size = (std::min)(static_cast<std::size_t>(write_pos - read_pos), RING_SIZE - offset);
+				std::fwrite(ring_.get() + offset, 1, size, file_);
+				read_pos += size;
+				read_pos_.store(read_pos, std::memory_order::release);
+			}
+		}
+
+		void Run() {
+			std::unique_lock<std::mutex> lock(mutex_);
+			while (running_) {
+				cv_.wait_for(lock, std::chrono::milliseconds(50), [this] { return !running_; });
+				lock.unlock();
+				Flush();
+				lock.lock();
+			}
+		}
+
+		std::unique_ptr<std::uint8_t[]> ring_;
+		std::atomic<std::uint64_t> write_pos_ = 0;
+		std::atomic<std::uint64_t> read_pos_ = 0;
+		std::atomic<std::uint64_t> dropped_ = 0;
+		std::atomic<std::uint32_t> generation_ = 0;
+		std::atomic<bool> active_ = false;
+		std::atomic<int> writers_ = 0;
+
+		std::FILE* file_ = nullptr;
+		std::mutex mutex_;
+		std::condition_variable cv_;
+		std::thread thread_;
+		bool running_ = false;
+	};
+
+	class Reader final {
+	public:
+		~Reader() {
+			if (file_) {
+				std::fclose(file_);
+			}
+		}
+
+		bool Open(std::filesystem::path const& path) {
+#if defined(_WIN32)
+			if (::_wfopen_s(&file_, path.c_str(), L"rb") != 0) {
+				file_ = nullptr;
+			}
+#else
+			file_ = std::fopen(path.c_str(), "rb");
+#endif
+			if (!file_) {
+				return false;
+			}
+			if (std::fread(&header_, sizeof(header_), 1, file_) != 1) {
+				return false;
+			}
+			return std::memcmp(header_.magic, MAGIC, sizeof(MAGIC)) == 0 && header_.version == VERSION;
+		}
+
+		file_header const& Header() const noexcept {
+			return header_;
+		}
+
+		/// 次のレコードを読む (ペイロードは Payload() から)
+		/// 終わりか壊れたレコードで false を返す (壊れていたら Error() が理由を返す)
+		bool Next(record_header& header) {
+			std::size_t const read = std::fread(&header, 1, sizeof(header), file_);
+			if (read != sizeof(header)) {
+				if (read != 0 || std::ferror(file_)) {
+					error_ = "truncated record header";
+				}
+				return false;
+			}
+			if (header.size > MAX_RECORD_SIZE) {
+				error_ = "record too large";
+				return false;
+			}
+			if (payload_capacity_ < header.size) {
+				payload_capacity_ = header.size;
+				payload_.reset(new std::uint8_t[payload_capacity_]);
+			}
+			if (std::fread(payload_.get(), 1, header.size, file_) != header.size) {
+				error_ = "truncated record payload";
+				return false;
+			}
+			if (!IsValid(header)) {
+				error_ = "record size does not match its type";
+				return false;
+			}
+			return true;
+		}
+
+		std::uint8_t const* Payload() const noexcept {
+			return payload_.get();
+		}
+
+		/// 壊れたレコードで止まった理由 (最後まで読めたら nullptr)
+		char const* Error() const noexcept {
+			return error_;
+		}
+
+	private:
+		/// 1 レコードの上限 (24kHz で 10 分を超えるパケットはない)
+		static constexpr std::uint32_t const MAX_RECORD_SIZE = 64 << 20;
+
+		/// 既知のレコードはペイロードが構造体に足りているか (パケットはサンプルの分も)
+		bool IsValid(record_header const& header) const noexcept {
+			switch (header.type) {
+			case record_type::packet:
+			{
+				if (header.size < sizeof(packet_record)) {
+					return false;
+				}
+				packet_record packet;
+				std::memcpy(&packet, payload_.get(), sizeof(packet));
+				return header.size == sizeof(packet_record) || header.size == sizeof(packet_record) + static_cast<std::uint64_t>(packet.frames) * sizeof(float);
+			}
+			case record_type::params:
+				return header.size >= sizeof(params_record);
+			case record_type::timing:
+				return header.size >= sizeof(timing_record);
+			case record_type::config:
+				return header.size >= sizeof(config_record);
+			default:
+				// 未知のレコードは読み飛ばせる
+				return true;
+			}
+		}
+
+		std::FILE* file_ = nullptr;
+		file_header header_{};
+		std::unique_ptr<std::uint8_t[]> payload_;
+		std::size_t payload_capacity_ = 0;
+		char const* error_ = nullptr;
+	};
+}
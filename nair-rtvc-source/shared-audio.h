@@ -0,0 +1,443 @@
+﻿#pragma once
+
+// プロセス間で変換後の音声を共有するリング
+//
+// rtvc-host が書き込み、nair-rtvc-source は取り込みバックエンドとして読む。推論はホストで 1 回だけ行う。
+// 書き込み側は 1 つ、読み込み側はそれぞれ自分の読み込み位置を持つ (読み込み側が遅れても書き込み側は待たない)。
+//
+// 共有メモリーの配置
+//   shared_audio_header
+//   float[capacity]
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "capture-backend.h"
+
+namespace rtvc {
+	constexpr char const SHARED_AUDIO_MAGIC[8] = { 'R', 'T', 'V', 'C', 'S', 'H', 'M', 'A' };
+	constexpr std::uint32_t const SHARED_AUDIO_VERSION = 1;
+	constexpr char const SHARED_AUDIO_DEFAULT_NAME[] = "rtvc-host";
+
+	struct shared_audio_header {
+		char magic[8];
+		std::uint32_t version;
+		std::uint32_t sample_rate;
+		std::uint32_t capacity;       ///< フレーム数 (2 の冪)
+		std::uint32_t sample_latency; ///< ホストのエンジンの遅延 [frames]
+
+		alignas(64) std::atomic<std::uint64_t> write_pos; ///< 書き込んだ累積フレーム数
+
+		// 最後の書き込みの先頭フレームと、その元になった入力の取り込み時刻 (seqlock)
+		alignas(64) std::atomic<std::uint32_t> origin_seq;
+		std::atomic<std::uint64_t> origin_pos;
+		std::atomic<std::uint64_t> origin_time_ns;
+	};
+	static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+
+	namespace detail {
+		inline std::size_t shared_audio_size(std::uint32_t capacity) noexcept {
+			return sizeof(shared_audio_header) + static_cast<std::size_t>(capacity) * sizeof(float);
+		}
+
+		inline float* shared_audio_data(shared_audio_header* header) noexcept {
+			return reinterpret_cast<float*>(reinterpret_cast<std::uint8_t*>(header) + sizeof(shared_audio_header));
+		}
+
+#if defined(_WIN32)
+		// Local\<name>
+		inline std::wstring shared_audio_path(std::string const& name) {
+			std::wstring path = L"Local\\";
+			int const length = ::MultiByteToWideChar(CP_UTF8, 0, name.data(), static_cast<int>(name.size()), nullptr, 0);
+			if (length > 0) {
+				std::size_t const offset = path.size();
+				path.resize(offset + static_cast<std::size_t>(length));
+				::MultiByteToWideChar(CP_UTF8, 0, name.data(), static_cast<int>(name.size()), path.data() + offset, length);
+			}
+			return path;
+		}
+#else
+		// /dev/shm/<name>
+		inline std::string shared_audio_path(std::string const& name) {
+			return "/" + name;
+		}
+#endif
+	}
+
+	/// 書き込み側 (rtvc-host)
+	class SharedAudioWriter final {
+	public:
+		SharedAudioWriter() = default;
+		SharedAudioWriter(SharedAudioWriter const&) = delete;
+		SharedAudioWriter& operator=(SharedAudioWriter const&) = delete;
+
+		~SharedAudioWriter() {
+			Close();
+		}
+
+		/// 共有メモリーを作る (capacity は 2 の冪に切り上げる)
+		HRESULT Create(std::string const& name, std::uint32_t sample_rate, std::uint32_t sample_latency, std::uint32_t capacity) {
+			Close();
+
+			std::uint32_t size = 1;
+			while (size < capacity) {
+				size <<= 1;
+			}
+			std::size_t const bytes = detail::shared_audio_size(size);
+
+#if defined(_WIN32)
+			hMapping_ = ::CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(static_cast<std::uint64_t>(bytes) >> 32), static_cast<DWORD>(bytes), detail::shared_audio_path(name).c_str());
+			if (!hMapping_) {
+				return HRESULT_FROM_WIN32(::GetLastError());
+			}
+			void* const view = ::MapViewOfFile(hMapping_, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+			if (!view) {
+				HRESULT const hr = HRESULT_FROM_WIN32(::GetLastError());
+				Close();
+				return hr;
+			}
+#else
+			// 読み込み側が開いたままでも同じものを使い直せるように、閉じても unlink しない
+			int const fd = ::shm_open(detail::shared_audio_path(name).c_str(), O_CREAT | O_RDWR, 0600);
+			if (fd < 0) {
+				return hresult_from_errno(errno);
+			}
+			if (::ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+				HRESULT const hr = hresult_from_errno(errno);
+				::close(fd);
+				Close();
+				return hr;
+			}
+			void* view = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			::close(fd);
+			if (view == MAP_FAILED) {
+				HRESULT const hr = hresult_from_errno(errno);
+				Close();
+				return hr;
+			}
+#endif
+			header_ = static_cast<shared_audio_header*>(view);
+			bytes_ = bytes;
+
+			// 読み込み側は write_pos が戻ったのを見て読み込み位置を合わせ直す
+			header_->version = SHARED_AUDIO_VERSION;
+			header_->sample_rate = sample_rate;
+			header_->capacity = size;
+			header_->sample_latency = sample_latency;
+			header_->origin_seq.store(0, std::memory_order::relaxed);
+			header_->origin_pos.store(0, std::memory_order::relaxed);
+			header_->origin_time_ns.store(0, std::memory_order::relaxed);
+			header_->write_pos.store(0, std::memory_order::relaxed);
+			std::memset(detail::shared_audio_data(header_), 0, static_cast<std::size_t>(size) * sizeof(float));
+			std::atomic_thread_fence(std::memory_order::release);
+			std::memcpy(header_->magic, SHARED_AUDIO_MAGIC, sizeof(header_->magic));
+			return S_OK;
+		}
+
+		void Close() {
+			if (header_) {
+				// 読み込み側に終わったことを知らせる
+				std::memset(header_->magic, 0, sizeof(header_->magic));
+#if defined(_WIN32)
+				::UnmapViewOfFile(header_);
+#else
+				::munmap(header_, bytes_);
+#endif
+				header_ = nullptr;
+			}
+#if defined(_WIN32)
+			if (hMapping_) {
+				::CloseHandle(hMapping_);
+				hMapping_ = nullptr;
+			}
+#endif
+		}
+
+		bool IsOpen() const noexcept {
+			return header_ != nullptr;
+		}
+
+		/// 書き込む (処理スレッドから。data が nullptr なら無音)
+		/// origin_time_ns は先頭フレームの元になった入力の取り込み時刻 (不明なら 0)
+		void Write(float const* data, std::uint32_t frames, std::uint64_t origin_time_ns) noexcept {
+			std::uint32_t const capacity = header_->capacity;
+			float* const buffer = detail::shared_audio_data(header_);
+			std::uint64_t const pos = header_->write_pos.load(std::memory_order::relaxed);
+
+			// 容量を超える分は先頭を捨てる
+			if (frames > capacity) {
+				if (data) {
+					data += frames - capacity;
+				}
+				origin_time_ns = 0;
+				frames = capacity;
+			}
+			std::size_t const offset = static_cast<std::size_t>(pos & (capacity - 1));
+			std::size_t const first = (std::min)(static_cast<std::size_t>(frames), capacity - offset);
+			if (data) {
+				std::memcpy(buffer + offset, data, first * sizeof(float));
+				std::memcpy(buffer, data + first, (frames - first) * sizeof(float));
+			}
+			else {
+				std::memset(buffer + offset, 0, first * sizeof(float));
+				std::memset(buffer, 0, (frames - first) * sizeof(float));
+			}
+
+			std::uint32_t const seq = header_->origin_seq.load(std::memory_order::relaxed);
+			header_->origin_seq.store(seq + 1, std::memory_order::relaxed);
+			std::atomic_thread_fence(std::memory_order::release);
+			header_->origin_pos.store(pos, std::memory_order::relaxed);
+			header_->origin_time_ns.store(origin_time_ns, std::memory_order::relaxed);
+			header_->origin_seq.store(seq + 2, std::memory_order::release);
+
+			header_->write_pos.store(pos + frames, std::memory_order::release);
+		}
+
+	private:
+		shared_audio_header* header_ = nullptr;
+		std::size_t bytes_ = 0;
+#if defined(_WIN32)
+		HANDLE hMapping_ = nullptr;
+#endif
+	};
+
+	/// 読み込み側 (nair-rtvc-source の取り込みバックエンド)
+	///
+	/// 読み込むたびに Wait() がポーリングするので、起床は最大でブロックの 1/4 だけ遅れる。
+	class SharedAudioCapture final : public CaptureBackend {
+	public:
+		explicit SharedAudioCapture(std::string name = SHARED_AUDIO_DEFAULT_NAME)
+			: name_(std::move(name))
+		{
+		}
+
+		~SharedAudioCapture() override {
+			Unmap();
+		}
+
+		char const* Name() const noexcept override {
+			return "host";
+		}
+
+		char const* LastError() const noexcept override {
+			return error_;
+		}
+
+		HRESULT Open(capture_config const& config) override {
+			Unmap();
+			sample_rate_ = config.sample_rate;
+			poll_interval_ = std::chrono::nanoseconds(std::int64_t(1'000'000'000) * config.block_size / config.sample_rate / 4);
+
+#if defined(_WIN32)
+			hMapping_ = ::OpenFileMappingW(FILE_MAP_READ, FALSE, detail::shared_audio_path(name_).c_str());
+			if (!hMapping_) {
+				error_ = "the voice changer host is not running";
+				return HRESULT_FROM_WIN32(::GetLastError());
+			}
+			// まずヘッダーだけ見て大きさを決める
+			void* view = ::MapViewOfFile(hMapping_, FILE_MAP_READ, 0, 0, sizeof(shared_audio_header));
+			if (!view) {
+				error_ = "unable to map the shared memory";
+				return HRESULT_FROM_WIN32(::GetLastError());
+			}
+			std::uint32_t const capacity = static_cast<shared_audio_header const*>(view)->capacity;
+			::UnmapViewOfFile(view);
+			bytes_ = detail::shared_audio_size(capacity);
+			view = ::MapViewOfFile(hMapping_, FILE_MAP_READ, 0, 0, bytes_);
+			if (!view) {
+				error_ = "unable to map the shared memory";
+				return HRESULT_FROM_WIN32(::GetLastError());
+			}
+#else
+			int const fd = ::shm_open(detail::shared_audio_path(name_).c_str(), O_RDONLY, 0);
+			if (fd < 0) {
+				error_ = "the voice changer host is not running";
+				return hresult_from_errno(errno);
+			}
+			struct stat st {};
+			if (::fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(shared_audio_header)) {
+				::close(fd);
+				error_ = "the shared memory is too small";
+				return E_FAIL;
+			}
+			bytes_ = static_cast<std::size_t>(st.st_size);
+			void* view = ::mmap(nullptr, bytes_, PROT_READ, MAP_SHARED, fd, 0);
+			::close(fd);
+			if (view == MAP_FAILED) {
+				error_ = "unable to map the shared memory";
+				return hresult_from_errno(errno);
+			}
+#endif
+			header_ = static_cast<shared_audio_header const*>(view);
+
+			if (std::memcmp(header_->magic, SHARED_AUDIO_MAGIC, sizeof(SHARED_AUDIO_MAGIC)) != 0 || header_->version != SHARED_AUDIO_VERSION) {
+				error_ = "the voice changer host is not running or has a different version";
+				return E_FAIL;
+			}
+			if (bytes_ < detail::shared_audio_size(header_->capacity)) {
+				error_ = "the shared memory is too small";
+				return E_FAIL;
+			}
+			if (static_cast<int>(header_->sample_rate) != config.sample_rate) {
+				error_ = "the voice changer host runs at a different sample rate";
+				return E_INVALIDARG;
+			}
+			capacity_ = header_->capacity;
+			return S_OK;
+		}
+
+		std::uint32_t MaxPacketFrames() const noexcept override {
+			return capacity_ / 4;
+		}
+
+		HRESULT Start() override {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				interrupted_ = false;
+			}
+			// 過去の音は流さない
+			read_pos_ = header_->write_pos.load(std::memory_order::acquire);
+			resync_ = false;
+			return S_OK;
+		}
+
+		HRESULT Wait() override {
+			std::unique_lock<std::mutex> lock(mutex_);
+			for (;;) {
+				if (interrupted_) {
+					return S_FALSE;
+				}
+				if (std::memcmp(header_->magic, SHARED_AUDIO_MAGIC, sizeof(SHARED_AUDIO_MAGIC)) != 0) {
+					// ホストが終わった (開き直すのは呼び出し側)
+					error_ = "the voice changer host has ended";
+					return CAPTURE_E_DEVICE_INVALIDATED;
+				}
+				if (header_->write_pos.load(std::memory_order::acquire) != read_pos_) {
+					return S_OK;
+				}
+				cv_.wait_for(lock, poll_interval_, [this] { return interrupted_; });
+			}
+		}
+
+		void Interrupt() noexcept override {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				interrupted_ = true;
+			}
+			cv_.notify_all();
+		}
+
+		HRESULT Acquire(capture_packet& packet) override {
+			std::uint64_t const write_pos = header_->write_pos.load(std::memory_order::acquire);
+			std::uint32_t flags = resync_ ? CAPTURE_FLAG_DISCONTINUITY : 0;
+			resync_ = false;
+
+			// ホストが作り直したか、追いつけないほど遅れた
+			if (write_pos < read_pos_ || write_pos - read_pos_ > capacity_ / 2) {
+				read_pos_ = write_pos > MaxPacketFrames() ? write_pos - MaxPacketFrames() : 0;
+				flags |= CAPTURE_FLAG_DISCONTINUITY;
+			}
+
+			std::size_t const offset = static_cast<std::size_t>(read_pos_ & (capacity_ - 1));
+			std::uint32_t const frames = static_cast<std::uint32_t>((std::min)({ write_pos - read_pos_, static_cast<std::uint64_t>(capacity_ - offset), static_cast<std::uint64_t>(MaxPacketFrames()) }));
+
+			packet.data = detail::shared_audio_data(const_cast<shared_audio_header*>(header_)) + offset;
+			packet.frames = frames;
+			packet.flags = flags;
+			packet.device_time_ns = OriginTime(read_pos_);
+			if (packet.device_time_ns == 0) {
+				packet.flags |= CAPTURE_FLAG_TIMESTAMP_ERROR;
+			}
+			return S_OK;
+		}
+
+		HRESULT Release(capture_packet const& packet) override {
+			read_pos_ += packet.frames;
+
+			// 読んでいる間に上書きされていたら次のパケットで知らせる
+			if (header_->write_pos.load(std::memory_order::acquire) - (read_pos_ - packet.frames) > capacity_) {
+				resync_ = true;
+			}
+			return S_OK;
+		}
+
+		HRESULT Stop() override {
+			return S_OK;
+		}
+
+	private:
+		/// pos のフレームの元になった入力の取り込み時刻 (不明なら 0)
+		std::uint64_t OriginTime(std::uint64_t pos) const noexcept {
+			for (int retry = 0; retry < 4; ++retry) {
+				std::uint32_t const seq0 = header_->origin_seq.load(std::memory_order::acquire);
+				if (seq0 & 1) {
+					continue;
+				}
+				std::uint64_t const origin_pos = header_->origin_pos.load(std::memory_order::relaxed);
+				std::uint64_t const origin_time = header_->origin_time_ns.load(std::memory_order::relaxed);
+				std::atomic_thread_fence(std::memory_order::acquire);
+				if (header_->origin_seq.load(std::memory_order::relaxed) != seq0) {
+					continue;
+				}
+				if (origin_time == 0) {
+					return 0;
+				}
+				std::int64_t const frames = static_cast<std::int64_t>(pos - origin_pos);
+				return origin_time + frames * 1'000'000'000ll / sample_rate_;
+			}
+			return 0;
+		}
+
+		void Unmap() {
+			if (header_) {
+#if defined(_WIN32)
+				::UnmapViewOfFile(header_);
+#else
+				::munmap(const_cast<shared_audio_header*>(header_), bytes_);
+#endif
+				header_ = nullptr;
+			}
+#if defined(_WIN32)
+			if (hMapping_) {
+				::CloseHandle(hMapping_);
+				hMapping_ = nullptr;
+			}
+#endif
+		}
+
+		std::string name_;
+		char const* error_ = "";
+		shared_audio_header const* header_ = nullptr;
+		std::size_t bytes_ = 0;
+#if defined(_WIN32)
+		HANDLE hMapping_ = nullptr;
+#endif
+		int sample_rate_ = 24'000;
+		std::uint32_t capacity_ = 0;
+		std::uint64_t read_pos_ = 0;
+		bool resync_ = false;
+		std::chrono::nanoseconds poll_interval_{ 2'000'000 };
+
+		std::mutex mutex_;
+		std::condition_variable cv_;
+		bool interrupted_ = false;
+	};
+}
@@ -0,0 +1,475 @@
+﻿#pragma once
+
+// DSP のカーネル (読み込んだときに CPU を見て選ぶ)
+//
+// ビルドは x86-64 の基本命令 (SSE2) だけを前提にし、AVX2 と AVX-512 の版は関数ごとに命令セットを指定して作る。
+// 読み込んだときに CPUID と OS の対応 (XGETBV) を見て、使える一番新しい版を kernels() が返すようにする。
+// x86 以外では、SSE2 の版を OBS に同梱の SIMDe で移植して使う。
+//
+// scalar、SSE2、AVX2 の結果はビット単位で同じになる (総和は 16 本の部分和を同じ順に足す)。
+// AVX-512 の版は FMA を使うので、丸めだけが違う。rtvc-simd-check で確かめられる。
+// プラグインは /fp:fast でビルドするが、並べ替えや FMA への縮約で版ごとの結果が変わらないように、ここだけは precise にする (GCC では -ffast-math を外す)。
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#if !defined(RTVC_SIMD_X86)
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define RTVC_SIMD_X86 1
+#else
+#define RTVC_SIMD_X86 0
+#endif
+#endif
+
+#if RTVC_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif __has_include("../thirdparty/obs-libs/include/util/simde/x86/sse2.h")
+#define SIMDE_ENABLE_NATIVE_ALIASES
+#include "../thirdparty/obs-libs/include/util/simde/x86/sse2.h"
+#define RTVC_SIMD_SIMDE 1
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+// MSVC は /arch を付けなくても AVX2 と AVX-512 の組み込み関数を使える
+#define RTVC_SIMD_TARGET(isa)
+#else
+#define RTVC_SIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+#if defined(_MSC_VER) || defined(__clang__)
+#pragma float_control(precise, on, push)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC optimize("no-fast-math", "fp-contract=off")
+#endif
+
+namespace rtvc::simd {
+	enum class level : int {
+		scalar = 0,
+		sse2 = 1,
+		avx2 = 2,
+		avx512 = 3,
+	};
+
+	inline constexpr char const* to_string(level isa) noexcept {
+		switch (isa) {
+		case level::scalar: return "scalar";
+		case level::sse2: return "sse2";
+		case level::avx2: return "avx2";
+		case level::avx512: return "avx512";
+		default: return "unknown";
+		}
+	}
+
+	/// 名前から選ぶ (見つからなければ false)
+	inline bool from_string(char const* name, level& isa) noexcept {
+		for (level const candidate : { level::scalar, level::sse2, level::avx2, level::avx512 }) {
+			char const* a = name;
+			char const* b = to_string(candidate);
+			while (*a && *a == *b) {
+				++a;
+				++b;
+			}
+			if (*a == *b) {
+				isa = candidate;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	struct kernel_table {
+		level isa;
+		/// y[i] = x[i] * gain (x と y は同じでもよい)
+		void (*scale)(float const* x, float* y, float gain, std::size_t n) noexcept;
+		/// y[i] = a[i] + (b[i] - a[i]) * min((first + i) * step, 1) (a から b へのクロスフェード。y は a か b と同じでもよい。first + n は 2^31 未満)
+		void (*crossfade)(float const* a, float const* b, float* y, std::uint32_t first, float step, std::size_t n) noexcept;
+		/// sum a[i] * b[i]
+		float (*dot)(float const* a, float const* b, std::size_t n) noexcept;
+		/// sum (a[i] - b[i])^2
+		float (*squared_distance)(float const* a, float const* b, std::size_t n) noexcept;
+	};
+
+	namespace detail {
+		/// 16 本の部分和を足す (どの版も同じ順に)
+		inline float sum16(float const* s) noexcept {
+			float t[8];
+			for (int k = 0; k < 8; ++k) {
+				t[k] = s[k] + s[k + 8];
+			}
+			return ((t[0] + t[1]) + (t[2] + t[3])) + ((t[4] + t[5]) + (t[6] + t[7]));
+		}
+
+		inline void scale_scalar(float const* x, float* y, float gain, std::size_t n) noexcept {
+			for (std::size_t i = 0; i < n; ++i) {
+				y[i] = x[i] * gain;
+			}
+		}
+
+		inline void crossfade_scalar(float const* a, float const* b, float* y, std::uint32_t first, float step, std::size_t n) noexcept {
+			for (std::size_t i = 0; i < n; ++i) {
+				float const w = (std::min)(static_cast<float>(static_cast<std::int32_t>(first + static_cast<std::uint32_t>(i))) * step, 1.0f);
+				y[i] = a[i] + (b[i] - a[i]) * w;
+			}
+		}
+
+		inline float dot_scalar(float const* a, float const* b, std::size_t n) noexcept {
+			float sums[16] = {};
+			std::size_t i = 0;
+			for (; i + 16 <= n; i += 16) {
+				for (std::size_t k = 0; k < 16; ++k) {
+					sums[k] += a[i + k] * b[i + k];
+				}
+			}
+			float sum = sum16(sums);
+			for (; i < n; ++i) {
+				sum += a[i] * b[i];
+			}
+			return sum;
+		}
+
+		inline float squared_distance_scalar(float const* a, float const* b, std::size_t n) noexcept {
+			float sums[16] = {};
+			std::size_t i = 0;
+			for (; i + 16 <= n; i += 16) {
+				for (std::size_t k = 0; k < 16; ++k) {
+					float const d = a[i + k] - b[i + k];
+					sums[k] += d * d;
+				}
+			}
+			float sum = sum16(sums);
+			for (; i < n; ++i) {
+				float const d = a[i] - b[i];
+				sum += d * d;
+			}
+			return sum;
+		}
+
+#if RTVC_SIMD_X86 || RTVC_SIMD_SIMDE
+		inline void scale_sse2(float const* x, float* y, float gain, std::size_t n) noexcept {
+			__m128 const g = _mm_set1_ps(gain);
+			std::size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				_mm_storeu_ps(y + i, _mm_mul_ps(_mm_loadu_ps(x + i), g));
+			}
+			scale_scalar(x + i, y + i, gain, n - i);
+		}
+
+		inline void crossfade_sse2(float const* a, float const* b, float* y, std::uint32_t first, float step, std::size_t n) noexcept {
+			__m128 const s = _mm_set1_ps(step);
+			__m128 const one = _mm_set1_ps(1.0f);
+			__m128i const lanes = _mm_setr_epi32(0, 1, 2, 3);
+			std::size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				__m128i const index = _mm_add_epi32(_mm_set1_epi32(static_cast<int>(first + static_cast<std::uint32_t>(i))), lanes);
+				__m128 const w = _mm_min_ps(_mm_mul_ps(_mm_cvtepi32_ps(index), s), one);
+				__m128 const va = _mm_loadu_ps(a + i);
+				_mm_storeu_ps(y + i, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(b + i), va), w)));
+			}
+			crossfade_scalar(a + i, b + i, y + i, first + static_cast<std::uint32_t>(i), step, n - i);
+		}
+
+		inline float dot_sse2(float const* a, float const* b, std::size_t n) noexcept {
+			__m128 s[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+			std::size_t i = 0;
+			for (; i + 16 <= n; i += 16) {
+				for (int k = 0; k < 4; ++k) {
+					s[k] = _mm_add_ps(s[k], _mm_mul_ps(_mm_loadu_ps(a + i + 4 * k), _mm_loadu_ps(b + i + 4 * k)));
+				}
+			}
+			float sums[16];
+			for (int k = 0; k < 4; ++k) {
+				_mm_storeu_ps(sums + 4 * k, s[k]);
+			}
+			float sum = sum16(sums);
+			for (; i < n; ++i) {
+				sum += a[i] * b[i];
+			}
+			return sum;
+		}
+
+		inline float squared_distance_sse2(float const* a, float const* b, std::size_t n) noexcept {
+			__m128 s[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+			std::size_t i = 0;
+			for (; i + 16 <= n; i += 16) {
+				for (int k = 0; k < 4; ++k) {
+					__m128 const d = _mm_sub_ps(_mm_loadu_ps(a + i + 4 * k), _mm_loadu_ps(b + i + 4 * k));
+					s[k] = _mm_add_ps(s[k], _mm_mul_ps(d, d));
+				}
+			}
+			float sums[16];
+			for (int k = 0; k < 4; ++k) {
+				_mm_storeu_ps(sums + 4 * k, s[k]);
+			}
+			float sum = sum16(sums);
+			for (; i < n; ++i) {
+				float const d = a[i] - b[i];
+				sum += d * d;
+			}
+			return sum;
+		}
+#endif
+
+#if RTVC_SIMD_X86
+		// FMA は使わない (scalar と丸めを揃える)
+		RTVC_SIMD_TARGET("avx2")
+		inline void scale_avx2(float const* x, float* y, float gain, std::size_t n) noexcept {
+			__m256 const g = _mm256_set1_ps(gain);
+			std::size_t i = 0;
+			for (; i + 8 <= n; i += 8) {
+				_mm256_storeu_ps(y + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), g));
+			}
+			_mm256_zeroupper();
+			scale_scalar(x + i, y + i, gain, n - i);
+		}
+
+		RTVC_SIMD_TARGET("avx2")
+		inline void crossfade_avx2(float const* a, float const* b, float* y, std::uint32_t first, float step, std::size_t n) noexcept {
+			__m256 const s = _mm256_set1_ps(step);
+			__m256 const one = _mm256_set1_ps(1.0f);
+			__m256i const lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+			std::size_t i = 0;
+			for (; i + 8 <= n; i += 8) {
+				__m256i const index = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(first + static_cast<std::uint32_t>(i))), lanes);
+				__m256 const w = _mm256_min_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(index), s), one);
+				__m256 const va = _mm256_loadu_ps(a + i);
+				_mm256_storeu_ps(y + i, _mm256_add_ps(va, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(b + i), va), w)));
+			}
+			_mm256_zeroupper();
+			crossfade_scalar(a + i, b + i, y + i, first + static_cast<std::uint32_t>(i), step, n - i);
+		}
+
+		RTVC_SIMD_TARGET("avx2")
+		inline float dot_avx2(float const* a, float const* b, std::size_t n) noexcept {
+			__m256 s0 = _mm256_setzero_ps();
+			__m256 s1 = _mm256_setzero_ps();
+			std::size_t i = 0;
+			for (; i + 16 <= n; i += 16) {
+				s0 = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+				s1 = _mm256_add_ps(s1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+			}
+			float sums[16];
+			_mm256_storeu_ps(sums, s0);
+			_mm256_storeu_ps(sums + 8, s1);
+			_mm256_zeroupper();
+			float sum = sum16(sums);
+			for (; i < n; ++i) {
+				sum += a[i] * b[i];
+			}
+			return sum;
+		}
+
+		RTVC_SIMD_TARGET("avx2")
+		inline float squared_distance_avx2(float const* a, float const* b, std::size_t n) noexcept {
+			__m256 s0 = _mm256_setzero_ps();
+			__m256 s1 = _mm256_setzero_ps();
+			std::size_t i = 0;
+			for (; i + 16 <= n; i += 16) {
+				__m256 const d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+				__m256 const d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+				s0 = _mm256_add_ps(s0, _mm256_mul_ps(d0, d0));
+				s1 = _mm256_add_ps(s1, _mm256_mul_ps(d1, d1));
+			}
+			float sums[16];
+			_mm256_storeu_ps(sums, s0);
+			_mm256_storeu_ps(sums + 8, s1);
+			_mm256_zeroupper();
+			float sum = sum16(sums);
+			for (; i < n; ++i) {
+				float const d = a[i] - b[i];
+				sum += d * d;
+			}
+			return sum;
+		}
+
+		// AVX-512 は FMA を使い、端数はマスクで読み書きする
+		RTVC_SIMD_TARGET("avx512f")
+		inline __mmask16 tail_mask(std::size_t remaining) noexcept {
+			return static_cast<__mmask16>((1u << remaining) - 1u);
+		}
+
+		RTVC_SIMD_TARGET("avx512f")
+		inline void scale_avx512(float const* x, float* y, float gain, std::size_t n) noexcept {
+			__m512 const g = _mm512_set1_ps(gain);
+			std::size_t i = 0;
+			for (; i + 16 <= n; i += 16) {
+				_mm512_storeu_ps(y + i, _mm512_mul_ps(_mm512_loadu_ps(x + i), g));
+			}
+			if (i < n) {
+				__mmask16 const m = tail_mask(n - i);
+				_mm512_mask_storeu_ps(y + i, m, _mm512_mul_ps(_mm512_maskz_loadu_ps(m, x + i), g));
+			}
+			_mm256_zeroupper();
+		}
+
+		RTVC_SIMD_TARGET("avx512f")
+		inline void crossfade_avx512(float const* a, float const* b, float* y, std::uint32_t first, float step, std::size_t n) noexcept {
+			__m512 const s = _mm512_set1_ps(step);
+			__m512 const one = _mm512_set1_ps(1.0f);
+			__m512i const lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+			for (std::size_t i = 0; i < n; i += 16) {
+				__mmask16 const m = n - i >= 16 ? static_cast<__mmask16>(0xFFFF) : tail_mask(n - i);
+				__m512i const index = _mm512_add_epi32(_mm512_set1_epi32(static_cast<int>(first + static_cast<std::uint32_t>(i))), lanes);
+				__m512 const w = _mm512_maskz_min_ps(0xFFFF, _mm512_mul_ps(_mm512_maskz_cvtepi32_ps(0xFFFF, index), s), one);
+				__m512 const va = _mm512_maskz_loadu_ps(m, a + i);
+				_mm512_mask_storeu_ps(y + i, m, _mm512_fmadd_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(m, b + i), va), w, va));
+			}
+			_mm256_zeroupper();
+		}
+
+		RTVC_SIMD_TARGET("avx512f")
+		inline float dot_avx512(float const* a, float const* b, std::size_t n) noexcept {
+			__m512 s = _mm512_setzero_ps();
+			std::size_t i = 0;
+			for (; i + 16 <= n; i += 16) {
+				s = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), s);
+			}
+			if (i < n) {
+				__mmask16 const m = tail_mask(n - i);
+				s = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), s);
+			}
+			float sums[16];
+			_mm512_storeu_ps(sums, s);
+			_mm256_zeroupper();
+			return sum16(sums);
+		}
+
+		RTVC_SIMD_TARGET("avx512f")
+		inline float squared_distance_avx512(float const* a, float const* b, std::size_t n) noexcept {
+			__m512 s = _mm512_setzero_ps();
+			std::size_t i = 0;
+			for (; i + 16 <= n; i += 16) {
+				__m512 const d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+				s = _mm512_fmadd_ps(d, d, s);
+			}
+			if (i < n) {
+				__mmask16 const m = tail_mask(n - i);
+				__m512 const d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i));
+				s = _mm512_fmadd_ps(d, d, s);
+			}
+			float sums[16];
+			_mm512_storeu_ps(sums, s);
+			_mm256_zeroupper();
+			return sum16(sums);
+		}
+
+		inline void cpuid(int leaf, int subleaf, unsigned int (&regs)[4]) noexcept {
+#if defined(_MSC_VER)
+			int r[4];
+			__cpuidex(r, leaf, subleaf);
+			for (int i = 0; i < 4; ++i) {
+				regs[i] = static_cast<unsigned int>(r[i]);
+			}
+#else
+			__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+		}
+
+		inline std::uint64_t xgetbv0() noexcept {
+#if defined(_MSC_VER)
+			return _xgetbv(0);
+#else
+			unsigned int eax = 0;
+			unsigned int edx = 0;
+			__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			return (static_cast<std::uint64_t>(edx) << 32) | eax;
+#endif
+		}
+#endif
+
+		inline constexpr kernel_table const SCALAR_KERNELS{ level::scalar, &scale_scalar, &crossfade_scalar, &dot_scalar, &squared_distance_scalar };
+#if RTVC_SIMD_X86 || RTVC_SIMD_SIMDE
+		inline constexpr kernel_table const SSE2_KERNELS{ level::sse2, &scale_sse2, &crossfade_sse2, &dot_sse2, &squared_distance_sse2 };
+#endif
+#if RTVC_SIMD_X86
+		inline constexpr kernel_table const AVX2_KERNELS{ level::avx2, &scale_avx2, &crossfade_avx2, &dot_avx2, &squared_distance_avx2 };
+		inline constexpr kernel_table const AVX512_KERNELS{ level::avx512, &scale_avx512, &crossfade_avx512, &dot_avx512, &squared_distance_avx512 };
+#endif
+	}
+
+	/// この CPU と OS で使える一番新しい版
+	inline level detect() noexcept {
+#if RTVC_SIMD_X86
+		unsigned int regs[4] = {};
+		detail::cpuid(0, 0, regs);
+		unsigned int const max_leaf = regs[0];
+		detail::cpuid(1, 0, regs);
+		if (!(regs[3] & (1u << 26))) {
+			return level::scalar;
+		}
+		// OS が YMM (と ZMM) のレジスターを保存するか
+		bool const osxsave = (regs[2] & (1u << 27)) != 0;
+		bool const avx = (regs[2] & (1u << 28)) != 0;
+		std::uint64_t const xcr0 = osxsave ? detail::xgetbv0() : 0;
+		if (!avx || (xcr0 & 0x6) != 0x6 || max_leaf < 7) {
+			return level::sse2;
+		}
+		detail::cpuid(7, 0, regs);
+		bool const avx2 = (regs[1] & (1u << 5)) != 0;
+		bool const avx512f = (regs[1] & (1u << 16)) != 0;
+		if (!avx2) {
+			return level::sse2;
+		}
+		if (!avx512f || (xcr0 & 0xE6) != 0xE6) {
+			return level::avx2;
+		}
+		return level::avx512;
+#elif RTVC_SIMD_SIMDE
+		return level::sse2;
+#else
+		return level::scalar;
+#endif
+	}
+
+	/// 指定した版のカーネル (ビルドしていない版なら、その下の版)
+	inline kernel_table const& kernels_for(level isa) noexcept {
+		switch (isa) {
+#if RTVC_SIMD_X86
+		case level::avx512: return detail::AVX512_KERNELS;
+		case level::avx2: return detail::AVX2_KERNELS;
+#else
+		case level::avx512:
+		case level::avx2:
+#endif
+#if RTVC_SIMD_X86 || RTVC_SIMD_SIMDE
+		case level::sse2: return detail::SSE2_KERNELS;
+#else
+		case level::sse2:
+#endif
+		default: return detail::SCALAR_KERNELS;
+		}
+	}
+
+	/// 読み込んだときに調べた結果
+	inline level const supported_level = detect();
+
+	namespace detail {
+		inline kernel_table const* active_kernels = &kernels_for(supported_level);
+	}
+
+	/// 使っている版のカーネル
+	inline kernel_table const& kernels() noexcept {
+		return *detail::active_kernels;
+	}
+
+	/// 古い版に切り替える (比べるとき用。リアルタイムスレッドを動かす前に呼ぶ。CPU が対応していない版は選べない)
+	inline bool use(level isa) noexcept {
+		if (isa > supported_level) {
+			return false;
+		}
+		detail::active_kernels = &kernels_for(isa);
+		return true;
+	}
+}
+
+#if defined(_MSC_VER) || defined(__clang__)
+#pragma float_control(pop)
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
@@ -0,0 +1,90 @@
+﻿#pragma once
+
+// 単一生産者・単一消費者のロックフリーリング
+//
+// 生産者と消費者がそれぞれ 1 スレッドなら、どちらもロックやメモリー確保なしに呼べる。
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+
+namespace rtvc {
+	template <typename T>
+	class SpscRing final {
+		static_assert(std::is_trivially_copyable_v<T>);
+
+	public:
+		/// 容量を 2 の冪に切り上げて確保する (リアルタイムスレッドの外で)
+		void Reset(std::size_t capacity) {
+			std::size_t size = 1;
+			while (size < capacity) {
+				size <<= 1;
+			}
+			buffer_.reset(new T[size]);
+			capacity_ = size;
+			read_pos_.store(0, std::memory_order::relaxed);
+			write_pos_.store(0, std::memory_order::relaxed);
+		}
+
+		std::size_t Capacity() const noexcept {
+			return capacity_;
+		}
+
+		/// 読み出せる要素数 (消費者から)
+		std::size_t Readable() const noexcept {
+			return static_cast<std::size_t>(write_pos_.load(std::memory_order::acquire) - read_pos_.load(std::memory_order::relaxed));
+		}
+
+		/// 書き込める要素数 (生産者から)
+		std::size_t Writable() const noexcept {
+			return capacity_ - static_cast<std::size_t>(write_pos_.load(std::memory_order::relaxed) - read_pos_.load(std::memory_order::acquire));
+		}
+
+		/// 書けるだけ書いて、書いた要素数を返す (data が nullptr ならゼロを書く)
+		std::size_t Write(T const* data, std::size_t count) noexcept {
+			count = (std::min)(count, Writable());
+			std::uint64_t const pos = write_pos_.load(std::memory_order::relaxed);
+			std::size_t const offset = static_cast<std::size_t>(pos & (capacity_ - 1));
+			std::size_t const first = (std::min)(count, capacity_ - offset);
+			if (data) {
+				std::memcpy(buffer_.get() + offset, data, first * sizeof(T));
+				std::memcpy(buffer_.get(), data + first, (count - first) * sizeof(T));
+			}
+			else {
+				std::memset(buffer_.get() + offset, 0, first * sizeof(T));
+				std::memset(buffer_.get(), 0, (count - first) * sizeof(T));
+			}
+			write_pos_.store(pos + count, std::memory_order::release);
+			return count;
+		}
+
+		/// 読めるだけ読んで、読んだ要素数を返す
+		std::size_t Read(T* data, std::size_t count) noexcept {
+			count = (std::min)(count, Readable());
+			std::uint64_t const pos = read_pos_.load(std::memory_order::relaxed);
+			std::size_t const offset = static_cast<std::size_t>(pos & (capacity_ - 1));
+			std::size_t const first = (std::min)(count, capacity_ - offset);
+			std::memcpy(data, buffer_.get() + offset, first * sizeof(T));
+			std::memcpy(data + first, buffer_.get(), (count - first) * sizeof(T));
+			read_pos_.store(pos + count, std::memory_order::release);
+			return count;
+		}
+
+		/// 読まずに捨てる
+		std::size_t Skip(std::size_t count) noexcept {
+			count = (std::min)(count, Readable());
+			read_pos_.store(read_pos_.load(std::memory_order::relaxed) + count, std::memory_order::release);
+			return count;
+		}
+
+	private:
+		std::unique_ptr<T[]> buffer_;
+		std::size_t capacity_ = 0;
+		alignas(64) std::atomic<std::uint64_t> write_pos_ = 0;
+		alignas(64) std::atomic<std::uint64_t> read_pos_ = 0;
+	};
+}
@@ -0,0 +1,240 @@
+﻿#pragma once
+
+// 試験用のエンジン (stub)
+//
+// rtvc.vvfx と同じ関数テーブルの形で、入力を get_sample_latency() のフレーム数だけ遅らせてそのまま返す。
+// 遅延が分かっているので、見張り (EngineWatchdog) の期限や、遅延の勘定を実際のエンジンなしで試せる。
+// stall で決まったブロックの処理を 1 度だけ止められる (ドライバーやページインで止まったときの代わり)。
+// process_n() も持ち、呼び出しごとにかかる時間 (call_us、GPU への投入や同期の代わり) を 1 回だけ払うので、
+// 1 ブロックずつ呼んだときとまとめて呼んだときを比べられる。どちらで呼んでも出力は同じ。
+//
+// gain と version で出力の大きさと get_version() を変えられるので、版の違う 2 つのビルド (rtvc-stub-engine) で
+// エンジンの差し替えを試せる。
+//
+// 状態は 1 つしか持たない (rtvc-replay から 1 つだけ開く。共有ライブラリーにしたときは複製ごとに 1 つで、
+// rtvc-stub-engine はそのために stub 名前空間を隠して公開する)。
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "delay-line.h"
+#include "rtvc-engine.h"
+
+namespace rtvc {
+	struct stub_engine_config {
+		int sample_rate = 24'000;
+		int block_size = 256;
+		int sample_latency = 480;        ///< 入力をこのフレーム数だけ遅らせて返す
+		std::uint64_t stall_block = 0;   ///< このブロック (1 から数える) の処理で 1 度だけ止まる (0 なら止まらない)
+		double stall_ms = 300.0;
+		double call_us = 0.0;            ///< 呼び出しごとにかかる時間 (ブロック数によらない。回して待つ)
+		int max_blocks = 8;              ///< get_max_blocks() で返す (0 なら process_n() を持たない)
+		float gain = 1.0f;               ///< 遅らせた入力に掛ける
+		int version = 0;                 ///< get_version() の major
+	};
+
+	/// "rate=24000;block=256;latency=480;stall=150;stall_ms=300;call_us=50;max_blocks=8;gain=1;version=0" を設定にする
+	inline bool parse_stub_engine_config(std::string const& spec, stub_engine_config& config) {
+		std::size_t pos = 0;
+		while (pos < spec.size()) {
+			std::size_t const end = (std::min)(spec.find(';', pos), spec.size());
+			std::string const item = spec.substr(pos, end - pos);
+			pos = end + 1;
+
+			std::size_t const eq = item.find('=');
+			if (eq == std::string::npos) {
+				return false;
+			}
+			std::string const key = item.substr(0, eq);
+			std::string const value = item.substr(eq + 1);
+			if (key == "rate") {
+				config.sample_rate = std::atoi(value.c_str());
+			}
+			else if (key == "block") {
+				config.block_size = std::atoi(value.c_str());
+			}
+			else if (key == "latency") {
+				config.sample_latency = std::atoi(value.c_str());
+			}
+			else if (key == "stall") {
+				config.stall_block = static_cast<std::uint64_t>(std::strtoull(value.c_str(), nullptr, 10));
+			}
+			else if (key == "stall_ms") {
+				config.stall_ms = std::strtod(value.c_str(), nullptr);
+			}
+			else if (key == "call_us") {
+				config.call_us = std::strtod(value.c_str(), nullptr);
+			}
+			else if (key == "max_blocks") {
+				config.max_blocks = std::atoi(value.c_str());
+			}
+			else if (key == "gain") {
+				config.gain = std::strtof(value.c_str(), nullptr);
+			}
+			else if (key == "version") {
+				config.version = std::atoi(value.c_str());
+			}
+			else {
+				return false;
+			}
+		}
+		return config.sample_rate > 0 && config.block_size > 0 && config.sample_latency >= 0 && config.max_blocks >= 0;
+	}
+
+	namespace stub {
+		struct engine_state {
+			stub_engine_config config;
+			DelayLine delay;
+			std::uint64_t blocks = 0;
+		};
+
+		inline engine_state& state() {
+			static engine_state instance;
+			return instance;
+		}
+
+		inline int RTVC_CALL get_protocol_version(int* major_version, int* minor_version, int* revision) {
+			*major_version = 1;
+			*minor_version = 0;
+			*revision = 0;
+			return 0;
+		}
+
+		inline int RTVC_CALL init([[maybe_unused]] char const* model_name) {
+			engine_state& s = state();
+			std::size_t const max_frames = static_cast<std::size_t>((std::max)(s.config.max_blocks, 1)) * s.config.block_size;
+			s.delay.Reset(static_cast<std::uint32_t>(s.config.sample_latency), max_frames);
+			s.blocks = 0;
+			return 0;
+		}
+
+		/// 呼び出しごとの時間 (sleep では粗すぎるので回して待つ)
+		inline void spend_call_time(double call_us) noexcept {
+			if (call_us <= 0.0) {
+				return;
+			}
+			auto const until = std::chrono::steady_clock::now() + std::chrono::duration<double, std::micro>(call_us);
+			while (std::chrono::steady_clock::now() < until) {
+			}
+		}
+
+		/// num_blocks ブロックを通す (stall のブロックが含まれていれば止まる)
+		inline void pass_blocks(engine_state& s, int num_blocks, float const* x, float* y) noexcept {
+			if (s.blocks < s.config.stall_block && s.blocks + static_cast<std::uint64_t>(num_blocks) >= s.config.stall_block) {
+				std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(s.config.stall_ms));
+			}
+			s.blocks += static_cast<std::uint64_t>(num_blocks);
+			std::uint32_t const frames = static_cast<std::uint32_t>(num_blocks * s.config.block_size);
+			s.delay.Process(x, y, frames);
+			if (s.config.gain != 1.0f) {
+				for (std::uint32_t i = 0; i < frames; ++i) {
+					y[i] *= s.config.gain;
+				}
+			}
+		}
+
+		inline int RTVC_CALL destroy() {
+			return 0;
+		}
+
+		inline int RTVC_CALL process([[maybe_unused]] int num_params, [[maybe_unused]] float const* params, float const* x, float* y) {
+			engine_state& s = state();
+			spend_call_time(s.config.call_us);
+			pass_blocks(s, 1, x, y);
+			return 0;
+		}
+
+		// x と y は同じでもよい (DelayLine は in を積んでから out に書く)
+		inline int RTVC_CALL process_n([[maybe_unused]] int num_params, [[maybe_unused]] float const* params, int num_blocks, float const* x, float* y) {
+			engine_state& s = state();
+			if (num_blocks < 1 || num_blocks > s.config.max_blocks) {
+				return -1;
+			}
+			spend_call_time(s.config.call_us);
+			pass_blocks(s, num_blocks, x, y);
+			return 0;
+		}
+
+		inline int RTVC_CALL get_max_blocks(int* max_blocks) {
+			*max_blocks = state().config.max_blocks;
+			return 0;
+		}
+
+		inline int RTVC_CALL get_version(int* major_version, int* minor_version, int* revision) {
+			*major_version = state().config.version;
+			*minor_version = 0;
+			*revision = 0;
+			return 0;
+		}
+
+		inline int RTVC_CALL get_sample_rate(int* sample_rate) {
+			*sample_rate = state().config.sample_rate;
+			return 0;
+		}
+
+		inline int RTVC_CALL get_sample_latency(int* sample_latency) {
+			*sample_latency = state().config.sample_latency;
+			return 0;
+		}
+
+		inline int RTVC_CALL get_block_size(int* block_size) {
+			*block_size = state().config.block_size;
+			return 0;
+		}
+
+		inline int RTVC_CALL get_num_params(int* num_params) {
+			*num_params = 0;
+			return 0;
+		}
+
+		inline int RTVC_CALL get_param_name([[maybe_unused]] int i, [[maybe_unused]] char const** param_name) {
+			return -1;
+		}
+
+		inline int RTVC_CALL get_num_voices(int* num_voices) {
+			*num_voices = 1;
+			return 0;
+		}
+
+		inline int RTVC_CALL get_voice_name(int i, char const** voice_name) {
+			if (i != 0) {
+				return -1;
+			}
+			*voice_name = "delay (stub)";
+			return 0;
+		}
+
+		inline int RTVC_CALL set_voice([[maybe_unused]] int voice_id) {
+			return 0;
+		}
+
+		inline int RTVC_CALL set_voices([[maybe_unused]] int num_voices, [[maybe_unused]] int const* voice_ids, [[maybe_unused]] float const* voice_amounts) {
+			return 0;
+		}
+	}
+
+	/// 試験用のエンジンの関数テーブル (init() の前に呼ぶ)
+	inline void stub_engine_api(engine_api& api, stub_engine_config const& config) {
+		stub::state().config = config;
+		api.get_protocol_version = stub::get_protocol_version;
+		api.init = stub::init;
+		api.destroy = stub::destroy;
+		api.process = stub::process;
+		api.get_version = stub::get_version;
+		api.get_sample_rate = stub::get_sample_rate;
+		api.get_sample_latency = stub::get_sample_latency;
+		api.get_block_size = stub::get_block_size;
+		api.get_num_params = stub::get_num_params;
+		api.get_param_name = stub::get_param_name;
+		api.get_num_voices = stub::get_num_voices;
+		api.get_voice_name = stub::get_voice_name;
+		api.set_voice = stub::set_voice;
+		api.set_voices = stub::set_voices;
+		api.process_n = config.max_blocks > 0 ? stub::process_n : nullptr;
+		api.get_max_blocks = config.max_blocks > 0 ? stub::get_max_blocks : nullptr;
+	}
+}
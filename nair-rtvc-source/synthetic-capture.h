@@ -0,0 +1,218 @@
+﻿#pragma once
+
+// 合成信号による取り込み
+//
+// パケット長の分布、起床の揺らぎ、無音や欠落のフラグを指定して WASAPI のようなパケット列を作る。
+// 乱数は seed で決まるので、同じ設定なら同じパケット列になる。
+// fault / open_fault でデバイスが抜かれたときの失敗も起こせる (取り込みの監視を試すため)。
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "capture-backend.h"
+
+namespace rtvc {
+	struct synthetic_capture_config {
+		std::vector<std::uint32_t> packet_frames; ///< パケット長の候補 (一様に選ぶ。空なら 10 ms)
+		double jitter_ms = 0.0;                   ///< 起床時刻の揺らぎ (±)
+		double silent_probability = 0.0;          ///< AUDCLNT_BUFFERFLAGS_SILENT を立てる確率
+		double discontinuity_probability = 0.0;   ///< AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY を立てる確率
+		double fault_probability = 0.0;           ///< パケットごとに Acquire() / Release() を CAPTURE_E_DEVICE_INVALIDATED で失敗させる確率
+		double open_fault_probability = 0.0;      ///< Open() を失敗させる確率
+		double tone_hz = 220.0;
+		float amplitude = 0.1f;
+		std::uint64_t duration_frames = 0;        ///< 0 なら止めるまで続ける
+		bool realtime = true;                     ///< false なら待たずに最大速度で流す
+		std::uint32_t seed = 1;
+	};
+
+	/// "packets=441,480;jitter=2;silent=0.05;discontinuity=0.01;fault=0.001;open_fault=0.5;seconds=10;seed=1" を設定にする
+	inline bool parse_synthetic_capture_config(std::string const& spec, synthetic_capture_config& config, int sample_rate) {
+		std::size_t pos = 0;
+		while (pos < spec.size()) {
+			std::size_t const end = (std::min)(spec.find(';', pos), spec.size());
+			std::string const item = spec.substr(pos, end - pos);
+			pos = end + 1;
+
+			std::size_t const eq = item.find('=');
+			if (eq == std::string::npos) {
+				return false;
+			}
+			std::string const key = item.substr(0, eq);
+			std::string const value = item.substr(eq + 1);
+			if (key == "packets") {
+				for (std::size_t p = 0; p < value.size();) {
+					std::size_t const comma = (std::min)(value.find(',', p), value.size());
+					config.packet_frames.push_back(static_cast<std::uint32_t>(std::strtoul(value.substr(p, comma - p).c_str(), nullptr, 10)));
+					p = comma + 1;
+				}
+			}
+			else if (key == "jitter") {
+				config.jitter_ms = std::strtod(value.c_str(), nullptr);
+			}
+			else if (key == "silent") {
+				config.silent_probability = std::strtod(value.c_str(), nullptr);
+			}
+			else if (key == "discontinuity") {
+				config.discontinuity_probability = std::strtod(value.c_str(), nullptr);
+			}
+			else if (key == "fault") {
+				config.fault_probability = std::strtod(value.c_str(), nullptr);
+			}
+			else if (key == "open_fault") {
+				config.open_fault_probability = std::strtod(value.c_str(), nullptr);
+			}
+			else if (key == "seconds") {
+				config.duration_frames = static_cast<std::uint64_t>(std::strtod(value.c_str(), nullptr) * sample_rate);
+			}
+			else if (key == "seed") {
+				config.seed = static_cast<std::uint32_t>(std::strtoul(value.c_str(), nullptr, 10));
+			}
+			else {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	class SyntheticCapture final : public CaptureBackend {
+		static constexpr double const TWO_PI = 2.0 * 3.14159265358979323846;
+
+	public:
+		explicit SyntheticCapture(synthetic_capture_config config)
+			: config_(std::move(config))
+		{
+		}
+
+		char const* Name() const noexcept override {
+			return "synthetic";
+		}
+
+		HRESULT Open(capture_config const& config) override {
+			random_.seed(config_.seed);
+			if (std::uniform_real_distribution<double>(0.0, 1.0)(random_) < config_.open_fault_probability) {
+				return CAPTURE_E_DEVICE_INVALIDATED;
+			}
+			sample_rate_ = config.sample_rate;
+			if (config_.packet_frames.empty()) {
+				config_.packet_frames.push_back(static_cast<std::uint32_t>(sample_rate_ / 100));
+			}
+			max_packet_frames_ = *std::max_element(config_.packet_frames.begin(), config_.packet_frames.end());
+			if (max_packet_frames_ == 0) {
+				return E_INVALIDARG;
+			}
+			buffer_.reset(new float[max_packet_frames_]);
+			return S_OK;
+		}
+
+		std::uint32_t MaxPacketFrames() const noexcept override {
+			return max_packet_frames_;
+		}
+
+		HRESULT Start() override {
+			random_.seed(config_.seed);
+			next_fault_ = false;
+			total_frames_ = 0;
+			phase_ = 0.0;
+			last_wake_ns_ = 0;
+			pacer_.Reset(config_.realtime);
+			Plan();
+			return S_OK;
+		}
+
+		HRESULT Wait() override {
+			if (config_.duration_frames && total_frames_ >= config_.duration_frames) {
+				return S_FALSE;
+			}
+			// パケットの最後のサンプルが届いた時刻に揺らぎを足して起きる (前の起床より前には戻らない)
+			std::int64_t wake_ns = static_cast<std::int64_t>(frames_to_ns(total_frames_ + next_frames_));
+			if (config_.jitter_ms > 0.0) {
+				std::uniform_real_distribution<double> jitter(-config_.jitter_ms, config_.jitter_ms);
+				wake_ns += static_cast<std::int64_t>(jitter(random_) * 1'000'000.0);
+			}
+			last_wake_ns_ = (std::max)(last_wake_ns_, static_cast<std::uint64_t>((std::max)(wake_ns, std::int64_t{ 0 })));
+			return pacer_.WaitUntil(last_wake_ns_) ? S_OK : S_FALSE;
+		}
+
+		void Interrupt() noexcept override {
+			pacer_.Interrupt();
+		}
+
+		HRESULT Acquire(capture_packet& packet) override {
+			double const step = TWO_PI * config_.tone_hz / sample_rate_;
+			for (std::uint32_t i = 0; i < next_frames_; ++i) {
+				buffer_[i] = config_.amplitude * static_cast<float>(std::sin(phase_));
+				phase_ += step;
+			}
+			phase_ = std::fmod(phase_, TWO_PI);
+
+			packet.data = buffer_.get();
+			packet.frames = next_frames_;
+			packet.flags = next_flags_;
+			packet.device_time_ns = pacer_.IsRealtime() ? pacer_.StartTime() + frames_to_ns(total_frames_) : 0;
+			return next_fault_ ? CAPTURE_E_DEVICE_INVALIDATED : S_OK;
+		}
+
+		HRESULT Release(capture_packet const& packet) override {
+			if (next_fault_) {
+				return CAPTURE_E_DEVICE_INVALIDATED;
+			}
+			total_frames_ += packet.frames;
+			Plan();
+			return S_OK;
+		}
+
+		HRESULT Stop() override {
+			return S_OK;
+		}
+
+	private:
+		// 次のパケットの長さとフラグを決める
+		void Plan() {
+			std::uniform_int_distribution<std::size_t> choose(0, config_.packet_frames.size() - 1);
+			next_frames_ = config_.packet_frames[choose(random_)];
+			if (config_.duration_frames) {
+				next_frames_ = static_cast<std::uint32_t>((std::min)(static_cast<std::uint64_t>(next_frames_), config_.duration_frames - (std::min)(total_frames_, config_.duration_frames)));
+			}
+
+			std::uniform_real_distribution<double> probability(0.0, 1.0);
+			next_flags_ = 0;
+			if (probability(random_) < config_.silent_probability) {
+				next_flags_ |= CAPTURE_FLAG_SILENT;
+			}
+			if (probability(random_) < config_.discontinuity_probability) {
+				next_flags_ |= CAPTURE_FLAG_DISCONTINUITY;
+			}
+			// 一度失敗したら作り直すまで失敗し続ける (fault がなければ乱数を引かず、以前と同じパケット列にする)
+			if (config_.fault_probability > 0.0 && probability(random_) < config_.fault_probability) {
+				next_fault_ = true;
+			}
+		}
+
+		std::uint64_t frames_to_ns(std::uint64_t frames) const noexcept {
+			return frames * 1'000'000'000ull / static_cast<std::uint64_t>(sample_rate_);
+		}
+
+		synthetic_capture_config config_;
+		int sample_rate_ = 0;
+		std::uint32_t max_packet_frames_ = 0;
+		std::unique_ptr<float[]> buffer_;
+
+		std::mt19937 random_;
+		std::uint64_t total_frames_ = 0;
+		std::uint32_t next_frames_ = 0;
+		std::uint32_t next_flags_ = 0;
+		bool next_fault_ = false;
+		double phase_ = 0.0;
+		std::uint64_t last_wake_ns_ = 0;
+		CapturePacer pacer_;
+	};
+}
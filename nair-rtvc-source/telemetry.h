@@ -0,0 +1,464 @@
+﻿#pragma once
+
+// 運用監視のための統計の書き出し
+//
+// 推論スレッドは PipelineCounters のアトミックな数を足すだけで、ロックもシステムコールもしない。
+// 低優先度のスレッドが 1 秒ごとに前回からの差分を telemetry_record にまとめ、メモリーマップしたファイル (TelemetryFile) と
+// Prometheus の textfile collector が読むファイル (write_prometheus()) に書く。外のエージェントはファイルを読むだけでよい。
+//
+//   PipelineCounters::Record*() (推論スレッドから) -> TelemetryWindow::Update() -> TelemetryFile::Publish() / write_prometheus()
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <system_error>
+#include <type_traits>
+
+#include "capture-backend.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace rtvc {
+	/// 処理時間の分布 (1/4 オクターブ刻み。1 [us] 未満から約 1 [s] まで)
+	class LatencyHistogram final {
+	public:
+		static constexpr std::size_t const BUCKETS = 84;
+
+		/// 数える (リアルタイムスレッドから)
+		void Record(std::uint64_t ns) noexcept {
+			counts_[BucketOf(ns / 1'000)].fetch_add(1, std::memory_order::relaxed);
+		}
+
+		/// 今までの数を写す (ほかのスレッドから)
+		void Snapshot(std::uint64_t (&counts)[BUCKETS]) const noexcept {
+			for (std::size_t i = 0; i < BUCKETS; ++i) {
+				counts[i] = counts_[i].load(std::memory_order::relaxed);
+			}
+		}
+
+		/// 0 は 1 [us] 未満、それ以降は 2^e * (1 + m / 4) [us] から
+		static std::size_t BucketOf(std::uint64_t us) noexcept {
+			if (us == 0) {
+				return 0;
+			}
+			int const e = static_cast<int>(std::bit_width(us)) - 1;
+			std::uint64_t const m = e >= 2 ? (us >> (e - 2)) & 3 : (us << (2 - e)) & 3;
+			return (std::min)(BUCKETS - 1, static_cast<std::size_t>(1 + 4 * e + m));
+		}
+
+		/// バケツの上限 [us]
+		static double UpperBoundUs(std::size_t bucket) noexcept {
+			return std::ldexp(1.0 + static_cast<double>(bucket & 3) / 4.0, static_cast<int>(bucket >> 2));
+		}
+
+	private:
+		std::atomic<std::uint64_t> counts_[BUCKETS] = {};
+	};
+
+	/// 推論スレッドが足していく累積の数 (読むのは TelemetryWindow)
+	class PipelineCounters final {
+	public:
+		/// 推論スレッドの始まりと終わりに (同じスレッドから)
+		void Start() noexcept {
+			last_wake_ns_ = 0;
+			last_packet_ns_ = 0;
+			drift_anchor_ns_ = 0;
+			drift_frames_ = 0;
+			drift_ppm_.store(std::numeric_limits<double>::quiet_NaN(), std::memory_order::relaxed);
+			running_.store(true, std::memory_order::release);
+		}
+
+		void Stop() noexcept {
+			running_.store(false, std::memory_order::release);
+		}
+
+		/// 起床ごとに (リアルタイムスレッドから)
+		/// 前の起床からの間隔と前のパケットの長さの差を、起床の揺れとして数える
+		void RecordWake(std::uint64_t wake_time_ns, std::uint64_t packet_ns) noexcept {
+			if (last_wake_ns_ != 0 && last_packet_ns_ != 0) {
+				std::uint64_t const interval = wake_time_ns - last_wake_ns_;
+				std::uint64_t const jitter = interval > last_packet_ns_ ? interval - last_packet_ns_ : last_packet_ns_ - interval;
+				wakes_.fetch_add(1, std::memory_order::relaxed);
+				wake_jitter_ns_.fetch_add(jitter, std::memory_order::relaxed);
+				std::uint64_t max = wake_jitter_max_ns_.load(std::memory_order::relaxed);
+				while (jitter > max && !wake_jitter_max_ns_.compare_exchange_weak(max, jitter, std::memory_order::relaxed)) {
+				}
+			}
+			last_wake_ns_ = wake_time_ns;
+			last_packet_ns_ = packet_ns;
+		}
+
+		/// パケットの取り込み時刻と長さから、デバイスのクロックのずれを求める (リアルタイムスレッドから)
+		/// 時刻が無効なパケットや途切れたパケットで測り直す
+		void RecordCapture(std::uint64_t device_time_ns, std::uint32_t frames, int sample_rate, bool valid) noexcept {
+			if (!valid || device_time_ns == 0) {
+				drift_anchor_ns_ = 0;
+				return;
+			}
+			if (drift_anchor_ns_ == 0 || device_time_ns <= drift_anchor_ns_) {
+				drift_anchor_ns_ = device_time_ns;
+				drift_frames_ = 0;
+			}
+			else if (std::uint64_t const elapsed = device_time_ns - drift_anchor_ns_; elapsed >= DRIFT_MIN_NS) {
+				// 届いたサンプルの長さが実時間より長ければ、デバイスのクロックが速い
+				double const nominal = static_cast<double>(drift_frames_) * 1e9 / sample_rate;
+				drift_ppm_.store((nominal - static_cast<double>(elapsed)) / static_cast<double>(elapsed) * 1e6, std::memory_order::relaxed);
+			}
+			drift_frames_ += frames;
+		}
+
+		/// 起床ごとの処理の結果 (リアルタイムスレッドから)
+		void RecordBlocks(std::uint32_t blocks, std::uint64_t audio_ns, std::uint64_t engine_ns, std::uint64_t elapsed_ns) noexcept {
+			blocks_.fetch_add(blocks, std::memory_order::relaxed);
+			audio_ns_.fetch_add(audio_ns, std::memory_order::relaxed);
+			engine_ns_.fetch_add(engine_ns, std::memory_order::relaxed);
+			latency_.Record(elapsed_ns);
+			if (elapsed_ns > audio_ns) {
+				overruns_.fetch_add(1, std::memory_order::relaxed);
+			}
+		}
+
+	private:
+		friend class TelemetryWindow;
+
+		/// ずれはこれだけ測ってから出す (取り込み時刻の揺れ 0.1 [ms] で 10 [ppm])
+		static constexpr std::uint64_t const DRIFT_MIN_NS = 10'000'000'000ull;
+
+		std::atomic<bool> running_ = false;
+		std::atomic<std::uint64_t> blocks_ = 0;
+		std::atomic<std::uint64_t> audio_ns_ = 0;  ///< 処理したブロックの長さの合計
+		std::atomic<std::uint64_t> engine_ns_ = 0; ///< エンジンに通していた時間の合計
+		std::atomic<std::uint64_t> overruns_ = 0;  ///< 起床から出力までがブロックの長さを超えた回数
+		LatencyHistogram latency_;                 ///< 起床から出力まで
+		std::atomic<std::uint64_t> wakes_ = 0;
+		std::atomic<std::uint64_t> wake_jitter_ns_ = 0;
+		std::atomic<std::uint64_t> wake_jitter_max_ns_ = 0; ///< 読んだら 0 に戻す
+		std::atomic<double> drift_ppm_ = std::numeric_limits<double>::quiet_NaN();
+
+		// 推論スレッドのみ
+		std::uint64_t last_wake_ns_ = 0;
+		std::uint64_t last_packet_ns_ = 0;
+		std::uint64_t drift_anchor_ns_ = 0;
+		std::uint64_t drift_frames_ = 0;
+	};
+
+	/// 統計ファイルの中身 (リトルエンディアン、固定の配置。version を上げずに並びを変えない)
+	///
+	/// 書く側は sequence を奇数にしてから中身を書き、偶数に戻す。読む側は sequence を読み、中身を写し、もう一度 sequence を読んで、
+	/// 同じ偶数なら採用する (違えば読み直す)。
+	struct telemetry_record {
+		char          magic[8];               ///< "RTVCSTAT"
+		std::uint32_t version;
+		std::uint32_t size;                   ///< sizeof(telemetry_record)
+		std::uint64_t sequence;
+		std::uint64_t update_time_ns;         ///< 書いた時刻 (UNIX 時間 [ns])
+		std::uint32_t sample_rate;
+		std::uint32_t block_size;
+		std::int32_t  latency_mode;           ///< 取り込みのレイテンシーモード (1 から)
+		std::uint32_t running;                ///< 推論スレッドが動いていれば 1
+		char          latency_mode_name[32];
+		double        engine_rtf;             ///< 直近の窓でエンジンに通していた時間 / 処理した音声の長さ
+		double        block_latency_p50_us;   ///< 直近の窓の起床から出力まで (バケツの上限)
+		double        block_latency_p90_us;
+		double        block_latency_p99_us;
+		double        block_latency_max_us;
+		double        wake_jitter_mean_us;    ///< 直近の窓の起床間隔とパケットの長さの差
+		double        wake_jitter_max_us;
+		double        output_fifo_fill_ms;    ///< 直接モニターのジッターバッファー (使っていなければ 0)
+		double        output_fifo_target_ms;
+		double        drift_ppm;              ///< 取り込みデバイスのクロックのずれ (測れるまでは NaN)
+		double        pipeline_delay_ms;      ///< 取り込みから出力まで (測れるまでは 0)
+		double        window_seconds;         ///< 直近の窓の長さ
+		std::uint64_t blocks_total;
+		std::uint64_t overruns_total;
+		std::uint64_t deadline_misses_total;  ///< 見張りの期限に間に合わなかった起床
+		std::uint64_t shed_blocks_total;      ///< エンジンを待たずにドライで出したブロック
+		std::uint64_t concealed_frames_total;
+		std::uint64_t output_underruns_total;
+		std::uint64_t output_skipped_frames_total;
+	};
+	static_assert(std::is_standard_layout_v<telemetry_record> && std::is_trivially_copyable_v<telemetry_record>);
+
+	inline constexpr char const TELEMETRY_MAGIC[8] = { 'R', 'T', 'V', 'C', 'S', 'T', 'A', 'T' };
+	inline constexpr std::uint32_t const TELEMETRY_VERSION = 1;
+
+	/// PipelineCounters の前回からの差分を telemetry_record にまとめる (低優先度のスレッドから)
+	/// 累積の数と窓の値だけを埋める。ほかの欄は呼ぶ側が埋める
+	class TelemetryWindow final {
+	public:
+		void Update(PipelineCounters& counters, std::uint64_t now_ns, telemetry_record& record) noexcept {
+			std::uint64_t const blocks = counters.blocks_.load(std::memory_order::relaxed);
+			std::uint64_t const audio_ns = counters.audio_ns_.load(std::memory_order::relaxed);
+			std::uint64_t const engine_ns = counters.engine_ns_.load(std::memory_order::relaxed);
+			std::uint64_t const wakes = counters.wakes_.load(std::memory_order::relaxed);
+			std::uint64_t const wake_jitter_ns = counters.wake_jitter_ns_.load(std::memory_order::relaxed);
+			std::uint64_t latency[LatencyHistogram::BUCKETS];
+			counters.latency_.Snapshot(latency);
+
+			record.running = counters.running_.load(std::memory_order::acquire) ? 1 : 0;
+			record.blocks_total = blocks;
+			record.overruns_total = counters.overruns_.load(std::memory_order::relaxed);
+			record.engine_rtf = audio_ns > last_audio_ns_ ? static_cast<double>(engine_ns - last_engine_ns_) / static_cast<double>(audio_ns - last_audio_ns_) : 0.0;
+			record.wake_jitter_mean_us = wakes > last_wakes_ ? static_cast<double>(wake_jitter_ns - last_wake_jitter_ns_) / static_cast<double>(wakes - last_wakes_) / 1'000.0 : 0.0;
+			record.wake_jitter_max_us = static_cast<double>(counters.wake_jitter_max_ns_.exchange(0, std::memory_order::relaxed)) / 1'000.0;
+			record.drift_ppm = counters.drift_ppm_.load(std::memory_order::relaxed);
+			record.window_seconds = last_update_ns_ != 0 && now_ns > last_update_ns_ ? static_cast<double>(now_ns - last_update_ns_) / 1e9 : 0.0;
+
+			// 窓の中の分布から分位点を出す
+			std::uint64_t total = 0;
+			for (std::size_t i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+				std::uint64_t const count = latency[i] - last_latency_[i];
+				last_latency_[i] = latency[i];
+				latency[i] = count;
+				total += count;
+			}
+			double* const quantiles[] = { &record.block_latency_p50_us, &record.block_latency_p90_us, &record.block_latency_p99_us, &record.block_latency_max_us };
+			double const ranks[] = { 0.50, 0.90, 0.99, 1.0 };
+			for (std::size_t q = 0; q < std::size(quantiles); ++q) {
+				*quantiles[q] = 0.0;
+				if (total == 0) {
+					continue;
+				}
+				std::uint64_t const rank = (std::max)(std::uint64_t{ 1 }, static_cast<std::uint64_t>(std::ceil(ranks[q] * static_cast<double>(total))));
+				std::uint64_t seen = 0;
+				for (std::size_t i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+					seen += latency[i];
+					if (seen >= rank) {
+						*quantiles[q] = LatencyHistogram::UpperBoundUs(i);
+						break;
+					}
+				}
+			}
+
+			last_audio_ns_ = audio_ns;
+			last_engine_ns_ = engine_ns;
+			last_wakes_ = wakes;
+			last_wake_jitter_ns_ = wake_jitter_ns;
+			last_update_ns_ = now_ns;
+		}
+
+	private:
+		std::uint64_t last_audio_ns_ = 0;
+		std::uint64_t last_engine_ns_ = 0;
+		std::uint64_t last_wakes_ = 0;
+		std::uint64_t last_wake_jitter_ns_ = 0;
+		std::uint64_t last_update_ns_ = 0;
+		std::uint64_t last_latency_[LatencyHistogram::BUCKETS] = {};
+	};
+
+	/// 統計ファイル (メモリーマップして telemetry_record を書く。ほかのプロセスは読むだけでよい)
+	class TelemetryFile final {
+	public:
+		TelemetryFile() = default;
+		TelemetryFile(TelemetryFile const&) = delete;
+		TelemetryFile& operator=(TelemetryFile const&) = delete;
+
+		~TelemetryFile() {
+			Close();
+		}
+
+		HRESULT Open(std::filesystem::path const& path) {
+			Close();
+#if defined(_WIN32)
+			hFile_ = ::CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (hFile_ == INVALID_HANDLE_VALUE) {
+				return HRESULT_FROM_WIN32(::GetLastError());
+			}
+			// ファイルより大きくマップするとその大きさに伸びる
+			hMapping_ = ::CreateFileMappingW(hFile_, nullptr, PAGE_READWRITE, 0, static_cast<DWORD>(sizeof(telemetry_record)), nullptr);
+			if (!hMapping_) {
+				HRESULT const hr = HRESULT_FROM_WIN32(::GetLastError());
+				Close();
+				return hr;
+			}
+			view_ = reinterpret_cast<telemetry_record*>(::MapViewOfFile(hMapping_, FILE_MAP_WRITE, 0, 0, sizeof(telemetry_record)));
+			if (!view_) {
+				HRESULT const hr = HRESULT_FROM_WIN32(::GetLastError());
+				Close();
+				return hr;
+			}
+#else
+			fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+			if (fd_ < 0) {
+				return hresult_from_errno(errno);
+			}
+			if (::ftruncate(fd_, static_cast<off_t>(sizeof(telemetry_record))) != 0) {
+				HRESULT const hr = hresult_from_errno(errno);
+				Close();
+				return hr;
+			}
+			void* const view = ::mmap(nullptr, sizeof(telemetry_record), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+			if (view == MAP_FAILED) {
+				HRESULT const hr = hresult_from_errno(errno);
+				Close();
+				return hr;
+			}
+			view_ = reinterpret_cast<telemetry_record*>(view);
+#endif
+			// 前の中身は捨てて、版と大きさを書いてから印を付ける (読む側は印で見分ける)
+			std::memset(view_, 0, sizeof(telemetry_record));
+			view_->version = TELEMETRY_VERSION;
+			view_->size = static_cast<std::uint32_t>(sizeof(telemetry_record));
+			std::atomic_thread_fence(std::memory_order::release);
+			std::memcpy(view_->magic, TELEMETRY_MAGIC, sizeof(view_->magic));
+			return S_OK;
+		}
+
+		void Close() noexcept {
+#if defined(_WIN32)
+			if (view_) {
+				::UnmapViewOfFile(view_);
+			}
+			if (hMapping_) {
+				::CloseHandle(hMapping_);
+				hMapping_ = nullptr;
+			}
+			if (hFile_ != INVALID_HANDLE_VALUE) {
+				::CloseHandle(hFile_);
+				hFile_ = INVALID_HANDLE_VALUE;
+			}
+#else
+			if (view_) {
+				::munmap(view_, sizeof(telemetry_record));
+			}
+			if (fd_ >= 0) {
+				::close(fd_);
+				fd_ = -1;
+			}
+#endif
+			view_ = nullptr;
+		}
+
+		bool IsOpen() const noexcept {
+			return view_ != nullptr;
+		}
+
+		/// 中身を書き換える (magic から sequence までは書かない)
+		void Publish(telemetry_record const& record) noexcept {
+			if (!view_) {
+				return;
+			}
+			std::atomic_ref<std::uint64_t> sequence(view_->sequence);
+			std::uint64_t const current = sequence.load(std::memory_order::relaxed);
+			sequence.store(current + 1, std::memory_order::relaxed);
+			std::atomic_thread_fence(std::memory_order::release);
+			constexpr std::size_t const BODY = offsetof(telemetry_record, update_time_ns);
+			std::memcpy(reinterpret_cast<char*>(view_) + BODY, reinterpret_cast<char const*>(&record) + BODY, sizeof(telemetry_record) - BODY);
+			sequence.store(current + 2, std::memory_order::release);
+		}
+
+	private:
+#if defined(_WIN32)
+		HANDLE hFile_ = INVALID_HANDLE_VALUE;
+		HANDLE hMapping_ = nullptr;
+#else
+		int fd_ = -1;
+#endif
+		telemetry_record* view_ = nullptr;
+	};
+
+	/// Prometheus のラベルの値をエスケープする
+	inline std::string prometheus_label(std::string const& value) {
+		std::string escaped;
+		escaped.reserve(value.size());
+		for (char const c : value) {
+			if (c == '\\' || c == '"') {
+				escaped += '\\';
+				escaped += c;
+			}
+			else if (c == '\n') {
+				escaped += "\\n";
+			}
+			else {
+				escaped += c;
+			}
+		}
+		return escaped;
+	}
+
+	/// textfile collector が読むファイルを書く (途中を読まれないように、隣に書いてから置き換える)
+	inline bool write_prometheus(std::filesystem::path const& path, telemetry_record const& record, std::string const& source_name) {
+		std::string const source = prometheus_label(source_name);
+		std::filesystem::path temp = path;
+		temp += ".tmp";
+		{
+			std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+			if (!out) {
+				return false;
+			}
+			char line[512];
+			auto const metric = [&](char const* name, char const* type, char const* help) {
+				std::snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+				out << line;
+			};
+			auto const sample = [&](char const* name, char const* labels, double value) {
+				if (std::isnan(value)) {
+					std::snprintf(line, sizeof(line), "%s{source=\"%s\"%s} NaN\n", name, source.c_str(), labels);
+				}
+				else {
+					std::snprintf(line, sizeof(line), "%s{source=\"%s\"%s} %.9g\n", name, source.c_str(), labels, value);
+				}
+				out << line;
+			};
+
+			metric("rtvc_up", "gauge", "1 while the inference thread is running");
+			sample("rtvc_up", "", record.running);
+			metric("rtvc_engine_rtf", "gauge", "Engine time divided by the audio length over the last window");
+			sample("rtvc_engine_rtf", "", record.engine_rtf);
+			metric("rtvc_block_latency_seconds", "gauge", "Wake-up to output time per wake-up over the last window");
+			sample("rtvc_block_latency_seconds", ",quantile=\"0.5\"", record.block_latency_p50_us / 1e6);
+			sample("rtvc_block_latency_seconds", ",quantile=\"0.9\"", record.block_latency_p90_us / 1e6);
+			sample("rtvc_block_latency_seconds", ",quantile=\"0.99\"", record.block_latency_p99_us / 1e6);
+			sample("rtvc_block_latency_seconds", ",quantile=\"1\"", record.block_latency_max_us / 1e6);
+			metric("rtvc_wake_jitter_seconds", "gauge", "Difference between the wake-up interval and the packet length over the last window");
+			sample("rtvc_wake_jitter_seconds", ",stat=\"mean\"", record.wake_jitter_mean_us / 1e6);
+			sample("rtvc_wake_jitter_seconds", ",stat=\"max\"", record.wake_jitter_max_us / 1e6);
+			metric("rtvc_latency_mode", "gauge", "Capture latency mode");
+			std::string const mode = ",mode=\"" + prometheus_label(record.latency_mode_name) + "\"";
+			sample("rtvc_latency_mode", mode.c_str(), record.latency_mode);
+			metric("rtvc_pipeline_delay_seconds", "gauge", "Capture to output delay");
+			sample("rtvc_pipeline_delay_seconds", "", record.pipeline_delay_ms / 1e3);
+			metric("rtvc_output_fifo_fill_seconds", "gauge", "Direct monitoring jitter buffer fill");
+			sample("rtvc_output_fifo_fill_seconds", "", record.output_fifo_fill_ms / 1e3);
+			metric("rtvc_output_fifo_target_seconds", "gauge", "Direct monitoring jitter buffer target");
+			sample("rtvc_output_fifo_target_seconds", "", record.output_fifo_target_ms / 1e3);
+			metric("rtvc_capture_drift_ppm", "gauge", "Capture device clock drift against the system clock");
+			sample("rtvc_capture_drift_ppm", "", record.drift_ppm);
+
+			metric("rtvc_blocks_total", "counter", "Blocks processed");
+			sample("rtvc_blocks_total", "", static_cast<double>(record.blocks_total));
+			metric("rtvc_overruns_total", "counter", "Wake-ups that took longer than their audio");
+			sample("rtvc_overruns_total", "", static_cast<double>(record.overruns_total));
+			metric("rtvc_deadline_misses_total", "counter", "Wake-ups where the engine missed the watchdog deadline");
+			sample("rtvc_deadline_misses_total", "", static_cast<double>(record.deadline_misses_total));
+			metric("rtvc_shed_blocks_total", "counter", "Blocks output dry without waiting for the engine");
+			sample("rtvc_shed_blocks_total", "", static_cast<double>(record.shed_blocks_total));
+			metric("rtvc_concealed_frames_total", "counter", "Frames concealed after failed or late engine output");
+			sample("rtvc_concealed_frames_total", "", static_cast<double>(record.concealed_frames_total));
+			metric("rtvc_output_underruns_total", "counter", "Direct monitoring jitter buffer underruns");
+			sample("rtvc_output_underruns_total", "", static_cast<double>(record.output_underruns_total));
+			metric("rtvc_output_skipped_frames_total", "counter", "Frames dropped from the direct monitoring jitter buffer");
+			sample("rtvc_output_skipped_frames_total", "", static_cast<double>(record.output_skipped_frames_total));
+			if (!out) {
+				return false;
+			}
+		}
+		std::error_code ec;
+		std::filesystem::rename(temp, path, ec);
+		return !ec;
+	}
+}
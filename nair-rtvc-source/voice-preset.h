@@ -0,0 +1,234 @@
+﻿#pragma once
+
+// 声のプリセット
+//
+// プロパティの値と、ホットキーで呼び出す NUM_PRESETS 個のプリセットについて、エンジンに渡す値 (声の配分とパラメーター) を
+// UI のスレッドで前もって計算し、表ごと推論スレッドに渡す。ホットキーは表の番号を 1 つ書くだけにする。
+// 推論スレッドは起床の頭で Advance() を呼ぶ。声が変わったら、set_voices() の配分を数ブロックかけて移していく。
+//
+//   Publish() (UI のスレッド) / Select() (ホットキーのスレッド) -> Advance() (推論スレッドから)
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+
+namespace rtvc {
+	/// エンジンに渡す値 (UI のスレッドで計算しておく)
+	struct voice_params {
+		int primary_voice = 0;
+		int secondary_voice = -1; ///< -1 なら primary_voice だけ
+		float amount = 0.0f;      ///< secondary_voice の割合
+		float params[5] = { 1.0f, 1.0f, 0.0f, 1.0f, 0.0f }; ///< input_gain, output_gain, pitch_shift, pitch_shift_mode, pitch_snap
+
+		bool operator==(voice_params const& other) const noexcept = default;
+	};
+
+	/// set_voice() / set_voices() と process() に渡すもの
+	struct voice_mix {
+		static constexpr int MAX_VOICES = 4;
+
+		int num_voices = 0; ///< 0 ならまだ何も届いていない
+		int ids[MAX_VOICES] = {};
+		float amounts[MAX_VOICES] = {};
+		float params[5] = {};
+	};
+
+	class VoicePresets final {
+	public:
+		static constexpr int NUM_PRESETS = 4;
+		static constexpr int NUM_SLOTS = 1 + NUM_PRESETS; ///< 0 はプロパティの値
+
+		VoicePresets() = default;
+		VoicePresets(VoicePresets const&) = delete;
+		VoicePresets& operator=(VoicePresets const&) = delete;
+
+		/// 推論スレッドを止めてから破棄する
+		~VoicePresets() {
+			delete ready_.exchange(nullptr);
+			delete retired_.exchange(nullptr);
+			delete serving_;
+		}
+
+		/// 計算済みの表を推論スレッドに渡す (UI のスレッドから)
+		/// プロパティの値が変わったら、プリセットからプロパティの値に戻す
+		void Publish(voice_params const (&slots)[NUM_SLOTS], std::uint64_t blend_ns) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			blend_ns_.store(blend_ns, std::memory_order::relaxed);
+
+			// 推論スレッドが手放した表を破棄する
+			delete retired_.exchange(nullptr, std::memory_order::acq_rel);
+
+			voice_table* const table = new voice_table;
+			std::copy(std::begin(slots), std::end(slots), table->slots);
+			// まだ受け取られていない古い表は捨てる
+			delete ready_.exchange(table, std::memory_order::acq_rel);
+
+			if (published_ && !(slots[0] == properties_)) {
+				selected_.store(0, std::memory_order::release);
+			}
+			properties_ = slots[0];
+			published_ = true;
+		}
+
+		/// 使う表の番号を切り替える (どのスレッドからでも)
+		bool Select(int index) noexcept {
+			if (index < 0 || NUM_SLOTS <= index) {
+				return false;
+			}
+			selected_.store(index, std::memory_order::release);
+			return true;
+		}
+
+		int Selected() const noexcept {
+			return selected_.load(std::memory_order::acquire);
+		}
+
+		/// 今回の起床で使う声とパラメーター (推論スレッドから。blocks はこの起床で処理するブロック数)
+		voice_mix const& Advance(std::uint32_t blocks, std::uint64_t block_ns) noexcept {
+			// 前の表を手放したことが伝わるまでは差し替えない
+			if (ready_.load(std::memory_order::relaxed) && !retired_.load(std::memory_order::acquire)) {
+				if (voice_table* const next = ready_.exchange(nullptr, std::memory_order::acq_rel)) {
+					if (serving_) {
+						retired_.store(serving_, std::memory_order::release);
+					}
+					serving_ = next;
+				}
+			}
+			if (!serving_) {
+				return mix_;
+			}
+
+			voice_params const& target = serving_->slots[selected_.load(std::memory_order::acquire)];
+			if (mix_.num_voices == 0) {
+				target_ = target;
+				Assign(mix_, target_);
+			}
+			else if (!(target == target_)) {
+				// 今の配分から移り始める (移っている途中でも、そこから)
+				target_ = target;
+				from_ = mix_;
+				blend_ns_total_ = blend_ns_.load(std::memory_order::relaxed);
+				blend_ns_done_ = 0;
+				blending_ = blend_ns_total_ != 0;
+				if (!blending_) {
+					Assign(mix_, target_);
+				}
+			}
+
+			if (blending_) {
+				blend_ns_done_ += blocks * block_ns;
+				if (blend_ns_done_ >= blend_ns_total_) {
+					blending_ = false;
+					Assign(mix_, target_);
+				}
+				else {
+					Blend(mix_, from_, target_, static_cast<float>(static_cast<double>(blend_ns_done_) / blend_ns_total_));
+				}
+			}
+			return mix_;
+		}
+
+		/// 移っていく先の値 (推論スレッドから。記録用)
+		voice_params const& Target() const noexcept {
+			return target_;
+		}
+
+		/// 声を移している途中か (推論スレッドから)
+		bool Blending() const noexcept {
+			return blending_;
+		}
+
+	private:
+		struct voice_table {
+			voice_params slots[NUM_SLOTS];
+		};
+
+		// そのままの値 (これまでどおり 2 つ目の声がなければ set_voice() になる)
+		static void Assign(voice_mix& mix, voice_params const& p) noexcept {
+			mix.ids[0] = p.primary_voice;
+			if (p.secondary_voice < 0) {
+				mix.num_voices = 1;
+				mix.amounts[0] = 1.0f;
+			}
+			else {
+				mix.num_voices = 2;
+				mix.ids[1] = p.secondary_voice;
+				mix.amounts[0] = 1.0f - p.amount;
+				mix.amounts[1] = p.amount;
+			}
+			std::copy(std::begin(p.params), std::end(p.params), mix.params);
+		}
+
+		// from から to へ t だけ移した配分 (同じ声はまとめ、入り切らなければ小さいものから落とす)
+		static void Blend(voice_mix& mix, voice_mix const& from, voice_params const& to, float t) noexcept {
+			int ids[voice_mix::MAX_VOICES + 2];
+			float amounts[voice_mix::MAX_VOICES + 2];
+			int n = 0;
+			auto const add = [&](int id, float amount) {
+				if (amount <= 0.0f) {
+					return;
+				}
+				for (int i = 0; i < n; ++i) {
+					if (ids[i] == id) {
+						amounts[i] += amount;
+						return;
+					}
+				}
+				ids[n] = id;
+				amounts[n] = amount;
+				++n;
+			};
+			for (int i = 0; i < from.num_voices; ++i) {
+				add(from.ids[i], from.amounts[i] * (1.0f - t));
+			}
+			if (to.secondary_voice < 0) {
+				add(to.primary_voice, t);
+			}
+			else {
+				add(to.primary_voice, (1.0f - to.amount) * t);
+				add(to.secondary_voice, to.amount * t);
+			}
+			while (n > voice_mix::MAX_VOICES) {
+				int const smallest = static_cast<int>(std::min_element(amounts, amounts + n) - amounts);
+				--n;
+				ids[smallest] = ids[n];
+				amounts[smallest] = amounts[n];
+			}
+			float total = 0.0f;
+			for (int i = 0; i < n; ++i) {
+				total += amounts[i];
+			}
+			mix.num_voices = n;
+			for (int i = 0; i < n; ++i) {
+				mix.ids[i] = ids[i];
+				mix.amounts[i] = amounts[i] / total;
+			}
+
+			// ゲインとピッチはそのまま補間し、ピッチシフトの方式だけは半分で切り替える
+			for (int i = 0; i < 5; ++i) {
+				mix.params[i] = from.params[i] + (to.params[i] - from.params[i]) * t;
+			}
+			mix.params[3] = t < 0.5f ? from.params[3] : to.params[3];
+		}
+
+		std::mutex mutex_; ///< Publish() を呼ぶスレッドどうし
+		voice_params properties_; ///< 最後に渡したプロパティの値 (mutex_)
+		bool published_ = false;  ///< (mutex_)
+
+		std::atomic<voice_table*> ready_ = nullptr;   ///< UI のスレッドから推論スレッドへ
+		std::atomic<voice_table*> retired_ = nullptr; ///< 推論スレッドから UI のスレッドへ
+		std::atomic<int> selected_ = 0;
+		std::atomic<std::uint64_t> blend_ns_ = 0;
+
+		// 推論スレッドだけが使う
+		voice_table* serving_ = nullptr;
+		voice_params target_;
+		voice_mix from_;
+		voice_mix mix_;
+		std::uint64_t blend_ns_total_ = 0;
+		std::uint64_t blend_ns_done_ = 0;
+		bool blending_ = false;
+	};
+}
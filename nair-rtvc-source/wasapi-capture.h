@@ -0,0 +1,232 @@
+﻿#pragma once
+
+// WASAPI による取り込み (共有モード、イベント駆動)
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <Windows.h>
+#include <audioclient.h>
+#include <mmdeviceapi.h>
+#include <wrl.h>
+
+#include <util/base.h>
+
+#include "capture-backend.h"
+
+namespace rtvc {
+	class WasapiCapture final : public CaptureBackend {
+	public:
+		/// latency_mode はデフォルトのデバイス周期の何倍をバッファーにするか
+		WasapiCapture(Microsoft::WRL::ComPtr<IMMDevice> pDevice, int latency_mode)
+			: pDevice_(std::move(pDevice))
+			, latency_mode_(latency_mode)
+		{
+		}
+
+		~WasapiCapture() override {
+			if (hEvtAudioCaptureSamplesReady_) {
+				::CloseHandle(hEvtAudioCaptureSamplesReady_);
+				hEvtAudioCaptureSamplesReady_ = nullptr;
+			}
+			if (hEvtShutdown_) {
+				::CloseHandle(hEvtShutdown_);
+				hEvtShutdown_ = nullptr;
+			}
+		}
+
+		char const* Name() const noexcept override {
+			return "wasapi";
+		}
+
+		HRESULT Open(capture_config const& config) override {
+			HRESULT hr = S_OK;
+
+			hEvtAudioCaptureSamplesReady_ = ::CreateEventEx(nullptr, nullptr, 0, EVENT_MODIFY_STATE | SYNCHRONIZE);
+			if (!hEvtAudioCaptureSamplesReady_) {
+				hr = ::GetLastError();
+				std::string const& msg = std::system_category().message(hr);
+				blog(LOG_ERROR, "[nair-rtvc-source] unable to create samples ready event: %s (%x)", msg.c_str(), hr);
+				return hr;
+			}
+
+			hEvtShutdown_ = ::CreateEventEx(nullptr, nullptr, 0, EVENT_MODIFY_STATE | SYNCHRONIZE);
+			if (!hEvtShutdown_) {
+				hr = ::GetLastError();
+				std::string const& msg = std::system_category().message(hr);
+				blog(LOG_ERROR, "[nair-rtvc-source] unable to create shutdown event: %s (%x)", msg.c_str(), hr);
+				return hr;
+			}
+
+			// AudioClient準備
+			if FAILED(hr = pDevice_->Activate(__uuidof(IAudioClient3), CLSCTX_INPROC_SERVER, nullptr, &pAudioClientIn_)) {
+				std::string const& msg = std::system_category().message(hr);
+				blog(LOG_ERROR, "[nair-rtvc-source] unable to activate audio pAudioClientIn: %s (%x)", msg.c_str(), hr);
+				return hr;
+			}
+
+			// デバイスのレイテンシ取得
+			REFERENCE_TIME hnsDefaultDevicePeriod;
+			REFERENCE_TIME hnsMinimumDevicePeriod;
+			if FAILED(hr = pAudioClientIn_->GetDevicePeriod(&hnsDefaultDevicePeriod, &hnsMinimumDevicePeriod)) {
+				std::string const& msg = std::system_category().message(hr);
+				blog(LOG_ERROR, "[nair-rtvc-source] unable to get pDeviceIn period: %s (%x)", msg.c_str(), hr);
+				return hr;
+			}
+
+			blog(LOG_INFO, "[nair-rtvc-source] default device period: %lld [ms]", static_cast<long long>(hnsDefaultDevicePeriod / 10'000));
+			blog(LOG_INFO, "[nair-rtvc-source] minimum device period: %lld [ms]", static_cast<long long>(hnsMinimumDevicePeriod / 10'000));
+
+			int const SAMPLE_RATE = config.sample_rate;
+			int const BLOCK_SIZE = config.block_size;
+
+			REFERENCE_TIME const hnsBufferPeriod = hnsDefaultDevicePeriod * latency_mode_;
+			max_packet_frames_ = static_cast<std::uint32_t>((((SAMPLE_RATE * hnsBufferPeriod / 1'000'000) + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE);
+			// 数周期届かなければデバイスの状態を確かめる
+			stall_timeout_ms_ = (std::max)(static_cast<DWORD>(hnsBufferPeriod * 4 / 10'000), MIN_STALL_TIMEOUT_MS);
+
+			{
+				WAVEFORMATEXTENSIBLE format;
+				std::memset(&format, 0, sizeof(format));
+				format.Format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+				format.Format.nChannels = 1;
+				format.Format.nSamplesPerSec = SAMPLE_RATE;
+				format.Format.wBitsPerSample = 32;
+				format.Format.nBlockAlign = format.Format.wBitsPerSample / 8 * format.Format.nChannels;
+				format.Format.nAvgBytesPerSec = format.Format.nSamplesPerSec * format.Format.nBlockAlign;
+				format.Format.cbSize = sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
+				format.dwChannelMask = SPEAKER_FRONT_CENTER;
+				format.Samples.wValidBitsPerSample = format.Format.wBitsPerSample;
+				format.SubFormat = KSDATAFORMAT_SUBTYPE_IEEE_FLOAT;
+
+				if FAILED(hr = pAudioClientIn_->Initialize(
+					AUDCLNT_SHAREMODE_SHARED,
+					AUDCLNT_STREAMFLAGS_EVENTCALLBACK | AUDCLNT_STREAMFLAGS_NOPERSIST | AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM | AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY,
+					hnsBufferPeriod,
+					0,
+					reinterpret_cast<WAVEFORMATEX*>(&format),
+					nullptr))
+				{
+					std::string const& msg = std::system_category().message(hr);
+					blog(LOG_ERROR, "[nair-rtvc-source] unable to initialize audio pAudioClientIn: %s (%x)", msg.c_str(), hr);
+					return hr;
+				}
+			}
+
+			UINT uBufferSizeIn = 0;
+			if FAILED(hr = pAudioClientIn_->GetBufferSize(&uBufferSizeIn)) {
+				return hr;
+			}
+			blog(LOG_INFO, "[nair-rtvc-source] uBufferSizeIn: %u", uBufferSizeIn);
+
+			if FAILED(hr = pAudioClientIn_->SetEventHandle(hEvtAudioCaptureSamplesReady_))
+			{
+				std::string const& msg = std::system_category().message(hr);
+				blog(LOG_ERROR, "[nair-rtvc-source] unable to set ready event: %s (%x)", msg.c_str(), hr);
+				return hr;
+			}
+
+			if FAILED(hr = pAudioClientIn_->GetService(IID_PPV_ARGS(&pCaptureClient_)))
+			{
+				std::string const& msg = std::system_category().message(hr);
+				blog(LOG_ERROR, "[nair-rtvc-source] unable to get new pCaptureClient pAudioClientIn: %s (%x)", msg.c_str(), hr);
+				return hr;
+			}
+
+			return hr;
+		}
+
+		std::uint32_t MaxPacketFrames() const noexcept override {
+			return max_packet_frames_;
+		}
+
+		HRESULT Start() override {
+			HRESULT hr = S_OK;
+			if FAILED(hr = pAudioClientIn_->Start()) {
+				std::string const& msg = std::system_category().message(hr);
+				blog(LOG_ERROR, "[nair-rtvc-source] unable to start pCaptureClient pAudioClientIn: %s (%x)", msg.c_str(), hr);
+				return hr;
+			}
+			return hr;
+		}
+
+		HRESULT Wait() override {
+			HANDLE events[] = { hEvtAudioCaptureSamplesReady_, hEvtShutdown_ };
+			for (;;) {
+				DWORD const result = ::WaitForMultipleObjects(static_cast<DWORD>(std::size(events)), events, FALSE, stall_timeout_ms_);
+				if (result == WAIT_OBJECT_0 + 1) {
+					return S_FALSE;
+				}
+				if (result == WAIT_TIMEOUT) {
+					// 抜かれたデバイスはイベントを鳴らさなくなるので、ここで AUDCLNT_E_DEVICE_INVALIDATED などを返す
+					HRESULT hr = S_OK;
+					UINT32 uPadding = 0;
+					if FAILED(hr = pAudioClientIn_->GetCurrentPadding(&uPadding)) {
+						return hr;
+					}
+					continue;
+				}
+				if (result != WAIT_OBJECT_0) {
+					return HRESULT_FROM_WIN32(::GetLastError());
+				}
+				return S_OK;
+			}
+		}
+
+		void Interrupt() noexcept override {
+			if (hEvtShutdown_) {
+				::SetEvent(hEvtShutdown_);
+			}
+		}
+
+		HRESULT Acquire(capture_packet& packet) override {
+			HRESULT hr = S_OK;
+			float* pDataIn = nullptr;
+			UINT32 uNumFrameToRead = 0; // shared mode での GetNextPacketSize と一致する。
+			DWORD dwFlags = 0;
+			UINT64 u64QPCPosition = 0; // パケット先頭サンプルの取り込み時刻 [100ns]
+			if FAILED(hr = pCaptureClient_->GetBuffer(reinterpret_cast<BYTE**>(&pDataIn), &uNumFrameToRead, &dwFlags, nullptr, &u64QPCPosition)) {
+				return hr;
+			}
+			packet.data = pDataIn;
+			packet.frames = uNumFrameToRead;
+			packet.flags = static_cast<std::uint32_t>(dwFlags);
+			packet.device_time_ns = u64QPCPosition * 100;
+			return hr;
+		}
+
+		HRESULT Release(capture_packet const& packet) override {
+			return pCaptureClient_->ReleaseBuffer(packet.frames);
+		}
+
+		HRESULT Stop() override {
+			HRESULT hr = S_OK;
+			if (pAudioClientIn_) {
+				if FAILED(hr = pAudioClientIn_->Stop()) {
+					std::string const& msg = std::system_category().message(hr);
+					blog(LOG_ERROR, "[nair-rtvc-source] Unable to stop audio pAudioClientIn: %s (%x)", msg.c_str(), hr);
+					return hr;
+				}
+			}
+			return hr;
+		}
+
+	private:
+		static constexpr DWORD const MIN_STALL_TIMEOUT_MS = 200;
+
+		Microsoft::WRL::ComPtr<IMMDevice> pDevice_;
+		int latency_mode_;
+
+		Microsoft::WRL::ComPtr<IAudioClient3> pAudioClientIn_;
+		Microsoft::WRL::ComPtr<IAudioCaptureClient> pCaptureClient_;
+		HANDLE hEvtAudioCaptureSamplesReady_ = nullptr;
+		HANDLE hEvtShutdown_ = nullptr;
+		std::uint32_t max_packet_frames_ = 0;
+		DWORD stall_timeout_ms_ = INFINITE;
+	};
+}
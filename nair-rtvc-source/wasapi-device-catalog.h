@@ -0,0 +1,275 @@
+﻿#pragma once
+
+// WASAPI のデバイスの一覧
+//
+// IMMNotificationClient の通知はイベントを立てるだけにして、一覧の作り直しと変更の通知は専用のスレッドで行う。
+// (通知のコールバックの中で待ったり、登録を解除したりしてはいけない)
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <Windows.h>
+#include <mmdeviceapi.h>
+#include <functiondiscoverykeys_devpkey.h>
+#include <wrl.h>
+
+#include "device-catalog.h"
+
+namespace rtvc {
+	class WasapiDeviceCatalog final : public DeviceCatalog {
+		/// 続けて届く通知 (抜き差しで数回来る) をまとめる時間
+		static constexpr DWORD const COALESCE_MS = 20;
+
+	public:
+		WasapiDeviceCatalog() = default;
+		WasapiDeviceCatalog(WasapiDeviceCatalog const&) = delete;
+		WasapiDeviceCatalog& operator=(WasapiDeviceCatalog const&) = delete;
+
+		~WasapiDeviceCatalog() override {
+			Stop();
+		}
+
+		/// 最初の一覧を作って通知を受け始める
+		HRESULT Start() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (thread_.joinable()) {
+				return S_OK;
+			}
+			HRESULT hr = S_OK;
+
+			hEvtChanged_ = ::CreateEventEx(nullptr, nullptr, 0, EVENT_MODIFY_STATE | SYNCHRONIZE);
+			hEvtShutdown_ = ::CreateEventEx(nullptr, nullptr, 0, EVENT_MODIFY_STATE | SYNCHRONIZE);
+			if (!hEvtChanged_ || !hEvtShutdown_) {
+				return HRESULT_FROM_WIN32(::GetLastError());
+			}
+			if FAILED(hr = ::CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&pEnumerator_))) {
+				return hr;
+			}
+
+			Refresh();
+
+			pClient_.Attach(new notification_client(hEvtChanged_));
+			if FAILED(hr = pEnumerator_->RegisterEndpointNotificationCallback(pClient_.Get())) {
+				pClient_.Reset();
+				return hr;
+			}
+			thread_ = std::thread([this] { Run(); });
+			return S_OK;
+		}
+
+		void Stop() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (pClient_) {
+				pEnumerator_->UnregisterEndpointNotificationCallback(pClient_.Get());
+				pClient_.Reset();
+			}
+			if (thread_.joinable()) {
+				::SetEvent(hEvtShutdown_);
+				thread_.join();
+			}
+			pEnumerator_.Reset();
+			if (hEvtChanged_) {
+				::CloseHandle(hEvtChanged_);
+				hEvtChanged_ = nullptr;
+			}
+			if (hEvtShutdown_) {
+				::CloseHandle(hEvtShutdown_);
+				hEvtShutdown_ = nullptr;
+			}
+		}
+
+		/// ID でデバイスを開く (一覧は作り直さない。id が空なら既定のデバイス)
+		HRESULT OpenDevice(device_flow flow, std::string const& id, Microsoft::WRL::ComPtr<IMMDevice>& pDevice) const {
+			if (!pEnumerator_) {
+				return E_UNEXPECTED;
+			}
+			if (id.empty()) {
+				return pEnumerator_->GetDefaultAudioEndpoint(to_data_flow(flow), eConsole, &pDevice);
+			}
+			return pEnumerator_->GetDevice(to_wide(id).c_str(), &pDevice);
+		}
+
+	private:
+		// 通知を受けたらイベントを立てるだけ
+		class notification_client final : public IMMNotificationClient {
+		public:
+			explicit notification_client(HANDLE hEvtChanged)
+				: hEvtChanged_(hEvtChanged)
+			{
+			}
+
+			HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override {
+				if (!ppvObject) {
+					return E_POINTER;
+				}
+				if (IsEqualIID(riid, __uuidof(IUnknown)) || IsEqualIID(riid, __uuidof(IMMNotificationClient))) {
+					*ppvObject = static_cast<IMMNotificationClient*>(this);
+					AddRef();
+					return S_OK;
+				}
+				*ppvObject = nullptr;
+				return E_NOINTERFACE;
+			}
+
+			ULONG STDMETHODCALLTYPE AddRef() override {
+				return ++ref_count_;
+			}
+
+			ULONG STDMETHODCALLTYPE Release() override {
+				ULONG const ref_count = --ref_count_;
+				if (ref_count == 0) {
+					delete this;
+				}
+				return ref_count;
+			}
+
+			HRESULT STDMETHODCALLTYPE OnDeviceStateChanged(LPCWSTR pwstrDeviceId, DWORD dwNewState) override {
+				::SetEvent(hEvtChanged_);
+				return S_OK;
+			}
+
+			HRESULT STDMETHODCALLTYPE OnDeviceAdded(LPCWSTR pwstrDeviceId) override {
+				::SetEvent(hEvtChanged_);
+				return S_OK;
+			}
+
+			HRESULT STDMETHODCALLTYPE OnDeviceRemoved(LPCWSTR pwstrDeviceId) override {
+				::SetEvent(hEvtChanged_);
+				return S_OK;
+			}
+
+			HRESULT STDMETHODCALLTYPE OnDefaultDeviceChanged(EDataFlow flow, ERole role, LPCWSTR pwstrDefaultDeviceId) override {
+				if (role == eConsole) {
+					::SetEvent(hEvtChanged_);
+				}
+				return S_OK;
+			}
+
+			HRESULT STDMETHODCALLTYPE OnPropertyValueChanged(LPCWSTR pwstrDeviceId, const PROPERTYKEY key) override {
+				// 名前が変わったときだけ (他のプロパティは頻繁に変わる)
+				if (IsEqualPropertyKey(key, PKEY_Device_FriendlyName)) {
+					::SetEvent(hEvtChanged_);
+				}
+				return S_OK;
+			}
+
+		private:
+			std::atomic<ULONG> ref_count_ = 1;
+			HANDLE hEvtChanged_;
+		};
+
+		void Run() {
+			::SetThreadPriority(::GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+			bool const com = SUCCEEDED(::CoInitializeEx(nullptr, COINIT_MULTITHREADED));
+
+			HANDLE events[] = { hEvtChanged_, hEvtShutdown_ };
+			while (::WaitForMultipleObjects(static_cast<DWORD>(std::size(events)), events, FALSE, INFINITE) == WAIT_OBJECT_0) {
+				// 続けて届いた通知をまとめてから作り直す
+				while (::WaitForSingleObject(hEvtChanged_, COALESCE_MS) == WAIT_OBJECT_0) {
+				}
+				Refresh();
+			}
+
+			if (com) {
+				::CoUninitialize();
+			}
+		}
+
+		void Refresh() {
+			Publish(device_flow::capture, Enumerate(device_flow::capture));
+			Publish(device_flow::render, Enumerate(device_flow::render));
+		}
+
+		device_list Enumerate(device_flow flow) const {
+			device_list list;
+
+			Microsoft::WRL::ComPtr<IMMDevice> pDefault;
+			if SUCCEEDED(pEnumerator_->GetDefaultAudioEndpoint(to_data_flow(flow), eConsole, &pDefault)) {
+				list.default_id = device_id(pDefault.Get());
+			}
+
+			Microsoft::WRL::ComPtr<IMMDeviceCollection> pCollection;
+			UINT deviceCount = 0;
+			if (FAILED(pEnumerator_->EnumAudioEndpoints(to_data_flow(flow), DEVICE_STATE_ACTIVE, &pCollection)) || FAILED(pCollection->GetCount(&deviceCount))) {
+				return list;
+			}
+			list.devices.reserve(deviceCount);
+			for (UINT i = 0; i < deviceCount; ++i) {
+				Microsoft::WRL::ComPtr<IMMDevice> pDevice;
+				if FAILED(pCollection->Item(i, &pDevice)) {
+					continue;
+				}
+				device_entry entry;
+				entry.id = device_id(pDevice.Get());
+				if (entry.id.empty()) {
+					continue;
+				}
+
+				Microsoft::WRL::ComPtr<IPropertyStore> propertyStore;
+				if SUCCEEDED(pDevice->OpenPropertyStore(STGM_READ, &propertyStore)) {
+					PROPVARIANT pv;
+					::PropVariantInit(&pv);
+					if (SUCCEEDED(propertyStore->GetValue(PKEY_Device_FriendlyName, &pv)) && pv.vt == VT_LPWSTR) {
+						entry.name = to_utf8(pv.pwszVal);
+					}
+					::PropVariantClear(&pv);
+				}
+				if (entry.name.empty()) {
+					entry.name = entry.id;
+				}
+				list.devices.push_back(std::move(entry));
+			}
+			return list;
+		}
+
+		static EDataFlow to_data_flow(device_flow flow) noexcept {
+			return flow == device_flow::capture ? eCapture : eRender;
+		}
+
+		static std::string device_id(IMMDevice* pDevice) {
+			LPWSTR pwszId = nullptr;
+			if FAILED(pDevice->GetId(&pwszId)) {
+				return std::string();
+			}
+			std::string id = to_utf8(pwszId);
+			::CoTaskMemFree(pwszId);
+			return id;
+		}
+
+		static std::string to_utf8(LPCWSTR value) {
+			int const size = ::WideCharToMultiByte(CP_UTF8, 0, value, -1, nullptr, 0, nullptr, nullptr);
+			if (size <= 1) {
+				return std::string();
+			}
+			std::string result(static_cast<std::size_t>(size - 1), '\0');
+			::WideCharToMultiByte(CP_UTF8, 0, value, -1, result.data(), size, nullptr, nullptr);
+			return result;
+		}
+
+		static std::wstring to_wide(std::string const& value) {
+			int const size = ::MultiByteToWideChar(CP_UTF8, 0, value.c_str(), -1, nullptr, 0);
+			if (size <= 1) {
+				return std::wstring();
+			}
+			std::wstring result(static_cast<std::size_t>(size - 1), L'\0');
+			::MultiByteToWideChar(CP_UTF8, 0, value.c_str(), -1, result.data(), size);
+			return result;
+		}
+
+		std::mutex mutex_;
+		Microsoft::WRL::ComPtr<IMMDeviceEnumerator> pEnumerator_;
+		Microsoft::WRL::ComPtr<IMMNotificationClient> pClient_;
+		HANDLE hEvtChanged_ = nullptr;
+		HANDLE hEvtShutdown_ = nullptr;
+		std::thread thread_;
+	};
+
+	/// プロセスで 1 つの一覧 (モジュールの読み込みで Start()、解放で Stop() する)
+	inline WasapiDeviceCatalog& wasapi_device_catalog() {
+		static WasapiDeviceCatalog catalog;
+		return catalog;
+	}
+}
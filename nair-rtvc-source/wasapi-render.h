@@ -0,0 +1,259 @@
+﻿#pragma once
+
+// WASAPI による直接モニター出力 (共有モード、イベント駆動)
+//
+// IAudioClient3 の最小周期はミックス形式でしか開けないので、ミックス形式 (float) で開いて 24 kHz モノラルから線形補間で変換して書く。
+// 開けなければ既定の周期で、形式の変換を WASAPI に任せて開く。
+// 再生スレッドは周期ごとに、デバイスに溜まっている量 (パディング) が 2 周期になる分だけ JitterBuffer から取り出して書き込む
+// (バッファー全体を埋めると、その分だけ遅れる)。
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <Windows.h>
+#include <audioclient.h>
+#include <avrt.h>
+#include <mmdeviceapi.h>
+#include <wrl.h>
+
+#include "monitor-output.h"
+
+namespace rtvc {
+	class WasapiRender final : public MonitorOutput {
+	public:
+		explicit WasapiRender(Microsoft::WRL::ComPtr<IMMDevice> pDevice)
+			: pDevice_(std::move(pDevice))
+		{
+		}
+
+		~WasapiRender() override {
+			Stop();
+			if (hEvtRenderReady_) {
+				::CloseHandle(hEvtRenderReady_);
+				hEvtRenderReady_ = nullptr;
+			}
+			if (hEvtShutdown_) {
+				::CloseHandle(hEvtShutdown_);
+				hEvtShutdown_ = nullptr;
+			}
+		}
+
+		char const* Name() const noexcept override {
+			return "wasapi";
+		}
+
+		char const* LastError() const noexcept override {
+			return error_;
+		}
+
+		HRESULT Open(int sample_rate, std::uint32_t write_frames) override {
+			HRESULT hr = S_OK;
+
+			hEvtRenderReady_ = ::CreateEventEx(nullptr, nullptr, 0, EVENT_MODIFY_STATE | SYNCHRONIZE);
+			hEvtShutdown_ = ::CreateEventEx(nullptr, nullptr, 0, EVENT_MODIFY_STATE | SYNCHRONIZE);
+			if (!hEvtRenderReady_ || !hEvtShutdown_) {
+				error_ = "unable to create render events";
+				return HRESULT_FROM_WIN32(::GetLastError());
+			}
+
+			if FAILED(hr = pDevice_->Activate(__uuidof(IAudioClient3), CLSCTX_INPROC_SERVER, nullptr, &pAudioClient_)) {
+				error_ = "unable to activate the render device";
+				return hr;
+			}
+
+			WAVEFORMATEXTENSIBLE format;
+			std::memset(&format, 0, sizeof(format));
+			format.Format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+			format.Format.nChannels = 1;
+			format.Format.nSamplesPerSec = sample_rate;
+			format.Format.wBitsPerSample = 32;
+			format.Format.nBlockAlign = format.Format.wBitsPerSample / 8 * format.Format.nChannels;
+			format.Format.nAvgBytesPerSec = format.Format.nSamplesPerSec * format.Format.nBlockAlign;
+			format.Format.cbSize = sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
+			format.dwChannelMask = SPEAKER_FRONT_CENTER;
+			format.Samples.wValidBitsPerSample = format.Format.wBitsPerSample;
+			format.SubFormat = KSDATAFORMAT_SUBTYPE_IEEE_FLOAT;
+
+			// エンジンの最小周期 (ミックス形式でだけ使える)
+			UINT32 uDefaultPeriod = 0;
+			UINT32 uFundamentalPeriod = 0;
+			UINT32 uMinPeriod = 0;
+			UINT32 uMaxPeriod = 0;
+			bool low_latency = false;
+			WAVEFORMATEX* pMixFormat = nullptr;
+			if (SUCCEEDED(pAudioClient_->GetMixFormat(&pMixFormat)) && is_float32(pMixFormat) &&
+				SUCCEEDED(pAudioClient_->GetSharedModeEnginePeriod(pMixFormat, &uDefaultPeriod, &uFundamentalPeriod, &uMinPeriod, &uMaxPeriod)) &&
+				SUCCEEDED(pAudioClient_->InitializeSharedAudioStream(AUDCLNT_STREAMFLAGS_EVENTCALLBACK, uMinPeriod, pMixFormat, nullptr)))
+			{
+				low_latency = true;
+				device_rate_ = static_cast<int>(pMixFormat->nSamplesPerSec);
+				channels_ = pMixFormat->nChannels;
+			}
+			::CoTaskMemFree(pMixFormat);
+			if (!low_latency) {
+				// 作り直さないと Initialize() できない
+				pAudioClient_.Reset();
+				if FAILED(hr = pDevice_->Activate(__uuidof(IAudioClient3), CLSCTX_INPROC_SERVER, nullptr, &pAudioClient_)) {
+					error_ = "unable to activate the render device";
+					return hr;
+				}
+				if FAILED(hr = pAudioClient_->Initialize(
+					AUDCLNT_SHAREMODE_SHARED,
+					AUDCLNT_STREAMFLAGS_EVENTCALLBACK | AUDCLNT_STREAMFLAGS_NOPERSIST | AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM | AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY,
+					0,
+					0,
+					reinterpret_cast<WAVEFORMATEX*>(&format),
+					nullptr))
+				{
+					error_ = "unable to initialize the render stream";
+					return hr;
+				}
+				device_rate_ = sample_rate;
+				channels_ = 1;
+			}
+
+			if FAILED(hr = pAudioClient_->GetBufferSize(&buffer_frames_)) {
+				error_ = "unable to get the render buffer size";
+				return hr;
+			}
+			REFERENCE_TIME hnsStreamLatency = 0;
+			pAudioClient_->GetStreamLatency(&hnsStreamLatency);
+			stream_latency_ns_ = static_cast<std::uint64_t>(hnsStreamLatency) * 100;
+
+			REFERENCE_TIME hnsDefaultDevicePeriod = 0;
+			REFERENCE_TIME hnsMinimumDevicePeriod = 0;
+			pAudioClient_->GetDevicePeriod(&hnsDefaultDevicePeriod, &hnsMinimumDevicePeriod);
+			period_frames_ = low_latency ? uMinPeriod : static_cast<std::uint32_t>(device_rate_ * hnsDefaultDevicePeriod / 10'000'000);
+			target_frames_ = (std::min)(2 * period_frames_, buffer_frames_);
+
+			if FAILED(hr = pAudioClient_->SetEventHandle(hEvtRenderReady_)) {
+				error_ = "unable to set the render event";
+				return hr;
+			}
+			if FAILED(hr = pAudioClient_->GetService(IID_PPV_ARGS(&pRenderClient_))) {
+				error_ = "unable to get the render client";
+				return hr;
+			}
+
+			// JitterBuffer は 24 kHz のフレームで数える
+			resampler_.Reset(sample_rate, device_rate_);
+			source_.assign(static_cast<std::size_t>(resampler_.SourceFrames(buffer_frames_)) + 1, 0.0f);
+			std::uint32_t const period_frames = static_cast<std::uint32_t>((static_cast<std::uint64_t>(period_frames_) * sample_rate + device_rate_ - 1) / device_rate_);
+			ResetBuffer(sample_rate, write_frames, period_frames);
+			return S_OK;
+		}
+
+		HRESULT Start() override {
+			HRESULT hr = S_OK;
+
+			// 最初の周期は無音で埋めておく
+			BYTE* pData = nullptr;
+			if SUCCEEDED(pRenderClient_->GetBuffer(period_frames_, &pData)) {
+				pRenderClient_->ReleaseBuffer(period_frames_, AUDCLNT_BUFFERFLAGS_SILENT);
+			}
+
+			if FAILED(hr = pAudioClient_->Start()) {
+				error_ = "unable to start the render stream";
+				return hr;
+			}
+			::ResetEvent(hEvtShutdown_);
+			thread_ = std::thread([this] { Render(); });
+			return S_OK;
+		}
+
+		HRESULT Stop() override {
+			if (thread_.joinable()) {
+				::SetEvent(hEvtShutdown_);
+				thread_.join();
+			}
+			if (pAudioClient_) {
+				pAudioClient_->Stop();
+			}
+			return S_OK;
+		}
+
+	private:
+		static bool is_float32(WAVEFORMATEX const* format) noexcept {
+			if (!format || format->wBitsPerSample != 32) {
+				return false;
+			}
+			if (format->wFormatTag == WAVE_FORMAT_IEEE_FLOAT) {
+				return true;
+			}
+			return format->wFormatTag == WAVE_FORMAT_EXTENSIBLE && format->cbSize >= sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX) &&
+				reinterpret_cast<WAVEFORMATEXTENSIBLE const*>(format)->SubFormat == KSDATAFORMAT_SUBTYPE_IEEE_FLOAT;
+		}
+
+		void Render() {
+			bool const com = SUCCEEDED(::CoInitializeEx(nullptr, COINIT_MULTITHREADED));
+			DWORD taskIndex = 0;
+			HANDLE const hMmCss = ::AvSetMmThreadCharacteristics(TEXT("Pro Audio"), &taskIndex);
+
+			HRESULT hr = S_OK;
+			HANDLE events[] = { hEvtRenderReady_, hEvtShutdown_ };
+			DWORD wait = WAIT_OBJECT_0;
+			while ((wait = ::WaitForMultipleObjects(static_cast<DWORD>(std::size(events)), events, FALSE, INFINITE)) == WAIT_OBJECT_0) {
+				UINT32 uPadding = 0;
+				if FAILED(hr = pAudioClient_->GetCurrentPadding(&uPadding)) {
+					error_ = "unable to get the render padding";
+					break;
+				}
+				// 溜まっている量が 2 周期になるまで (イベントを取りこぼしても次の周期で戻る)
+				if (uPadding >= target_frames_) {
+					continue;
+				}
+				UINT32 const uFrames = target_frames_ - uPadding;
+				BYTE* pData = nullptr;
+				if FAILED(hr = pRenderClient_->GetBuffer(uFrames, &pData)) {
+					error_ = "unable to get the render buffer";
+					break;
+				}
+				std::uint32_t const source_frames = resampler_.SourceFrames(uFrames);
+				buffer_.Pull(source_.data(), source_frames);
+				resampler_.Process(source_.data(), reinterpret_cast<float*>(pData), uFrames, channels_);
+				if FAILED(hr = pRenderClient_->ReleaseBuffer(uFrames, 0)) {
+					error_ = "unable to release the render buffer";
+					break;
+				}
+
+				// 書き込んだ分が鳴り終わるまで (JitterBuffer と同じ 24 kHz のフレームにする)
+				ReportDeviceLatency((static_cast<std::uint64_t>(uPadding) + uFrames) * static_cast<std::uint64_t>(sample_rate_) / static_cast<std::uint64_t>(device_rate_), stream_latency_ns_);
+			}
+			if (wait == WAIT_FAILED) {
+				hr = HRESULT_FROM_WIN32(::GetLastError());
+				error_ = "unable to wait for the render event";
+			}
+			if FAILED(hr) {
+				// デバイスが抜かれたときなど。推論スレッドはそのまま積み続け、溜まりすぎた分は捨てられる
+				ReportRenderFailure(hr);
+			}
+
+			if (hMmCss) {
+				::AvRevertMmThreadCharacteristics(hMmCss);
+			}
+			if (com) {
+				::CoUninitialize();
+			}
+		}
+
+		Microsoft::WRL::ComPtr<IMMDevice> pDevice_;
+		Microsoft::WRL::ComPtr<IAudioClient3> pAudioClient_;
+		Microsoft::WRL::ComPtr<IAudioRenderClient> pRenderClient_;
+		HANDLE hEvtRenderReady_ = nullptr;
+		HANDLE hEvtShutdown_ = nullptr;
+		UINT32 buffer_frames_ = 0;
+		UINT32 period_frames_ = 0; ///< デバイスのレートのフレーム
+		UINT32 target_frames_ = 0; ///< 溜めておくパディング (2 周期)
+		int device_rate_ = 24'000;
+		std::uint32_t channels_ = 1;
+		LinearResampler resampler_;
+		std::vector<float> source_;
+		std::uint64_t stream_latency_ns_ = 0;
+		std::thread thread_;
+		char const* error_ = "";
+	};
+}
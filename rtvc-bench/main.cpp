@@ -0,0 +1,549 @@
+﻿// プラグインの音声処理のマイクロベンチマーク
+//
+// エンジンの外でプラグインがパケットごとにすること (ブロックの組み立て、無音の書き込み、タイムスタンプの計算、
+// パラメーターの読み出し、obs_source_audio の用意) と、遅延、穴埋め、ドライへのつなぎ、DSP のカーネルを、
+// 実際に届くパケットの大きさごとに測る。エンジンも OBS も要らない (OBS のヘッダーはインライン関数と構造体だけを使う)。
+//
+//   rtvc-bench [--filter <name>] [--sizes <frames,...>] [--min-time <ms>] [--simd <isa>] [--call-us <us>] [--output <json>]
+//
+// 大きさの既定は 240 / 441 / 480 (24 / 44.1 / 48 kHz の WASAPI の 10 ms)、256 (エンジンのブロック)、
+// 1 / 37 / 509 (半端な大きさ)、2400 (100 ms まとめて届いたとき)。
+// engine.single / engine.batched は試験用のエンジン (stub-engine.h、呼び出しごとに --call-us かかる) に、
+// 1 回の起床で揃ったブロックを 1 ブロックずつ渡したときと process_n() でまとめて渡したときを比べる (出力が違えば失敗にする)。
+// 1 フレームあたりのナノ秒とサイクル (x86 では TSC の刻み) を出す。--output の JSON を前の結果と比べれば、遅くなったところが分かる。
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <obs.h>
+#include <media-io/audio-io.h>
+
+#include "../nair-rtvc-source/simd-kernels.h"
+#include "../nair-rtvc-source/eco-engine.h"
+#include "../nair-rtvc-source/stub-engine.h"
+#include "../nair-rtvc-source/block-assembler.h"
+#include "../nair-rtvc-source/delay-line.h"
+#include "../nair-rtvc-source/engine-watchdog.h"
+#include "../nair-rtvc-source/concealment.h"
+#include "../nair-rtvc-source/voice-preset.h"
+
+namespace {
+	// eco エンジンと同じ 24 kHz、256 フレームのブロックで測る
+	constexpr int SAMPLE_RATE = rtvc::eco::SAMPLE_RATE;
+	constexpr std::uint32_t BLOCK_SIZE = rtvc::eco::BLOCK_SIZE;
+
+	// 1 つのケースを REPEATS 回に分けて測り、中央値を取る
+	constexpr int REPEATS = 5;
+
+	struct options {
+		std::string filter;
+		std::string output;
+		std::string simd;
+		std::vector<std::uint32_t> sizes{ 240, 441, 480, 256, 1, 37, 509, 2400 };
+		double min_time_ms = 50.0;
+		double call_us = 20.0; ///< 試験用のエンジンの呼び出しごとの時間
+	};
+
+	void usage() {
+		std::fprintf(stderr,
+			"usage: rtvc-bench [--filter <name>] [--sizes <frames,...>] [--min-time <ms>] [--simd <scalar|sse2|avx2|avx512>] [--call-us <us>] [--output <json>]\n"
+			);
+	}
+
+	bool parse_sizes(char const* text, std::vector<std::uint32_t>& sizes) {
+		sizes.clear();
+		while (*text) {
+			char* end = nullptr;
+			unsigned long const frames = std::strtoul(text, &end, 10);
+			if (end == text || frames == 0 || frames > 1'000'000) {
+				return false;
+			}
+			sizes.push_back(static_cast<std::uint32_t>(frames));
+			text = *end == ',' ? end + 1 : end;
+			if (*end && *end != ',') {
+				return false;
+			}
+		}
+		return !sizes.empty();
+	}
+
+	bool parse_options(int argc, char** argv, options& opts) {
+		for (int i = 1; i < argc; ++i) {
+			std::string const arg = argv[i];
+			if (arg == "--filter" && i + 1 < argc) {
+				opts.filter = argv[++i];
+			}
+			else if (arg == "--output" && i + 1 < argc) {
+				opts.output = argv[++i];
+			}
+			else if (arg == "--simd" && i + 1 < argc) {
+				opts.simd = argv[++i];
+			}
+			else if (arg == "--sizes" && i + 1 < argc) {
+				if (!parse_sizes(argv[++i], opts.sizes)) {
+					return false;
+				}
+			}
+			else if (arg == "--call-us" && i + 1 < argc) {
+				opts.call_us = std::strtod(argv[++i], nullptr);
+				if (!(opts.call_us >= 0.0)) {
+					return false;
+				}
+			}
+			else if (arg == "--min-time" && i + 1 < argc) {
+				opts.min_time_ms = std::strtod(argv[++i], nullptr);
+				if (!(opts.min_time_ms > 0.0)) {
+					return false;
+				}
+			}
+			else {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	std::uint64_t now_ns() {
+		return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	constexpr bool HAS_CYCLES = true;
+
+	/// TSC の刻み (コアのクロックではなく一定の周波数で進む)
+	inline std::uint64_t read_cycles() noexcept {
+		return __rdtsc();
+	}
+#else
+	constexpr bool HAS_CYCLES = false;
+
+	inline std::uint64_t read_cycles() noexcept {
+		return 0;
+	}
+#endif
+
+	/// 値とメモリーへの書き込みを使ったことにして、最適化で消されないようにする
+	template <typename T>
+	inline void keep(T const& value) noexcept {
+#if defined(_MSC_VER)
+		static_cast<void>(*reinterpret_cast<char const volatile*>(&value));
+		_ReadWriteBarrier();
+#else
+		asm volatile("" : : "r"(&value) : "memory");
+#endif
+	}
+
+	struct result {
+		std::string name;
+		std::uint32_t packet_frames;   ///< 測った大きさ (--sizes)
+		std::uint32_t frames_per_call; ///< 1 回に通したフレーム数
+		double ns_per_call;
+		double cycles_per_call;
+		std::uint64_t iterations;      ///< 1 回の計測で呼んだ回数
+	};
+
+	class bench {
+	public:
+		explicit bench(options const& opts)
+			: opts_(opts)
+		{
+		}
+
+		bool Enabled(std::string const& name) const {
+			return opts_.filter.empty() || name.find(opts_.filter) != std::string::npos;
+		}
+
+		/// fn() を 1 回 frames_per_call フレーム分として測る
+		template <typename Fn>
+		void Run(std::string const& name, std::uint32_t packet_frames, std::uint32_t frames_per_call, Fn&& fn) {
+			if (!Enabled(name)) {
+				return;
+			}
+
+			// 1 回の計測が min_time / REPEATS になる回数を見積もる (キャッシュと分岐予測も温まる)
+			std::uint64_t const target_ns = (std::max)(static_cast<std::uint64_t>(opts_.min_time_ms * 1e6 / REPEATS), std::uint64_t{ 1'000 });
+			std::uint64_t iterations = 1;
+			for (;;) {
+				std::uint64_t const start = now_ns();
+				for (std::uint64_t i = 0; i < iterations; ++i) {
+					fn();
+				}
+				std::uint64_t const elapsed = now_ns() - start;
+				if (elapsed >= target_ns / 4 || iterations >= (std::uint64_t{ 1 } << 32)) {
+					iterations = (std::max)(iterations * target_ns / (std::max)(elapsed, std::uint64_t{ 1 }), std::uint64_t{ 1 });
+					break;
+				}
+				iterations *= 4;
+			}
+
+			double ns[REPEATS];
+			double cycles[REPEATS];
+			for (int r = 0; r < REPEATS; ++r) {
+				std::uint64_t const start = now_ns();
+				std::uint64_t const start_cycles = read_cycles();
+				for (std::uint64_t i = 0; i < iterations; ++i) {
+					fn();
+				}
+				std::uint64_t const end_cycles = read_cycles();
+				std::uint64_t const end = now_ns();
+				ns[r] = static_cast<double>(end - start) / static_cast<double>(iterations);
+				cycles[r] = static_cast<double>(end_cycles - start_cycles) / static_cast<double>(iterations);
+			}
+			std::sort(std::begin(ns), std::end(ns));
+			std::sort(std::begin(cycles), std::end(cycles));
+
+			result const& added = results_.emplace_back(result{ name, packet_frames, frames_per_call, ns[REPEATS / 2], cycles[REPEATS / 2], iterations });
+			double const frames = static_cast<double>(frames_per_call);
+			std::printf("%-30s %5u  %9.3f ns/frame  %9.3f cycles/frame  %10.1f ns/call\n", added.name.c_str(), added.packet_frames,
+				added.ns_per_call / frames, added.cycles_per_call / frames, added.ns_per_call);
+		}
+
+		bool Write(std::string const& path) const {
+			std::ofstream out(path, std::ios::binary | std::ios::trunc);
+			if (!out) {
+				return false;
+			}
+			out.precision(6);
+			out << "{\n"
+				<< "  \"version\": 1,\n"
+				<< "  \"sample_rate\": " << SAMPLE_RATE << ",\n"
+				<< "  \"block_size\": " << BLOCK_SIZE << ",\n"
+				<< "  \"simd\": \"" << rtvc::simd::to_string(rtvc::simd::kernels().isa) << "\",\n"
+				<< "  \"simd_supported\": \"" << rtvc::simd::to_string(rtvc::simd::supported_level) << "\",\n"
+				<< "  \"cycles\": \"" << (HAS_CYCLES ? "tsc" : "none") << "\",\n"
+				<< "  \"results\": [";
+			for (std::size_t i = 0; i < results_.size(); ++i) {
+				result const& r = results_[i];
+				double const frames = static_cast<double>(r.frames_per_call);
+				out << (i == 0 ? "\n" : ",\n")
+					<< "    { \"name\": \"" << r.name << "\""
+					<< ", \"packet_frames\": " << r.packet_frames
+					<< ", \"frames_per_call\": " << r.frames_per_call
+					<< ", \"ns_per_frame\": " << r.ns_per_call / frames
+					<< ", \"cycles_per_frame\": ";
+				if (HAS_CYCLES) {
+					out << r.cycles_per_call / frames;
+				}
+				else {
+					out << "null";
+				}
+				out << ", \"ns_per_call\": " << r.ns_per_call
+					<< ", \"iterations\": " << r.iterations << " }";
+			}
+			out << "\n  ]\n}\n";
+			return static_cast<bool>(out);
+		}
+
+	private:
+		options const& opts_;
+		std::vector<result> results_;
+	};
+
+	/// 有声音の代わり (150 Hz ののこぎり波を帯域制限したもの)
+	std::vector<float> voice(std::size_t frames) {
+		std::vector<float> x(frames);
+		double const PI = 3.14159265358979323846;
+		for (std::size_t i = 0; i < frames; ++i) {
+			double sample = 0.0;
+			for (int k = 1; k <= 16; ++k) {
+				sample += std::sin(2.0 * PI * 150.0 * k * static_cast<double>(i) / SAMPLE_RATE) / k;
+			}
+			x[i] = static_cast<float>(0.2 * sample);
+		}
+		return x;
+	}
+
+	// Process() がパケットごとにすること (エンジンの前後)
+	void bench_packet(bench& b, std::uint32_t frames) {
+		std::vector<float> const packet = voice(frames);
+
+		// 取り込んだパケットをブロックに切り分ける
+		{
+			rtvc::BlockAssembler assembler;
+			assembler.Reset(BLOCK_SIZE, frames);
+			b.Run("assembler.push", frames, frames, [&] {
+				keep(assembler.Push(packet.data(), frames));
+			});
+			assembler.Reset(BLOCK_SIZE, frames);
+			b.Run("assembler.push_silent", frames, frames, [&] {
+				keep(assembler.Push(nullptr, frames));
+			});
+		}
+
+		// 遅延の測定中に出力を無音にする
+		{
+			std::vector<float> blocks(frames);
+			b.Run("silence.fill", frames, frames, [&] {
+				std::memset(blocks.data(), 0, frames * sizeof(float));
+				keep(blocks[0]);
+			});
+		}
+
+		// 出力のタイムスタンプ、取り込み時刻、見張りの期限
+		{
+			std::uint64_t total_frames = 0;
+			std::uint32_t remainings = 0;
+			std::uint64_t device_time_ns = 1'000'000'000;
+			std::atomic<std::uint64_t> engine_timeout_ns{ 20'000'000 };
+			b.Run("timestamps", frames, frames, [&] {
+				std::uint64_t const timestamp = audio_frames_to_ns(SAMPLE_RATE, total_frames * BLOCK_SIZE);
+				std::uint64_t const capture_time = device_time_ns - audio_frames_to_ns(SAMPLE_RATE, remainings);
+				std::uint32_t const block_count = (remainings + frames) / BLOCK_SIZE;
+				remainings = (remainings + frames) % BLOCK_SIZE;
+				std::uint64_t const deadline = capture_time + audio_frames_to_ns(SAMPLE_RATE, block_count * BLOCK_SIZE) + engine_timeout_ns.load(std::memory_order::acquire);
+				std::uint64_t const block_ns = audio_frames_to_ns(SAMPLE_RATE, BLOCK_SIZE);
+				total_frames += block_count;
+				device_time_ns += audio_frames_to_ns(SAMPLE_RATE, frames);
+				keep(timestamp);
+				keep(deadline);
+				keep(block_ns);
+			});
+		}
+
+		// 声とパラメーターを読み出して process() に渡す形にする (切り替えた直後は配分を移す)
+		{
+			rtvc::voice_params slots[rtvc::VoicePresets::NUM_SLOTS];
+			slots[1].secondary_voice = 2;
+			slots[1].amount = 0.3f;
+			slots[2].primary_voice = 3;
+			slots[2].params[2] = 0.2f;
+			rtvc::VoicePresets presets;
+			presets.Publish(slots, 30'000'000);
+			std::uint32_t const blocks = (std::max)(frames / BLOCK_SIZE, 1u);
+			std::uint64_t const block_ns = audio_frames_to_ns(SAMPLE_RATE, BLOCK_SIZE);
+			auto const load = [&] {
+				rtvc::voice_mix const& voices = presets.Advance(blocks, block_ns);
+				float const params[] = { voices.params[0], voices.params[1], voices.params[2], voices.params[3], voices.params[4] };
+				keep(params);
+				keep(voices.ids[0]);
+			};
+			presets.Select(1);
+			b.Run("params.load", frames, frames, load);
+			int preset = 1;
+			b.Run("params.blend", frames, frames, [&] {
+				presets.Select(preset = 3 - preset);
+				load();
+			});
+		}
+
+		// obs_source_output_audio() に渡すまで (ドライと、再開からの遅延、取り込みからの遅延も)
+		{
+			std::vector<float> blocks(frames);
+			std::vector<float> dry_blocks(frames);
+			std::atomic<std::uint64_t> resume_ns{ 0 };
+			std::atomic<bool> dry_in_use{ false };
+			std::atomic<obs_source_t*> dry_source{ nullptr };
+			std::atomic<std::int64_t> pipeline_delay_ns{ 0 };
+			std::uint64_t capture_time = 0;
+			b.Run("obs_audio.setup", frames, frames, [&] {
+				obs_source_audio data;
+				std::memset(&data, 0, sizeof(data));
+				data.data[0] = reinterpret_cast<std::uint8_t*>(blocks.data());
+				data.frames = frames;
+				data.speakers = SPEAKERS_MONO;
+				data.format = AUDIO_FORMAT_FLOAT;
+				data.samples_per_sec = SAMPLE_RATE;
+				data.timestamp = now_ns();
+				keep(data);
+				if (resume_ns.load(std::memory_order::relaxed) != 0) {
+					resume_ns.exchange(0, std::memory_order::acq_rel);
+				}
+				dry_in_use.store(true);
+				if (dry_source.load() == nullptr) {
+					data.data[0] = reinterpret_cast<std::uint8_t*>(dry_blocks.data());
+					keep(data);
+				}
+				dry_in_use.store(false, std::memory_order::release);
+				std::int64_t const delay = static_cast<std::int64_t>(data.timestamp - capture_time) + static_cast<std::int64_t>(audio_frames_to_ns(SAMPLE_RATE, rtvc::eco::SAMPLE_LATENCY));
+				std::int64_t const smoothed = pipeline_delay_ns.load(std::memory_order::relaxed);
+				pipeline_delay_ns.store(smoothed == 0 ? delay : smoothed + (delay - smoothed) / 16, std::memory_order::release);
+				capture_time = data.timestamp;
+			});
+		}
+	}
+
+	// ドライの遅延、穴埋め、ドライへのつなぎ (Reset() の後、リアルタイムスレッドで動くもの)
+	void bench_blocks(bench& b, std::uint32_t frames) {
+		std::vector<float> const input = voice(frames + 4 * SAMPLE_RATE / 60);
+		std::vector<float> out(frames);
+
+		{
+			rtvc::DelayLine delay;
+			delay.Reset(static_cast<std::uint32_t>(rtvc::eco::SAMPLE_LATENCY), frames);
+			b.Run("delay_line", frames, frames, [&] {
+				delay.Process(input.data(), out.data(), frames);
+				keep(out[0]);
+			});
+		}
+
+		// 本物の音声を覚えるだけのときと、1 回欠けて戻るとき (周期を探して合成し、クロスフェードで戻る)
+		{
+			rtvc::Concealer concealer;
+			concealer.Reset(SAMPLE_RATE);
+			// 周期を探せるだけの履歴を入れておく
+			std::vector<float> history = input;
+			concealer.Good(history.data(), static_cast<std::uint32_t>(history.size()));
+			b.Run("concealer.good", frames, frames, [&] {
+				std::memcpy(out.data(), input.data(), frames * sizeof(float));
+				concealer.Good(out.data(), frames);
+				keep(out[0]);
+			});
+			std::vector<float> good(frames);
+			b.Run("concealer.dropout", frames, 2 * frames, [&] {
+				concealer.Conceal(out.data(), frames);
+				std::memcpy(good.data(), input.data(), frames * sizeof(float));
+				concealer.Good(good.data(), frames);
+				keep(out[0]);
+				keep(good[0]);
+			});
+		}
+
+		// 見張りが間に合わなかったと判断したブロックと、エンジンが戻ったブロック
+		{
+			rtvc::DryFallback fallback;
+			fallback.Reset(static_cast<std::uint32_t>(SAMPLE_RATE / 100));
+			b.Run("dry_fallback.miss", frames, frames, [&] {
+				fallback.Process(false, out.data(), input.data(), frames);
+				keep(out[0]);
+			});
+			b.Run("dry_fallback.dropout", frames, 2 * frames, [&] {
+				fallback.Process(false, out.data(), input.data(), frames);
+				fallback.Process(true, out.data(), input.data(), frames);
+				keep(out[0]);
+			});
+		}
+	}
+
+	// 1 回の起床で揃ったブロックをエンジンに渡す (1 ブロックずつと process_n() でまとめて)
+	// まとめても出力が変わらないことを先に確かめる (違えば false)
+	bool bench_engine(bench& b, std::uint32_t frames, double call_us) {
+		if (!b.Enabled("engine.")) {
+			return true;
+		}
+		int const num_blocks = static_cast<int>((std::max)(frames / BLOCK_SIZE, 1u));
+		rtvc::stub_engine_config config;
+		config.sample_rate = SAMPLE_RATE;
+		config.block_size = static_cast<int>(BLOCK_SIZE);
+		config.call_us = call_us;
+		config.max_blocks = num_blocks;
+		rtvc::engine_api engine;
+		rtvc::stub_engine_api(engine, config);
+		float const params[] = { 1.0f, 1.0f, 0.0f, 1.0f, 0.0f };
+		std::size_t const block_frames = static_cast<std::size_t>(num_blocks) * BLOCK_SIZE;
+		std::vector<float> const input = voice(4 * block_frames);
+
+		// 同じ入力を 4 回の起床に分けて通し、出力を比べる
+		std::vector<float> outputs[2];
+		for (int batched = 0; batched < 2; ++batched) {
+			engine.init("");
+			rtvc::negotiate_batch(engine, batched ? 0 : 1);
+			outputs[batched].assign(input.size(), 0.0f);
+			for (std::size_t offset = 0; offset < input.size(); offset += block_frames) {
+				rtvc::process_blocks(engine, static_cast<int>(std::size(params)), params, static_cast<int>(BLOCK_SIZE), num_blocks, input.data() + offset, outputs[batched].data() + offset);
+			}
+			engine.destroy();
+		}
+		if (std::memcmp(outputs[0].data(), outputs[1].data(), input.size() * sizeof(float)) != 0) {
+			std::fprintf(stderr, "engine.batched: output differs from engine.single (%d blocks)\n", num_blocks);
+			return false;
+		}
+
+		std::vector<float> blocks(block_frames);
+		for (int batched = 0; batched < 2; ++batched) {
+			engine.init("");
+			rtvc::negotiate_batch(engine, batched ? 0 : 1);
+			b.Run(batched ? "engine.batched" : "engine.single", frames, static_cast<std::uint32_t>(block_frames), [&] {
+				std::memcpy(blocks.data(), input.data(), block_frames * sizeof(float));
+				keep(rtvc::process_blocks(engine, static_cast<int>(std::size(params)), params, static_cast<int>(BLOCK_SIZE), num_blocks, blocks.data(), blocks.data()));
+				keep(blocks[0]);
+			});
+			engine.destroy();
+		}
+		return true;
+	}
+
+	// DSP のカーネル (CPU が対応している版をすべて)
+	void bench_kernels(bench& b, std::uint32_t frames) {
+		std::vector<float> const a = voice(frames);
+		std::vector<float> x(a.rbegin(), a.rend());
+		std::vector<float> y(frames);
+		float const step = 1.0f / static_cast<float>(SAMPLE_RATE / 100);
+		for (rtvc::simd::level const isa : { rtvc::simd::level::scalar, rtvc::simd::level::sse2, rtvc::simd::level::avx2, rtvc::simd::level::avx512 }) {
+			if (isa > rtvc::simd::supported_level) {
+				break;
+			}
+			rtvc::simd::kernel_table const& kernels = rtvc::simd::kernels_for(isa);
+			std::string const suffix = std::string(".") + rtvc::simd::to_string(isa);
+			b.Run("simd.scale" + suffix, frames, frames, [&] {
+				kernels.scale(a.data(), y.data(), 0.5f, frames);
+				keep(y[0]);
+			});
+			b.Run("simd.crossfade" + suffix, frames, frames, [&] {
+				kernels.crossfade(a.data(), x.data(), y.data(), 0, step, frames);
+				keep(y[0]);
+			});
+			b.Run("simd.dot" + suffix, frames, frames, [&] {
+				keep(kernels.dot(a.data(), x.data(), frames));
+			});
+			b.Run("simd.squared_distance" + suffix, frames, frames, [&] {
+				keep(kernels.squared_distance(a.data(), x.data(), frames));
+			});
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	options opts;
+	if (!parse_options(argc, argv, opts)) {
+		usage();
+		return 2;
+	}
+
+	// 穴埋めとドライへのつなぎが使う版 (simd.* はすべての版を測る)
+	if (!opts.simd.empty()) {
+		rtvc::simd::level isa = rtvc::simd::level::scalar;
+		if (!rtvc::simd::from_string(opts.simd.c_str(), isa)) {
+			usage();
+			return 2;
+		}
+		if (!rtvc::simd::use(isa)) {
+			std::fprintf(stderr, "%s is not supported on this CPU (up to %s)\n", rtvc::simd::to_string(isa), rtvc::simd::to_string(rtvc::simd::supported_level));
+			return 1;
+		}
+	}
+	std::printf("simd: %s (supported %s)\n", rtvc::simd::to_string(rtvc::simd::kernels().isa), rtvc::simd::to_string(rtvc::simd::supported_level));
+	std::printf("%d [hz], block %u, cycles: %s\n", SAMPLE_RATE, BLOCK_SIZE, HAS_CYCLES ? "tsc" : "none");
+
+	bench b(opts);
+	bool ok = true;
+	for (std::uint32_t const frames : opts.sizes) {
+		bench_packet(b, frames);
+		bench_blocks(b, frames);
+		ok = bench_engine(b, frames, opts.call_us) && ok;
+		bench_kernels(b, frames);
+	}
+
+	if (!opts.output.empty()) {
+		if (!b.Write(opts.output)) {
+			std::fprintf(stderr, "could not write %s\n", opts.output.c_str());
+			return 1;
+		}
+		std::printf("wrote %s\n", opts.output.c_str());
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,1272 @@
+﻿// 変換ホスト
+//
+// 取り込みバックエンド -> ブロックへの切り分け -> エンジン -> 出力 を 1 プロセスで動かし、
+// 変換した音声を複数の出力に配る。推論は 1 回だけで、OBS と通話アプリに同じ声を届けられる。
+//
+//   rtvc-host [--capture <spec>] [--engine <path|eco>] [--model <name>] [--shm <name>] [--pipe <name>] [--control <port>]
+//
+// 出力
+//   --shm   共有メモリー (nair-rtvc-source の Capture で「Voice Changer Host」を選ぶと読む)
+//   --pipe  Windows は名前付きパイプ \\.\pipe\<name>、それ以外は FIFO (float32le モノラル)
+//           PipeWire / PulseAudio では module-pipe-source に渡すと仮想マイクになる
+//   --alsa-output  ALSA の再生デバイス (RTVC_WITH_ALSA を定義して -lasound とリンクしたとき)
+//           snd-aloop の hw:Loopback,0 に流すと hw:Loopback,1 が仮想マイクになる
+//   --monitor  自分の声を聞くための低遅延の再生 (Windows は default か再生デバイスの番号、ALSA はデバイス名)
+//
+// 制御 (127.0.0.1 の UDP。1 データグラムに 1 コマンド、応答も 1 データグラム)
+//   voice <id>
+//   voices <id1> <id2> <amount %>
+//   set <input_gain|output_gain|your_voice|pitch_shift|pitch_shift_mode|pitch_snap> <value>   (db, 0-4, cent, 0/1, %)
+//   get | list | stats | quit
+//   model <name> | models   (裏で初期化して、ブロックの境目でクロスフェードして差し替える)
+//   reload                  (--engine のファイルを新しい版に替えてから。並べて読み込んで差し替える)
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../nair-rtvc-source/rtvc-engine.h"
+#include "../nair-rtvc-source/eco-engine.h"
+#include "../nair-rtvc-source/model-registry.h"
+#include "../nair-rtvc-source/concealment.h"
+#include "../nair-rtvc-source/block-assembler.h"
+#include "../nair-rtvc-source/capture-backend.h"
+#include "../nair-rtvc-source/file-capture.h"
+#include "../nair-rtvc-source/synthetic-capture.h"
+#include "../nair-rtvc-source/spsc-ring.h"
+#include "../nair-rtvc-source/shared-audio.h"
+#include "../nair-rtvc-source/monitor-output.h"
+#include "../nair-rtvc-source/rt-check.h"
+#if defined(_WIN32)
+#include <avrt.h>
+#include <functiondiscoverykeys_devpkey.h>
+#include "../nair-rtvc-source/wasapi-capture.h"
+#include "../nair-rtvc-source/wasapi-render.h"
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+#if defined(RTVC_WITH_ALSA)
+#include "../nair-rtvc-source/alsa-capture.h"
+#include "../nair-rtvc-source/alsa-render.h"
+#include "../nair-rtvc-source/alsa-device-catalog.h"
+#endif
+
+#if defined(_WIN32)
+#pragma comment(lib, "avrt.lib")
+#pragma comment(lib, "ws2_32.lib")
+
+// wasapi-capture.h のログを標準エラーに出す (libobs はリンクしない)
+void blog(int log_level, char const* format, ...) {
+	va_list args;
+	va_start(args, format);
+	std::vfprintf(stderr, format, args);
+	va_end(args);
+	std::fputc('\n', stderr);
+}
+#endif
+
+namespace {
+	constexpr double const PITCH_SHIFT_PROTOTYPES[2][5] = {
+		{0, +1200,    0,    0, -1200},  // song mode
+		{0, +1000, +400, -200,  -800},  // talk mode
+	};
+
+	std::atomic<bool> quit_requested = false;
+
+	struct options {
+		std::string capture;
+		int latency_mode = 7;
+		std::string engine;
+		std::string model = "jvs100";
+		std::string shm = rtvc::SHARED_AUDIO_DEFAULT_NAME;
+		std::string pipe;
+		std::string alsa_output;
+		std::string monitor;
+		int control_port = 39'000;
+		bool list_devices = false;
+	};
+
+	void usage() {
+		std::fprintf(stderr,
+			"usage: rtvc-host [--capture <spec>] [--engine <path|eco>] [--model <name>]\n"
+			"                 [--shm <name>|none] [--pipe <name>] [--control <port>]\n"
+#if defined(RTVC_WITH_ALSA)
+			"                 [--alsa-output <device>]\n"
+#endif
+#if defined(_WIN32) || defined(RTVC_WITH_ALSA)
+			"                 [--monitor <device>]\n"
+#endif
+			"capture:\n"
+#if defined(_WIN32)
+			"  wasapi[:<index>] [--latency <mode>]   (--list-devices to show the indices)\n"
+#endif
+#if defined(RTVC_WITH_ALSA)
+			"  alsa:<device>   (--list-devices to show the devices)\n"
+#endif
+			"  file:<wav|raw>\n"
+			"  synthetic[:packets=441,480;jitter=<ms>;silent=<p>;discontinuity=<p>;seed=<n>]\n"
+			);
+	}
+
+	bool parse_options(int argc, char** argv, options& opts) {
+		for (int i = 1; i < argc; ++i) {
+			std::string const arg = argv[i];
+			if (arg == "--capture" && i + 1 < argc) {
+				opts.capture = argv[++i];
+			}
+			else if (arg == "--latency" && i + 1 < argc) {
+				opts.latency_mode = std::atoi(argv[++i]);
+			}
+			else if (arg == "--engine" && i + 1 < argc) {
+				opts.engine = argv[++i];
+			}
+			else if (arg == "--model" && i + 1 < argc) {
+				opts.model = argv[++i];
+			}
+			else if (arg == "--shm" && i + 1 < argc) {
+				opts.shm = argv[++i];
+			}
+			else if (arg == "--pipe" && i + 1 < argc) {
+				opts.pipe = argv[++i];
+			}
+			else if (arg == "--alsa-output" && i + 1 < argc) {
+				opts.alsa_output = argv[++i];
+			}
+			else if (arg == "--monitor" && i + 1 < argc) {
+				opts.monitor = argv[++i];
+			}
+			else if (arg == "--control" && i + 1 < argc) {
+				opts.control_port = std::atoi(argv[++i]);
+			}
+			else if (arg == "--list-devices") {
+				opts.list_devices = true;
+			}
+			else {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	rtvc::module_handle load_engine(std::filesystem::path const& path) {
+#if defined(_WIN32)
+		return ::LoadLibrary(path.c_str());
+#else
+		return ::dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+#endif
+	}
+
+	std::uint64_t now_ns() {
+		return rtvc::CapturePacer::now_ns();
+	}
+
+	// 出力先
+	class OutputSink {
+	public:
+		virtual ~OutputSink() = default;
+
+		virtual char const* Name() const noexcept = 0;
+
+		virtual HRESULT Open(int sample_rate, int block_size, int sample_latency) = 0;
+
+		/// 変換した音声を渡す (処理スレッドから。ブロックしない)
+		/// origin_time_ns は先頭フレームの元になった入力の取り込み時刻 (不明なら 0)
+		virtual void Write(float const* data, std::uint32_t frames, std::uint64_t origin_time_ns) noexcept = 0;
+
+		virtual void Close() = 0;
+
+		/// 間に合わずに捨てたフレーム数
+		virtual std::uint64_t Dropped() const noexcept {
+			return 0;
+		}
+
+		/// Write() してから届くまでの実測値 [ns] (測れなければ 0)
+		virtual std::uint64_t LatencyNs() const noexcept {
+			return 0;
+		}
+	};
+
+	// nair-rtvc-source に共有メモリーで渡す
+	class SharedMemorySink final : public OutputSink {
+	public:
+		explicit SharedMemorySink(std::string name)
+			: name_(std::move(name))
+		{
+		}
+
+		char const* Name() const noexcept override {
+			return "shm";
+		}
+
+		HRESULT Open(int sample_rate, int block_size, int sample_latency) override {
+			// 1 秒以上あれば OBS 側の起床が多少遅れても追いつける
+			return writer_.Create(name_, static_cast<std::uint32_t>(sample_rate), static_cast<std::uint32_t>(sample_latency), static_cast<std::uint32_t>(sample_rate + block_size));
+		}
+
+		void Write(float const* data, std::uint32_t frames, std::uint64_t origin_time_ns) noexcept override {
+			writer_.Write(data, frames, origin_time_ns);
+		}
+
+		void Close() override {
+			writer_.Close();
+		}
+
+	private:
+		std::string name_;
+		rtvc::SharedAudioWriter writer_;
+	};
+
+	// 書き込みがブロックする出力は別スレッドから送る
+	//
+	// 処理スレッドはリングに積むだけで、相手がいなければ捨てる。相手が切れたらつなぎ直す。
+	class StreamSink : public OutputSink {
+	public:
+		HRESULT Open(int sample_rate, int block_size, [[maybe_unused]] int sample_latency) override {
+			sample_rate_ = sample_rate;
+			chunk_frames_ = static_cast<std::uint32_t>(block_size);
+			ring_.Reset(static_cast<std::size_t>(sample_rate / 2));
+			dropped_.store(0, std::memory_order::relaxed);
+			running_.store(true, std::memory_order::release);
+			finished_.store(false, std::memory_order::release);
+			thread_ = std::thread([this] { Run(); });
+			return S_OK;
+		}
+
+		void Write(float const* data, std::uint32_t frames, [[maybe_unused]] std::uint64_t origin_time_ns) noexcept override {
+			std::size_t const written = ring_.Write(data, frames);
+			if (written < frames) {
+				dropped_.fetch_add(frames - written, std::memory_order::relaxed);
+			}
+		}
+
+		void Close() override {
+			if (!thread_.joinable()) {
+				return;
+			}
+			running_.store(false, std::memory_order::release);
+			while (!finished_.load(std::memory_order::acquire)) {
+				Cancel();
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			thread_.join();
+		}
+
+		std::uint64_t Dropped() const noexcept override {
+			return dropped_.load(std::memory_order::relaxed);
+		}
+
+	protected:
+		/// 相手とつなぐ (ブロックしてよい。失敗したら少し待ってやり直す)
+		virtual bool Connect() = 0;
+
+		/// 送る (ブロックしてよい。false なら切断する)
+		virtual bool Send(float const* data, std::uint32_t frames) = 0;
+
+		virtual void Disconnect() = 0;
+
+		/// Connect() / Send() で止まっている送信スレッドを起こす
+		virtual void Cancel() noexcept {
+		}
+
+		bool IsRunning() const noexcept {
+			return running_.load(std::memory_order::acquire);
+		}
+
+		std::thread thread_;
+		int sample_rate_ = 24'000;
+
+	private:
+		void Run() {
+			std::vector<float> buffer(chunk_frames_);
+			auto const idle = std::chrono::nanoseconds(std::int64_t(1'000'000'000) * chunk_frames_ / sample_rate_ / 4);
+			bool connected = false;
+			while (IsRunning()) {
+				if (!connected) {
+					// つながるまでの音は古くなるので捨てる
+					ring_.Skip(ring_.Readable());
+					connected = Connect();
+					if (!connected) {
+						std::this_thread::sleep_for(std::chrono::milliseconds(100));
+					}
+					continue;
+				}
+				std::size_t const frames = ring_.Read(buffer.data(), buffer.size());
+				if (frames == 0) {
+					std::this_thread::sleep_for(idle);
+					continue;
+				}
+				if (!Send(buffer.data(), static_cast<std::uint32_t>(frames))) {
+					Disconnect();
+					connected = false;
+				}
+			}
+			if (connected) {
+				Disconnect();
+			}
+			finished_.store(true, std::memory_order::release);
+		}
+
+		rtvc::SpscRing<float> ring_;
+		std::uint32_t chunk_frames_ = 256;
+		std::atomic<std::uint64_t> dropped_ = 0;
+		std::atomic<bool> running_ = false;
+		std::atomic<bool> finished_ = true;
+	};
+
+#if defined(_WIN32)
+	// 名前付きパイプ (\\.\pipe\<name>) のサーバー
+	class PipeSink final : public StreamSink {
+	public:
+		explicit PipeSink(std::string const& name)
+			: path_(L"\\\\.\\pipe\\" + std::wstring(name.begin(), name.end()))
+		{
+		}
+
+		char const* Name() const noexcept override {
+			return "pipe";
+		}
+
+	protected:
+		bool Connect() override {
+			DWORD const buffer_size = static_cast<DWORD>(sample_rate_ / 10 * sizeof(float));
+			hPipe_ = ::CreateNamedPipeW(path_.c_str(), PIPE_ACCESS_OUTBOUND, PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, buffer_size, 0, 0, nullptr);
+			if (hPipe_ == INVALID_HANDLE_VALUE) {
+				hPipe_ = nullptr;
+				return false;
+			}
+			if (!::ConnectNamedPipe(hPipe_, nullptr) && ::GetLastError() != ERROR_PIPE_CONNECTED) {
+				::CloseHandle(hPipe_);
+				hPipe_ = nullptr;
+				return false;
+			}
+			return true;
+		}
+
+		bool Send(float const* data, std::uint32_t frames) override {
+			DWORD const size = static_cast<DWORD>(frames * sizeof(float));
+			DWORD written = 0;
+			return ::WriteFile(hPipe_, data, size, &written, nullptr) && written == size;
+		}
+
+		void Disconnect() override {
+			::DisconnectNamedPipe(hPipe_);
+			::CloseHandle(hPipe_);
+			hPipe_ = nullptr;
+		}
+
+		void Cancel() noexcept override {
+			::CancelSynchronousIo(thread_.native_handle());
+		}
+
+	private:
+		std::wstring path_;
+		HANDLE hPipe_ = nullptr;
+	};
+#else
+	// FIFO (なければ作る)
+	class PipeSink final : public StreamSink {
+	public:
+		explicit PipeSink(std::string path)
+			: path_(std::move(path))
+		{
+		}
+
+		char const* Name() const noexcept override {
+			return "pipe";
+		}
+
+		HRESULT Open(int sample_rate, int block_size, int sample_latency) override {
+			if (::mkfifo(path_.c_str(), 0600) != 0 && errno != EEXIST) {
+				return rtvc::hresult_from_errno(errno);
+			}
+			return StreamSink::Open(sample_rate, block_size, sample_latency);
+		}
+
+	protected:
+		bool Connect() override {
+			// 読み手がいなければ ENXIO で失敗する
+			fd_ = ::open(path_.c_str(), O_WRONLY | O_NONBLOCK);
+			return fd_ >= 0;
+		}
+
+		bool Send(float const* data, std::uint32_t frames) override {
+			std::uint8_t const* p = reinterpret_cast<std::uint8_t const*>(data);
+			std::size_t remaining = frames * sizeof(float);
+			while (remaining > 0 && IsRunning()) {
+				ssize_t const written = ::write(fd_, p, remaining);
+				if (written > 0) {
+					p += written;
+					remaining -= static_cast<std::size_t>(written);
+					continue;
+				}
+				if (written < 0 && errno == EAGAIN) {
+					// 読み手が詰まっている
+					pollfd pfd{ fd_, POLLOUT, 0 };
+					::poll(&pfd, 1, 100);
+					continue;
+				}
+				if (written < 0 && errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			return true;
+		}
+
+		void Disconnect() override {
+			::close(fd_);
+			fd_ = -1;
+		}
+
+	private:
+		std::string path_;
+		int fd_ = -1;
+	};
+#endif
+
+#if defined(RTVC_WITH_ALSA)
+	// ALSA の再生デバイス
+	class AlsaPlaybackSink final : public StreamSink {
+	public:
+		explicit AlsaPlaybackSink(std::string device)
+			: device_(std::move(device))
+		{
+		}
+
+		char const* Name() const noexcept override {
+			return "alsa";
+		}
+
+	protected:
+		bool Connect() override {
+			if (::snd_pcm_open(&pcm_, device_.c_str(), SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+				pcm_ = nullptr;
+				return false;
+			}
+			// 周期はブロック程度、バッファーはその数倍にして writei で送信スレッドを刻む
+			if (::snd_pcm_set_params(pcm_, SND_PCM_FORMAT_FLOAT_LE, SND_PCM_ACCESS_RW_INTERLEAVED, 1, static_cast<unsigned int>(sample_rate_), 1, 40'000) < 0) {
+				Disconnect();
+				return false;
+			}
+			return true;
+		}
+
+		bool Send(float const* data, std::uint32_t frames) override {
+			while (frames > 0) {
+				snd_pcm_sframes_t written = ::snd_pcm_writei(pcm_, data, frames);
+				if (written < 0) {
+					// アンダーランは戻して続ける
+					if (::snd_pcm_recover(pcm_, static_cast<int>(written), 1) < 0) {
+						return false;
+					}
+					continue;
+				}
+				data += written;
+				frames -= static_cast<std::uint32_t>(written);
+			}
+			return true;
+		}
+
+		void Disconnect() override {
+			if (pcm_) {
+				::snd_pcm_close(pcm_);
+				pcm_ = nullptr;
+			}
+		}
+
+	private:
+		std::string device_;
+		snd_pcm_t* pcm_ = nullptr;
+	};
+#endif
+
+	// 直接モニター出力 (自分の声を聞く)
+	class MonitorSink final : public OutputSink {
+	public:
+		MonitorSink(std::unique_ptr<rtvc::MonitorOutput> output, std::uint32_t write_frames)
+			: output_(std::move(output))
+			, write_frames_(write_frames)
+		{
+		}
+
+		char const* Name() const noexcept override {
+			return "monitor";
+		}
+
+		HRESULT Open(int sample_rate, [[maybe_unused]] int block_size, [[maybe_unused]] int sample_latency) override {
+			HRESULT hr = S_OK;
+			if FAILED(hr = output_->Open(sample_rate, write_frames_)) {
+				std::fprintf(stderr, "%s monitor: %s\n", output_->Name(), output_->LastError());
+				return hr;
+			}
+			if FAILED(hr = output_->Start()) {
+				std::fprintf(stderr, "%s monitor: %s\n", output_->Name(), output_->LastError());
+				return hr;
+			}
+			return S_OK;
+		}
+
+		void Write(float const* data, std::uint32_t frames, [[maybe_unused]] std::uint64_t origin_time_ns) noexcept override {
+			output_->Write(data, frames);
+		}
+
+		void Close() override {
+			output_->Stop();
+			if (HRESULT const hr = output_->RenderResult(); FAILED(hr)) {
+				std::fprintf(stderr, "%s monitor stopped playing: %s (%x)\n", output_->Name(), output_->LastError(), static_cast<unsigned>(hr));
+			}
+			rtvc::JitterBuffer const& buffer = output_->Buffer();
+			std::printf("monitor: %llu underrun(s), %llu overflow(s), %llu frame(s) skipped, %llu frame(s) concealed\n",
+				static_cast<unsigned long long>(buffer.Underruns()), static_cast<unsigned long long>(buffer.Overflows()), static_cast<unsigned long long>(buffer.SkippedFrames()),
+				static_cast<unsigned long long>(buffer.ConcealedFrames()));
+		}
+
+		std::uint64_t Dropped() const noexcept override {
+			return output_->Buffer().SkippedFrames();
+		}
+
+		std::uint64_t LatencyNs() const noexcept override {
+			return output_->DeviceLatencyNs() > 0 ? output_->LatencyNs() : 0;
+		}
+
+	private:
+		std::unique_ptr<rtvc::MonitorOutput> output_;
+		std::uint32_t write_frames_;
+	};
+
+	// 制御から変える値 (制御スレッドが書き、処理スレッドが読む)
+	struct host_params {
+		std::atomic<int> primary_voice = 100;
+		std::atomic<int> secondary_voice = -1;
+		std::atomic<float> amount = 0.0f;
+
+		std::atomic<float> input_gain = 1.0f;
+		std::atomic<float> output_gain = 1.0f;
+		std::atomic<float> pitch_shift = 0.0f;
+		std::atomic<float> pitch_shift_mode = 1.0f;
+		std::atomic<float> pitch_snap = 0.0f;
+	};
+
+	// 制御の設定値 (プラグインのプロパティと同じ単位)
+	struct control_settings {
+		int primary_voice = 100;
+		int secondary_voice = -1;
+		double amount = 0.0;      ///< %
+		double input_gain = 0.0;  ///< db
+		double output_gain = 0.0; ///< db
+		double pitch_shift = 0.0; ///< cent
+		int pitch_shift_mode = 1; ///< 0: song, 1: talk
+		int your_voice = 0;       ///< 0: neutral, 1: bass, 2: tenor, 3: alto, 4: soprano
+		double pitch_snap = 0.0;  ///< %
+
+		// プラグインの Update() と同じ変換でエンジンの値にする
+		void publish(host_params& params) const {
+			params.input_gain.store(static_cast<float>(std::pow(10.0, input_gain * 0.05)), std::memory_order::release);
+			params.output_gain.store(static_cast<float>(std::pow(10.0, output_gain * 0.05)), std::memory_order::release);
+			double const base_pitch_shift = PITCH_SHIFT_PROTOTYPES[pitch_shift_mode][your_voice];
+			params.pitch_shift.store(static_cast<float>((pitch_shift + base_pitch_shift) * (std::log(2.0) / 1200.0)), std::memory_order::release);
+			params.pitch_shift_mode.store(static_cast<float>(pitch_shift_mode), std::memory_order::release);
+			params.pitch_snap.store(static_cast<float>(pitch_snap * 0.01), std::memory_order::release);
+			params.amount.store(static_cast<float>(amount * 0.01), std::memory_order::release);
+			params.secondary_voice.store(secondary_voice, std::memory_order::release);
+			params.primary_voice.store(primary_voice, std::memory_order::release);
+		}
+	};
+
+	struct host_stats {
+		std::atomic<std::uint64_t> packets = 0;
+		std::atomic<std::uint64_t> blocks = 0;
+		std::atomic<std::uint64_t> discontinuities = 0;
+		std::atomic<std::uint64_t> overruns = 0; ///< 処理がブロックの長さに間に合わなかった回数
+		std::atomic<std::uint64_t> engine_ns = 0; ///< 直近の起床の set_voice と process にかかった時間
+		std::atomic<std::uint64_t> failed_blocks = 0; ///< process が失敗して直前の出力で埋めたブロック数
+	};
+
+	// 取り込みからエンジンを通して出力まで
+	HRESULT run_pipeline(rtvc::CaptureBackend& capture, rtvc::ModelSwitcher& models, int sample_rate, int block_size,
+		host_params const& params, std::vector<std::unique_ptr<OutputSink>>& sinks, host_stats& stats)
+	{
+		HRESULT hr = S_OK;
+		rtvc::BlockAssembler assembler;
+		assembler.Reset(static_cast<std::uint32_t>(block_size), capture.MaxPacketFrames());
+
+		// モデルを差し替えるときは 20 ms かけて移る
+		rtvc::engine_api const* engine = &models.Serving()->api;
+		rtvc::EngineCrossfade crossfade;
+		crossfade.Reset(block_size, sample_rate / 50);
+
+		// 失敗したブロックは直前の出力を繰り返して埋める
+		rtvc::Concealer concealer;
+		concealer.Reset(sample_rate);
+
+		while ((hr = capture.Wait()) == S_OK) {
+			rtvc::rt_check::realtime_scope _realtime_scope;
+			std::uint64_t const wake_time = now_ns();
+			rtvc::capture_packet packet;
+			if FAILED(hr = capture.Acquire(packet)) {
+				break;
+			}
+			stats.packets.fetch_add(1, std::memory_order::relaxed);
+			if (packet.flags & rtvc::CAPTURE_FLAG_DISCONTINUITY) {
+				stats.discontinuities.fetch_add(1, std::memory_order::relaxed);
+			}
+
+			// 出力ブロック先頭サンプルの取り込み時刻 (あまりの分だけ前のパケットに遡る)
+			std::uint64_t origin_time = 0;
+			if (packet.device_time_ns != 0 && !(packet.flags & rtvc::CAPTURE_FLAG_TIMESTAMP_ERROR)) {
+				origin_time = packet.device_time_ns - static_cast<std::uint64_t>(assembler.Remainings()) * 1'000'000'000ull / sample_rate;
+			}
+
+			bool const silent = (packet.flags & rtvc::CAPTURE_FLAG_SILENT) != 0;
+			std::uint32_t const block_count = assembler.Push(silent ? nullptr : packet.data, packet.frames);
+			if FAILED(hr = capture.Release(packet)) {
+				break;
+			}
+			if (block_count == 0) {
+				continue;
+			}
+
+			// 裏で用意できたモデルに差し替える (古いモデルとしばらく並べて通してクロスフェードする)
+			rtvc::model_instance const* previous = nullptr;
+			if (crossfade.Active()) {
+			}
+			else if (rtvc::model_instance const* const next = models.TakeReady(previous)) {
+				engine = &next->api;
+				crossfade.Begin(previous, next);
+			}
+
+			// プラグインと同じ順に声とパラメーターを設定して処理する
+			std::uint64_t const engine_start = now_ns();
+			int const id1 = params.primary_voice.load(std::memory_order::acquire);
+			int const id2 = params.secondary_voice.load(std::memory_order::acquire);
+			for (rtvc::engine_api const* const target : { engine, crossfade.Active() ? &crossfade.From() : nullptr }) {
+				if (!target) {
+				}
+				else if (id2 < 0) {
+					target->set_voice(id1);
+				}
+				else {
+					int const ids[] = { id1, id2 };
+					float const amount = params.amount.load(std::memory_order::acquire);
+					float const amounts[] = { 1.0f - amount, amount };
+					target->set_voices(2, ids, amounts);
+				}
+			}
+			float const engine_params[] = {
+				params.input_gain.load(std::memory_order::acquire),
+				params.output_gain.load(std::memory_order::acquire),
+				params.pitch_shift.load(std::memory_order::acquire),
+				params.pitch_shift_mode.load(std::memory_order::acquire),
+				params.pitch_snap.load(std::memory_order::acquire),
+			};
+			constexpr int const num_params = static_cast<int>(std::size(engine_params));
+			float* out = assembler.Blocks();
+			for (std::uint32_t i = 0; i < block_count;) {
+				bool const fading = crossfade.Active();
+				if (fading) {
+					crossfade.ProcessFrom(num_params, engine_params, out);
+				}
+				std::uint32_t const n = fading ? 1 : block_count - i;
+				if (rtvc::process_blocks(*engine, num_params, engine_params, block_size, static_cast<int>(n), out, out) == 0) {
+					concealer.Good(out, n * block_size);
+				}
+				else {
+					concealer.Conceal(out, n * block_size);
+					stats.failed_blocks.fetch_add(n, std::memory_order::relaxed);
+				}
+				if (fading && crossfade.Mix(out)) {
+					models.FinishFade();
+				}
+				i += n;
+				out += n * block_size;
+			}
+			std::uint64_t const engine_end = now_ns();
+			stats.engine_ns.store(engine_end - engine_start, std::memory_order::relaxed);
+			stats.blocks.fetch_add(block_count, std::memory_order::relaxed);
+
+			std::uint32_t const block_frames = block_count * static_cast<std::uint32_t>(block_size);
+			for (std::unique_ptr<OutputSink> const& sink : sinks) {
+				sink->Write(assembler.Blocks(), block_frames, origin_time);
+			}
+
+			// 処理がブロックの長さに間に合っていない
+			if ((now_ns() - wake_time) * sample_rate > static_cast<std::uint64_t>(block_frames) * 1'000'000'000ull) {
+				stats.overruns.fetch_add(1, std::memory_order::relaxed);
+			}
+		}
+		models.FinishFade();
+		return hr;
+	}
+
+	// 読み込んでいるモデルの声の番号か ("list" の番号)
+	bool is_valid_voice(rtvc::ModelSwitcher& models, int id) {
+		return models.WithServing([id](rtvc::model_instance const* serving) {
+			int num_voices = 0;
+			return serving && serving->api.get_num_voices(&num_voices) == 0 && id >= 0 && id < num_voices;
+		});
+	}
+
+	// 1 行のコマンドを実行して応答を返す
+	std::string execute_command(std::string const& line, control_settings& settings, host_params& params,
+		rtvc::ModelSwitcher& models, host_stats const& stats, std::vector<std::unique_ptr<OutputSink>> const& sinks)
+	{
+		std::istringstream in(line);
+		std::string command;
+		in >> command;
+
+		if (command == "voice") {
+			int id = 0;
+			if (!(in >> id)) {
+				return "error: usage: voice <id>";
+			}
+			if (!is_valid_voice(models, id)) {
+				return "error: unknown voice: " + std::to_string(id);
+			}
+			settings.primary_voice = id;
+			settings.secondary_voice = -1;
+		}
+		else if (command == "voices") {
+			int id1 = 0;
+			int id2 = 0;
+			double amount = 0.0;
+			if (!(in >> id1 >> id2 >> amount) || amount < 0.0 || amount > 100.0) {
+				return "error: usage: voices <id1> <id2> <amount 0-100>";
+			}
+			if (!is_valid_voice(models, id1) || !is_valid_voice(models, id2)) {
+				return "error: unknown voice: " + std::to_string(is_valid_voice(models, id1) ? id2 : id1);
+			}
+			settings.primary_voice = id1;
+			settings.secondary_voice = id2;
+			settings.amount = amount;
+		}
+		else if (command == "set") {
+			std::string name;
+			double value = 0.0;
+			if (!(in >> name >> value)) {
+				return "error: usage: set <name> <value>";
+			}
+			if (name == "input_gain" && value >= -6.0 && value <= 6.0) {
+				settings.input_gain = value;
+			}
+			else if (name == "output_gain" && value >= -6.0 && value <= 6.0) {
+				settings.output_gain = value;
+			}
+			else if (name == "pitch_shift" && value >= -1200.0 && value <= 1200.0) {
+				settings.pitch_shift = value;
+			}
+			else if (name == "pitch_shift_mode" && (value == 0.0 || value == 1.0)) {
+				settings.pitch_shift_mode = static_cast<int>(value);
+			}
+			else if (name == "your_voice" && value >= 0.0 && value <= 4.0 && value == std::floor(value)) {
+				settings.your_voice = static_cast<int>(value);
+			}
+			else if (name == "pitch_snap" && value >= 0.0 && value <= 100.0) {
+				settings.pitch_snap = value;
+			}
+			else {
+				return "error: unknown parameter or value out of range: " + name;
+			}
+		}
+		else if (command == "get") {
+			char buf[256];
+			std::snprintf(buf, sizeof(buf), "voices %d %d %.0f input_gain %.2f output_gain %.2f your_voice %d pitch_shift %.0f pitch_shift_mode %d pitch_snap %.0f",
+				settings.primary_voice, settings.secondary_voice, settings.amount, settings.input_gain, settings.output_gain,
+				settings.your_voice, settings.pitch_shift, settings.pitch_shift_mode, settings.pitch_snap);
+			return buf;
+		}
+		else if (command == "list") {
+			// 差し替えたモデルも、読んでいる間は破棄されない
+			return models.WithServing([](rtvc::model_instance const* serving) {
+				std::string reply;
+				int num_voices = 0;
+				serving->api.get_num_voices(&num_voices);
+				for (int i = 0; i < num_voices; ++i) {
+					char const* voice_name = nullptr;
+					if (serving->api.get_voice_name(i, &voice_name) == 0 && voice_name) {
+						reply += std::to_string(i) + " " + voice_name + "\n";
+					}
+				}
+				return reply;
+			});
+		}
+		else if (command == "model") {
+			std::string name;
+			if (!(in >> name)) {
+				return "error: usage: model <name>";
+			}
+			if (!rtvc::model_registry().Available()) {
+				return "error: the built-in engine has no models";
+			}
+			models.Request(name);
+		}
+		else if (command == "models") {
+			std::string const current = models.WithServing([](rtvc::model_instance const* serving) {
+				return serving->name;
+			});
+			std::string reply;
+			for (std::string const& name : rtvc::model_registry().Models()) {
+				reply += (name == current ? "* " : "  ") + name + "\n";
+			}
+			return reply;
+		}
+		else if (command == "reload") {
+			int protocol_version[3] = { -1, -1, -1 };
+			std::string error;
+			if FAILED(rtvc::model_registry().Upgrade(protocol_version, error)) {
+				return "error: " + error;
+			}
+			models.Reopen();
+			char buf[64];
+			std::snprintf(buf, sizeof(buf), "ok protocol %d.%d.%d", protocol_version[0], protocol_version[1], protocol_version[2]);
+			return buf;
+		}
+		else if (command == "stats") {
+			char buf[256];
+			std::snprintf(buf, sizeof(buf), "packets %llu blocks %llu discontinuities %llu overruns %llu engine %.1f [us] concealed %llu",
+				static_cast<unsigned long long>(stats.packets.load(std::memory_order::relaxed)),
+				static_cast<unsigned long long>(stats.blocks.load(std::memory_order::relaxed)),
+				static_cast<unsigned long long>(stats.discontinuities.load(std::memory_order::relaxed)),
+				static_cast<unsigned long long>(stats.overruns.load(std::memory_order::relaxed)),
+				stats.engine_ns.load(std::memory_order::relaxed) / 1e3,
+				static_cast<unsigned long long>(stats.failed_blocks.load(std::memory_order::relaxed)));
+			std::string reply = buf;
+			{
+				rtvc::model_switch_stats const& switches = models.Stats();
+				std::snprintf(buf, sizeof(buf), " switches %llu failed %llu init %.0f [ms] swap %.1f [us] crossfade %.1f [ms]",
+					static_cast<unsigned long long>(switches.swaps.load(std::memory_order::acquire)),
+					static_cast<unsigned long long>(switches.failures.load(std::memory_order::acquire)),
+					switches.last_init_ns.load(std::memory_order::relaxed) / 1e6, switches.last_swap_ns.load(std::memory_order::relaxed) / 1e3,
+					switches.last_fade_ns.load(std::memory_order::relaxed) / 1e6);
+				reply += buf;
+				if (switches.failures.load(std::memory_order::relaxed) != 0) {
+					reply += " last_error \"" + models.LastError() + "\"";
+				}
+			}
+			for (std::unique_ptr<OutputSink> const& sink : sinks) {
+				reply += std::string(" ") + sink->Name() + "_dropped " + std::to_string(sink->Dropped());
+				if (std::uint64_t const latency = sink->LatencyNs()) {
+					std::snprintf(buf, sizeof(buf), " %s_latency %.1f [ms]", sink->Name(), latency / 1e6);
+					reply += buf;
+				}
+			}
+			return reply;
+		}
+		else if (command == "quit") {
+			quit_requested.store(true, std::memory_order::release);
+		}
+		else {
+			return "error: unknown command: " + command;
+		}
+
+		settings.publish(params);
+		return "ok";
+	}
+
+#if defined(_WIN32)
+	using socket_handle = SOCKET;
+	constexpr socket_handle const INVALID_SOCKET_HANDLE = INVALID_SOCKET;
+
+	void close_socket(socket_handle s) {
+		::closesocket(s);
+	}
+#else
+	using socket_handle = int;
+	constexpr socket_handle const INVALID_SOCKET_HANDLE = -1;
+
+	void close_socket(socket_handle s) {
+		::close(s);
+	}
+#endif
+
+	// 127.0.0.1 の UDP でコマンドを受ける (終了を頼まれるまで戻らない)
+	template <typename Handler>
+	bool serve_control(int port, Handler&& handler) {
+		socket_handle const s = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (s == INVALID_SOCKET_HANDLE) {
+			return false;
+		}
+		sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(static_cast<std::uint16_t>(port));
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (::bind(s, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) != 0) {
+			close_socket(s);
+			return false;
+		}
+
+		// 終了の確認のために時々抜ける
+#if defined(_WIN32)
+		DWORD const timeout = 200;
+#else
+		timeval const timeout{ 0, 200'000 };
+#endif
+		::setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<char const*>(&timeout), sizeof(timeout));
+
+		char buf[1024];
+		while (!quit_requested.load(std::memory_order::acquire)) {
+			sockaddr_in from{};
+			socklen_t from_size = sizeof(from);
+			int const size = static_cast<int>(::recvfrom(s, buf, sizeof(buf) - 1, 0, reinterpret_cast<sockaddr*>(&from), &from_size));
+			if (size <= 0) {
+				continue;
+			}
+			buf[size] = '\0';
+			std::string line(buf);
+			while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
+				line.pop_back();
+			}
+			std::string const reply = handler(line) + "\n";
+			::sendto(s, reply.data(), static_cast<int>(reply.size()), 0, reinterpret_cast<sockaddr const*>(&from), from_size);
+		}
+		close_socket(s);
+		return true;
+	}
+
+#if defined(_WIN32)
+	BOOL WINAPI console_ctrl_handler(DWORD) {
+		quit_requested.store(true, std::memory_order::release);
+		return TRUE;
+	}
+
+	// 取り込みデバイスの一覧
+	Microsoft::WRL::ComPtr<IMMDeviceCollection> enumerate_capture_devices() {
+		Microsoft::WRL::ComPtr<IMMDeviceEnumerator> pDeviceEnumerator;
+		Microsoft::WRL::ComPtr<IMMDeviceCollection> pDeviceCollection;
+		if (SUCCEEDED(::CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&pDeviceEnumerator)))) {
+			pDeviceEnumerator->EnumAudioEndpoints(eCapture, DEVICE_STATE_ACTIVE, &pDeviceCollection);
+		}
+		return pDeviceCollection;
+	}
+
+	// default か再生デバイスの番号
+	Microsoft::WRL::ComPtr<IMMDevice> open_render_device(std::string const& spec) {
+		Microsoft::WRL::ComPtr<IMMDeviceEnumerator> pDeviceEnumerator;
+		Microsoft::WRL::ComPtr<IMMDevice> pDevice;
+		if (FAILED(::CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&pDeviceEnumerator)))) {
+			return pDevice;
+		}
+		if (spec == "default") {
+			pDeviceEnumerator->GetDefaultAudioEndpoint(eRender, eConsole, &pDevice);
+		}
+		else {
+			Microsoft::WRL::ComPtr<IMMDeviceCollection> pDeviceCollection;
+			if (SUCCEEDED(pDeviceEnumerator->EnumAudioEndpoints(eRender, DEVICE_STATE_ACTIVE, &pDeviceCollection))) {
+				pDeviceCollection->Item(static_cast<UINT>(std::atoi(spec.c_str())), &pDevice);
+			}
+		}
+		return pDevice;
+	}
+
+	void list_capture_devices(IMMDeviceCollection* pDeviceCollection) {
+		UINT deviceCount = 0;
+		pDeviceCollection->GetCount(&deviceCount);
+		for (UINT i = 0; i < deviceCount; ++i) {
+			Microsoft::WRL::ComPtr<IMMDevice> pDevice;
+			Microsoft::WRL::ComPtr<IPropertyStore> propertyStore;
+			if (FAILED(pDeviceCollection->Item(i, &pDevice)) || FAILED(pDevice->OpenPropertyStore(STGM_READ, &propertyStore))) {
+				continue;
+			}
+			PROPVARIANT pv;
+			::PropVariantInit(&pv);
+			if (SUCCEEDED(propertyStore->GetValue(PKEY_Device_FriendlyName, &pv)) && pv.vt == VT_LPWSTR) {
+				std::printf("%u: %ls\n", i, pv.pwszVal);
+			}
+			::PropVariantClear(&pv);
+		}
+	}
+#else
+	void on_signal(int) {
+		quit_requested.store(true, std::memory_order::release);
+	}
+#endif
+}
+
+int main(int argc, char** argv) {
+	options opts;
+	if (!parse_options(argc, argv, opts)) {
+		usage();
+		return 2;
+	}
+
+#if defined(_WIN32)
+	if FAILED(::CoInitializeEx(nullptr, COINIT_MULTITHREADED)) {
+		std::fprintf(stderr, "could not initialize COM\n");
+		return 1;
+	}
+	WSADATA wsa_data;
+	if (::WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+		std::fprintf(stderr, "could not initialize winsock\n");
+		return 1;
+	}
+	::SetConsoleCtrlHandler(console_ctrl_handler, TRUE);
+
+	Microsoft::WRL::ComPtr<IMMDeviceCollection> pDeviceCollection = enumerate_capture_devices();
+	if (!pDeviceCollection) {
+		std::fprintf(stderr, "could not enumerate capture devices\n");
+		return 1;
+	}
+	if (opts.list_devices) {
+		list_capture_devices(pDeviceCollection.Get());
+		return 0;
+	}
+	if (opts.capture.empty()) {
+		opts.capture = "wasapi";
+	}
+#else
+	std::signal(SIGINT, on_signal);
+	std::signal(SIGTERM, on_signal);
+	std::signal(SIGPIPE, SIG_IGN);
+#if defined(RTVC_WITH_ALSA)
+	// カードの抜き差しを知らせる
+	rtvc::AlsaDeviceCatalog catalog;
+	if (HRESULT const hr = catalog.Start(); FAILED(hr)) {
+		std::fprintf(stderr, "could not watch sound devices (%x)\n", static_cast<unsigned>(hr));
+	}
+	if (opts.list_devices) {
+		for (rtvc::device_flow const flow : { rtvc::device_flow::capture, rtvc::device_flow::render }) {
+			std::printf("%s:\n", flow == rtvc::device_flow::capture ? "capture" : "playback");
+			for (rtvc::device_entry const& entry : catalog.Devices(flow)->devices) {
+				std::printf("  %s: %s\n", entry.id.c_str(), entry.name.c_str());
+			}
+		}
+		return 0;
+	}
+	catalog.Subscribe([](rtvc::device_flow flow, rtvc::device_change change, std::string const& id) {
+		if (change != rtvc::device_change::default_changed) {
+			std::fprintf(stderr, "%s device %s: %s\n", flow == rtvc::device_flow::capture ? "capture" : "playback", change == rtvc::device_change::added ? "added" : "removed", id.c_str());
+		}
+	});
+#endif
+	if (opts.capture.empty()) {
+		usage();
+		return 2;
+	}
+#endif
+
+	// エンジンを読み込む ("eco" なら組み込みの軽量エンジン)
+	std::unique_ptr<rtvc::model_instance> instance;
+	std::string error;
+	if (opts.engine == "eco") {
+		instance.reset(new rtvc::model_instance);
+		instance->name = "eco";
+		if (!rtvc::eco_engine_api(instance->api)) {
+			std::fprintf(stderr, "too many eco engines are open\n");
+			return 1;
+		}
+		if FAILED(rtvc::init_model(*instance, error)) {
+			std::fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+	}
+	else {
+#if defined(_WIN32)
+		std::filesystem::path const engine_path = opts.engine.empty() ? std::filesystem::path(rtvc::default_engine_path()) : std::filesystem::u8path(opts.engine);
+#else
+		if (opts.engine.empty()) {
+			std::fprintf(stderr, "--engine is required on this platform\n");
+			return 2;
+		}
+		std::filesystem::path const engine_path = std::filesystem::u8path(opts.engine);
+#endif
+		rtvc::module_handle const hModule = load_engine(engine_path);
+		if (!hModule) {
+			std::fprintf(stderr, "could not load engine: %s\n", engine_path.string().c_str());
+			return 1;
+		}
+		rtvc::engine_api engine;
+		if (char const* const missing = rtvc::resolve_engine_api(hModule, engine)) {
+			std::fprintf(stderr, "failed to get proc %s\n", missing);
+			return 1;
+		}
+		// model と reload はこの場所から複製を読み込む (解放もレジストリーが行う)
+		rtvc::model_registry().Reset(engine, hModule, engine_path);
+		if FAILED(rtvc::model_registry().Open(opts.model, instance, error)) {
+			std::fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+	}
+	int const sample_rate = instance->format.sample_rate;
+	int const block_size = instance->format.block_size;
+	int const sample_latency = instance->format.sample_latency;
+	std::printf("engine: %d [hz], block %d, latency %d [frames]\n", sample_rate, block_size, sample_latency);
+	std::printf("simd: %s\n", rtvc::simd::to_string(rtvc::simd::kernels().isa));
+	if (instance->api.max_blocks > 1) {
+		std::printf("process_n: up to %d blocks per call\n", instance->api.max_blocks);
+	}
+
+	// 形式 (サンプルレート、ブロックサイズ、遅延) が違うモデルには出力を開き直さないと移れない
+	std::unique_ptr<rtvc::ModelSwitcher> models;
+	models.reset(new rtvc::ModelSwitcher(rtvc::model_registry(), [&models] {
+		if (std::unique_ptr<rtvc::model_instance> restart = models->TakeRestart()) {
+			std::fprintf(stderr, "model %s has a different format, restart rtvc-host to use it\n", restart->name.c_str());
+			rtvc::model_registry().Close(std::move(restart));
+		}
+	}));
+	models->Reset(std::move(instance));
+
+	// 取り込み
+	std::unique_ptr<rtvc::CaptureBackend> capture;
+#if defined(_WIN32)
+	if (opts.capture.rfind("wasapi", 0) == 0) {
+		int const device_id = opts.capture.size() > 7 ? std::atoi(opts.capture.c_str() + 7) : 0;
+		Microsoft::WRL::ComPtr<IMMDevice> pDevice;
+		if SUCCEEDED(pDeviceCollection->Item(static_cast<UINT>(device_id), &pDevice)) {
+			capture.reset(new rtvc::WasapiCapture(std::move(pDevice), opts.latency_mode));
+		}
+	}
+#else
+	if (false) {
+	}
+#endif
+#if defined(RTVC_WITH_ALSA)
+	else if (opts.capture.rfind("alsa:", 0) == 0) {
+		rtvc::alsa_capture_config config;
+		config.device = opts.capture.substr(5);
+		capture.reset(new rtvc::AlsaCapture(std::move(config)));
+	}
+#endif
+	else if (opts.capture.rfind("file:", 0) == 0) {
+		rtvc::file_capture_config config;
+		config.path = std::filesystem::u8path(opts.capture.substr(5));
+		config.loop = true;
+		capture.reset(new rtvc::FileCapture(std::move(config)));
+	}
+	else if (opts.capture.rfind("synthetic", 0) == 0) {
+		rtvc::synthetic_capture_config config;
+		std::string const spec = opts.capture.size() > 10 ? opts.capture.substr(10) : std::string();
+		if (rtvc::parse_synthetic_capture_config(spec, config, sample_rate)) {
+			capture.reset(new rtvc::SyntheticCapture(std::move(config)));
+		}
+	}
+	if (!capture) {
+		std::fprintf(stderr, "unknown capture: %s\n", opts.capture.c_str());
+		return 2;
+	}
+
+	HRESULT hr = S_OK;
+	if FAILED(hr = capture->Open(rtvc::capture_config{ sample_rate, block_size })) {
+		std::fprintf(stderr, "could not open %s capture: %s (%x)\n", capture->Name(), capture->LastError(), static_cast<unsigned>(hr));
+		return 1;
+	}
+
+	// 出力
+	std::vector<std::unique_ptr<OutputSink>> sinks;
+	if (!opts.shm.empty() && opts.shm != "none") {
+		sinks.emplace_back(new SharedMemorySink(opts.shm));
+	}
+	if (!opts.pipe.empty()) {
+		sinks.emplace_back(new PipeSink(opts.pipe));
+	}
+#if defined(RTVC_WITH_ALSA)
+	if (!opts.alsa_output.empty()) {
+		sinks.emplace_back(new AlsaPlaybackSink(opts.alsa_output));
+	}
+#endif
+	if (!opts.monitor.empty()) {
+#if defined(_WIN32) || defined(RTVC_WITH_ALSA)
+		// 1 回の起床で積むのは最大でパケットとあまりを合わせたブロック数
+		std::uint32_t const write_frames = static_cast<std::uint32_t>((capture->MaxPacketFrames() / block_size + 1) * block_size);
+#endif
+#if defined(_WIN32)
+		Microsoft::WRL::ComPtr<IMMDevice> pRenderDevice = open_render_device(opts.monitor);
+		if (!pRenderDevice) {
+			std::fprintf(stderr, "unknown monitor device: %s\n", opts.monitor.c_str());
+			return 2;
+		}
+		sinks.emplace_back(new MonitorSink(std::make_unique<rtvc::WasapiRender>(std::move(pRenderDevice)), write_frames));
+#elif defined(RTVC_WITH_ALSA)
+		sinks.emplace_back(new MonitorSink(std::make_unique<rtvc::AlsaRender>(opts.monitor), write_frames));
+#else
+		std::fprintf(stderr, "--monitor is not available in this build\n");
+		return 2;
+#endif
+	}
+	for (std::unique_ptr<OutputSink> const& sink : sinks) {
+		if (HRESULT const hr = sink->Open(sample_rate, block_size, sample_latency); FAILED(hr)) {
+			std::fprintf(stderr, "could not open %s output (%x)\n", sink->Name(), static_cast<unsigned>(hr));
+			return 1;
+		}
+	}
+
+	// 制御
+	host_params params;
+	host_stats stats;
+	control_settings settings;
+	settings.publish(params);
+	std::thread control_thread([&] {
+		bool const served = serve_control(opts.control_port, [&](std::string const& line) {
+			return execute_command(line, settings, params, *models, stats, sinks);
+		});
+		if (!served) {
+			std::fprintf(stderr, "could not listen on 127.0.0.1:%d, control is disabled\n", opts.control_port);
+			while (!quit_requested.load(std::memory_order::acquire)) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(200));
+			}
+		}
+		capture->Interrupt();
+	});
+
+	std::printf("capture: %s, control: udp 127.0.0.1:%d\n", capture->Name(), opts.control_port);
+	if FAILED(hr = capture->Start()) {
+		std::fprintf(stderr, "could not start %s capture: %s (%x)\n", capture->Name(), capture->LastError(), static_cast<unsigned>(hr));
+		quit_requested.store(true, std::memory_order::release);
+	}
+	else {
+#if defined(_WIN32)
+		DWORD taskIndex = 0;
+		HANDLE const hMmCss = ::AvSetMmThreadCharacteristics(TEXT("Pro Audio"), &taskIndex);
+#endif
+		hr = run_pipeline(*capture, *models, sample_rate, block_size, params, sinks, stats);
+#if defined(_WIN32)
+		if (hMmCss) {
+			::AvRevertMmThreadCharacteristics(hMmCss);
+		}
+#endif
+		capture->Stop();
+		if FAILED(hr) {
+			std::fprintf(stderr, "%s capture failed: %s (%x)\n", capture->Name(), capture->LastError(), static_cast<unsigned>(hr));
+		}
+		// 入力が終わったときも制御スレッドを止める
+		quit_requested.store(true, std::memory_order::release);
+	}
+	control_thread.join();
+
+	for (std::unique_ptr<OutputSink> const& sink : sinks) {
+		sink->Close();
+	}
+	models->Shutdown();
+	rtvc::model_registry().Close(models->Reset(nullptr));
+	rtvc::model_registry().Reset(rtvc::engine_api{}, nullptr, {});
+#if defined(_WIN32)
+	::WSACleanup();
+	::CoUninitialize();
+#endif
+	return FAILED(hr) ? 1 : 0;
+}
@@ -0,0 +1,278 @@
+﻿// エンジンの差し替えの検査
+//
+// 版の違う 2 つのエンジン (rtvc-stub-engine を RTVC_STUB_ENGINE_VERSION を変えて 2 つビルドしたもの) で、
+// プラグインと同じ手順 (読み込んでいるファイルの名前を変えて新しい版を置き、Upgrade() してから開き直す) を通す。
+//
+//   rtvc-reload-check <old engine> <new engine> [--model <name>] [--timeout <ms>]
+//
+// 一定の大きさの入力を 1 ブロックずつ通し、次を確かめる。
+//   - 差し替えが失敗せず、推論スレッド (このループ) が止まらずに新しい版に移る (get_version() が変わる)
+//   - 出力が古い版の大きさから新しい版の大きさへ、途切れず (0 に落ちず) 一方向に 20 ms かけて移る
+//   - 古い版と複製は、使っていたインスタンスを破棄した後に解放され、一時フォルダーに残らない
+// 失敗があれば 1 を返す。
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+#include "../nair-rtvc-source/rtvc-engine.h"
+#include "../nair-rtvc-source/model-registry.h"
+
+namespace {
+	struct options {
+		std::filesystem::path old_engine;
+		std::filesystem::path new_engine;
+		std::string model = rtvc::ModelRegistry::DEFAULT_MODEL;
+		int timeout_ms = 5'000; ///< 差し替えを待つ長さ
+	};
+
+	void usage() {
+		std::fprintf(stderr,
+			"usage: rtvc-reload-check <old engine> <new engine> [--model <name>] [--timeout <ms>]\n"
+			);
+	}
+
+	bool parse_options(int argc, char** argv, options& opts) {
+		std::vector<std::string> positional;
+		for (int i = 1; i < argc; ++i) {
+			std::string const arg = argv[i];
+			if (arg == "--model" && i + 1 < argc) {
+				opts.model = argv[++i];
+			}
+			else if (arg == "--timeout" && i + 1 < argc) {
+				opts.timeout_ms = std::atoi(argv[++i]);
+			}
+			else if (arg.rfind("--", 0) == 0) {
+				return false;
+			}
+			else {
+				positional.push_back(arg);
+			}
+		}
+		if (positional.size() != 2 || opts.timeout_ms <= 0) {
+			return false;
+		}
+		opts.old_engine = positional[0];
+		opts.new_engine = positional[1];
+		return true;
+	}
+
+	/// 推論スレッドの代わり (rtvc-host の run_pipeline() と同じ順に差し替えてクロスフェードする)
+	class pipeline {
+	public:
+		static constexpr float INPUT = 0.5f;
+
+		pipeline(rtvc::ModelSwitcher& models)
+			: models_(models)
+		{
+			rtvc::model_instance const* const serving = models.Serving();
+			engine_ = &serving->api;
+			block_size_ = serving->format.block_size;
+			fade_frames_ = serving->format.sample_rate / 50;
+			crossfade_.Reset(block_size_, fade_frames_);
+			block_.resize(static_cast<std::size_t>(block_size_));
+		}
+
+		/// 1 ブロック通して出力を output に足す (エンジンが失敗したら false)
+		bool Step() {
+			rtvc::model_instance const* previous = nullptr;
+			if (crossfade_.Active()) {
+			}
+			else if (rtvc::model_instance const* const next = models_.TakeReady(previous)) {
+				engine_ = &next->api;
+				crossfade_.Begin(previous, next);
+				swap_frame_ = output.size();
+			}
+
+			float const params[] = { 1.0f, 1.0f, 0.0f, 0.0f, 0.0f };
+			constexpr int const num_params = static_cast<int>(std::size(params));
+			std::fill(block_.begin(), block_.end(), INPUT);
+			bool const fading = crossfade_.Active();
+			if (fading) {
+				crossfade_.ProcessFrom(num_params, params, block_.data());
+			}
+			if (engine_->process(num_params, params, block_.data(), block_.data())) {
+				return false;
+			}
+			if (fading && crossfade_.Mix(block_.data())) {
+				models_.FinishFade();
+			}
+			output.insert(output.end(), block_.begin(), block_.end());
+			return true;
+		}
+
+		bool Fading() const noexcept {
+			return crossfade_.Active();
+		}
+
+		std::vector<float> output;
+		std::size_t swap_frame_ = 0; ///< 差し替えたブロックの先頭
+		int fade_frames_ = 0;
+
+	private:
+		rtvc::ModelSwitcher& models_;
+		rtvc::engine_api const* engine_ = nullptr;
+		rtvc::EngineCrossfade crossfade_;
+		int block_size_ = 0;
+		std::vector<float> block_;
+	};
+
+	unsigned long process_id() noexcept {
+#if defined(_WIN32)
+		return ::GetCurrentProcessId();
+#else
+		return static_cast<unsigned long>(::getpid());
+#endif
+	}
+
+	/// 一時フォルダーに残っている、このプロセスが作ったエンジンの複製
+	std::vector<std::filesystem::path> leftover_copies(std::filesystem::path const& engine_path) {
+		std::string const prefix = engine_path.stem().string() + "-" + std::to_string(process_id()) + "-";
+		std::vector<std::filesystem::path> copies;
+		std::error_code ec;
+		for (std::filesystem::directory_entry const& entry : std::filesystem::directory_iterator(std::filesystem::temp_directory_path(), ec)) {
+			if (entry.path().filename().string().rfind(prefix, 0) == 0) {
+				copies.push_back(entry.path());
+			}
+		}
+		return copies;
+	}
+
+	bool expect(bool condition, char const* what) {
+		std::printf("%-48s %s\n", what, condition ? "ok" : "FAILED");
+		return condition;
+	}
+}
+
+int main(int argc, char** argv) {
+	options opts;
+	if (!parse_options(argc, argv, opts)) {
+		usage();
+		return 2;
+	}
+
+	// プラグインと同じく、読み込んだファイルの名前を変えて新しい版を同じ場所に置くので、作業用のフォルダーに写す
+	std::error_code ec;
+	std::filesystem::path const work = std::filesystem::temp_directory_path() / ("rtvc-reload-check-" + std::to_string(process_id()));
+	std::filesystem::create_directories(work, ec);
+	std::filesystem::path const engine_path = work / "rtvc.vvfx";
+	if (!std::filesystem::copy_file(opts.old_engine, engine_path, std::filesystem::copy_options::overwrite_existing, ec)) {
+		std::fprintf(stderr, "could not copy %s: %s\n", opts.old_engine.string().c_str(), ec.message().c_str());
+		return 1;
+	}
+
+	rtvc::module_handle const module = rtvc::load_module(engine_path);
+	if (!module) {
+		std::fprintf(stderr, "could not load %s\n", engine_path.string().c_str());
+		return 1;
+	}
+	rtvc::engine_api engine;
+	if (char const* const missing = rtvc::resolve_engine_api(module, engine)) {
+		std::fprintf(stderr, "failed to get proc %s\n", missing);
+		rtvc::free_module(module);
+		return 1;
+	}
+	rtvc::model_registry().Reset(engine, module, engine_path);
+
+	std::unique_ptr<rtvc::model_instance> instance;
+	std::string error;
+	if FAILED(rtvc::model_registry().Open(opts.model, instance, error)) {
+		std::fprintf(stderr, "%s\n", error.c_str());
+		rtvc::model_registry().Reset(rtvc::engine_api{}, nullptr, {});
+		return 1;
+	}
+	int const old_version = instance->version[0];
+	int restarts = 0;
+	bool ok = true;
+	{
+		rtvc::ModelSwitcher models(rtvc::model_registry(), [&restarts] { ++restarts; });
+		models.Reset(std::move(instance));
+		pipeline p(models);
+		rtvc::engine_format const format = models.Serving()->format;
+		std::printf("engine: %d [hz], block %d, latency %d [frames], version %d\n", format.sample_rate, format.block_size, format.sample_latency, old_version);
+
+		// 遅延が埋まるまで古い版で回す
+		std::size_t const settle_blocks = static_cast<std::size_t>((format.sample_latency + p.fade_frames_) / format.block_size + 4);
+		for (std::size_t i = 0; i < settle_blocks && ok; ++i) {
+			ok = p.Step();
+		}
+		float const old_level = p.output.empty() ? 0.0f : p.output.back();
+
+		// 新しい版に置き換える (読み込んでいるファイルは上書きせずに名前を変える)
+		std::filesystem::rename(engine_path, work / "rtvc.vvfx.old", ec);
+		ok = expect(!ec && std::filesystem::copy_file(opts.new_engine, engine_path, ec), "replace the engine file") && ok;
+		int protocol_version[3] = { -1, -1, -1 };
+		ok = expect(ok && SUCCEEDED(rtvc::model_registry().Upgrade(protocol_version, error)), "upgrade (side-by-side load, protocol check)") && ok;
+		if (!ok) {
+			std::fprintf(stderr, "%s\n", error.c_str());
+		}
+		models.Reopen();
+
+		// 裏で開き直す間も止めずに回し、差し替えてクロスフェードを終えるまで待つ
+		std::uint64_t max_step_ns = 0;
+		auto const deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(opts.timeout_ms);
+		while (ok && (models.Stats().swaps.load(std::memory_order::acquire) == 0 || p.Fading()) && std::chrono::steady_clock::now() < deadline) {
+			std::uint64_t const start = rtvc::CapturePacer::now_ns();
+			ok = p.Step();
+			max_step_ns = (std::max)(max_step_ns, rtvc::CapturePacer::now_ns() - start);
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		ok = expect(models.Stats().swaps.load(std::memory_order::acquire) == 1 && models.Stats().failures.load(std::memory_order::acquire) == 0 && restarts == 0,
+			"swap without failure or restart") && ok;
+		if (!models.LastError().empty()) {
+			std::fprintf(stderr, "%s\n", models.LastError().c_str());
+		}
+		for (std::size_t i = 0; i < settle_blocks && ok; ++i) {
+			ok = p.Step();
+		}
+		int const new_version = models.Serving()->version[0];
+		float const new_level = p.output.back();
+		std::printf("version %d -> %d, level %.4f -> %.4f, swapped at frame %zu, longest block %.1f [us]\n",
+			old_version, new_version, old_level, new_level, p.swap_frame_, max_step_ns / 1e3);
+		ok = expect(new_version != old_version && new_level != old_level, "serving the new version") && ok;
+
+		// 差し替えたところから、遅延の分は古い版の出力のまま、その後 fade_frames で新しい版の大きさに移る
+		float const low = (std::min)(old_level, new_level);
+		float const high = (std::max)(old_level, new_level);
+		float const eps = 1e-5f * (std::max)(high, 1.0f);
+		float const max_step = (high - low) / static_cast<float>(p.fade_frames_) * 1.01f + eps;
+		bool bounded = true;
+		bool monotonic = true;
+		bool smooth = true;
+		std::size_t const begin = p.swap_frame_ > 0 ? p.swap_frame_ - 1 : 0;
+		for (std::size_t i = begin; i < p.output.size(); ++i) {
+			float const y = p.output[i];
+			bounded = bounded && y >= low - eps && y <= high + eps;
+			if (i > begin) {
+				float const step = y - p.output[i - 1];
+				monotonic = monotonic && (new_level > old_level ? step >= -eps : step <= eps);
+				smooth = smooth && std::fabs(step) <= max_step;
+			}
+		}
+		ok = expect(bounded, "no gap (output stays between the two levels)") && ok;
+		ok = expect(monotonic && smooth, "one-way ramp no steeper than the crossfade") && ok;
+		models.Shutdown();
+		rtvc::model_registry().Close(models.Reset(nullptr));
+	}
+	rtvc::model_registry().Reset(rtvc::engine_api{}, nullptr, {});
+
+	// 古い版も新しい版の複製も解放されて消えている
+	ok = expect(leftover_copies(engine_path).empty(), "engine copies released") && ok;
+	std::filesystem::remove_all(work, ec);
+	ok = expect(!ec, "old engine released (work folder removed)") && ok;
+	std::printf("%s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
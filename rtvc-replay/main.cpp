@@ -0,0 +1,1038 @@
+﻿// セッションファイルの再生
+//
+// nair-rtvc-source が記録したセッション、または取り込みバックエンド (ファイル、合成信号) の出力を、
+// プラグインと同じ切り分けとパラメーターでエンジンに通し、ブロックごとの処理時間を集計する。
+//
+//   rtvc-replay <session> [--engine <path|eco|stub[:<spec>]>] [--model <name>] [--max-speed] [--batch <blocks>] [--watchdog <ms>] [--drop-rate <p>] [--probe] [--impulse] [--no-conceal] [--simd <isa>] [--trace <json>] [--stats <file>] [--prometheus <prom>] [--output <raw>]
+//   rtvc-replay --capture file:<wav|raw> [...]
+//   rtvc-replay --capture synthetic[:packets=441,480;jitter=2;silent=0.05;discontinuity=0.01;seconds=10;seed=1] [...]
+//   rtvc-replay --capture alsa:<device> [...]   (RTVC_WITH_ALSA を定義して -lasound とリンクしたとき)
+//   rtvc-replay --capture <capture> --recover [...]   (失敗したら開き直す。synthetic の fault / open_fault で試せる)
+//   rtvc-replay --jack <client name> [--seconds <s>] [...]   (RTVC_WITH_JACK を定義して -ljack とリンクしたとき)
+//
+// エンジンが process_n() を持っていれば、1 回の起床で揃ったブロックをまとめて渡す (--batch 1 で 1 ブロックずつに戻す)。
+// --watchdog を付けるとプラグインと同じくエンジンを別のスレッドで呼び、期限を過ぎたらドライでつなぐ。
+// --engine stub[:latency=480;stall=150;stall_ms=300] は入力を遅らせて返すだけの試験用のエンジンで、stall のブロックで 1 度だけ止まる。
+//   rtvc-replay --capture synthetic:seconds=5 --engine "stub:stall=150" --watchdog 20 で期限切れから戻るまでを再現できる。
+// 失敗したか間に合わなかったブロックはプラグインと同じく直前の出力を繰り返して埋める (--no-conceal で埋めずに比べられる)。
+// --drop-rate は起床ごとにその確率でエンジンの出力を捨てて埋め、埋めたフレーム数と、埋めた区間の端での段差 (隣り合うサンプルの差) を出す。
+// --probe はプラグインの遅延測定 (latency-probe.h) と同じく最初の起床からチャープを入れ、エンジンを通った遅延 (往復) と get_sample_latency() を並べて出す。
+//   rtvc-replay --capture synthetic:seconds=5 --engine stub --max-speed --probe で、遅延が分かっているエンジンで測定を確かめられる。
+// --impulse は取り込んだ音声を無音にして 0.5 秒ごとにインパルスを置き、出てきた時刻から測った遅延が、
+// プラグインと同じ勘定 (出力の時刻 - ブロック先頭の取り込み時刻 + エンジンの遅延、pipeline_delay_ns_) と 1 フレーム以内で合うかを確かめる。
+// 取り込みの時刻が要るので --capture で実時間で流すときだけ (合わなければ 1 を返す)。
+// --simd scalar|sse2|avx2|avx512 で DSP のカーネルを古い版に替えて、--output の結果を比べられる。
+// --trace を付けると、終わったときに最後のブロックごとの時系列を Chrome のトレースイベント形式で書き出す。
+// --stats / --prometheus を付けると、プラグインと同じ統計を動いている間 1 秒ごとに書き出す。
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../nair-rtvc-source/rtvc-engine.h"
+#include "../nair-rtvc-source/simd-kernels.h"
+#include "../nair-rtvc-source/eco-engine.h"
+#include "../nair-rtvc-source/stub-engine.h"
+#include "../nair-rtvc-source/block-assembler.h"
+#include "../nair-rtvc-source/session-file.h"
+#include "../nair-rtvc-source/delay-line.h"
+#include "../nair-rtvc-source/engine-watchdog.h"
+#include "../nair-rtvc-source/concealment.h"
+#include "../nair-rtvc-source/latency-probe.h"
+#include "../nair-rtvc-source/pipeline-trace.h"
+#include "../nair-rtvc-source/telemetry.h"
+#include "../nair-rtvc-source/capture-backend.h"
+#include "../nair-rtvc-source/file-capture.h"
+#include "../nair-rtvc-source/synthetic-capture.h"
+#include "../nair-rtvc-source/capture-supervisor.h"
+#include "../nair-rtvc-source/rt-check.h"
+#if defined(RTVC_WITH_ALSA)
+#include "../nair-rtvc-source/alsa-capture.h"
+#endif
+#if defined(RTVC_WITH_JACK)
+#include "../nair-rtvc-source/jack-client.h"
+#endif
+
+#if defined(_WIN32)
+#pragma comment(lib, "avrt.lib")
+#endif
+
+namespace {
+	struct options {
+		std::string session;
+		std::string capture;
+		std::string engine;
+		std::string model = "jvs100";
+		std::string output;
+		std::string jack;
+		std::string simd;
+		std::string trace;
+		std::string stats;
+		std::string prometheus;
+		double seconds = 10.0;
+		int batch = 0;
+		double watchdog_ms = -1.0;
+		double drop_rate = 0.0;
+		bool probe = false;
+		bool impulse = false;
+		bool max_speed = false;
+		bool recover = false;
+		bool conceal = true;
+	};
+
+	void usage() {
+		std::fprintf(stderr,
+			"usage: rtvc-replay <session> [--engine <path|eco|stub[:<spec>]>] [--model <name>] [--max-speed] [--batch <blocks>] [--watchdog <ms>] [--drop-rate <p>] [--probe] [--impulse] [--no-conceal] [--simd <scalar|sse2|avx2|avx512>] [--trace <json>] [--stats <file>] [--prometheus <prom>] [--output <raw>]\n"
+			"       rtvc-replay --capture file:<wav|raw> [...]\n"
+			"       rtvc-replay --capture synthetic[:packets=441,480;jitter=<ms>;silent=<p>;discontinuity=<p>;fault=<p>;open_fault=<p>;seconds=<s>;seed=<n>] [...]\n"
+			"       rtvc-replay --capture <capture> --recover [...]\n"
+#if defined(RTVC_WITH_ALSA)
+			"       rtvc-replay --capture alsa:<device> [...]\n"
+#endif
+#if defined(RTVC_WITH_JACK)
+			"       rtvc-replay --jack <client name> [--seconds <s>] [...]\n"
+#endif
+			);
+	}
+
+	bool parse_options(int argc, char** argv, options& opts) {
+		for (int i = 1; i < argc; ++i) {
+			std::string const arg = argv[i];
+			if (arg == "--engine" && i + 1 < argc) {
+				opts.engine = argv[++i];
+			}
+			else if (arg == "--model" && i + 1 < argc) {
+				opts.model = argv[++i];
+			}
+			else if (arg == "--output" && i + 1 < argc) {
+				opts.output = argv[++i];
+			}
+			else if (arg == "--capture" && i + 1 < argc) {
+				opts.capture = argv[++i];
+			}
+			else if (arg == "--jack" && i + 1 < argc) {
+				opts.jack = argv[++i];
+			}
+			else if (arg == "--seconds" && i + 1 < argc) {
+				opts.seconds = std::strtod(argv[++i], nullptr);
+			}
+			else if (arg == "--batch" && i + 1 < argc) {
+				opts.batch = std::atoi(argv[++i]);
+			}
+			else if (arg == "--watchdog" && i + 1 < argc) {
+				opts.watchdog_ms = std::strtod(argv[++i], nullptr);
+			}
+			else if (arg == "--drop-rate" && i + 1 < argc) {
+				opts.drop_rate = std::strtod(argv[++i], nullptr);
+				if (!(opts.drop_rate >= 0.0 && opts.drop_rate <= 1.0)) {
+					return false;
+				}
+			}
+			else if (arg == "--simd" && i + 1 < argc) {
+				opts.simd = argv[++i];
+			}
+			else if (arg == "--trace" && i + 1 < argc) {
+				opts.trace = argv[++i];
+			}
+			else if (arg == "--stats" && i + 1 < argc) {
+				opts.stats = argv[++i];
+			}
+			else if (arg == "--prometheus" && i + 1 < argc) {
+				opts.prometheus = argv[++i];
+			}
+			else if (arg == "--max-speed") {
+				opts.max_speed = true;
+			}
+			else if (arg == "--probe") {
+				opts.probe = true;
+			}
+			else if (arg == "--impulse") {
+				opts.impulse = true;
+			}
+			else if (arg == "--no-conceal") {
+				opts.conceal = false;
+			}
+			else if (arg == "--recover") {
+				opts.recover = true;
+			}
+			else if (!arg.empty() && arg[0] != '-' && opts.session.empty()) {
+				opts.session = arg;
+			}
+			else {
+				return false;
+			}
+		}
+		return (!opts.session.empty() + !opts.capture.empty() + !opts.jack.empty()) == 1;
+	}
+
+	rtvc::module_handle load_engine(std::filesystem::path const& path) {
+#if defined(_WIN32)
+		return ::LoadLibrary(path.c_str());
+#else
+		return ::dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+#endif
+	}
+
+	std::uint64_t now_ns() {
+		return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	// ナノ秒の分布をまとめる
+	struct timing_stats {
+		std::vector<std::uint64_t> samples;
+		bool bounded = false; ///< reserve() した分を超えたら捨てる (リアルタイムスレッドから add するとき)
+
+		void add(std::uint64_t ns) {
+			if (!bounded || samples.size() < samples.capacity()) {
+				samples.push_back(ns);
+			}
+		}
+
+		void print(char const* name) {
+			if (samples.empty()) {
+				std::printf("%-10s (no samples)\n", name);
+				return;
+			}
+			std::sort(samples.begin(), samples.end());
+			long double sum = 0;
+			for (std::uint64_t const sample : samples) {
+				sum += sample;
+			}
+			auto const percentile = [this](double p) {
+				return samples[std::min(samples.size() - 1, static_cast<std::size_t>(p * samples.size()))];
+			};
+			std::printf("%-10s n=%zu mean=%.1f p50=%.1f p99=%.1f max=%.1f [us]\n", name, samples.size(),
+				static_cast<double>(sum / samples.size()) / 1e3, percentile(0.50) / 1e3, percentile(0.99) / 1e3, samples.back() / 1e3);
+		}
+	};
+
+	// Process() と同じ手順でパケットをブロックにしてエンジンに通す
+	struct pipeline {
+		pipeline(rtvc::engine_api const& engine, int block_size)
+			: engine(engine)
+			, block_size(block_size)
+		{
+		}
+
+		rtvc::engine_api const& engine;
+		int block_size;
+		rtvc::BlockAssembler assembler;
+		rtvc::session::params_record params{ 0, -1, 0.0f, { 1.0f, 1.0f, 0.0f, 0.0f, 0.0f } };
+		std::ofstream output;
+
+		// --watchdog: 期限はブロックの長さ + watchdog_timeout_ns
+		rtvc::EngineWatchdog watchdog;
+		rtvc::DelayLine dry_delay;
+		std::vector<float> dry;
+		rtvc::DryFallback fallback;
+		std::uint64_t watchdog_timeout_ns = 0;
+		int sample_rate = 0;
+
+		// 失敗したか間に合わなかったブロックを埋める (Reset() していなければ埋めない)
+		rtvc::Concealer concealer;
+		bool conceal = false;
+		timing_stats conceal_time;
+		std::uint64_t failures = 0;
+		int last_error = 0;
+
+		// --drop-rate: 起床ごとにこの確率でエンジンの出力を捨てる (乱数は毎回同じ)
+		double drop_rate = 0.0;
+		std::mt19937 drop_random{ 1 };
+		std::uint64_t dropped_wakes = 0;
+		std::uint64_t dropped_frames = 0;
+		bool last_dropped = false;
+		bool has_last_sample = false;
+		float last_sample = 0.0f;
+		double step_sum = 0.0;          ///< 端以外の隣り合うサンプルの差の和
+		std::uint64_t steps = 0;
+		double boundary_step_sum = 0.0; ///< 捨てた区間の端 (入るときと出るとき) の差
+		double boundary_step_max = 0.0;
+		std::uint64_t boundaries = 0;
+
+		// --probe: プラグインと同じくエンジンの入力をチャープに替えて、出力との相互相関で遅延を測る (測る間の出力は無音にする)
+		rtvc::LatencyProbe probe;
+		bool probe_armed = false;
+		bool probe_done = false;
+		rtvc::latency_probe_result probe_result{ 0.0, 0.0 };
+		int sample_latency = 0;
+
+		// --impulse: 置いたインパルスの取り込み時刻と、出てきたところで測った遅延と勘定した遅延の差
+		bool impulse = false;
+		std::uint64_t impulse_interval = 0;            ///< インパルスの間隔 [frames]
+		std::uint64_t input_frames = 0;
+		std::vector<float> impulse_input;
+		std::deque<std::uint64_t> impulse_times;
+		std::uint64_t capture_time = 0;                ///< このブロック先頭の取り込み時刻 (分からなければ 0)
+		std::int64_t pipeline_delay_ns = 0;            ///< プラグインと同じく平滑化した勘定の遅延
+		std::uint64_t impulses_sent = 0;
+		std::uint64_t impulses_found = 0;
+		std::uint64_t impulses_lost = 0;
+		double impulse_delay_sum_ns = 0.0;
+		double impulse_error_max_ns = 0.0;             ///< 測った遅延と勘定の差 (絶対値の最大)
+		std::uint64_t impulse_skip = 0;                ///< 見つけた後に読み飛ばす残り [frames]
+
+		// --trace: プラグインと同じ区間を記録する (nullptr なら記録しない)
+		rtvc::PipelineTrace* trace = nullptr;
+
+		// --stats / --prometheus: プラグインと同じ数を足す (nullptr なら数えない)
+		rtvc::PipelineCounters* counters = nullptr;
+
+		timing_stats engine_time;
+		std::uint64_t packets = 0;
+		std::uint64_t silent_packets = 0;
+		std::uint64_t discontinuities = 0;
+
+		void push(float const* data, std::uint32_t frames, std::uint32_t flags) {
+			++packets;
+			if (flags & rtvc::CAPTURE_FLAG_SILENT) {
+				++silent_packets;
+			}
+			if (flags & rtvc::CAPTURE_FLAG_DISCONTINUITY) {
+				++discontinuities;
+			}
+
+			rtvc::TraceScope _block_trace(trace, rtvc::trace_thread::capture, rtvc::trace_span::block);
+			std::uint32_t block_count = 0;
+			{
+				rtvc::TraceScope _trace(trace, rtvc::trace_thread::capture, rtvc::trace_span::assemble);
+				block_count = assembler.Push((flags & rtvc::CAPTURE_FLAG_SILENT) ? nullptr : data, frames);
+				_trace.SetArg(block_count);
+			}
+			_block_trace.SetArg(block_count);
+			if (block_count == 0) {
+				return;
+			}
+			process(assembler.Blocks(), block_count);
+			if (impulse) {
+				find_impulses(assembler.Blocks(), static_cast<std::size_t>(block_count) * block_size);
+			}
+
+			if (output.is_open()) {
+				rtvc::TraceScope _trace(trace, rtvc::trace_thread::capture, rtvc::trace_span::output, block_count * static_cast<std::uint32_t>(block_size));
+				output.write(reinterpret_cast<char const*>(assembler.Blocks()), static_cast<std::streamsize>(block_count) * block_size * sizeof(float));
+			}
+		}
+
+		/// 1 回に処理するのは max_frames まで (超えた起床は見張らずに処理する)
+		void start_watchdog(double timeout_ms, int rate, int sample_latency, std::size_t max_frames) {
+			watchdog_timeout_ns = static_cast<std::uint64_t>(timeout_ms * 1'000'000);
+			sample_rate = rate;
+			dry_delay.Reset(static_cast<std::uint32_t>(sample_latency), max_frames);
+			dry.assign(max_frames, 0.0f);
+			fallback.Reset(static_cast<std::uint32_t>(rate / 100));
+			if (HRESULT const hr = watchdog.Start(max_frames, trace); FAILED(hr)) {
+				std::fprintf(stderr, "engine thread is not registered with MMCSS (%x)\n", static_cast<unsigned>(hr));
+			}
+		}
+
+		void process(float* blocks, std::uint32_t block_count) {
+			// プラグインと同じ順に声とパラメーターを設定して処理する
+			std::uint64_t const engine_start = now_ns();
+			std::size_t const frames = static_cast<std::size_t>(block_count) * block_size;
+			bool const supervised = watchdog.Running() && frames <= dry.size();
+			{
+				rtvc::TraceScope _trace(trace, rtvc::trace_thread::capture, rtvc::trace_span::set_voice);
+				if (supervised && watchdog.Stalled()) {
+					// 止まったエンジンが返るまでは声も設定しない
+				}
+				else if (params.secondary_voice < 0) {
+					if (int const retval = engine.set_voice(params.primary_voice)) {
+						std::fprintf(stderr, "set_voice failed: %d (voice %d)\n", retval, params.primary_voice);
+					}
+				}
+				else {
+					int const ids[] = { params.primary_voice, params.secondary_voice };
+					float const amounts[] = { 1.0f - params.amount, params.amount };
+					if (int const retval = engine.set_voices(2, ids, amounts)) {
+						std::fprintf(stderr, "set_voices failed: %d (voice %d)\n", retval, params.primary_voice);
+					}
+				}
+			}
+			constexpr int const num_params = static_cast<int>(std::size(rtvc::session::params_record{}.params));
+			int retval = 0;
+			bool wet = true;
+			if (supervised) {
+				dry_delay.Process(blocks, dry.data(), static_cast<std::uint32_t>(frames));
+			}
+			// ドライには入れない (プラグインと同じ)
+			bool const probing = probe.IsRunning();
+			if (probing) {
+				probe.Inject(blocks, frames);
+			}
+			if (supervised) {
+				std::uint64_t const deadline = engine_start + frames * 1'000'000'000ull / static_cast<std::uint64_t>(sample_rate) + watchdog_timeout_ns;
+				rtvc::TraceScope _trace(trace, rtvc::trace_thread::capture, rtvc::trace_span::process, block_count);
+				wet = watchdog.Run(engine, num_params, params.params, block_size, static_cast<int>(block_count), blocks, deadline, retval);
+			}
+			else {
+				rtvc::TraceScope _trace(trace, rtvc::trace_thread::capture, rtvc::trace_span::process, block_count);
+				retval = rtvc::process_blocks(engine, num_params, params.params, block_size, static_cast<int>(block_count), blocks, blocks);
+			}
+			if (!wet && trace) {
+				trace->Instant(rtvc::trace_thread::capture, rtvc::trace_span::deadline_miss, block_count);
+			}
+			if (retval) {
+				++failures;
+				last_error = retval;
+			}
+			bool dropped = false;
+			if (drop_rate > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(drop_random) < drop_rate) {
+				// エンジンは呼んで状態を進め、出力だけを捨てる
+				dropped = true;
+				++dropped_wakes;
+				dropped_frames += frames;
+				if (!conceal) {
+					std::memset(blocks, 0, frames * sizeof(float));
+				}
+			}
+			if (!conceal) {
+			}
+			else if (wet && retval == 0 && !dropped) {
+				concealer.Good(blocks, static_cast<std::uint32_t>(frames));
+			}
+			else {
+				rtvc::TraceScope _trace(trace, rtvc::trace_thread::capture, rtvc::trace_span::conceal, block_count);
+				std::uint64_t const conceal_start = now_ns();
+				concealer.Conceal(blocks, static_cast<std::uint32_t>(frames));
+				conceal_time.add((now_ns() - conceal_start) / block_count);
+			}
+			if (supervised) {
+				fallback.Process(wet, blocks, dry.data(), static_cast<std::uint32_t>(frames));
+			}
+			if (probing) {
+				probe.Record(blocks, frames);
+				std::memset(blocks, 0, frames * sizeof(float));
+			}
+			if (drop_rate > 0.0) {
+				measure_steps(blocks, frames, dropped);
+			}
+			std::uint64_t const engine_ns = now_ns() - engine_start;
+			engine_time.add(engine_ns);
+			// 解析は処理時間に含めない (プラグインでは低優先度のスレッドで行う)
+			if (probe_armed && !probe_done) {
+				probe_done = probe.Analyze(probe_result);
+			}
+			if (counters) {
+				// 出力先がないので、起床から出力までの代わりに処理時間を数える
+				counters->RecordBlocks(block_count, frames * 1'000'000'000ull / static_cast<std::uint64_t>(sample_rate), engine_ns, engine_ns);
+			}
+		}
+
+		/// 取り込んだパケットをインパルスだけの入力に替える (device_time_ns が 0 なら時刻は残さない)
+		float const* make_impulses(std::uint32_t frames, std::uint64_t device_time_ns) {
+			impulse_input.assign(frames, 0.0f);
+			for (std::uint32_t i = 0; i < frames; ++i) {
+				// 始めの半周期は空ける
+				if ((input_frames + i) % impulse_interval == impulse_interval / 2) {
+					impulse_input[i] = 1.0f;
+					++impulses_sent;
+					if (device_time_ns != 0) {
+						impulse_times.push_back(device_time_ns + static_cast<std::uint64_t>(i) * 1'000'000'000ull / static_cast<std::uint64_t>(sample_rate));
+					}
+				}
+			}
+			input_frames += frames;
+			return impulse_input.data();
+		}
+
+		// 出力の y[j] は now + j / sample_rate に出て、取り込み時刻は capture_time + (j - sample_latency) / sample_rate のはず
+		void find_impulses(float const* y, std::size_t frames) {
+			std::uint64_t const output_time = now_ns();
+			if (capture_time == 0 || output_time <= capture_time) {
+				return;
+			}
+			// プラグインの Process() と同じ勘定
+			std::int64_t const accounted = static_cast<std::int64_t>(output_time - capture_time) + static_cast<std::int64_t>(static_cast<std::uint64_t>(sample_latency) * 1'000'000'000ull / static_cast<std::uint64_t>(sample_rate));
+			pipeline_delay_ns = pipeline_delay_ns == 0 ? accounted : pipeline_delay_ns + (accounted - pipeline_delay_ns) / 16;
+
+			double const frame_ns = 1e9 / sample_rate;
+			for (std::size_t j = 0; j < frames; ++j) {
+				if (impulse_skip > 0) {
+					--impulse_skip;
+					continue;
+				}
+				if (std::fabs(y[j]) < 0.5f) {
+					continue;
+				}
+				impulse_skip = impulse_interval / 2;
+				double const expected = static_cast<double>(capture_time) + (static_cast<double>(j) - sample_latency) * frame_ns;
+				// 穴埋めなどで出てこなかったものは飛ばす
+				while (!impulse_times.empty() && static_cast<double>(impulse_times.front()) < expected - impulse_interval / 2 * frame_ns) {
+					impulse_times.pop_front();
+					++impulses_lost;
+				}
+				if (impulse_times.empty()) {
+					continue;
+				}
+				double const measured = static_cast<double>(output_time) + j * frame_ns - static_cast<double>(impulse_times.front());
+				impulse_times.pop_front();
+				++impulses_found;
+				impulse_delay_sum_ns += measured;
+				impulse_error_max_ns = (std::max)(impulse_error_max_ns, std::fabs(measured - static_cast<double>(accounted)));
+			}
+		}
+
+		/// 測った遅延と勘定した遅延が 1 フレーム以内で合っている
+		bool impulse_ok() const {
+			return impulses_found > 0 && impulse_error_max_ns <= 1e9 / sample_rate;
+		}
+
+		// 出力の隣り合うサンプルの差を、捨てた区間の端とそれ以外に分けて足す
+		void measure_steps(float const* y, std::size_t frames, bool dropped) {
+			if (frames == 0) {
+				return;
+			}
+			if (has_last_sample) {
+				double const step = std::fabs(static_cast<double>(y[0]) - last_sample);
+				if (dropped != last_dropped) {
+					boundary_step_sum += step;
+					boundary_step_max = (std::max)(boundary_step_max, step);
+					++boundaries;
+				}
+				else {
+					step_sum += step;
+					++steps;
+				}
+			}
+			for (std::size_t i = 1; i < frames; ++i) {
+				step_sum += std::fabs(static_cast<double>(y[i]) - y[i - 1]);
+			}
+			steps += frames - 1;
+			last_sample = y[frames - 1];
+			last_dropped = dropped;
+			has_last_sample = true;
+		}
+
+		void print() {
+			std::printf("packets: %llu (silent %llu, discontinuity %llu)\n",
+				static_cast<unsigned long long>(packets), static_cast<unsigned long long>(silent_packets), static_cast<unsigned long long>(discontinuities));
+			if (failures > 0) {
+				std::printf("process failed: %llu time(s) (last error %d)\n", static_cast<unsigned long long>(failures), last_error);
+			}
+			if (!conceal_time.samples.empty()) {
+				std::printf("concealed: %llu [frames]\n", static_cast<unsigned long long>(concealer.ConcealedFrames()));
+				conceal_time.print("conceal");
+			}
+			if (probe_armed && !probe_done) {
+				std::printf("probe: not finished (the capture ended before the chirp came back)\n");
+			}
+			else if (probe_armed) {
+				std::printf("probe: engine round trip %.2f [frames] (%.3f [ms]), nominal %d [frames] (%.3f [ms]), confidence %.1f\n",
+					probe_result.latency_frames, 1'000.0 * probe_result.latency_frames / sample_rate,
+					sample_latency, 1'000.0 * sample_latency / sample_rate, probe_result.confidence);
+				if (probe_result.confidence < 10.0) {
+					std::printf("probe: weak correlation peak, the measurement may be wrong\n");
+				}
+			}
+			if (impulse) {
+				if (impulses_found > 0) {
+					std::printf("impulse: %llu found of %llu (lost %llu), measured delay %.3f [ms], pipeline delay %.3f [ms], max error %.3f [ms] (%.2f [frames]) %s\n",
+						static_cast<unsigned long long>(impulses_found), static_cast<unsigned long long>(impulses_sent), static_cast<unsigned long long>(impulses_lost),
+						impulse_delay_sum_ns / impulses_found / 1e6, pipeline_delay_ns / 1e6, impulse_error_max_ns / 1e6, impulse_error_max_ns * sample_rate / 1e9,
+						impulse_ok() ? "ok" : "MISMATCH");
+				}
+				else {
+					std::printf("impulse: none of %llu came back with a capture time\n", static_cast<unsigned long long>(impulses_sent));
+				}
+			}
+			if (drop_rate > 0.0) {
+				std::printf("dropped: %llu wake(s), %llu [frames] (%s)\n", static_cast<unsigned long long>(dropped_wakes), static_cast<unsigned long long>(dropped_frames),
+					conceal ? "concealed" : "silenced");
+				double const typical = steps > 0 ? step_sum / static_cast<double>(steps) : 0.0;
+				if (boundaries > 0) {
+					std::printf("boundary step: %llu edge(s), mean %.5f, max %.5f (typical step %.5f, %.1fx)\n", static_cast<unsigned long long>(boundaries),
+						boundary_step_sum / static_cast<double>(boundaries), boundary_step_max, typical, typical > 0.0 ? boundary_step_sum / static_cast<double>(boundaries) / typical : 0.0);
+				}
+			}
+			if (watchdog.Running()) {
+				rtvc::watchdog_stats const& stats = watchdog.Stats();
+				std::printf("watchdog: %llu miss(es), %llu dry block(s), %llu recovery(ies), last stall %.1f [ms], max %.1f [ms]\n",
+					static_cast<unsigned long long>(stats.misses.load()), static_cast<unsigned long long>(stats.dry_blocks.load()),
+					static_cast<unsigned long long>(stats.recoveries.load()), stats.last_stall_ns.load() / 1'000'000.0, stats.max_stall_ns.load() / 1'000'000.0);
+			}
+		}
+	};
+
+	// プラグインの Monitor() と同じく、1 秒ごとに統計を書き出す
+	struct telemetry_publisher {
+		telemetry_publisher(pipeline& p, rtvc::PipelineCounters& counters, std::string const& prometheus_path)
+			: p(p)
+			, counters(counters)
+			, prometheus_path(prometheus_path)
+		{
+		}
+
+		pipeline& p;
+		rtvc::PipelineCounters& counters;
+		std::string prometheus_path;
+		rtvc::TelemetryFile file;
+		rtvc::TelemetryWindow window;
+		std::mutex mutex;
+		std::condition_variable stopped;
+		bool stopping = false;
+		std::thread thread;
+
+		void start() {
+			thread = std::thread([this] {
+				std::unique_lock<std::mutex> lock(mutex);
+				while (!stopped.wait_for(lock, std::chrono::seconds(1), [this] { return stopping; })) {
+					publish(false);
+				}
+			});
+		}
+
+		/// 止まったことを残して終わる
+		void stop() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			stopped.notify_all();
+			if (thread.joinable()) {
+				thread.join();
+			}
+			publish(true);
+		}
+
+		void publish(bool closing) {
+			rtvc::telemetry_record record{};
+			window.Update(counters, now_ns(), record);
+			std::memcpy(record.magic, rtvc::TELEMETRY_MAGIC, sizeof(record.magic));
+			record.version = rtvc::TELEMETRY_VERSION;
+			record.size = static_cast<std::uint32_t>(sizeof(record));
+			record.update_time_ns = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+			record.sample_rate = static_cast<std::uint32_t>(p.sample_rate);
+			record.block_size = static_cast<std::uint32_t>(p.block_size);
+			if (closing) {
+				record.running = 0;
+			}
+			rtvc::watchdog_stats const& stats = p.watchdog.Stats();
+			record.deadline_misses_total = stats.misses.load(std::memory_order::relaxed);
+			record.shed_blocks_total = stats.dry_blocks.load(std::memory_order::relaxed);
+			record.concealed_frames_total = p.concealer.ConcealedFrames();
+			file.Publish(record);
+			if (!prometheus_path.empty() && !rtvc::write_prometheus(std::filesystem::u8path(prometheus_path), record, "rtvc-replay")) {
+				std::fprintf(stderr, "could not write prometheus textfile: %s\n", prometheus_path.c_str());
+			}
+		}
+	};
+
+	// 記録したセッションを流す
+	int run_session(rtvc::session::Reader& reader, pipeline& p, bool max_speed) {
+		rtvc::session::file_header const& header = reader.Header();
+		bool configured = false;
+		timing_stats recorded_engine;
+		std::uint64_t first_timestamp = 0;
+		std::uint64_t const replay_start = now_ns();
+
+		rtvc::session::record_header record;
+		while (reader.Next(record)) {
+			// 記録時の起床間隔を再現する
+			if (!max_speed) {
+				if (first_timestamp == 0) {
+					first_timestamp = record.timestamp_ns;
+				}
+				std::uint64_t const due = replay_start + (record.timestamp_ns - first_timestamp);
+				std::uint64_t const now = now_ns();
+				if (due > now) {
+					std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+				}
+			}
+
+			switch (record.type) {
+			case rtvc::session::record_type::config:
+			{
+				rtvc::session::config_record config;
+				std::memcpy(&config, reader.Payload(), sizeof(config));
+				p.assembler.Reset(header.block_size, config.buffer_frames);
+				configured = true;
+				std::printf("config: device %d, latency mode %d, buffer %u [frames]\n", config.device, config.latency_mode, config.buffer_frames);
+				break;
+			}
+			case rtvc::session::record_type::params:
+				std::memcpy(&p.params, reader.Payload(), sizeof(p.params));
+				break;
+			case rtvc::session::record_type::timing:
+			{
+				rtvc::session::timing_record timing;
+				std::memcpy(&timing, reader.Payload(), sizeof(timing));
+				recorded_engine.add(timing.engine_ns);
+				break;
+			}
+			case rtvc::session::record_type::packet:
+			{
+				rtvc::session::packet_record packet;
+				std::memcpy(&packet, reader.Payload(), sizeof(packet));
+				if (!configured) {
+					// config より前のパケットは最大パケット長が分からないので、十分な大きさで用意する
+					p.assembler.Reset(header.block_size, std::max<std::size_t>(packet.frames, header.sample_rate));
+					configured = true;
+				}
+				float const* data = record.size > sizeof(packet) ? reinterpret_cast<float const*>(reader.Payload() + sizeof(packet)) : nullptr;
+				p.push(data, packet.frames, packet.flags);
+				break;
+			}
+			default:
+				// 未知のレコードは読み飛ばす
+				break;
+			}
+		}
+		if (char const* const error = reader.Error()) {
+			std::fprintf(stderr, "corrupt session: %s\n", error);
+			return 1;
+		}
+
+		p.print();
+		recorded_engine.print("recorded");
+		p.engine_time.print("replayed");
+		return 0;
+	}
+
+	// 取り込みバックエンドから流す
+	// max_frames まで流したら止める (0 なら取り込みが終わるまで)
+	int run_capture(rtvc::CaptureBackend& capture, pipeline& p, int sample_rate, std::uint64_t max_frames) {
+		HRESULT hr = S_OK;
+		if FAILED(hr = capture.Open(rtvc::capture_config{ sample_rate, p.block_size })) {
+			std::fprintf(stderr, "could not open %s capture: %s (%x)\n", capture.Name(), capture.LastError(), static_cast<unsigned>(hr));
+			return 1;
+		}
+		p.assembler.Reset(p.block_size, capture.MaxPacketFrames());
+
+		timing_stats wake_delay;
+		if FAILED(hr = capture.Start()) {
+			std::fprintf(stderr, "could not start %s capture: %s (%x)\n", capture.Name(), capture.LastError(), static_cast<unsigned>(hr));
+			return 1;
+		}
+		std::uint64_t total_frames = 0;
+		while ((max_frames == 0 || total_frames < max_frames) && (hr = capture.Wait()) == S_OK) {
+			rtvc::rt_check::realtime_scope _realtime_scope;
+			std::uint64_t const wake_time = now_ns();
+			rtvc::capture_packet packet;
+			if FAILED(hr = capture.Acquire(packet)) {
+				break;
+			}
+			if (p.counters) {
+				p.counters->RecordWake(wake_time, static_cast<std::uint64_t>(packet.frames) * 1'000'000'000ull / sample_rate);
+				p.counters->RecordCapture(packet.device_time_ns, packet.frames, sample_rate, !(packet.flags & (rtvc::CAPTURE_FLAG_DISCONTINUITY | rtvc::CAPTURE_FLAG_TIMESTAMP_ERROR)));
+			}
+			// パケットの最後のサンプルが届いてから起きるまで
+			if (packet.device_time_ns != 0) {
+				std::uint64_t const packet_end = packet.device_time_ns + static_cast<std::uint64_t>(packet.frames) * 1'000'000'000ull / sample_rate;
+				wake_delay.add(wake_time > packet_end ? wake_time - packet_end : 0);
+			}
+			if (p.impulse) {
+				// 出力ブロック先頭サンプルの取り込み時刻 (あまりの分だけ前のパケットに遡る)
+				bool const valid = packet.device_time_ns != 0 && !(packet.flags & rtvc::CAPTURE_FLAG_TIMESTAMP_ERROR);
+				p.capture_time = valid ? packet.device_time_ns - static_cast<std::uint64_t>(p.assembler.Remainings()) * 1'000'000'000ull / sample_rate : 0;
+				float const* const data = p.make_impulses(packet.frames, valid ? packet.device_time_ns : 0);
+				p.push(data, packet.frames, packet.flags & ~rtvc::CAPTURE_FLAG_SILENT);
+			}
+			else {
+				p.push(packet.data, packet.frames, packet.flags);
+			}
+			total_frames += packet.frames;
+			if FAILED(hr = capture.Release(packet)) {
+				break;
+			}
+		}
+		capture.Stop();
+		if FAILED(hr) {
+			std::fprintf(stderr, "%s capture failed: %s (%x)\n", capture.Name(), capture.LastError(), static_cast<unsigned>(hr));
+			return 1;
+		}
+
+		p.print();
+		wake_delay.print("wake");
+		p.engine_time.print("engine");
+		return p.impulse && !p.impulse_ok() ? 1 : 0;
+	}
+
+#if defined(RTVC_WITH_JACK)
+	// JACK クライアントとして動かす
+	int run_jack(std::string const& client_name, pipeline& p, int sample_rate, double seconds) {
+		p.engine_time.samples.reserve(static_cast<std::size_t>(seconds * sample_rate / p.block_size) + 1);
+		p.engine_time.bounded = true;
+		p.conceal_time.samples.reserve(p.engine_time.samples.capacity());
+		p.conceal_time.bounded = true;
+
+		rtvc::jack_client_config config;
+		config.client_name = client_name;
+		rtvc::JackClient client(std::move(config));
+		HRESULT hr = S_OK;
+		auto const process = [](void* user, float* blocks, std::uint32_t block_count) {
+			reinterpret_cast<pipeline*>(user)->process(blocks, block_count);
+		};
+		if (FAILED(hr = client.Open(rtvc::capture_config{ sample_rate, p.block_size }, process, &p)) || FAILED(hr = client.Activate())) {
+			std::fprintf(stderr, "jack: %s\n", client.LastError());
+			return 1;
+		}
+		std::printf("jack: period %u [frames], %s\n", client.Period(), client.IsPeriodLocked() ? "processing in the callback" : "handing off to the inference thread");
+
+		std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+		client.Close();
+
+		std::printf("underruns: %llu\n", static_cast<unsigned long long>(client.Underruns()));
+		p.engine_time.print("engine");
+		return 0;
+	}
+#endif
+}
+
+int main(int argc, char** argv) {
+	options opts;
+	if (!parse_options(argc, argv, opts)) {
+		usage();
+		return 2;
+	}
+
+	// DSP のカーネル (エンジンと取り込みを動かす前に選ぶ)
+	if (!opts.simd.empty()) {
+		rtvc::simd::level isa = rtvc::simd::level::scalar;
+		if (!rtvc::simd::from_string(opts.simd.c_str(), isa)) {
+			usage();
+			return 2;
+		}
+		if (!rtvc::simd::use(isa)) {
+			std::fprintf(stderr, "%s is not supported on this CPU (up to %s)\n", rtvc::simd::to_string(isa), rtvc::simd::to_string(rtvc::simd::supported_level));
+			return 1;
+		}
+	}
+	std::printf("simd: %s (supported %s)\n", rtvc::simd::to_string(rtvc::simd::kernels().isa), rtvc::simd::to_string(rtvc::simd::supported_level));
+
+	rtvc::session::Reader reader;
+	if (!opts.session.empty()) {
+		if (!reader.Open(std::filesystem::u8path(opts.session))) {
+			std::fprintf(stderr, "could not open session: %s\n", opts.session.c_str());
+			return 1;
+		}
+		rtvc::session::file_header const& header = reader.Header();
+		std::printf("session: %u [hz], block %u, latency %u\n", header.sample_rate, header.block_size, header.sample_latency);
+	}
+
+	// エンジンを読み込む ("eco" なら組み込みの軽量エンジン、"stub" なら試験用のエンジン)
+	rtvc::module_handle hModule = nullptr;
+	rtvc::engine_api engine;
+	if (opts.engine == "eco") {
+		if (!rtvc::eco_engine_api(engine)) {
+			std::fprintf(stderr, "too many eco engines are open\n");
+			return 1;
+		}
+	}
+	else if (opts.engine.rfind("stub", 0) == 0 && (opts.engine.size() == 4 || opts.engine[4] == ':')) {
+		rtvc::stub_engine_config config;
+		if (!rtvc::parse_stub_engine_config(opts.engine.size() > 5 ? opts.engine.substr(5) : std::string(), config)) {
+			std::fprintf(stderr, "invalid stub engine: %s\n", opts.engine.c_str());
+			return 2;
+		}
+		rtvc::stub_engine_api(engine, config);
+	}
+	else {
+#if defined(_WIN32)
+		std::filesystem::path const engine_path = opts.engine.empty() ? std::filesystem::path(rtvc::default_engine_path()) : std::filesystem::u8path(opts.engine);
+#else
+		if (opts.engine.empty()) {
+			std::fprintf(stderr, "--engine is required on this platform\n");
+			return 2;
+		}
+		std::filesystem::path const engine_path = std::filesystem::u8path(opts.engine);
+#endif
+		hModule = load_engine(engine_path);
+		if (!hModule) {
+			std::fprintf(stderr, "could not load engine: %s\n", engine_path.string().c_str());
+			return 1;
+		}
+		if (char const* const missing = rtvc::resolve_engine_api(hModule, engine)) {
+			std::fprintf(stderr, "failed to get proc %s\n", missing);
+			return 1;
+		}
+	}
+
+	if (int const retval = engine.init(opts.model.c_str())) {
+		std::fprintf(stderr, "could not init %s: %d\n", opts.model.c_str(), retval);
+		return 1;
+	}
+	int sample_rate = 0;
+	int block_size = 0;
+	int sample_latency = 0;
+	engine.get_sample_rate(&sample_rate);
+	engine.get_block_size(&block_size);
+	engine.get_sample_latency(&sample_latency);
+	// --batch 1 で process_n() を使わずに比べられる
+	if (int const max_blocks = rtvc::negotiate_batch(engine, opts.batch); max_blocks > 1) {
+		std::printf("process_n: up to %d blocks per call\n", max_blocks);
+	}
+
+	int result = 0;
+	pipeline p(engine, block_size);
+	p.sample_rate = sample_rate;
+	std::unique_ptr<rtvc::PipelineTrace> trace;
+	if (!opts.trace.empty()) {
+		trace.reset(new rtvc::PipelineTrace);
+		p.trace = trace.get();
+	}
+	if (opts.conceal) {
+		p.concealer.Reset(sample_rate);
+		p.conceal = true;
+	}
+	p.drop_rate = opts.drop_rate;
+	p.sample_latency = sample_latency;
+	if (opts.impulse) {
+		if (opts.capture.empty() || opts.max_speed) {
+			std::fprintf(stderr, "--impulse needs --capture in real time (capture times are unknown otherwise)\n");
+			result = 2;
+		}
+		p.impulse = true;
+		p.impulse_interval = static_cast<std::uint64_t>(sample_rate / 2);
+	}
+	if (opts.probe) {
+		// 戻りを待つのは 2 秒まで (プラグインと同じ)
+		p.probe_armed = p.probe.Arm(sample_rate, 2 * sample_rate);
+	}
+	if (opts.watchdog_ms >= 0.0) {
+		// 1 回の起床は 1 秒分まで見張る
+		p.start_watchdog(opts.watchdog_ms, sample_rate, sample_latency, static_cast<std::size_t>(sample_rate + block_size));
+	}
+	if (!opts.output.empty()) {
+		p.output.open(std::filesystem::u8path(opts.output), std::ios::binary);
+		if (!p.output) {
+			std::fprintf(stderr, "could not open output: %s\n", opts.output.c_str());
+			result = 1;
+		}
+	}
+	rtvc::PipelineCounters counters;
+	std::unique_ptr<telemetry_publisher> publisher;
+	if (!opts.stats.empty() || !opts.prometheus.empty()) {
+		publisher.reset(new telemetry_publisher(p, counters, opts.prometheus));
+		if (!opts.stats.empty() && FAILED(publisher->file.Open(std::filesystem::u8path(opts.stats)))) {
+			std::fprintf(stderr, "could not open stats file: %s\n", opts.stats.c_str());
+			result = 1;
+		}
+		p.counters = &counters;
+		counters.Start();
+		publisher->start();
+	}
+
+	if (result != 0) {
+	}
+	else if (!opts.session.empty()) {
+		rtvc::session::file_header const& header = reader.Header();
+		if (sample_rate != static_cast<int>(header.sample_rate) || block_size != static_cast<int>(header.block_size)) {
+			std::fprintf(stderr, "engine format (%d [hz], block %d) differs from session\n", sample_rate, block_size);
+			result = 1;
+		}
+		else {
+			result = run_session(reader, p, opts.max_speed);
+		}
+	}
+	else if (!opts.jack.empty()) {
+#if defined(RTVC_WITH_JACK)
+		result = run_jack(opts.jack, p, sample_rate, opts.seconds);
+#else
+		std::fprintf(stderr, "built without JACK support\n");
+		result = 2;
+#endif
+	}
+	else {
+		// --recover では開き直すたびに作る
+		std::function<std::unique_ptr<rtvc::CaptureBackend>()> make_capture;
+		std::uint64_t max_frames = 0;
+		if (opts.capture.rfind("file:", 0) == 0) {
+			rtvc::file_capture_config config;
+			config.path = std::filesystem::u8path(opts.capture.substr(5));
+			config.realtime = !opts.max_speed;
+			make_capture = [config] {
+				return std::unique_ptr<rtvc::CaptureBackend>(new rtvc::FileCapture(config));
+			};
+		}
+		else if (opts.capture.rfind("synthetic", 0) == 0) {
+			rtvc::synthetic_capture_config config;
+			config.realtime = !opts.max_speed;
+			config.duration_frames = static_cast<std::uint64_t>(10 * sample_rate);
+			std::string const spec = opts.capture.size() > 10 ? opts.capture.substr(10) : std::string();
+			if (rtvc::parse_synthetic_capture_config(spec, config, sample_rate)) {
+				if (opts.recover) {
+					// 長さは開き直しをまたいで数え、作り直すたびに乱数を変える (同じところで失敗し続けないように)
+					max_frames = config.duration_frames;
+					config.duration_frames = 0;
+				}
+				make_capture = [config]() mutable {
+					std::unique_ptr<rtvc::CaptureBackend> capture(new rtvc::SyntheticCapture(config));
+					++config.seed;
+					return capture;
+				};
+			}
+		}
+#if defined(RTVC_WITH_ALSA)
+		else if (opts.capture.rfind("alsa:", 0) == 0) {
+			rtvc::alsa_capture_config config;
+			config.device = opts.capture.substr(5);
+			make_capture = [config] {
+				return std::unique_ptr<rtvc::CaptureBackend>(new rtvc::AlsaCapture(config));
+			};
+		}
+#endif
+		if (!make_capture) {
+			std::fprintf(stderr, "unknown capture: %s\n", opts.capture.c_str());
+			result = 2;
+		}
+		else if (opts.recover) {
+			rtvc::capture_recovery_stats stats;
+			rtvc::SupervisedCapture capture(std::move(make_capture), stats);
+			result = run_capture(capture, p, sample_rate, max_frames);
+
+			std::uint64_t const recoveries = stats.recoveries.load();
+			std::printf("recovery: %llu fault(s), %llu recovery(ies), %llu open attempt(s), %llu frame(s) bridged\n",
+				static_cast<unsigned long long>(stats.faults.load()), static_cast<unsigned long long>(recoveries),
+				static_cast<unsigned long long>(stats.open_attempts.load()), static_cast<unsigned long long>(stats.bridged_frames.load()));
+			if (recoveries > 0) {
+				std::printf("time to recover: mean %.2f [ms], max %.2f [ms]\n",
+					stats.total_recover_ns.load() / 1'000'000.0 / recoveries, stats.max_recover_ns.load() / 1'000'000.0);
+			}
+		}
+		else {
+			result = run_capture(*make_capture(), p, sample_rate, 0);
+		}
+	}
+
+	p.output.close();
+	p.watchdog.Stop();
+	if (publisher) {
+		counters.Stop();
+		publisher->stop();
+	}
+	if (trace) {
+		if (trace->Write(std::filesystem::u8path(opts.trace), 0.0)) {
+			std::printf("trace: %s\n", opts.trace.c_str());
+		}
+		else {
+			std::fprintf(stderr, "could not write trace: %s\n", opts.trace.c_str());
+			result = 1;
+		}
+	}
+	engine.destroy();
+#if defined(_WIN32)
+	if (hModule) {
+		::FreeLibrary(hModule);
+	}
+#else
+	if (hModule) {
+		::dlclose(hModule);
+	}
+#endif
+	return result;
+}
@@ -0,0 +1,16 @@
+﻿// リアルタイムスレッドの検査 (Linux の LD_PRELOAD 用シム)
+//
+// rt-check.h のシムを共有ライブラリーにする。RTVC_RT_CHECK と -rdynamic を付けてビルドした rtvc-replay / rtvc-host に
+// LD_PRELOAD すると、realtime_scope の中 (推論スレッドの起床ごとの処理とエンジンのスレッドの rtvc_process) での
+// malloc/free、pthread のロック、ブロッキングする呼び出しを横取りし、終了時にスタックと共に標準エラーに出す。
+//
+//   g++ -std=c++20 -O1 -g -shared -fPIC rtvc-rt-check/main.cpp -o librtvc-rt-check.so -ldl
+
+#if !defined(__linux__)
+#error "rtvc-rt-check is for Linux (the Windows plugin checks in the Debug configuration)"
+#endif
+
+#define RTVC_RT_CHECK
+#define RTVC_RT_CHECK_INTERPOSE
+
+#include "../nair-rtvc-source/rt-check.h"
@@ -0,0 +1,328 @@
+﻿// DSP のカーネルの版ごとの結果の検査
+//
+// simd-kernels.h の SSE2 / AVX2 / AVX-512 の版を、大きさと先頭のずれ (16 バイトに揃っていないところ) を変えながら scalar の版と比べる。
+// SSE2 と AVX2 はビット単位で同じでなければ失敗にする。AVX-512 は FMA を使うので、丸めの誤差の上限までを許す
+// (要素ごとの計算は 1 回の丸め、総和は部分和の長さに比例する上限を --tolerance 倍したもの)。
+// どの版も、書き込む範囲の外 (端数をマスクで書くところ) を壊していないことも確かめる。
+//
+//   rtvc-simd-check [--sizes <frames,...>] [--offsets <max>] [--tolerance <scale>] [--seed <n>]
+//
+// プラグインと同じく Release は /fp:fast でビルドするので、precise を付けたカーネルがその中でも揃うことを確かめられる。
+// 失敗があれば 1 を返す。
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../nair-rtvc-source/simd-kernels.h"
+
+namespace {
+	struct options {
+		std::vector<std::uint32_t> sizes;
+		std::uint32_t max_offset = 15; ///< 先頭を 0 から何要素までずらすか
+		double tolerance = 1.0;        ///< AVX-512 で許す誤差 (上限の何倍か)
+		std::uint32_t seed = 1;
+	};
+
+	void usage() {
+		std::fprintf(stderr,
+			"usage: rtvc-simd-check [--sizes <frames,...>] [--offsets <max>] [--tolerance <scale>] [--seed <n>]\n"
+			);
+	}
+
+	bool parse_sizes(char const* text, std::vector<std::uint32_t>& sizes) {
+		sizes.clear();
+		while (*text) {
+			char* end = nullptr;
+			unsigned long const frames = std::strtoul(text, &end, 10);
+			if (end == text || frames > 1'000'000) {
+				return false;
+			}
+			sizes.push_back(static_cast<std::uint32_t>(frames));
+			text = *end == ',' ? end + 1 : end;
+			if (*end && *end != ',') {
+				return false;
+			}
+		}
+		return !sizes.empty();
+	}
+
+	bool parse_options(int argc, char** argv, options& opts) {
+		// 既定は 0 から 70 までのすべてと、ブロックやパケットの大きさとその前後
+		for (std::uint32_t n = 0; n <= 70; ++n) {
+			opts.sizes.push_back(n);
+		}
+		for (std::uint32_t const n : { 127u, 128u, 129u, 240u, 255u, 256u, 257u, 441u, 480u, 509u, 1023u, 1024u, 2400u, 4099u }) {
+			opts.sizes.push_back(n);
+		}
+
+		for (int i = 1; i < argc; ++i) {
+			std::string const arg = argv[i];
+			if (arg == "--sizes" && i + 1 < argc) {
+				if (!parse_sizes(argv[++i], opts.sizes)) {
+					return false;
+				}
+			}
+			else if (arg == "--offsets" && i + 1 < argc) {
+				opts.max_offset = static_cast<std::uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+				if (opts.max_offset > 64) {
+					return false;
+				}
+			}
+			else if (arg == "--tolerance" && i + 1 < argc) {
+				opts.tolerance = std::strtod(argv[++i], nullptr);
+				if (!(opts.tolerance >= 0.0)) {
+					return false;
+				}
+			}
+			else if (arg == "--seed" && i + 1 < argc) {
+				opts.seed = static_cast<std::uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+			}
+			else {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/// 書き込む範囲の外に置く値 (NaN のビット列なので、計算の結果とは重ならない)
+	constexpr std::uint32_t const CANARY = 0x7FC0DEADu;
+	/// 範囲の前後に置く要素数
+	constexpr std::size_t const GUARD = 32;
+
+	bool same_bits(float a, float b) noexcept {
+		return std::memcmp(&a, &b, sizeof(float)) == 0;
+	}
+
+	/// 出力の領域 (前後に CANARY を置く)
+	struct guarded_buffer {
+		std::vector<float> storage;
+
+		void reset(std::size_t offset, std::size_t n) {
+			storage.assign(GUARD + offset + n + GUARD, 0.0f);
+			for (float& value : storage) {
+				std::memcpy(&value, &CANARY, sizeof(float));
+			}
+		}
+
+		float* data(std::size_t offset) noexcept {
+			return storage.data() + GUARD + offset;
+		}
+
+		/// [offset, offset + n) の外が CANARY のままか
+		bool intact(std::size_t offset, std::size_t n) const noexcept {
+			for (std::size_t i = 0; i < storage.size(); ++i) {
+				if (i >= GUARD + offset && i < GUARD + offset + n) {
+					continue;
+				}
+				std::uint32_t bits = 0;
+				std::memcpy(&bits, &storage[i], sizeof(float));
+				if (bits != CANARY) {
+					return false;
+				}
+			}
+			return true;
+		}
+	};
+
+	/// 版とカーネルごとの結果
+	struct check_result {
+		std::uint64_t cases = 0;
+		std::uint64_t failures = 0;
+		double max_abs_diff = 0.0;
+		double max_ratio = 0.0; ///< 許した誤差に対する割合 (AVX-512 のみ)
+	};
+
+	class checker {
+	public:
+		explicit checker(options const& opts)
+			: opts_(opts)
+		{
+		}
+
+		/// 版 isa を scalar と比べる (失敗がなければ true)
+		bool Run(rtvc::simd::level isa) {
+			rtvc::simd::kernel_table const& reference = rtvc::simd::kernels_for(rtvc::simd::level::scalar);
+			rtvc::simd::kernel_table const& kernels = rtvc::simd::kernels_for(isa);
+			exact_ = isa != rtvc::simd::level::avx512;
+			isa_ = isa;
+			results_[0] = results_[1] = results_[2] = results_[3] = check_result{};
+
+			std::mt19937 random(opts_.seed);
+			std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+			for (std::uint32_t const n : opts_.sizes) {
+				for (std::uint32_t offset = 0; offset <= opts_.max_offset; ++offset) {
+					// 入力と出力で別々にずらす
+					std::size_t const oa = offset;
+					std::size_t const ob = (offset * 7u) % (opts_.max_offset + 1u);
+					std::size_t const oy = (offset * 3u + 1u) % (opts_.max_offset + 1u);
+					offsets_[0] = oa;
+					offsets_[1] = ob;
+					offsets_[2] = oy;
+					a_.assign(oa + n, 0.0f);
+					b_.assign(ob + n, 0.0f);
+					for (std::size_t i = 0; i < n; ++i) {
+						a_[oa + i] = uniform(random);
+						b_[ob + i] = uniform(random);
+					}
+					float const* const a = a_.data() + oa;
+					float const* const b = b_.data() + ob;
+
+					CheckScale(reference, kernels, a, n, oy, 0.70710678f);
+					for (std::uint32_t const first : { 0u, 100u, 1000u }) {
+						CheckCrossfade(reference, kernels, a, b, n, oy, first, 1.0f / 480.0f);
+					}
+					CheckReduction(2, "dot", reference.dot, kernels.dot, a, b, n, false);
+					CheckReduction(3, "squared_distance", reference.squared_distance, kernels.squared_distance, a, b, n, true);
+				}
+			}
+
+			static char const* const NAMES[] = { "scale", "crossfade", "dot", "squared_distance" };
+			bool ok = true;
+			for (int k = 0; k < 4; ++k) {
+				check_result const& r = results_[k];
+				if (exact_) {
+					std::printf("%-7s %-17s %8llu case(s), %llu failure(s), max abs diff %g\n", rtvc::simd::to_string(isa), NAMES[k],
+						static_cast<unsigned long long>(r.cases), static_cast<unsigned long long>(r.failures), r.max_abs_diff);
+				}
+				else {
+					std::printf("%-7s %-17s %8llu case(s), %llu failure(s), max abs diff %g (%.2f of the bound)\n", rtvc::simd::to_string(isa), NAMES[k],
+						static_cast<unsigned long long>(r.cases), static_cast<unsigned long long>(r.failures), r.max_abs_diff, r.max_ratio);
+				}
+				ok = ok && r.failures == 0;
+			}
+			return ok;
+		}
+
+	private:
+		void Fail(int kernel, char const* name, std::size_t n, std::size_t index, float expected, float actual, char const* reason) {
+			++results_[kernel].failures;
+			if (++reported_ <= 20) {
+				std::printf("FAIL %s %s: n=%zu, offsets %zu/%zu/%zu, element %zu: scalar %.9g, got %.9g (%s)\n",
+					rtvc::simd::to_string(isa_), name, n, offsets_[0], offsets_[1], offsets_[2], index, expected, actual, reason);
+			}
+		}
+
+		// 要素ごとの差を比べる (bound は AVX-512 で許す差)
+		void Compare(int kernel, char const* name, std::size_t n, std::size_t i, float expected, float actual, double bound) {
+			check_result& r = results_[kernel];
+			double const diff = std::fabs(static_cast<double>(expected) - static_cast<double>(actual));
+			r.max_abs_diff = (std::max)(r.max_abs_diff, diff);
+			if (exact_) {
+				if (!same_bits(expected, actual)) {
+					Fail(kernel, name, n, i, expected, actual, "not bit-identical");
+				}
+				return;
+			}
+			double const allowed = bound * opts_.tolerance;
+			if (allowed > 0.0) {
+				r.max_ratio = (std::max)(r.max_ratio, diff / allowed);
+			}
+			if (!(diff <= allowed) && !same_bits(expected, actual)) {
+				Fail(kernel, name, n, i, expected, actual, "exceeds tolerance");
+			}
+		}
+
+		void CheckScale(rtvc::simd::kernel_table const& reference, rtvc::simd::kernel_table const& kernels, float const* x, std::size_t n, std::size_t oy, float gain) {
+			++results_[0].cases;
+			expected_.reset(oy, n);
+			actual_.reset(oy, n);
+			reference.scale(x, expected_.data(oy), gain, n);
+			kernels.scale(x, actual_.data(oy), gain, n);
+			if (!actual_.intact(oy, n)) {
+				Fail(0, "scale", n, 0, 0.0f, 0.0f, "wrote outside the output");
+			}
+			for (std::size_t i = 0; i < n; ++i) {
+				// 掛け算 1 回なので AVX-512 でも同じ
+				Compare(0, "scale", n, i, expected_.data(oy)[i], actual_.data(oy)[i], 0.0);
+			}
+		}
+
+		void CheckCrossfade(rtvc::simd::kernel_table const& reference, rtvc::simd::kernel_table const& kernels, float const* a, float const* b, std::size_t n, std::size_t oy, std::uint32_t first, float step) {
+			++results_[1].cases;
+			expected_.reset(oy, n);
+			actual_.reset(oy, n);
+			reference.crossfade(a, b, expected_.data(oy), first, step, n);
+			kernels.crossfade(a, b, actual_.data(oy), first, step, n);
+			if (!actual_.intact(oy, n)) {
+				Fail(1, "crossfade", n, 0, 0.0f, 0.0f, "wrote outside the output");
+			}
+			for (std::size_t i = 0; i < n; ++i) {
+				// FMA は a + (b - a) * w の丸めを 1 回減らすだけ (差は 1 ulp 程度)
+				double const w = (std::min)(static_cast<double>(first + i) * step, 1.0);
+				double const bound = 2.0 * FLT_EPSILON * (std::fabs(a[i]) + std::fabs((static_cast<double>(b[i]) - a[i]) * w));
+				Compare(1, "crossfade", n, i, expected_.data(oy)[i], actual_.data(oy)[i], bound);
+			}
+
+			// 同じ場所に書く (y が b と同じ)
+			std::vector<float> in_place(b, b + n);
+			kernels.crossfade(a, in_place.data(), in_place.data(), first, step, n);
+			for (std::size_t i = 0; i < n; ++i) {
+				double const w = (std::min)(static_cast<double>(first + i) * step, 1.0);
+				double const bound = 2.0 * FLT_EPSILON * (std::fabs(a[i]) + std::fabs((static_cast<double>(b[i]) - a[i]) * w));
+				Compare(1, "crossfade (in place)", n, i, expected_.data(oy)[i], in_place[i], bound);
+			}
+		}
+
+		void CheckReduction(int kernel, char const* name, float (*reference)(float const*, float const*, std::size_t) noexcept,
+			float (*actual)(float const*, float const*, std::size_t) noexcept, float const* a, float const* b, std::size_t n, bool distance) {
+			++results_[kernel].cases;
+			float const expected = reference(a, b, n);
+			float const value = actual(a, b, n);
+			// 誤差の上限: 部分和 16 本にそれぞれ n / 16 回足し、最後に 16 本を足すので、およそ (n / 16 + 5) 回の丸めが項の絶対値の和に掛かる
+			double magnitude = 0.0;
+			for (std::size_t i = 0; i < n; ++i) {
+				double const d = distance ? static_cast<double>(a[i]) - b[i] : static_cast<double>(a[i]) * b[i];
+				magnitude += distance ? d * d : std::fabs(d);
+			}
+			double const bound = 2.0 * (static_cast<double>(n) / 16.0 + 5.0) * FLT_EPSILON * magnitude;
+			Compare(kernel, name, n, 0, expected, value, bound);
+		}
+
+		options const& opts_;
+		rtvc::simd::level isa_ = rtvc::simd::level::scalar;
+		bool exact_ = true;
+		check_result results_[4];
+		std::uint64_t reported_ = 0;
+		std::size_t offsets_[3] = {}; ///< 今の a、b、y の先頭のずれ (要素数)
+
+		std::vector<float> a_;
+		std::vector<float> b_;
+		guarded_buffer expected_;
+		guarded_buffer actual_;
+	};
+}
+
+int main(int argc, char** argv) {
+	options opts;
+	if (!parse_options(argc, argv, opts)) {
+		usage();
+		return 2;
+	}
+
+	std::printf("simd: supported %s, %zu size(s), offsets 0..%u, tolerance %g\n",
+		rtvc::simd::to_string(rtvc::simd::supported_level), opts.sizes.size(), opts.max_offset, opts.tolerance);
+
+	checker c(opts);
+	bool ok = true;
+	for (rtvc::simd::level const isa : { rtvc::simd::level::sse2, rtvc::simd::level::avx2, rtvc::simd::level::avx512 }) {
+		if (isa > rtvc::simd::supported_level) {
+			std::printf("%-7s not supported on this CPU, skipped\n", rtvc::simd::to_string(isa));
+			continue;
+		}
+		if (rtvc::simd::kernels_for(isa).isa != isa) {
+			std::printf("%-7s not built on this platform, skipped\n", rtvc::simd::to_string(isa));
+			continue;
+		}
+		ok = c.Run(isa) && ok;
+	}
+	std::printf("%s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
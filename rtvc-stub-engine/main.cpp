@@ -0,0 +1,135 @@
+﻿// 試験用のエンジン (stub) の共有ライブラリー
+//
+// stub-engine.h を rtvc.vvfx と同じ関数名で公開する。RTVC_STUB_ENGINE_VERSION を変えて 2 つビルドすると、
+// get_version() と出力の大きさ (gain) だけが違うエンジンができるので、エンジンの差し替えを実際のエンジンなしで試せる。
+// 設定は環境変数 RTVC_STUB_ENGINE ("latency=480;block=256;...") で上書きできる。
+//
+//   g++ -std=c++20 -O2 -shared -fPIC -DRTVC_STUB_ENGINE_VERSION=1 rtvc-stub-engine/main.cpp -o rtvc-stub-v1.so
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <dlfcn.h>
+#endif
+
+// stub::state() の static は inline 関数の中にあるので、既定の可視性のままだと STB_GNU_UNIQUE で公開され、
+// 並べて読み込んだ 2 つの版が 1 つの状態を共有してしまう。公開する関数以外は隠して複製ごとに持たせる。
+#if !defined(_WIN32)
+#pragma GCC visibility push(hidden)
+#endif
+#include "../nair-rtvc-source/stub-engine.h"
+#if !defined(_WIN32)
+#pragma GCC visibility pop
+#endif
+
+#if !defined(RTVC_STUB_ENGINE_VERSION)
+#define RTVC_STUB_ENGINE_VERSION 1
+#endif
+
+#if defined(_WIN32)
+#define RTVC_STUB_EXPORT __declspec(dllexport)
+#else
+#define RTVC_STUB_EXPORT __attribute__((visibility("default")))
+#endif
+
+namespace {
+	// 版ごとの既定値に環境変数の設定を重ねる (init() のたびに読み直す)
+	int configure() {
+		rtvc::stub_engine_config config;
+		config.version = RTVC_STUB_ENGINE_VERSION;
+		config.gain = static_cast<float>(RTVC_STUB_ENGINE_VERSION);
+		if (char const* const spec = std::getenv("RTVC_STUB_ENGINE")) {
+			if (!rtvc::parse_stub_engine_config(spec, config)) {
+				return -1;
+			}
+		}
+		rtvc::stub::state().config = config;
+		return 0;
+	}
+}
+
+extern "C" {
+	RTVC_STUB_EXPORT int RTVC_CALL get_protocol_version(int* major_version, int* minor_version, int* revision) {
+		return rtvc::stub::get_protocol_version(major_version, minor_version, revision);
+	}
+
+	RTVC_STUB_EXPORT int RTVC_CALL init(char const* model_name) {
+		if (int const retval = configure()) {
+			return retval;
+		}
+		return rtvc::stub::init(model_name);
+	}
+
+	RTVC_STUB_EXPORT int RTVC_CALL destroy() {
+		return rtvc::stub::destroy();
+	}
+
+	RTVC_STUB_EXPORT int RTVC_CALL process(int num_params, float const* params, float const* x, float* y) {
+		return rtvc::stub::process(num_params, params, x, y);
+	}
+
+	RTVC_STUB_EXPORT int RTVC_CALL process_n(int num_params, float const* params, int num_blocks, float const* x, float* y) {
+		return rtvc::stub::process_n(num_params, params, num_blocks, x, y);
+	}
+
+	RTVC_STUB_EXPORT int RTVC_CALL get_max_blocks(int* max_blocks) {
+		return rtvc::stub::get_max_blocks(max_blocks);
+	}
+
+	RTVC_STUB_EXPORT int RTVC_CALL get_version(int* major_version, int* minor_version, int* revision) {
+		return rtvc::stub::get_version(major_version, minor_version, revision);
+	}
+
+	RTVC_STUB_EXPORT int RTVC_CALL get_sample_rate(int* sample_rate) {
+		return rtvc::stub::get_sample_rate(sample_rate);
+	}
+
+	RTVC_STUB_EXPORT int RTVC_CALL get_sample_latency(int* sample_latency) {
+		return rtvc::stub::get_sample_latency(sample_latency);
+	}
+
+	RTVC_STUB_EXPORT int RTVC_CALL get_block_size(int* block_size) {
+		return rtvc::stub::get_block_size(block_size);
+	}
+
+	RTVC_STUB_EXPORT int RTVC_CALL get_num_params(int* num_params) {
+		return rtvc::stub::get_num_params(num_params);
+	}
+
+	RTVC_STUB_EXPORT int RTVC_CALL get_param_name(int i, char const** param_name) {
+		return rtvc::stub::get_param_name(i, param_name);
+	}
+
+	RTVC_STUB_EXPORT int RTVC_CALL get_num_voices(int* num_voices) {
+		return rtvc::stub::get_num_voices(num_voices);
+	}
+
+	RTVC_STUB_EXPORT int RTVC_CALL get_voice_name(int i, char const** voice_name) {
+		return rtvc::stub::get_voice_name(i, voice_name);
+	}
+
+	RTVC_STUB_EXPORT int RTVC_CALL set_voice(int voice_id) {
+		return rtvc::stub::set_voice(voice_id);
+	}
+
+	RTVC_STUB_EXPORT int RTVC_CALL set_voices(int num_voices, int const* voice_ids, float const* voice_amounts) {
+		return rtvc::stub::set_voices(num_voices, voice_ids, voice_amounts);
+	}
+}